@@ -0,0 +1,91 @@
+#define _GNU_SOURCE // CPU_SET(), pthread_attr_setaffinity_np()
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "affinity.h"
+
+/**
+ * Fill cpus with the CPUs this process may run on, in order
+ *
+ * Honours taskset and cgroup cpusets. Returns how many there are, at most
+ * max, or -1 on error.
+ */
+int affinity_cpus(int *cpus, int max)
+{
+    cpu_set_t set;
+    int count = 0;
+
+    if (sched_getaffinity(0, sizeof set, &set) < 0)
+    {
+        return -1;
+    }
+
+    for (int cpu = 0; cpu < CPU_SETSIZE && count < max; cpu++)
+    {
+        if (CPU_ISSET(cpu, &set))
+        {
+            cpus[count++] = cpu;
+        }
+    }
+
+    return count;
+}
+
+/**
+ * Return the NUMA node a CPU belongs to, or -1 if sysfs doesn't say
+ */
+int affinity_node(int cpu)
+{
+    char path[64];
+    struct dirent *d;
+    int node = -1;
+
+    snprintf(path, sizeof path, "/sys/devices/system/cpu/cpu%d", cpu);
+
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+    {
+        return -1;
+    }
+
+    // The node shows as a "nodeN" link in the CPU's directory
+    while ((d = readdir(dir)) != NULL && node < 0)
+    {
+        sscanf(d->d_name, "node%d", &node);
+    }
+    closedir(dir);
+
+    return node;
+}
+
+/**
+ * Make threads created with attr run on cpu only
+ *
+ * Threads they create inherit the pin.
+ */
+void affinity_attr(pthread_attr_t *attr, int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_attr_setaffinity_np(attr, sizeof set, &set);
+}
+
+/**
+ * Have the calling thread's memory come from the NUMA node it runs on,
+ * whatever policy the process was started with
+ *
+ * The kernel places a page on first touch, so a pinned thread's
+ * allocations then stay local. Threads it creates inherit the policy.
+ * Returns 0 on success, -1 on error.
+ */
+int affinity_local_memory(void)
+{
+    return syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0) < 0 ? -1 : 0;
+}
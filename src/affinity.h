@@ -0,0 +1,13 @@
+#ifndef _AFFINITY_H_
+#define _AFFINITY_H_
+
+#include <pthread.h>
+
+#define AFFINITY_CPUS_MAX 1024
+
+extern int affinity_cpus(int *cpus, int max);
+extern int affinity_node(int cpu);
+extern void affinity_attr(pthread_attr_t *attr, int cpu);
+extern int affinity_local_memory(void);
+
+#endif
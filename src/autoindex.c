@@ -0,0 +1,280 @@
+#define _GNU_SOURCE // fstatat() flags
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "file.h"
+#include "autoindex.h"
+
+#define AUTOINDEX_DENTS 32768 // Bytes of directory entries read per system call
+
+// What getdents64() fills its buffer with
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+// A listing being built
+struct listing {
+    char *data;
+    size_t len;
+    size_t size;
+    int failed; // An allocation failed, the listing is useless
+};
+
+/**
+ * Append len bytes to the listing, growing it as needed
+ */
+static void append(struct listing *l, const char *s, size_t len)
+{
+    if (l->failed)
+    {
+        return;
+    }
+
+    if (l->len + len > l->size)
+    {
+        size_t size = l->size * 2;
+        while (size < l->len + len)
+        {
+            size *= 2;
+        }
+
+        char *data = realloc(l->data, size);
+        if (data == NULL)
+        {
+            l->failed = 1;
+            return;
+        }
+        l->data = data;
+        l->size = size;
+    }
+
+    memcpy(l->data + l->len, s, len);
+    l->len += len;
+}
+
+static void append_str(struct listing *l, const char *s)
+{
+    append(l, s, strlen(s));
+}
+
+/**
+ * Append a name as HTML text or attribute value
+ */
+static void append_html(struct listing *l, const char *s)
+{
+    for (; *s != '\0'; s++)
+    {
+        switch (*s)
+        {
+        case '&': append_str(l, "&amp;"); break;
+        case '<': append_str(l, "&lt;"); break;
+        case '>': append_str(l, "&gt;"); break;
+        case '"': append_str(l, "&quot;"); break;
+        case '\'': append_str(l, "&#39;"); break;
+        default: append(l, s, 1);
+        }
+    }
+}
+
+/**
+ * Append a path as a URL path, percent-encoding all but unreserved
+ * characters and slashes
+ */
+static void append_url(struct listing *l, const char *s, size_t len)
+{
+    static const char hex[] = "0123456789ABCDEF";
+
+    for (const char *end = s + len; s < end; s++)
+    {
+        unsigned char c = *s;
+
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+            c == '-' || c == '.' || c == '_' || c == '~' || c == '/')
+        {
+            append(l, s, 1);
+        }
+        else
+        {
+            char escape[3] = { '%', hex[c >> 4], hex[c & 15] };
+            append(l, escape, 3);
+        }
+    }
+}
+
+/**
+ * Append a string as the inside of a JSON string
+ */
+static void append_json(struct listing *l, const char *s)
+{
+    for (; *s != '\0'; s++)
+    {
+        unsigned char c = *s;
+
+        if (c == '"' || c == '\\')
+        {
+            char escape[2] = { '\\', c };
+            append(l, escape, 2);
+        }
+        else if (c < 0x20)
+        {
+            char escape[8];
+            snprintf(escape, sizeof escape, "\\u%04x", c);
+            append_str(l, escape);
+        }
+        else
+        {
+            append(l, s, 1);
+        }
+    }
+}
+
+/**
+ * Return true if a directory entry is itself a directory
+ *
+ * d_type says so on most filesystems, the rest need a stat.
+ */
+static int is_dir(int dirfd, struct linux_dirent64 *d)
+{
+    struct stat st;
+
+    if (d->d_type != DT_UNKNOWN)
+    {
+        return d->d_type == DT_DIR;
+    }
+
+    return fstatat(dirfd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+}
+
+/**
+ * Build the cache key of a directory's listing
+ *
+ * dir_path is the directory's request path, with or without its
+ * trailing slash. Listing keys end in a slash or a query, which file
+ * keys never do, so the two can't collide.
+ *
+ * Returns 0, or -1 if the key doesn't fit.
+ */
+int autoindex_key(char *key, size_t size, char *dir_path, int json)
+{
+    size_t len = strlen(dir_path);
+    char *slash = len > 0 && dir_path[len - 1] == '/' ? "" : "/";
+
+    return snprintf(key, size, "%s%s%s", dir_path, slash, json ? AUTOINDEX_JSON : "") < (int)size ? 0 : -1;
+}
+
+/**
+ * Render a listing of the open directory dirfd, served at request_path
+ *
+ * request_path ends in a slash. Entries are written as getdents64()
+ * hands them over, in one pass with no stat() per entry, so a big
+ * directory costs a few system calls. Names starting with a dot are
+ * left out. The result is HTML, or JSON if json is set:
+ *
+ *    {"path":"/foo/","entries":[{"name":"bar","type":"directory"}, ...]}
+ *
+ * Reads from where dirfd is, so it must be freshly opened. Returns the
+ * listing, to be freed with file_free(), or NULL on error.
+ */
+struct file_data *autoindex_render(int dirfd, char *request_path, int json)
+{
+    char dents[AUTOINDEX_DENTS] __attribute__((aligned(8)));
+    struct listing l = { malloc(4096), 0, 4096, 0 };
+    int first = 1;
+    long n;
+
+    if (l.data == NULL)
+    {
+        return NULL;
+    }
+
+    // HEAD
+    if (json)
+    {
+        append_str(&l, "{\"path\":\"");
+        append_json(&l, request_path);
+        append_str(&l, "\",\"entries\":[");
+    }
+    else
+    {
+        append_str(&l, "<!DOCTYPE html>\n<html>\n<head>\n<meta charset=\"utf-8\">\n<title>Index of ");
+        append_html(&l, request_path);
+        append_str(&l, "</title>\n</head>\n<body>\n<h1>Index of ");
+        append_html(&l, request_path);
+        append_str(&l, "</h1>\n<ul>\n");
+
+        // PARENT, linked by absolute path so it holds without the slash
+        char *parent_end = request_path + strlen(request_path) - 1;
+
+        if (parent_end > request_path)
+        {
+            while (parent_end[-1] != '/')
+            {
+                parent_end--;
+            }
+            append_str(&l, "<li><a href=\"");
+            append_url(&l, request_path, parent_end - request_path);
+            append_str(&l, "\">../</a></li>\n");
+        }
+    }
+
+    // ENTRIES, a bufferful per system call
+    while ((n = syscall(SYS_getdents64, dirfd, dents, sizeof dents)) > 0)
+    {
+        for (long pos = 0; pos < n;)
+        {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(dents + pos);
+            pos += d->d_reclen;
+
+            if (d->d_name[0] == '.')
+            {
+                continue;
+            }
+
+            int dir = is_dir(dirfd, d);
+
+            if (json)
+            {
+                append_str(&l, first ? "{\"name\":\"" : ",{\"name\":\"");
+                append_json(&l, d->d_name);
+                append_str(&l, dir ? "\",\"type\":\"directory\"}" : "\",\"type\":\"file\"}");
+            }
+            else
+            {
+                append_str(&l, "<li><a href=\"");
+                append_url(&l, request_path, strlen(request_path));
+                append_url(&l, d->d_name, strlen(d->d_name));
+                append_str(&l, dir ? "/\">" : "\">");
+                append_html(&l, d->d_name);
+                append_str(&l, dir ? "/</a></li>\n" : "</a></li>\n");
+            }
+            first = 0;
+        }
+    }
+
+    // TAIL
+    append_str(&l, json ? "]}\n" : "</ul>\n</body>\n</html>\n");
+
+    struct file_data *filedata = malloc(sizeof *filedata);
+
+    if (n < 0 || l.failed || filedata == NULL)
+    {
+        free(l.data);
+        free(filedata);
+        return NULL;
+    }
+
+    filedata->data = l.data;
+    filedata->size = l.len;
+
+    return filedata;
+}
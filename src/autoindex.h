@@ -0,0 +1,12 @@
+#ifndef _AUTOINDEX_H_
+#define _AUTOINDEX_H_
+
+#include <stddef.h>
+#include "file.h"
+
+#define AUTOINDEX_JSON "?format=json" // Asks for a listing as JSON, and ends its cache key
+
+extern int autoindex_key(char *key, size_t size, char *dir_path, int json);
+extern struct file_data *autoindex_render(int dirfd, char *request_path, int json);
+
+#endif
@@ -0,0 +1,206 @@
+// Cache content benchmark: malloc() against the huge-page region
+//
+// Fills SIZE bytes with buffers of the sizes static files come in, 1 KB
+// to 64 KB, the way the cache fills, then reads LOOKUPS of them picked at
+// random, a few cache lines from each, the way requests hit a big cache.
+// Reports lookups per second and dTLB load misses per lookup, once with
+// each buffer malloc()ed and once from hugemem_alloc(). Each run is a
+// process of its own, so they don't share a heap.
+//
+// Counting TLB misses takes perf_event_open(), which the kernel may not
+// allow (kernel.perf_event_paranoid) or a VM may not offer; then they
+// show as n/a. Give the machine reserved huge pages to compare those
+// against transparent ones: sysctl vm.nr_hugepages=<SIZE / 2 MB * 1.3>
+//
+// Usage: make bench/hugemem && bench/hugemem [size] [lookups]
+// size takes K, M and G suffixes, 4G by default.
+
+#define _GNU_SOURCE // syscall()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "../hugemem.h"
+
+#define BUF_MIN 1024
+#define BUF_MAX (64 * 1024)
+#define LINES 4 // Cache lines read from each buffer looked up
+
+static uint64_t rng = 88172645463325252ULL;
+
+/**
+ * xorshift64, repeatable from run to run
+ */
+static uint64_t next_random(void)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+/**
+ * Parse a size with an optional K, M or G suffix
+ */
+static long long parse_size(char *s)
+{
+    char *end;
+    long long n = strtoll(s, &end, 10);
+
+    switch (*end)
+    {
+    case 'G': case 'g': return n << 30;
+    case 'M': case 'm': return n << 20;
+    case 'K': case 'k': return n << 10;
+    default: return n;
+    }
+}
+
+/**
+ * Open a counter of this process's dTLB load misses, -1 if there isn't one
+ */
+static int open_dtlb_counter(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/**
+ * Fill size bytes with buffers and look lookups of them up, printing
+ * the results on a line labelled name
+ */
+static void run(char *name, int huge, long long size, long lookups)
+{
+    char *kind = "4 KB pages";
+
+    if (huge)
+    {
+        // ROOM for the slack of the size classes and their part-used pages
+        int rv = hugemem_init(size + size / 4 + 64LL * HUGEMEM_PAGE);
+
+        kind = rv == HUGEMEM_HUGETLB ? "reserved" : rv == HUGEMEM_THP ? "transparent" : "malloc (no region)";
+    }
+
+    long max = size / BUF_MIN + 1;
+    char **bufs = malloc(max * sizeof *bufs);
+    int *lens = malloc(max * sizeof *lens);
+    long count = 0;
+    long long filled = 0;
+
+    if (bufs == NULL || lens == NULL)
+    {
+        perror("malloc");
+        exit(1);
+    }
+
+    // FILL, with sizes spread evenly over each power of two
+    while (filled < size && count < max)
+    {
+        int shift = 10 + next_random() % 6;
+        int len = (1 << shift) + next_random() % (1 << shift);
+
+        if (len > BUF_MAX)
+        {
+            len = BUF_MAX;
+        }
+        bufs[count] = huge ? hugemem_alloc(len) : malloc(len);
+        if (bufs[count] == NULL)
+        {
+            perror("alloc");
+            exit(1);
+        }
+        memset(bufs[count], (int)count, len);
+        lens[count++] = len;
+        filled += len;
+    }
+
+    // LOOK UP at random, counting TLB misses where we can
+    int counter = open_dtlb_counter();
+    uint64_t sum = 0, misses = 0;
+    struct timespec start, end;
+
+    if (counter >= 0)
+    {
+        ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (long i = 0; i < lookups; i++)
+    {
+        uint64_t r = next_random();
+        long n = r % count;
+        int step = lens[n] / LINES;
+
+        for (int j = 0; j < LINES; j++)
+        {
+            sum += ((volatile unsigned char *)bufs[n])[j * step];
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (counter < 0 || read(counter, &misses, sizeof misses) != sizeof misses)
+    {
+        counter = -1;
+    }
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    char tlb[32] = "n/a";
+
+    if (counter >= 0)
+    {
+        snprintf(tlb, sizeof tlb, "%.3f", (double)misses / lookups);
+    }
+
+    printf("%-10s %-20s %9ld bufs %8.3f s %9.2f M lookups/s %10s dTLB misses/lookup  (%llu)\n", name, kind,
+           count, seconds, lookups / seconds / 1e6, tlb, (unsigned long long)(sum & 0xff));
+}
+
+int main(int argc, char **argv)
+{
+    long long size = argc > 1 ? parse_size(argv[1]) : 4LL << 30;
+    long lookups = argc > 2 ? atol(argv[2]) : 20000000;
+
+    if (size <= 0 || lookups <= 0)
+    {
+        fprintf(stderr, "usage: %s [size] [lookups]\n", argv[0]);
+        return 1;
+    }
+
+    for (int huge = 0; huge < 2; huge++)
+    {
+        fflush(stdout);
+
+        pid_t pid = fork();
+
+        if (pid == 0)
+        {
+            run(huge ? "hugepages" : "malloc", huge, size, lookups);
+            exit(0);
+        }
+        if (pid < 0)
+        {
+            perror("fork");
+            return 1;
+        }
+        waitpid(pid, NULL, 0);
+    }
+
+    return 0;
+}
@@ -0,0 +1,48 @@
+#!/bin/sh
+#
+# Page-load benchmark: HTTP/1.1 against HTTP/2
+#
+# Fetches index.html and the assets it uses, the way a browser loads a
+# page, LOADS times over each protocol. With HTTP/1.1 every resource is a
+# new connection (the server sends Connection: close), with HTTP/2 they
+# are streams multiplexed over one.
+#
+# Runs over HTTPS by default, as browsers only speak HTTP/2 over TLS
+# (server built with `make TLS=1`), but a plain http:// base URL works too.
+#
+# Usage: sh bench/pageload.sh [base-url] [loads]
+# Needs a running server and a curl built with HTTP/2.
+
+BASE=${1:-https://localhost:3491}
+LOADS=${2:-200}
+PAGE="/ /css/style.css /css/reset.css /img/cat.jpg /favicon.ico"
+
+urls() {
+    i=0
+    while [ $i -lt $LOADS ]; do
+        for path in $PAGE; do
+            printf 'url = "%s%s"\noutput = "/dev/null"\n' "$BASE" "$path"
+        done
+        i=$((i + 1))
+    done
+}
+
+# RUN one protocol in a single curl, which keeps up to 6 transfers in
+# flight like a browser and reuses connections where the protocol lets it
+run() {
+    start=$(date +%s.%N)
+    urls | curl -sk --no-progress-meter --parallel --parallel-max 6 "$@" -K - || exit 1
+    end=$(date +%s.%N)
+    awk "BEGIN { printf \"%.3f\", $end - $start }"
+}
+
+t1=$(run --http1.1)
+case $BASE in
+https:*) t2=$(run --http2) ;;
+*) t2=$(run --http2-prior-knowledge) ;;
+esac
+
+awk "BEGIN {
+    printf \"%-10s %8.3f s  %8.3f ms/page\\n\", \"HTTP/1.1\", $t1, $t1 * 1000 / $LOADS
+    printf \"%-10s %8.3f s  %8.3f ms/page\\n\", \"HTTP/2\", $t2, $t2 * 1000 / $LOADS
+}"
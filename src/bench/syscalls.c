@@ -0,0 +1,363 @@
+// Syscall benchmark: how many system calls the server makes per request
+//
+// Attaches to a running server with ptrace() and counts every syscall its
+// threads enter, those it starts meanwhile included, while REQUESTS
+// requests for PATH go over fresh HTTP/1.1 connections, from CLIENTS
+// processes at once (one by default). The count covers the whole path a request takes: accept, the front
+// stage, the worker's reads and writes, and close. It needs neither perf
+// nor strace.
+//
+// Idle threads (deadlines, the warm-up, inotify) add a few calls of
+// their own, so use enough requests that they don't count. Tracing slows
+// the server down; the counts are what matter, not the time. Needs
+// permission to ptrace the server: the same user, or root.
+//
+// Usage: make bench/syscalls && bench/syscalls <server pid> [port] [requests] [clients] [path]
+
+#define _GNU_SOURCE // pid_t in the ptrace() calls
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <linux/ptrace.h>
+
+#define THREADS_MAX 65536
+
+static pid_t threads[THREADS_MAX]; // Threads being traced, 0 for free slots
+static int thread_count;
+
+/**
+ * Remember a traced thread
+ */
+static void add_thread(pid_t tid)
+{
+    for (int i = 0; i < THREADS_MAX; i++)
+    {
+        if (threads[i] == 0)
+        {
+            threads[i] = tid;
+            thread_count++;
+            return;
+        }
+    }
+}
+
+/**
+ * Forget a thread that exited or was detached
+ */
+static void drop_thread(pid_t tid)
+{
+    for (int i = 0; i < THREADS_MAX; i++)
+    {
+        if (threads[i] == tid)
+        {
+            threads[i] = 0;
+            thread_count--;
+            return;
+        }
+    }
+}
+
+/**
+ * Return true if tid is being traced
+ */
+static int traced(pid_t tid)
+{
+    for (int i = 0; i < THREADS_MAX; i++)
+    {
+        if (threads[i] == tid)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Attach to every thread of pid, stopping each so its syscalls can be
+ * traced from the next ptrace(PTRACE_SYSCALL) on
+ *
+ * Threads they start are attached by the kernel (PTRACE_O_TRACECLONE),
+ * so going over the list until it has nothing new catches them all.
+ * Returns 0 on success, -1 on error.
+ */
+static int attach(pid_t pid)
+{
+    char dirpath[64];
+    int added;
+
+    snprintf(dirpath, sizeof dirpath, "/proc/%d/task", (int)pid);
+
+    do
+    {
+        DIR *dir = opendir(dirpath);
+        struct dirent *de;
+
+        if (dir == NULL)
+        {
+            perror(dirpath);
+            return -1;
+        }
+
+        added = 0;
+        while ((de = readdir(dir)) != NULL)
+        {
+            pid_t tid = atoi(de->d_name);
+
+            if (tid <= 0 || traced(tid))
+            {
+                continue;
+            }
+            if (ptrace(PTRACE_SEIZE, tid, 0, PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE) < 0)
+            {
+                if (errno == ESRCH) { continue; } // Exited meanwhile
+                perror("ptrace seize");
+                closedir(dir);
+                return -1;
+            }
+            ptrace(PTRACE_INTERRUPT, tid, 0, 0);
+            add_thread(tid);
+            added++;
+        }
+        closedir(dir);
+    } while (added > 0);
+
+    return 0;
+}
+
+/**
+ * Handle one stop of a traced thread, counting it if it is a syscall
+ * entry, then let the thread go on to its next syscall
+ */
+static void resume(pid_t tid, int status, long long *calls)
+{
+    int sig = 0;
+
+    if (WIFEXITED(status) || WIFSIGNALED(status))
+    {
+        drop_thread(tid);
+        return;
+    }
+
+    if (WSTOPSIG(status) == (SIGTRAP | 0x80))
+    {
+        struct ptrace_syscall_info info;
+
+        if (ptrace(PTRACE_GET_SYSCALL_INFO, tid, sizeof info, &info) > 0 && info.op == PTRACE_SYSCALL_INFO_ENTRY)
+        {
+            (*calls)++;
+        }
+    }
+    else if (status >> 16 == PTRACE_EVENT_CLONE)
+    {
+        unsigned long child;
+
+        if (ptrace(PTRACE_GETEVENTMSG, tid, 0, &child) == 0 && !traced(child))
+        {
+            add_thread(child);
+        }
+    }
+    else if (status >> 16 == 0 && WSTOPSIG(status) != SIGTRAP)
+    {
+        sig = WSTOPSIG(status); // A signal for the server, pass it on
+    }
+
+    ptrace(PTRACE_SYSCALL, tid, 0, sig);
+}
+
+/**
+ * Stop every traced thread and let it go
+ */
+static void detach(void)
+{
+    int status;
+
+    for (int i = 0; i < THREADS_MAX; i++)
+    {
+        if (threads[i] != 0)
+        {
+            ptrace(PTRACE_INTERRUPT, threads[i], 0, 0);
+        }
+    }
+
+    while (thread_count > 0)
+    {
+        pid_t tid = waitpid(-1, &status, __WALL);
+
+        if (tid < 0)
+        {
+            break;
+        }
+        if (!traced(tid))
+        {
+            continue;
+        }
+        if (!WIFEXITED(status) && !WIFSIGNALED(status))
+        {
+            int sig = status >> 16 == 0 && WSTOPSIG(status) != SIGTRAP && WSTOPSIG(status) != (SIGTRAP | 0x80) ?
+                      WSTOPSIG(status) : 0;
+
+            ptrace(PTRACE_DETACH, tid, 0, sig);
+        }
+        drop_thread(tid);
+    }
+}
+
+/**
+ * Return true if pid is one of the client processes
+ */
+static int is_client(pid_t *pids, int count, pid_t pid)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (pids[i] == pid)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Make requests requests for path, each on a connection of its own that
+ * the server closes; runs in a process of its own
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int run_requests(char *port, long requests, char *path)
+{
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *ai;
+    char request[1024], buf[65536];
+    int rv = getaddrinfo("localhost", port, &hints, &ai);
+
+    if (rv != 0)
+    {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+        return -1;
+    }
+
+    int len = snprintf(request, sizeof request, "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n", path);
+
+    for (long i = 0; i < requests; i++)
+    {
+        int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+
+        if (fd < 0 || connect(fd, ai->ai_addr, ai->ai_addrlen) < 0 || send(fd, request, len, 0) != len)
+        {
+            perror("request");
+            return -1;
+        }
+        while (recv(fd, buf, sizeof buf, 0) > 0)
+        {
+        }
+        close(fd);
+    }
+
+    freeaddrinfo(ai);
+
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    pid_t pid = argc > 1 ? atoi(argv[1]) : 0;
+    char *port = argc > 2 ? argv[2] : "3490";
+    long requests = argc > 3 ? atol(argv[3]) : 1000;
+    int clients = argc > 4 ? atoi(argv[4]) : 1;
+    char *path = argc > 5 ? argv[5] : "/";
+
+    if (pid <= 0 || requests <= 0 || clients <= 0 || clients > requests)
+    {
+        fprintf(stderr, "usage: %s <server pid> [port] [requests] [clients] [path]\n", argv[0]);
+        return 1;
+    }
+
+    if (attach(pid) < 0)
+    {
+        detach();
+        return 1;
+    }
+
+    long long calls = 0;
+    struct timespec start, end;
+    int status, running = 0, failed = 0;
+    pid_t *client_pids = calloc(clients, sizeof *client_pids);
+
+    if (client_pids == NULL)
+    {
+        perror("calloc");
+        detach();
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // SPLIT the requests between the clients
+    for (int i = 0; i < clients; i++)
+    {
+        pid_t client = fork();
+
+        if (client == 0)
+        {
+            exit(run_requests(port, requests / clients + (i < requests % clients), path) == 0 ? 0 : 1);
+        }
+        if (client < 0)
+        {
+            perror("fork");
+            failed = 1;
+            break;
+        }
+        client_pids[running++] = client;
+    }
+
+    // TRACE until the clients are done
+    while (running > 0)
+    {
+        pid_t tid = waitpid(-1, &status, __WALL);
+
+        if (tid < 0)
+        {
+            if (errno == EINTR) { continue; }
+            perror("waitpid");
+            break;
+        }
+        if (is_client(client_pids, clients, tid))
+        {
+            running--;
+            failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+            continue;
+        }
+
+        // A new thread can stop before its clone event is seen
+        if (!traced(tid))
+        {
+            add_thread(tid);
+        }
+        resume(tid, status, &calls);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    detach();
+    free(client_pids);
+
+    if (failed)
+    {
+        fprintf(stderr, "requests failed\n");
+        return 1;
+    }
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("%-10s %3d clients %8.3f s  %8lld syscalls  %8.2f syscalls/request\n", "HTTP/1.1", clients, seconds,
+           calls, (double)calls / requests);
+
+    return 0;
+}
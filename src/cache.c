@@ -2,9 +2,40 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "hashtable.h"
+#include "slab.h"
+#include "hugemem.h"
 #include "cache.h"
 
+#define SNAPSHOT_MAGIC "WSCACHE1"
+
+// Snapshot file layout: this header, one record per entry (hottest first),
+// then the strings and contents. Offsets are from the start of the file so
+// it can be used straight from an mmap().
+struct snapshot_header
+{
+    char magic[8];
+    uint32_t count;
+    uint32_t reserved;
+    uint64_t size; // Whole file, to catch truncation
+};
+
+struct snapshot_record
+{
+    uint64_t path_offset; // NUL-terminated
+    uint64_t content_type_offset; // NUL-terminated
+    uint64_t content_offset;
+    int64_t created_at;
+    uint32_t content_length;
+    uint32_t reserved;
+};
+
 /**
  * Allocate a cache entry
  */
@@ -20,9 +51,14 @@ struct cache_entry *alloc_entry(char *path, char *content_type, void *content, i
     new_entry->path = strdup(path);
     new_entry->content_type = strdup(content_type);
     new_entry->content_length = content_length;
-    new_entry->content = malloc(content_length);
+    new_entry->content = hugemem_alloc(content_length);
     memcpy(new_entry->content, content, content_length);
     new_entry->created_at = time;
+    new_entry->expires_at = 0;
+    new_entry->headers = NULL;
+    new_entry->h2_head = NULL;
+    new_entry->refcount = 1;
+    new_entry->referenced = 0;
 
     new_entry->prev = NULL;
     new_entry->next = NULL;
@@ -38,10 +74,26 @@ void free_entry(struct cache_entry *entry)
     if (!entry) { return; }
     free(entry->path);
     free(entry->content_type);
-    free(entry->content);
+    hugemem_free(entry->content);
+    free(entry->headers);
+    free(entry->h2_head);
     free(entry);
 }
 
+/**
+ * Drop a reference to an entry, freeing it with the last one
+ *
+ * Needs no lock: once the cache has dropped its own reference nobody can
+ * find the entry to take a new one.
+ */
+static void entry_unref(struct cache_entry *ce)
+{
+    if (__atomic_sub_fetch(&ce->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free_entry(ce);
+    }
+}
+
 /**
  * Insert a cache entry at the head of the linked list
  */
@@ -62,6 +114,26 @@ void dllist_insert_head(struct cache *cache, struct cache_entry *ce)
     }
 }
 
+/**
+ * Insert a cache entry right after pos, on the tail side of it
+ */
+void dllist_insert_after(struct cache *cache, struct cache_entry *pos, struct cache_entry *ce)
+{
+    ce->prev = pos;
+    ce->next = pos->next;
+
+    if (pos->next != NULL)
+    {
+        pos->next->prev = ce;
+    }
+    else
+    {
+        cache->tail = ce;
+    }
+
+    pos->next = ce;
+}
+
 /**
  * Move a cache entry to the head of the list
  */
@@ -90,22 +162,140 @@ void dllist_move_to_head(struct cache *cache, struct cache_entry *ce)
 }
 
 /**
- * Removes the tail from the list and returns it
+ * Unlink a cache entry from wherever it is in the list
+ */
+void dllist_unlink(struct cache *cache, struct cache_entry *ce)
+{
+    if (ce->prev != NULL)
+    {
+        ce->prev->next = ce->next;
+    }
+    else
+    {
+        cache->head = ce->next;
+    }
+
+    if (ce->next != NULL)
+    {
+        ce->next->prev = ce->prev;
+    }
+    else
+    {
+        cache->tail = ce->prev;
+    }
+
+    ce->prev = ce->next = NULL;
+}
+
+/**
+ * Removes the tail from the list and returns it, NULL if the list is empty
  *
  * NOTE: does not deallocate the tail
  */
 struct cache_entry *dllist_remove_tail(struct cache *cache)
 {
     struct cache_entry *oldtail = cache->tail;
-    
-    cache->tail = oldtail->prev;
-    cache->tail->next = NULL;
 
-    cache->cur_size--;
-    
+    if (oldtail != NULL)
+    {
+        dllist_unlink(cache, oldtail);
+        cache->cur_size--;
+        cache->cur_bytes -= oldtail->content_length;
+    }
+
     return oldtail;
 }
 
+/**
+ * Take an entry out of both the index and the list, and drop the
+ * cache's reference to it
+ *
+ * Called with the cache lock held for writing.
+ */
+static void entry_remove(struct cache *cache, struct cache_entry *ce)
+{
+    if (cache->hand == ce)
+    {
+        cache->hand = ce->prev;
+    }
+
+    hashtable_delete(cache->index, ce->path);
+    dllist_unlink(cache, ce);
+    cache->cur_size--;
+    cache->cur_bytes -= ce->content_length;
+    entry_unref(ce);
+}
+
+/**
+ * Pick the CLOCK victim: sweep from the hand towards the head, giving
+ * every referenced entry a second chance, wrapping round at the head
+ *
+ * Ends within one full turn, by then every bit has been cleared.
+ * Called with the cache lock held for writing, on a non-empty cache.
+ */
+static struct cache_entry *clock_victim(struct cache *cache)
+{
+    struct cache_entry *ce = cache->hand != NULL ? cache->hand : cache->tail;
+
+    while (__atomic_load_n(&ce->referenced, __ATOMIC_RELAXED))
+    {
+        __atomic_store_n(&ce->referenced, 0, __ATOMIC_RELAXED);
+        ce = ce->prev != NULL ? ce->prev : cache->tail;
+    }
+
+    cache->hand = ce;
+
+    return ce;
+}
+
+/**
+ * Find an entry and take a reference to it, marking it recently used
+ *
+ * In CLOCK mode a hit writes nothing shared unless the entry's bit was
+ * clear, so the caller only needs the lock for reading. In LRU mode the
+ * entry moves to the head and the lock must be held for writing.
+ */
+static struct cache_entry *entry_lookup(struct cache *cache, char *path)
+{
+    struct cache_entry *ce = hashtable_get(cache->index, path);
+
+    if (ce == NULL)
+    {
+        return NULL;
+    }
+
+    if (cache->eviction == CACHE_CLOCK)
+    {
+        if (!__atomic_load_n(&ce->referenced, __ATOMIC_RELAXED))
+        {
+            __atomic_store_n(&ce->referenced, 1, __ATOMIC_RELAXED);
+        }
+    }
+    else
+    {
+        dllist_move_to_head(cache, ce);
+    }
+
+    __atomic_add_fetch(&ce->refcount, 1, __ATOMIC_RELAXED);
+
+    return ce;
+}
+
+/**
+ * Lock the cache for a lookup, for reading if the eviction mode allows
+ */
+static void lock_for_lookup(struct cache *cache)
+{
+    if (cache->eviction == CACHE_CLOCK)
+    {
+        pthread_rwlock_rdlock(&cache->lock);
+    }
+    else
+    {
+        pthread_rwlock_wrlock(&cache->lock);
+    }
+}
+
 /**
  * Create a new cache
  *
@@ -123,25 +313,36 @@ struct cache *cache_create(int max_size, int hashsize)
     {
         return NULL;
     }
-    pthread_mutex_init(&new_cache->lock, NULL);
+    pthread_rwlock_init(&new_cache->lock, NULL);
+    pthread_mutex_init(&new_cache->load_lock, NULL);
+    pthread_cond_init(&new_cache->loaded, NULL);
 
     // CREATE hashtable inside cache index
     new_cache->index = hashtable_create(hashsize, NULL);
+    new_cache->loading = hashtable_create(0, NULL);
     new_cache->head = NULL;
     new_cache->tail = NULL;
+    new_cache->hand = NULL;
+    new_cache->eviction = CACHE_LRU;
+    new_cache->warm = NULL;
 
     new_cache->max_size = max_size;
     new_cache->cur_size = 0;
+    new_cache->max_bytes = 0;
+    new_cache->cur_bytes = 0;
 
     return new_cache;
 }
 
 void cache_free(struct cache *cache)
 {
-    pthread_mutex_destroy(&cache->lock);
+    pthread_rwlock_destroy(&cache->lock);
+    pthread_mutex_destroy(&cache->load_lock);
+    pthread_cond_destroy(&cache->loaded);
     struct cache_entry *cur_entry = cache->head;
 
     hashtable_destroy(cache->index);
+    hashtable_destroy(cache->loading);
 
     while (cur_entry != NULL)
     {
@@ -155,12 +356,58 @@ void cache_free(struct cache *cache)
     free(cache);
 }
 
+/**
+ * Choose how entries are picked for eviction, before the cache is used
+ *
+ * CACHE_LRU (the default) evicts the least recently used entry, but every
+ * hit reorders the list under an exclusive lock. CACHE_CLOCK evicts
+ * entries not hit since the clock hand last passed them; hits only set a
+ * bit, so they run in parallel.
+ */
+void cache_set_eviction(struct cache *cache, int eviction)
+{
+    cache->eviction = eviction;
+}
+
+/**
+ * Change how many entries, and how many content bytes (0 for no byte
+ * budget), the cache may hold
+ *
+ * Safe while the cache is in use. Shrinking doesn't evict at once, the
+ * next puts evict until the cache fits again.
+ */
+void cache_set_limits(struct cache *cache, int max_size, long long max_bytes)
+{
+    pthread_rwlock_wrlock(&cache->lock);
+    cache->max_size = max_size;
+    cache->max_bytes = max_bytes;
+    pthread_rwlock_unlock(&cache->lock);
+}
+
+/**
+ * Give the cache a second, bigger tier, before the cache is used
+ *
+ * Evicted entries are demoted to the slab, and misses are promoted back
+ * from it by cache_get_or_claim() if fresh() (which may be NULL) agrees
+ * the entry is still good. The slab stays the caller's to close.
+ */
+void cache_set_warm_tier(struct cache *cache, struct slab *slab,
+                         int (*fresh)(char *path, time_t created_at, void *arg), void *arg)
+{
+    cache->warm = slab;
+    cache->warm_fresh = fresh;
+    cache->warm_arg = arg;
+}
+
 /**
  * Store an entry in the cache
  *
- * This will also remove the least-recently-used items as necessary.
+ * This will also evict entries as necessary, until both the entry count
+ * and the byte budget fit the new one. An entry bigger than the whole
+ * byte budget isn't stored.
  *
- * NOTE: doesn't check for duplicate cache entries
+ * An entry already stored under the path is replaced in the same step,
+ * so readers see either the old or the new one, never neither.
  */
 void cache_put(struct cache *cache, char *path, char *content_type, void *content, int content_length, time_t time)
 {
@@ -171,73 +418,544 @@ void cache_put(struct cache *cache, char *path, char *content_type, void *conten
     {
         return;
     }
-    pthread_mutex_lock(&cache->lock);
+    cache_insert(cache, new_entry);
+}
+
+/**
+ * Store an entry made with alloc_entry(), as cache_put() does
+ *
+ * The cache takes the entry over. Entries that expire are never demoted
+ * to the warm tier, which keeps neither their expiry nor their headers.
+ */
+void cache_insert(struct cache *cache, struct cache_entry *new_entry)
+{
+    char *path = new_entry->path;
+    int content_length = new_entry->content_length;
+
+    pthread_rwlock_wrlock(&cache->lock);
+
+    // REPLACE the old entry, whoever is still sending it keeps a reference
+    struct cache_entry *old_entry = hashtable_get(cache->index, path);
+    if (old_entry != NULL)
+    {
+        entry_remove(cache, old_entry);
+    }
+
+    // IF the entry can never fit THEN it isn't cached, the old one is gone
+    if (cache->max_bytes > 0 && content_length > cache->max_bytes)
+    {
+        pthread_rwlock_unlock(&cache->lock);
+        if (cache->warm != NULL)
+        {
+            slab_delete(cache->warm, path);
+        }
+        free_entry(new_entry);
+        return;
+    }
 
-    // INSERT cache_entry into the head of dllist
-    dllist_insert_head(cache, new_entry);
+    // WHILE the cache is full
+    struct cache_entry *demoted = NULL;
+    while ((cache->cur_size >= cache->max_size ||
+            (cache->max_bytes > 0 && cache->cur_bytes + content_length > cache->max_bytes)) &&
+           cache->tail != NULL)
+    {
+        // THEN evict an entry, it is freed once nobody is still sending it.
+        // Entries to demote are chained through next, which is free once
+        // they are out of the list
+        struct cache_entry *victim = cache->eviction == CACHE_CLOCK ? clock_victim(cache) : cache->tail;
+        int demote = cache->warm != NULL && victim->expires_at == 0;
+        if (demote)
+        {
+            __atomic_add_fetch(&victim->refcount, 1, __ATOMIC_RELAXED);
+        }
+        entry_remove(cache, victim);
+        if (demote)
+        {
+            victim->next = demoted;
+            demoted = victim;
+        }
+    }
+
+    // INSERT cache_entry into the head of dllist, or for CLOCK just behind
+    // the hand, so it is the last entry the hand comes back to
+    if (cache->eviction == CACHE_CLOCK && cache->hand != NULL)
+    {
+        dllist_insert_after(cache, cache->hand, new_entry);
+    }
+    else
+    {
+        dllist_insert_head(cache, new_entry);
+    }
 
     // PUT cache entry inside hashtable
     hashtable_put(cache->index, path, new_entry);
     // INCREMENT current cache size
     cache->cur_size++;
-    // IF cache max size greater than current size
-    if (cache->cur_size > cache->max_size)
+    cache->cur_bytes += content_length;
+    // HOLD the entry, path is its own and it may be evicted once unlocked
+    if (cache->warm != NULL)
+    {
+        __atomic_add_fetch(&new_entry->refcount, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&cache->lock);
+
+    // IF there is a warm tier THEN the new entry supersedes any copy there,
+    // and the evicted one moves down to it, outside the lock
+    if (cache->warm != NULL)
     {
-        // INIT tail entry from cache
-        struct cache_entry *tail_entry = hashtable_get(cache->index, cache->tail->path);
-        // THEN delist tail cache entry
-        dllist_remove_tail(cache);
-        // DELETE from hashtable
-        hashtable_delete(cache->index, tail_entry->path);
-        // FREE entry from memory
-        free_entry(tail_entry);
+        slab_delete(cache->warm, path);
+        entry_unref(new_entry);
+
+        while (demoted != NULL)
+        {
+            struct cache_entry *next = demoted->next;
+            slab_put(cache->warm, demoted->path, demoted->content_type, demoted->content,
+                     demoted->content_length, demoted->created_at);
+            entry_unref(demoted);
+            demoted = next;
+        }
     }
-    pthread_mutex_unlock(&cache->lock);
 }
 
 /**
  * Retrieve an entry from the cache
+ *
+ * The entry stays valid, even if it is deleted or evicted meanwhile,
+ * until it is given back with cache_release().
  */
 struct cache_entry *cache_get(struct cache *cache, char *path)
 {
     ///////////////////
     // IMPLEMENT ME! //
     ///////////////////
-    // INIT founded cache entry
-    pthread_mutex_lock(&cache->lock);
-    struct cache_entry *founded_entry = hashtable_get(cache->index, path);
-    if (!founded_entry)
+    // INIT founded cache entry, marked as used
+    lock_for_lookup(cache);
+    struct cache_entry *founded_entry = entry_lookup(cache, path);
+    pthread_rwlock_unlock(&cache->lock);
+    // RETURN founded cache entry
+    return founded_entry;
+}
+
+/**
+ * Move an entry up from the warm tier, if it is there and still fresh
+ *
+ * Returns the promoted entry as cache_get() would, or NULL.
+ */
+static struct cache_entry *warm_promote(struct cache *cache, char *path)
+{
+    struct slab_item *item = slab_get(cache->warm, path);
+
+    if (item == NULL)
     {
-        pthread_mutex_unlock(&cache->lock);
         return NULL;
     }
-    dllist_move_to_head(cache, founded_entry);
 
-    // MOVE founded entry to head
-    pthread_mutex_unlock(&cache->lock);
-    // RETURN founded cache entry
-    return founded_entry;
+    if (cache->warm_fresh != NULL && !cache->warm_fresh(path, item->created_at, cache->warm_arg))
+    {
+        slab_delete(cache->warm, path);
+        slab_item_free(item);
+        return NULL;
+    }
+
+    // PUT keeps created_at, and takes the entry out of the warm tier
+    cache_put(cache, path, item->content_type, item->content, item->content_length, item->created_at);
+    slab_item_free(item);
+
+    return cache_get(cache, path);
+}
+
+/**
+ * Look up an entry, making sure only one caller loads a missing one
+ *
+ * On a hit the entry is returned as with cache_get(). On a miss with no
+ * load in progress, the caller is given the load (*claimed is set) and
+ * must call cache_unclaim() once it has put the entry, or given up.
+ * If another caller is already loading the path, this waits for it and
+ * returns what it put, or NULL if it couldn't cache the path.
+ *
+ * The load is first tried from the warm tier, if there is one.
+ */
+struct cache_entry *cache_get_or_claim(struct cache *cache, char *path, int *claimed)
+{
+    struct cache_entry *entry;
+
+    *claimed = 0;
+
+    // IF it is cached THEN hits never touch the load lock
+    entry = cache_get(cache, path);
+    if (entry != NULL)
+    {
+        return entry;
+    }
+
+    pthread_mutex_lock(&cache->load_lock);
+
+    // WAIT out a load already in progress
+    int waited = 0;
+    while (hashtable_get(cache->loading, path) != NULL)
+    {
+        pthread_cond_wait(&cache->loaded, &cache->load_lock);
+        waited = 1;
+    }
+
+    // LOOK again, it may have been put since the first try
+    entry = cache_get(cache, path);
+
+    if (entry == NULL && !waited)
+    {
+        hashtable_put(cache->loading, path, cache);
+        *claimed = 1;
+    }
+
+    pthread_mutex_unlock(&cache->load_lock);
+
+    // IF the warm tier has it THEN the caller needn't load it after all
+    if (*claimed && cache->warm != NULL && (entry = warm_promote(cache, path)) != NULL)
+    {
+        cache_unclaim(cache, path);
+        *claimed = 0;
+    }
+
+    return entry;
+}
+
+/**
+ * Claim the reload of a cached path without waiting
+ *
+ * Used to revalidate a stale entry: the caller that gets the claim
+ * reloads it while everyone else keeps being served the stale copy.
+ *
+ * Returns 1 if the caller got the claim, 0 if someone else has it.
+ */
+int cache_claim(struct cache *cache, char *path)
+{
+    pthread_mutex_lock(&cache->load_lock);
+
+    int claimed = hashtable_get(cache->loading, path) == NULL;
+    if (claimed)
+    {
+        hashtable_put(cache->loading, path, cache);
+    }
+
+    pthread_mutex_unlock(&cache->load_lock);
+
+    return claimed;
+}
+
+/**
+ * Finish a load claimed with cache_get_or_claim() or cache_claim()
+ */
+void cache_unclaim(struct cache *cache, char *path)
+{
+    pthread_mutex_lock(&cache->load_lock);
+    hashtable_delete(cache->loading, path);
+    pthread_cond_broadcast(&cache->loaded);
+    pthread_mutex_unlock(&cache->load_lock);
+}
+
+/**
+ * Give back an entry from cache_get()
+ */
+void cache_release(struct cache *cache, struct cache_entry *entry)
+{
+    (void)cache;
+
+    entry_unref(entry);
+}
+
+/**
+ * Remove the entry for a path, from both tiers
+ *
+ * Returns 0 if it was cached, -1 if not.
+ */
+int cache_delete(struct cache *cache, char *path)
+{
+    pthread_rwlock_wrlock(&cache->lock);
+
+    struct cache_entry *ce = hashtable_get(cache->index, path);
+
+    if (ce != NULL)
+    {
+        entry_remove(cache, ce);
+    }
+
+    pthread_rwlock_unlock(&cache->lock);
+
+    int warm = cache->warm != NULL && slab_delete(cache->warm, path) == 0;
+
+    return ce != NULL || warm ? 0 : -1;
+}
+
+/**
+ * Remove every entry whose path starts with prefix ("" removes all), from
+ * both tiers
+ *
+ * Returns the number of entries removed.
+ */
+int cache_delete_prefix(struct cache *cache, char *prefix)
+{
+    size_t prefix_len = strlen(prefix);
+    int count = 0;
+
+    pthread_rwlock_wrlock(&cache->lock);
+
+    struct cache_entry *ce = cache->head;
+
+    while (ce != NULL)
+    {
+        struct cache_entry *next = ce->next;
+
+        if (strncmp(ce->path, prefix, prefix_len) == 0)
+        {
+            entry_remove(cache, ce);
+            count++;
+        }
+
+        ce = next;
+    }
+
+    pthread_rwlock_unlock(&cache->lock);
+
+    if (cache->warm != NULL)
+    {
+        count += slab_delete_prefix(cache->warm, prefix);
+    }
+
+    return count;
 }
 
 /**
 * Remove stale cache entry
+*
+* cache_entry must come from cache_get() and still be held. Nothing
+* happens if it has already been replaced, deleted or evicted.
 */
 void remove_entry(struct cache *cache, struct cache_entry *cache_entry)
 {
-    pthread_mutex_lock(&cache->lock);
-    // IF cache has only one entry
-    if (cache_entry->next == NULL)
+    pthread_rwlock_wrlock(&cache->lock);
+    // IF the entry is still the one cached under its path
+    if (hashtable_get(cache->index, cache_entry->path) == cache_entry)
     {
-        cache->head = NULL;
-        cache->tail = NULL;
-        free_entry(cache_entry);
+        // THEN take it out of the index and the list
+        entry_remove(cache, cache_entry);
     }
-    else
+    pthread_rwlock_unlock(&cache->lock);
+
+    if (cache->warm != NULL)
     {
-        cache->head = cache_entry->next;
-        cache_entry->next->prev = NULL;
-        free_entry(cache_entry);
+        slab_delete(cache->warm, cache_entry->path);
     }
-    cache->cur_size--;
-    pthread_mutex_unlock(&cache->lock);
-}
\ No newline at end of file
+}
+
+/**
+ * Write the cache's entries to a snapshot file, hottest first
+ *
+ * The file is written under a temporary name and renamed into place, so
+ * a crash never leaves a half-written snapshot behind.
+ *
+ * Returns the number of entries saved, or -1 on error.
+ */
+int cache_snapshot_save(struct cache *cache, char *filename)
+{
+    char tmpname[4096];
+    static const char padding[8];
+    struct snapshot_header header;
+    struct snapshot_record *records;
+    struct cache_entry *ce;
+    int count = 0, i;
+
+    snprintf(tmpname, sizeof tmpname, "%s.tmp", filename);
+
+    int fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    FILE *fp = fd >= 0 ? fdopen(fd, "wb") : NULL;
+
+    if (fp == NULL)
+    {
+        perror("snapshot open");
+        if (fd >= 0) { close(fd); }
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&cache->lock);
+
+    // Stored responses expire, they aren't worth a restart
+    for (ce = cache->head; ce != NULL; ce = ce->next)
+    {
+        count += ce->expires_at == 0;
+    }
+
+    records = calloc(count > 0 ? count : 1, sizeof *records);
+    if (records == NULL)
+    {
+        pthread_rwlock_unlock(&cache->lock);
+        fclose(fp);
+        unlink(tmpname);
+        return -1;
+    }
+
+    // LAY OUT the data after the record table, contents 8-byte aligned
+    uint64_t offset = sizeof header + count * sizeof *records;
+
+    for (ce = cache->head, i = 0; ce != NULL; ce = ce->next)
+    {
+        if (ce->expires_at != 0)
+        {
+            continue;
+        }
+        records[i].path_offset = offset;
+        offset += strlen(ce->path) + 1;
+        records[i].content_type_offset = offset;
+        offset += strlen(ce->content_type) + 1;
+        offset = (offset + 7) & ~(uint64_t)7;
+        records[i].content_offset = offset;
+        records[i].content_length = ce->content_length;
+        records[i].created_at = ce->created_at;
+        offset += ce->content_length;
+        offset = (offset + 7) & ~(uint64_t)7;
+        i++;
+    }
+
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof header.magic);
+    header.count = count;
+    header.size = offset;
+
+    fwrite(&header, sizeof header, 1, fp);
+    fwrite(records, sizeof *records, count, fp);
+
+    for (ce = cache->head, i = 0; ce != NULL; ce = ce->next)
+    {
+        if (ce->expires_at != 0)
+        {
+            continue;
+        }
+        fwrite(ce->path, strlen(ce->path) + 1, 1, fp);
+        fwrite(ce->content_type, strlen(ce->content_type) + 1, 1, fp);
+        fwrite(padding, records[i].content_offset - ftell(fp), 1, fp);
+        fwrite(ce->content, ce->content_length, 1, fp);
+        fwrite(padding, (8 - ce->content_length % 8) % 8, 1, fp);
+        i++;
+    }
+
+    pthread_rwlock_unlock(&cache->lock);
+    free(records);
+
+    // FLUSH to disk before the rename makes it visible
+    if (fflush(fp) != 0 || ferror(fp) || fsync(fd) < 0)
+    {
+        perror("snapshot write");
+        fclose(fp);
+        unlink(tmpname);
+        return -1;
+    }
+    fclose(fp);
+
+    if (rename(tmpname, filename) < 0)
+    {
+        perror("snapshot rename");
+        unlink(tmpname);
+        return -1;
+    }
+
+    return count;
+}
+
+/**
+ * Return the NUL-terminated string at offset, or NULL if it runs past
+ * the end of the snapshot
+ */
+static char *snapshot_string(char *map, uint64_t size, uint64_t offset)
+{
+    if (offset >= size || memchr(map + offset, '\0', size - offset) == NULL)
+    {
+        return NULL;
+    }
+
+    return map + offset;
+}
+
+/**
+ * Load a snapshot written by cache_snapshot_save()
+ *
+ * fresh, if not NULL, is asked about each entry and returns 0 for ones
+ * whose content has changed since created_at; those are skipped. Entries
+ * that are loaded are stamped with the current time. Keys already in the
+ * cache are left alone.
+ *
+ * Returns the number of entries loaded, or -1 if the file is missing or
+ * not a valid snapshot.
+ */
+int cache_snapshot_load(struct cache *cache, char *filename,
+                        int (*fresh)(char *path, time_t created_at, void *arg), void *arg)
+{
+    struct stat st;
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct snapshot_header))
+    {
+        close(fd);
+        return -1;
+    }
+
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+    madvise(map, st.st_size, MADV_WILLNEED);
+
+    struct snapshot_header *header = (struct snapshot_header *)map;
+    struct snapshot_record *records = (struct snapshot_record *)(map + sizeof *header);
+    uint64_t size = st.st_size;
+
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof header->magic) != 0 || header->size != size ||
+        sizeof *header + (uint64_t)header->count * sizeof *records > size)
+    {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    time_t now = time(NULL);
+    int loaded = 0;
+    int i = header->count < (uint32_t)cache->max_size ? (int)header->count : cache->max_size;
+
+    // COLDEST first, so the hottest entry ends up at the head
+    while (--i >= 0)
+    {
+        struct snapshot_record *rec = &records[i];
+        char *path = snapshot_string(map, size, rec->path_offset);
+        char *content_type = snapshot_string(map, size, rec->content_type_offset);
+
+        if (path == NULL || content_type == NULL || rec->content_offset > size ||
+            rec->content_length > size - rec->content_offset)
+        {
+            fprintf(stderr, "cache_snapshot_load: %s is corrupt\n", filename);
+            break;
+        }
+
+        if (fresh != NULL && !fresh(path, rec->created_at, arg))
+        {
+            continue;
+        }
+
+        pthread_rwlock_rdlock(&cache->lock);
+        int exists = hashtable_get(cache->index, path) != NULL;
+        pthread_rwlock_unlock(&cache->lock);
+
+        if (!exists)
+        {
+            cache_put(cache, path, content_type, map + rec->content_offset, rec->content_length, now);
+            loaded++;
+        }
+    }
+
+    munmap(map, st.st_size);
+
+    return loaded;
+}
@@ -1,6 +1,14 @@
 #ifndef _WEBCACHE_H_
 #define _WEBCACHE_H_
 
+#include <pthread.h>
+#include <time.h>
+
+struct slab;
+
+#define CACHE_LRU 0 // Evict the least recently used entry, hits reorder the list
+#define CACHE_CLOCK 1 // Evict an entry not hit since the hand last passed, hits only set a bit
+
 // Individual hash table entry
 struct cache_entry {
     char *path;   // Endpoint path--key to the cache
@@ -8,6 +16,11 @@ struct cache_entry {
     int content_length;
     void *content;
     time_t created_at;
+    time_t expires_at; // 0 but for stored responses, see respcache.c
+    char *headers; // More "Name: value\r\n" lines to send with it, NULL for none
+    void *h2_head; // Encoded HTTP/2 response headers, built on first use
+    int refcount; // The cache's own reference plus one per cache_get() not yet released, atomic
+    int referenced; // CLOCK: hit since the hand last passed, atomic
 
     struct cache_entry *prev, *next; // Doubly-linked list
 };
@@ -16,23 +29,41 @@ struct cache_entry {
 struct cache {
     struct hashtable *index;
     struct cache_entry *head, *tail; // Doubly-linked list
+    struct cache_entry *hand; // CLOCK: next entry to consider, moves from tail to head
     int max_size; // Maxiumum number of entries
     int cur_size; // Current number of entries
-    pthread_mutex_t lock; // Mutex for thread lock/unlock states
+    long long max_bytes; // Most content bytes held, 0 for no byte budget
+    long long cur_bytes; // Content bytes held
+    int eviction; // CACHE_LRU or CACHE_CLOCK
+    pthread_rwlock_t lock; // Index and list, lookups that change neither only read-lock
+    pthread_mutex_t load_lock; // Guards loading
+    struct hashtable *loading; // Paths somebody is loading right now
+    pthread_cond_t loaded; // Signalled whenever a load finishes
+    struct slab *warm; // Second tier evicted entries go to, may be NULL
+    int (*warm_fresh)(char *path, time_t created_at, void *arg); // Checked before promoting
+    void *warm_arg;
 };
 
-typedef struct  
-{ 
-    int sockfd;
-    struct cache *cache; 
-} thread_config_t;
-
 extern struct cache_entry *alloc_entry(char *path, char *content_type, void *content, int content_length, time_t time);
 extern void free_entry(struct cache_entry *entry);
 extern struct cache *cache_create(int max_size, int hashsize);
 extern void cache_free(struct cache *cache);
+extern void cache_set_eviction(struct cache *cache, int eviction);
+extern void cache_set_limits(struct cache *cache, int max_size, long long max_bytes);
+extern void cache_set_warm_tier(struct cache *cache, struct slab *slab,
+                                int (*fresh)(char *path, time_t created_at, void *arg), void *arg);
 extern void cache_put(struct cache *cache, char *path, char *content_type, void *content, int content_length, time_t time);
+extern void cache_insert(struct cache *cache, struct cache_entry *entry);
 extern struct cache_entry *cache_get(struct cache *cache, char *path);
+extern struct cache_entry *cache_get_or_claim(struct cache *cache, char *path, int *claimed);
+extern int cache_claim(struct cache *cache, char *path);
+extern void cache_unclaim(struct cache *cache, char *path);
+extern void cache_release(struct cache *cache, struct cache_entry *entry);
+extern int cache_delete(struct cache *cache, char *path);
+extern int cache_delete_prefix(struct cache *cache, char *prefix);
 extern void remove_entry(struct cache *cache, struct cache_entry *cache_entry);
+extern int cache_snapshot_save(struct cache *cache, char *filename);
+extern int cache_snapshot_load(struct cache *cache, char *filename,
+                               int (*fresh)(char *path, time_t created_at, void *arg), void *arg);
 
 #endif
\ No newline at end of file
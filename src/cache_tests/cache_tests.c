@@ -1,9 +1,17 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
 #include "utils.h"
 #include "minunit.h"
 #include "../cache.h"
 #include "../hashtable.h"
+#include "../slab.h"
+#include "../hugemem.h"
+#include "../hpack.h"
+#include "../urlpath.h"
 
 char *test_cache_create()
 {
@@ -149,6 +157,640 @@ char *test_cache_get()
   return NULL;
 }
 
+char *test_cache_delete()
+{
+  struct cache *cache = cache_create(3, 0);
+  time_t time = 0;
+
+  cache_put(cache, "/a/1", "text/plain", "1", 2, time);
+  cache_put(cache, "/a/2", "text/plain", "2", 2, time);
+  cache_put(cache, "/b/3", "text/plain", "3", 2, time);
+
+  // A held entry outlives its deletion until it is released
+  struct cache_entry *entry = cache_get(cache, "/a/2");
+  mu_assert(cache_delete(cache, "/a/2") == 0, "cache_delete did not find a cached path");
+  mu_assert(cache_delete(cache, "/a/2") == -1, "cache_delete found a path twice");
+  mu_assert(check_strings(entry->content, "2") == 0, "cache_delete freed an entry that was still held");
+  cache_release(cache, entry);
+
+  mu_assert(cache->cur_size == 2, "cache_delete did not update cur_size");
+  mu_assert(hashtable_get(cache->index, "/a/2") == NULL, "cache_delete did not remove the path from the index");
+  mu_assert(check_strings(cache->head->path, "/b/3") == 0 && check_strings(cache->tail->path, "/a/1") == 0, "cache_delete did not unlink from the middle of the list");
+  mu_assert(cache->head->next == cache->tail && cache->tail->prev == cache->head, "cache_delete left the list inconsistent");
+
+  mu_assert(cache_delete_prefix(cache, "/a/") == 1, "cache_delete_prefix did not remove the matching entry");
+  mu_assert(cache->head == cache->tail && cache->cur_size == 1, "cache_delete_prefix left the list inconsistent");
+  mu_assert(cache_delete_prefix(cache, "") == 1, "cache_delete_prefix did not remove everything for an empty prefix");
+  mu_assert(cache->head == NULL && cache->tail == NULL && cache->cur_size == 0, "cache_delete_prefix did not empty the cache");
+
+  cache_free(cache);
+
+  return NULL;
+}
+
+char *test_cache_put_replace()
+{
+  struct cache *cache = cache_create(3, 0);
+  time_t time = 0;
+
+  cache_put(cache, "/1", "text/plain", "old", 4, time);
+  struct cache_entry *old_entry = cache_get(cache, "/1");
+  cache_put(cache, "/1", "text/html", "new", 4, time);
+
+  mu_assert(cache->cur_size == 1, "cache_put stored a duplicate instead of replacing the entry");
+  mu_assert(cache->head == cache->tail, "cache_put left the replaced entry in the list");
+  mu_assert(check_strings(((struct cache_entry *)hashtable_get(cache->index, "/1"))->content, "new") == 0, "cache_put did not index the new entry");
+  mu_assert(check_strings(old_entry->content, "old") == 0, "cache_put freed a replaced entry that was still held");
+  cache_release(cache, old_entry);
+
+  cache_free(cache);
+
+  return NULL;
+}
+
+struct claim_waiter {
+  struct cache *cache;
+  struct cache_entry *entry;
+  int claimed;
+};
+
+void *wait_for_load(void *arg)
+{
+  struct claim_waiter *w = arg;
+
+  w->entry = cache_get_or_claim(w->cache, "/1", &w->claimed);
+
+  return NULL;
+}
+
+char *test_cache_claim()
+{
+  struct cache *cache = cache_create(3, 0);
+  struct claim_waiter waiter = { cache, NULL, -1 };
+  pthread_t thread;
+  int claimed;
+
+  // The first miss gets the load, a concurrent one waits for it
+  mu_assert(cache_get_or_claim(cache, "/1", &claimed) == NULL && claimed == 1, "cache_get_or_claim did not hand out the load on a miss");
+  mu_assert(cache_claim(cache, "/1") == 0, "cache_claim handed out a load that was already claimed");
+  pthread_create(&thread, NULL, wait_for_load, &waiter);
+  usleep(20000);
+  cache_put(cache, "/1", "text/plain", "1", 2, 0);
+  cache_unclaim(cache, "/1");
+  pthread_join(thread, NULL);
+
+  mu_assert(waiter.entry != NULL && waiter.claimed == 0, "cache_get_or_claim did not return the entry another caller loaded");
+  mu_assert(check_strings(waiter.entry->content, "1") == 0, "cache_get_or_claim returned the wrong entry");
+  cache_release(cache, waiter.entry);
+
+  // Revalidation claims don't block, and can be had again once finished
+  mu_assert(cache_claim(cache, "/1") == 1, "cache_claim refused an unclaimed path");
+  mu_assert(cache_claim(cache, "/1") == 0, "cache_claim handed out the same path twice");
+  cache_unclaim(cache, "/1");
+  mu_assert(cache_claim(cache, "/1") == 1, "cache_unclaim did not give the path back");
+  cache_unclaim(cache, "/1");
+
+  cache_free(cache);
+
+  return NULL;
+}
+
+#define STRESS_THREADS 8
+#define STRESS_OPS 20000
+#define STRESS_KEYS 24
+
+struct stress_worker {
+  struct cache *cache;
+  unsigned int seed;
+  char *error;
+};
+
+/**
+ * Check that the list and the index agree, with the cache lock held
+ *
+ * If idle is set no entry may be held or claimed any more.
+ */
+char *check_cache_invariants(struct cache *cache, int idle)
+{
+  struct cache_entry *ce, *prev = NULL;
+  int count = 0;
+  long long bytes = 0;
+
+  for (ce = cache->head; ce != NULL; prev = ce, ce = ce->next) {
+    if (ce->prev != prev) {
+      return "list prev pointers don't match the next pointers";
+    }
+    if (hashtable_get(cache->index, ce->path) != ce) {
+      return "list entry is not the one indexed under its path";
+    }
+    int refcount = __atomic_load_n(&ce->refcount, __ATOMIC_RELAXED);
+    if (refcount < 1 || (idle && refcount != 1)) {
+      return "list entry has the wrong reference count";
+    }
+    if (strcmp(ce->content, ce->path) != 0) {
+      return "list entry holds another path's content";
+    }
+    if (++count > cache->max_size) {
+      return "list is longer than the cache's max size";
+    }
+    bytes += ce->content_length;
+  }
+
+  if (cache->tail != prev) {
+    return "tail is not the last entry in the list";
+  }
+  if (count != cache->cur_size || count != cache->index->num_entries) {
+    return "cur_size, list length and index size disagree";
+  }
+  if (bytes != cache->cur_bytes || (cache->max_bytes > 0 && bytes > cache->max_bytes)) {
+    return "cur_bytes is wrong or over the byte budget";
+  }
+  if (idle && cache->loading->num_entries != 0) {
+    return "a load was left claimed";
+  }
+
+  return NULL;
+}
+
+void *stress_cache(void *arg)
+{
+  struct stress_worker *w = arg;
+  struct cache_entry *entry;
+  char path[16];
+  int i, claimed;
+
+  for (i = 0; i < STRESS_OPS && w->error == NULL; i++) {
+    int op = rand_r(&w->seed) % 100;
+
+    snprintf(path, sizeof path, "/%c/%d", "ab"[rand_r(&w->seed) % 2], rand_r(&w->seed) % STRESS_KEYS);
+
+    if (op < 40) {
+      entry = cache_get(w->cache, path);
+      if (entry != NULL) {
+        if (strcmp(entry->content, path) != 0 || entry->content_length != (int)strlen(path) + 1) {
+          w->error = "cache_get returned an entry for another path";
+        }
+        if (op < 3) {
+          remove_entry(w->cache, entry);
+        }
+        cache_release(w->cache, entry);
+      }
+    } else if (op < 55) {
+      entry = cache_get_or_claim(w->cache, path, &claimed);
+      if (entry != NULL) {
+        cache_release(w->cache, entry);
+      } else if (claimed) {
+        // Give up some loads, like a 404 does
+        if (op % 4 != 0) {
+          cache_put(w->cache, path, "text/plain", path, strlen(path) + 1, 0);
+        }
+        cache_unclaim(w->cache, path);
+      }
+    } else if (op < 85) {
+      cache_put(w->cache, path, "text/plain", path, strlen(path) + 1, 0);
+    } else if (op < 99) {
+      cache_delete(w->cache, path);
+    } else {
+      cache_delete_prefix(w->cache, path[1] == 'a' ? "/a/" : "/b/");
+    }
+
+    if (i % 64 == 0) {
+      pthread_rwlock_rdlock(&w->cache->lock);
+      char *error = check_cache_invariants(w->cache, 0);
+      pthread_rwlock_unlock(&w->cache->lock);
+      if (error != NULL) {
+        w->error = error;
+      }
+    }
+  }
+
+  return NULL;
+}
+
+char *run_cache_stress(int eviction)
+{
+  struct cache *cache = cache_create(STRESS_KEYS / 2, 0);
+  struct stress_worker workers[STRESS_THREADS];
+  pthread_t threads[STRESS_THREADS];
+  unsigned int seed = time(NULL);
+  int i;
+
+  cache_set_eviction(cache, eviction);
+
+  // Logged so a failing run can be replayed
+  fprintf(stderr, "test_cache_stress: eviction %d, seed %u\n", eviction, seed);
+
+  for (i = 0; i < STRESS_THREADS; i++) {
+    workers[i].cache = cache;
+    workers[i].seed = seed + i;
+    workers[i].error = NULL;
+    pthread_create(&threads[i], NULL, stress_cache, &workers[i]);
+  }
+
+  for (i = 0; i < STRESS_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  char *error = check_cache_invariants(cache, 1);
+  for (i = 0; i < STRESS_THREADS && error == NULL; i++) {
+    error = workers[i].error;
+  }
+  if (error != NULL) {
+    fprintf(stderr, "test_cache_stress: %s\n", error);
+  }
+  mu_assert(error == NULL, "Concurrent get/put/delete left the cache inconsistent");
+
+  // Removing entries one at a time down to an empty list keeps it whole
+  while (cache->tail != NULL) {
+    mu_assert(cache_delete(cache, cache->tail->path) == 0, "cache_delete did not find the tail's path");
+    mu_assert(check_cache_invariants(cache, 1) == NULL, "cache_delete left the list inconsistent");
+  }
+  mu_assert(cache->head == NULL && cache->cur_size == 0, "cache_delete did not empty the cache");
+
+  cache_free(cache);
+
+  return NULL;
+}
+
+char *test_cache_stress()
+{
+  char *message = run_cache_stress(CACHE_LRU);
+
+  return message != NULL ? message : run_cache_stress(CACHE_CLOCK);
+}
+
+char *test_cache_clock()
+{
+  struct cache *cache = cache_create(3, 0);
+  struct cache_entry *entry;
+  time_t time = 0;
+
+  cache_set_eviction(cache, CACHE_CLOCK);
+
+  cache_put(cache, "/1", "text/plain", "1", 2, time);
+  cache_put(cache, "/2", "text/plain", "2", 2, time);
+  cache_put(cache, "/3", "text/plain", "3", 2, time);
+
+  // A hit sets the entry's bit and leaves the list alone
+  entry = cache_get(cache, "/1");
+  mu_assert(entry->referenced == 1, "cache_get did not mark the entry referenced");
+  mu_assert(check_strings(cache->tail->path, "/1") == 0, "cache_get moved the entry in CLOCK mode");
+  cache_release(cache, entry);
+
+  // The hand gives /1 a second chance and takes /2, then /3
+  cache_put(cache, "/4", "text/plain", "4", 2, time);
+  mu_assert(hashtable_get(cache->index, "/2") == NULL, "CLOCK eviction did not take the first unreferenced entry");
+  mu_assert(hashtable_get(cache->index, "/1") != NULL, "CLOCK eviction took a referenced entry");
+  mu_assert(((struct cache_entry *)hashtable_get(cache->index, "/1"))->referenced == 0, "CLOCK eviction did not clear a passed entry's bit");
+  cache_put(cache, "/5", "text/plain", "5", 2, time);
+  mu_assert(hashtable_get(cache->index, "/3") == NULL, "CLOCK hand did not move on from its last victim");
+
+  // With nothing referenced the hand wraps round to /1
+  cache_put(cache, "/6", "text/plain", "6", 2, time);
+  mu_assert(hashtable_get(cache->index, "/1") == NULL, "CLOCK hand did not wrap round");
+  mu_assert(cache->cur_size == 3, "CLOCK eviction did not keep the cache at its max size");
+
+  cache_free(cache);
+
+  return NULL;
+}
+
+char *test_cache_byte_budget()
+{
+  struct cache *cache = cache_create(10, 0);
+  char *error;
+
+  cache_set_limits(cache, 10, 10);
+
+  cache_put(cache, "/1", "text/plain", "1234", 4, 0);
+  cache_put(cache, "/2", "text/plain", "1234", 4, 0);
+
+  // 4 more bytes don't fit in 10, the LRU entry makes room
+  cache_put(cache, "/3", "text/plain", "1234", 4, 0);
+  mu_assert(hashtable_get(cache->index, "/1") == NULL, "cache_put did not evict to stay within the byte budget");
+  mu_assert(cache->cur_bytes == 8, "cache_put did not count the bytes held");
+
+  // One big entry takes as many evictions as it needs
+  cache_put(cache, "/4", "text/plain", "123456789", 9, 0);
+  mu_assert(cache->cur_size == 1 && cache->tail == cache->head, "cache_put did not evict every entry the new one needs room from");
+
+  // An entry bigger than the whole budget isn't stored, nor is the old one kept
+  cache_put(cache, "/4", "text/plain", "12345678901", 11, 0);
+  mu_assert(cache_get(cache, "/4") == NULL, "cache_put stored an entry bigger than the byte budget");
+  mu_assert(cache->cur_size == 0 && cache->cur_bytes == 0, "cache_put left the replaced entry in the cache");
+
+  pthread_rwlock_rdlock(&cache->lock);
+  error = check_cache_invariants(cache, 1);
+  pthread_rwlock_unlock(&cache->lock);
+  if (error != NULL) {
+    fprintf(stderr, "test_cache_byte_budget: %s\n", error);
+  }
+  mu_assert(error == NULL, "cache_put broke the cache invariants");
+
+  cache_free(cache);
+
+  return NULL;
+}
+
+int reject_3(char *path, time_t created_at, void *arg)
+{
+  (void)created_at;
+  (void)arg;
+
+  return strcmp(path, "/3") != 0;
+}
+
+char *test_cache_snapshot()
+{
+  char *snapshot = "cache_tests/test.snapshot";
+  struct cache *cache = cache_create(3, 0);
+  time_t time = 0;
+  struct cache_entry *test_entry_1 = alloc_entry("/1", "text/plain", "1", 2, time);
+  struct cache_entry *test_entry_2 = alloc_entry("/2", "text/html", "22", 3, time);
+  struct cache_entry *test_entry_3 = alloc_entry("/3", "application/json", "333", 4, time);
+
+  cache_put(cache, test_entry_1->path, test_entry_1->content_type, test_entry_1->content, test_entry_1->content_length, time);
+  cache_put(cache, test_entry_2->path, test_entry_2->content_type, test_entry_2->content, test_entry_2->content_length, time);
+  cache_put(cache, test_entry_3->path, test_entry_3->content_type, test_entry_3->content, test_entry_3->content_length, time);
+  // Make the order 1, 3, 2 from hottest to coldest
+  cache_get(cache, "/1");
+
+  mu_assert(cache_snapshot_save(cache, snapshot) == 3, "cache_snapshot_save did not save every entry");
+  cache_free(cache);
+
+  // Reload into an empty cache, the LRU order must survive
+  cache = cache_create(3, 0);
+  mu_assert(cache_snapshot_load(cache, snapshot, NULL, NULL) == 3, "cache_snapshot_load did not load every entry");
+  mu_assert(cache->cur_size == 3, "cache_snapshot_load did not update cur_size");
+  mu_assert(check_cache_entries(cache->head, test_entry_1) == 0, "cache_snapshot_load did not put the hottest entry at the head");
+  mu_assert(check_cache_entries(cache->head->next, test_entry_3) == 0, "cache_snapshot_load did not keep the LRU order");
+  mu_assert(check_cache_entries(cache->tail, test_entry_2) == 0, "cache_snapshot_load did not put the coldest entry at the tail");
+  mu_assert(check_cache_entries(hashtable_get(cache->index, "/2"), test_entry_2) == 0, "cache_snapshot_load did not index the loaded entries");
+
+  // Loading again must not duplicate keys
+  mu_assert(cache_snapshot_load(cache, snapshot, NULL, NULL) == 0, "cache_snapshot_load loaded keys that were already cached");
+  cache_free(cache);
+
+  // Entries the callback says are stale are skipped
+  cache = cache_create(3, 0);
+  mu_assert(cache_snapshot_load(cache, snapshot, reject_3, NULL) == 2, "cache_snapshot_load did not skip stale entries");
+  mu_assert(hashtable_get(cache->index, "/3") == NULL, "cache_snapshot_load loaded an entry marked stale");
+  cache_free(cache);
+
+  // A smaller cache only takes the hottest entries
+  cache = cache_create(2, 0);
+  mu_assert(cache_snapshot_load(cache, snapshot, NULL, NULL) == 2, "cache_snapshot_load overfilled a smaller cache");
+  mu_assert(check_cache_entries(cache->head, test_entry_1) == 0, "cache_snapshot_load did not keep the hottest entries");
+  mu_assert(check_cache_entries(cache->tail, test_entry_3) == 0, "cache_snapshot_load did not keep the hottest entries");
+  cache_free(cache);
+
+  // A truncated snapshot is rejected
+  FILE *fp = fopen(snapshot, "r+");
+  fseek(fp, 0, SEEK_END);
+  long size = ftell(fp);
+  fclose(fp);
+  mu_assert(truncate(snapshot, size - 8) == 0, "could not truncate the test snapshot");
+  cache = cache_create(3, 0);
+  mu_assert(cache_snapshot_load(cache, snapshot, NULL, NULL) == -1, "cache_snapshot_load accepted a truncated snapshot");
+  cache_free(cache);
+
+  unlink(snapshot);
+  cache = cache_create(3, 0);
+  mu_assert(cache_snapshot_load(cache, snapshot, NULL, NULL) == -1, "cache_snapshot_load did not fail on a missing file");
+  cache_free(cache);
+
+  free_entry(test_entry_1);
+  free_entry(test_entry_2);
+  free_entry(test_entry_3);
+
+  return NULL;
+}
+
+char *test_cache_warm_tier()
+{
+  char *filename = "cache_tests/test.slab";
+  struct slab *slab = slab_open(filename, 4096);
+  struct cache *cache = cache_create(2, 0);
+  struct cache_entry *entry;
+  struct slab_item *item;
+  static char path[16], body[200], big[4096];
+  int claimed, i;
+
+  mu_assert(slab != NULL, "slab_open could not create the slab file");
+  cache_set_warm_tier(cache, slab, reject_3, NULL);
+
+  // Evicted entries are demoted, misses promote them back
+  cache_put(cache, "/1", "text/plain", "1", 2, 1);
+  cache_put(cache, "/2", "text/html", "22", 3, 2);
+  cache_put(cache, "/3", "text/plain", "333", 4, 3);
+  mu_assert(hashtable_get(cache->index, "/1") == NULL, "cache_put did not evict from the hot tier");
+  entry = cache_get_or_claim(cache, "/1", &claimed);
+  mu_assert(entry != NULL && claimed == 0, "cache_get_or_claim did not promote from the warm tier");
+  mu_assert(check_strings(entry->content, "1") == 0 && entry->created_at == 1, "promotion did not keep the entry intact");
+  cache_release(cache, entry);
+  mu_assert(slab_get(slab, "/1") == NULL, "promotion left a copy in the warm tier");
+  item = slab_get(slab, "/2");
+  mu_assert(item != NULL && check_strings(item->content_type, "text/html") == 0 && check_strings(item->content, "22") == 0, "promotion did not demote the hot tier's victim");
+  slab_item_free(item);
+
+  // Stale entries are dropped instead of promoted
+  cache_put(cache, "/4", "text/plain", "4", 2, 4);
+  mu_assert(slab_get(slab, "/3") != NULL, "cache_put did not demote its victim");
+  mu_assert(cache_get_or_claim(cache, "/3", &claimed) == NULL && claimed == 1, "cache_get_or_claim promoted a stale entry");
+  cache_unclaim(cache, "/3");
+  mu_assert(slab_get(slab, "/3") == NULL, "a stale entry was left in the warm tier");
+
+  // Deleting covers both tiers
+  mu_assert(cache_delete(cache, "/2") == 0 && slab_get(slab, "/2") == NULL, "cache_delete left a copy in the warm tier");
+
+  // Filling the ring drops the oldest records, the newest stay readable
+  memset(body, 'x', sizeof body);
+  for (i = 0; i < 100; i++) {
+    snprintf(path, sizeof path, "/r/%d", i);
+    body[0] = i;
+    mu_assert(slab_put(slab, path, "text/plain", body, sizeof body, 0) == 0, "slab_put refused an entry that fits");
+  }
+  item = slab_get(slab, "/r/99");
+  mu_assert(item != NULL && item->content_length == sizeof body && ((char *)item->content)[0] == 99, "slab_get did not return the newest record");
+  slab_item_free(item);
+  mu_assert(slab_get(slab, "/r/0") == NULL, "the slab did not drop its oldest records");
+  mu_assert(slab->index->num_entries == slab->count, "the slab index and log disagree");
+  mu_assert(slab_delete_prefix(slab, "/r/") == slab->count, "slab_delete_prefix did not forget every match");
+  for (i = 0; i < (int)sizeof big; i++) {
+    big[i] = rand();
+  }
+  mu_assert(slab_put(slab, "/big", "text/plain", big, sizeof big, 0) == -1, "slab_put stored an entry bigger than half the slab");
+
+  cache_free(cache);
+  slab_close(slab);
+  unlink(filename);
+
+  return NULL;
+}
+
+char *test_cache_stored_responses()
+{
+  char *filename = "cache_tests/test.slab";
+  char *snapshot = "cache_tests/test.snapshot";
+  struct slab *slab = slab_open(filename, 4096);
+  struct cache *cache = cache_create(2, 0);
+  struct cache_entry *entry;
+
+  mu_assert(slab != NULL, "slab_open could not create the slab file");
+  cache_set_warm_tier(cache, slab, NULL, NULL);
+
+  // An entry inserted whole keeps its expiry and headers
+  entry = alloc_entry("GET host/a", "text/plain", "a", 2, 1);
+  entry->expires_at = 61;
+  entry->headers = strdup("ETag: \"a\"\r\n");
+  cache_insert(cache, entry);
+  cache_put(cache, "/1", "text/plain", "1", 2, 1);
+  entry = cache_get(cache, "GET host/a");
+  mu_assert(entry != NULL && entry->expires_at == 61 && check_strings(entry->headers, "ETag: \"a\"\r\n") == 0, "cache_insert did not keep the entry as given");
+  cache_release(cache, entry);
+
+  // Snapshots leave stored responses out
+  mu_assert(cache_snapshot_save(cache, snapshot) == 1, "cache_snapshot_save saved a stored response");
+  unlink(snapshot);
+
+  // Evicted stored responses are dropped, not demoted
+  cache_put(cache, "/2", "text/plain", "2", 2, 1);
+  cache_put(cache, "/3", "text/plain", "3", 2, 1);
+  mu_assert(hashtable_get(cache->index, "GET host/a") == NULL, "cache_put did not evict the stored response");
+  mu_assert(slab_get(slab, "GET host/a") == NULL, "cache_put demoted a stored response to the warm tier");
+
+  cache_free(cache);
+  slab_close(slab);
+  unlink(filename);
+
+  return NULL;
+}
+
+char *test_cache_hugepages()
+{
+  struct cache *cache = cache_create(4, 0);
+  struct cache_entry *entry;
+  static char big[3 * 1024 * 1024];
+  void *p, *q;
+
+  mu_assert(hugemem_init(HUGEMEM_PAGE) > 0, "hugemem_init could not map a region");
+  mu_assert(hugemem_init(HUGEMEM_PAGE) == -1, "hugemem_init mapped a second region");
+
+  // Freed buffers go back to their size class
+  p = hugemem_alloc(100);
+  hugemem_free(p);
+  q = hugemem_alloc(110);
+  mu_assert(p == q, "hugemem_alloc did not reuse a freed buffer of the same class");
+  hugemem_free(q);
+
+  // Entries keep their contents in the region, or malloc() what doesn't fit
+  cache_put(cache, "/1", "text/plain", "1", 2, 1);
+  cache_put(cache, "/big", "text/plain", big, sizeof big, 1);
+  entry = cache_get(cache, "/1");
+  mu_assert(entry != NULL && check_strings(entry->content, "1") == 0, "cache_put lost content kept in huge pages");
+  cache_release(cache, entry);
+  entry = cache_get(cache, "/big");
+  mu_assert(entry != NULL && entry->content_length == sizeof big, "cache_put lost content too big for a huge page");
+  cache_release(cache, entry);
+
+  // A full region falls back to malloc()
+  p = hugemem_alloc(HUGEMEM_PAGE);
+  mu_assert(p != NULL, "hugemem_alloc failed once the region was full");
+  hugemem_free(p);
+
+  cache_free(cache);
+
+  return NULL;
+}
+
+// The last field hpack_decode() emitted
+struct decoded_field
+{
+  char name[64];
+  char value[64];
+  int count;
+};
+
+static int keep_field(void *arg, char *name, int name_len, char *value, int value_len)
+{
+  struct decoded_field *f = arg;
+
+  snprintf(f->name, sizeof f->name, "%.*s", name_len, name);
+  snprintf(f->value, sizeof f->value, "%.*s", value_len, value);
+  f->count++;
+
+  return 0;
+}
+
+char *test_hpack_evicted_name()
+{
+  struct hpack_decoder d;
+  struct decoded_field f = { "", "", 0 };
+
+  // TABLE of 64 bytes, then "x-a: 1234567890" indexed (45 bytes), then a
+  // field indexed under the name of that entry, which evicts it
+  unsigned char block[] = "\x3f\x21"
+                          "\x40\x03x-a\x0a" "1234567890"
+                          "\x7e\x0a" "abcdefghij";
+  // TOO BIG for the table, named after its only entry, which it empties
+  unsigned char too_big[] = "\x7e\x28" "0123456789012345678901234567890123456789";
+  unsigned char indexed[] = "\xbe";
+
+  hpack_decoder_init(&d);
+
+  mu_assert(hpack_decode(&d, block, sizeof block - 1, keep_field, &f) == 0, "hpack_decode failed on a valid block");
+  mu_assert(f.count == 2 && strcmp(f.name, "x-a") == 0 && strcmp(f.value, "abcdefghij") == 0,
+            "hpack_decode lost the name of the entry it evicted");
+  mu_assert(hpack_decode(&d, indexed, 1, keep_field, &f) == 0 && strcmp(f.name, "x-a") == 0 &&
+            strcmp(f.value, "abcdefghij") == 0, "hpack_decode did not index the field that evicted its name");
+
+  mu_assert(hpack_decode(&d, too_big, sizeof too_big - 1, keep_field, &f) == 0 && strcmp(f.name, "x-a") == 0,
+            "hpack_decode lost the name of a field too big for the table");
+  mu_assert(hpack_decode(&d, indexed, 1, keep_field, &f) == -1, "hpack_decode kept a field too big for the table");
+
+  hpack_decoder_free(&d);
+
+  return NULL;
+}
+
+char *test_urlpath_normalize()
+{
+  char path[64];
+  // Input, then what it normalizes to, NULL if it is refused
+  char *cases[][2] = {
+    { "/a/./b/../c", "/a/c" },
+    { "//a//b/", "/a/b/" },
+    { "/a%20b?x=%3F#frag", "/a b?x=%3F" },
+    { "/%2e%2e/x", NULL },
+    { "/..%3F/x", NULL },
+    { "/..%3f", NULL },
+    { "/a%23b", NULL },
+    { "/a%2Fb", NULL },
+    { "/a%00b", NULL },
+    { "/a%2", NULL },
+    { "/a/../..", NULL },
+    { "a", NULL },
+  };
+
+  for (size_t i = 0; i < sizeof cases / sizeof cases[0]; i++)
+  {
+    strcpy(path, cases[i][0]);
+    int len = urlpath_normalize(path);
+
+    if (cases[i][1] == NULL)
+    {
+      mu_assert(len == -1, "urlpath_normalize accepted a path it should refuse");
+    }
+    else
+    {
+      mu_assert(len == (int)strlen(cases[i][1]) && strcmp(path, cases[i][1]) == 0,
+                "urlpath_normalize did not normalize a path as expected");
+    }
+  }
+
+  return NULL;
+}
+
 char *all_tests()
 {
   mu_suite_start();
@@ -157,6 +799,18 @@ char *all_tests()
   mu_run_test(test_cache_alloc_entry);
   mu_run_test(test_cache_put);
   mu_run_test(test_cache_get);
+  mu_run_test(test_cache_delete);
+  mu_run_test(test_cache_put_replace);
+  mu_run_test(test_cache_claim);
+  mu_run_test(test_cache_stress);
+  mu_run_test(test_cache_clock);
+  mu_run_test(test_cache_byte_budget);
+  mu_run_test(test_cache_snapshot);
+  mu_run_test(test_cache_warm_tier);
+  mu_run_test(test_cache_stored_responses);
+  mu_run_test(test_cache_hugepages);
+  mu_run_test(test_hpack_evicted_name);
+  mu_run_test(test_urlpath_normalize);
 
   return NULL;
 }
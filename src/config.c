@@ -0,0 +1,708 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <stddef.h>
+#include "config.h"
+
+#define CONFIG_STR 0
+#define CONFIG_INT 1
+#define CONFIG_SIZE 2 // long long, with an optional K, M or G suffix
+
+#define STR(field, reloadable, help) \
+    { #field, CONFIG_STR, offsetof(struct config, field), sizeof ((struct config *)0)->field, 0, reloadable, help }
+#define INT(field, reloadable, help) \
+    { #field, CONFIG_INT, offsetof(struct config, field), sizeof(int), 0, reloadable, help }
+#define COUNT(field, reloadable, help) /* An INT that must be at least 1 */ \
+    { #field, CONFIG_INT, offsetof(struct config, field), sizeof(int), 1, reloadable, help }
+#define SIZE(field, reloadable, help) \
+    { #field, CONFIG_SIZE, offsetof(struct config, field), sizeof(long long), 0, reloadable, help }
+
+// Every setting, under the same name in the file and on the command line
+static struct config_option {
+    char *key;
+    int type;
+    size_t offset;
+    size_t size;
+    long long min;
+    int reloadable;
+    char *help;
+} options[] = {
+    STR(port, 0, "HTTP port"),
+    STR(tls_port, 0, "HTTPS port"),
+    STR(tls_cert, 0, "TLS certificate, PEM"),
+    STR(tls_key, 0, "TLS private key, PEM"),
+    INT(backlog, 0, "pending connections queued per listener"),
+    STR(engine, 0, "how connections are served: threads"),
+    INT(workers, 1, "most worker threads at once, 0 for no cap"),
+    INT(shards, 0, "pinned shared-nothing shards, one per core, 0 for one shared accept loop"),
+    STR(root, 0, "document root"),
+    STR(files, 0, "error pages directory"),
+    STR(assets, 0, "assets directory, searched after the root"),
+    STR(post_log, 0, "file POSTed data is appended to"),
+    INT(autoindex, 1, "list directories that have no index.html, 1 for on"),
+    COUNT(cache_entries, 1, "most entries in the in-memory cache"),
+    SIZE(cache_bytes, 1, "most content bytes in the in-memory cache, 0 for no budget"),
+    SIZE(cache_max_file, 0, "bigger files are sent from disk, not cached"),
+    INT(cache_ttl, 1, "seconds cache entries live when inotify is unavailable"),
+    STR(cache_snapshot, 0, "hot cache entries are saved here at shutdown"),
+    STR(cache_manifest, 0, "paths to pre-load into the cache"),
+    STR(cache_slab, 0, "warm cache tier file"),
+    SIZE(cache_slab_size, 0, "warm cache tier size, e.g. 64M, 0 for none"),
+    SIZE(cache_hugepages, 0, "huge-page region cache contents are kept in, 0 to malloc() them"),
+    SIZE(max_body, 1, "largest request body accepted"),
+    INT(rate_limit, 1, "connections per second each client may open, 0 for no limit"),
+    INT(rate_burst, 1, "connections a client may open at once"),
+    INT(max_client_conns, 1, "connections each client may have open, 0 for no cap"),
+    INT(timeout_idle, 1, "seconds from accept to the first byte of a request"),
+    INT(timeout_header, 1, "seconds from that byte to the end of the request head"),
+    INT(timeout_body, 1, "seconds a worker waits on a silent client"),
+    INT(timeout_write, 1, "seconds a worker waits on a client not taking data"),
+    INT(timeout_drain, 1, "seconds requests in flight get to finish when stopping"),
+    INT(timeout_upgrade, 1, "seconds a new binary gets to come up on SIGUSR2"),
+    INT(sndbuf, 1, "send buffer of each connection, 0 for the kernel default"),
+    INT(rcvbuf, 1, "receive buffer of each connection, 0 for the kernel default"),
+    INT(log_connections, 1, "print each connection's client address, 1 for on"),
+};
+
+#define OPTION_COUNT (int)(sizeof options / sizeof options[0])
+
+#define VHOST_STR(field) \
+    { #field, CONFIG_STR, offsetof(struct config_vhost, field), sizeof ((struct config_vhost *)0)->field, 0, 0, NULL }
+#define VHOST_INT(field) \
+    { #field, CONFIG_INT, offsetof(struct config_vhost, field), sizeof(int), 0, 0, NULL }
+#define VHOST_COUNT(field) \
+    { #field, CONFIG_INT, offsetof(struct config_vhost, field), sizeof(int), 1, 0, NULL }
+#define VHOST_SIZE(field) \
+    { #field, CONFIG_SIZE, offsetof(struct config_vhost, field), sizeof(long long), 0, 0, NULL }
+
+// What a [vhost] section may set
+static struct config_option vhost_options[] = {
+    VHOST_STR(root),
+    VHOST_STR(assets),
+    VHOST_STR(files),
+    VHOST_COUNT(cache_entries),
+    VHOST_SIZE(cache_bytes),
+    VHOST_INT(autoindex),
+};
+
+#define VHOST_OPTION_COUNT (int)(sizeof vhost_options / sizeof vhost_options[0])
+
+#define UPSTREAM_STR(field) \
+    { #field, CONFIG_STR, offsetof(struct config_upstream, field), sizeof ((struct config_upstream *)0)->field, 0, 0, NULL }
+#define UPSTREAM_INT(field) \
+    { #field, CONFIG_INT, offsetof(struct config_upstream, field), sizeof(int), 0, 0, NULL }
+
+// What an [upstream] section may set
+static struct config_option upstream_options[] = {
+    UPSTREAM_STR(prefix),
+    UPSTREAM_STR(servers),
+    UPSTREAM_STR(balance),
+    UPSTREAM_STR(health_check),
+    UPSTREAM_INT(health_interval),
+    UPSTREAM_INT(pool_size),
+    UPSTREAM_INT(timeout),
+};
+
+#define UPSTREAM_OPTION_COUNT (int)(sizeof upstream_options / sizeof upstream_options[0])
+
+/**
+ * Set every setting to its built-in default
+ */
+void config_defaults(struct config *config)
+{
+    memset(config, 0, sizeof *config);
+
+    strcpy(config->port, "3490");
+    strcpy(config->tls_port, "3491");
+    strcpy(config->tls_cert, "./tls/cert.pem");
+    strcpy(config->tls_key, "./tls/key.pem");
+    config->backlog = 10;
+
+    strcpy(config->engine, "threads");
+    config->workers = 0;
+    config->shards = 0;
+
+    strcpy(config->root, "./serverroot");
+    strcpy(config->files, "./serverfiles");
+    strcpy(config->assets, "./assets");
+    strcpy(config->post_log, "post_data.txt");
+    config->autoindex = 0;
+
+    config->cache_entries = 10;
+    config->cache_bytes = 0;
+    config->cache_max_file = 1024 * 1024;
+    config->cache_ttl = 60;
+    strcpy(config->cache_snapshot, "cache.snapshot");
+    strcpy(config->cache_manifest, "warmup.txt");
+    strcpy(config->cache_slab, "cache.slab");
+    config->cache_slab_size = 0;
+    config->cache_hugepages = 0;
+
+    config->max_body = 8 * 1024 * 1024;
+    config->rate_limit = 100;
+    config->rate_burst = 200;
+    config->max_client_conns = 32;
+
+    config->timeout_idle = 15;
+    config->timeout_header = 10;
+    config->timeout_body = 30;
+    config->timeout_write = 30;
+    config->timeout_drain = 30;
+    config->timeout_upgrade = 10;
+
+    config->sndbuf = 0;
+    config->rcvbuf = 0;
+
+    config->log_connections = 1;
+}
+
+/**
+ * Find a setting by name in a table, dashes and underscores alike
+ */
+static struct config_option *find_option(struct config_option *table, int count, char *key)
+{
+    for (int i = 0; i < count; i++)
+    {
+        char *a = table[i].key, *b = key;
+
+        while (*a != '\0' && (*a == *b || (*a == '_' && *b == '-')))
+        {
+            a++;
+            b++;
+        }
+        if (*a == '\0' && *b == '\0')
+        {
+            return &table[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Parse a non-negative number, with a K, M or G suffix if allowed
+ *
+ * Returns 0 on success, -1 if value isn't one.
+ */
+static int parse_number(char *value, int suffix, long long *result)
+{
+    char *end;
+
+    errno = 0;
+    long long n = strtoll(value, &end, 10);
+
+    if (end == value || errno != 0 || n < 0)
+    {
+        return -1;
+    }
+
+    if (suffix && *end != '\0' && end[1] == '\0')
+    {
+        int shift = 0;
+
+        switch (toupper((unsigned char)*end))
+        {
+            case 'K': shift = 10; break;
+            case 'M': shift = 20; break;
+            case 'G': shift = 30; break;
+            default: return -1;
+        }
+        if (n > (__LONG_LONG_MAX__ >> shift))
+        {
+            return -1;
+        }
+        n <<= shift;
+        end++;
+    }
+
+    if (*end != '\0')
+    {
+        return -1;
+    }
+
+    *result = n;
+    return 0;
+}
+
+/**
+ * Store a setting's text form in the field opt describes, in base
+ *
+ * Returns 0 on success, -1 for a bad value.
+ */
+static int set_option(struct config_option *opt, char *base, char *key, char *value)
+{
+    char *field = base + opt->offset;
+    long long n;
+
+    switch (opt->type)
+    {
+        case CONFIG_STR:
+            if (strlen(value) >= opt->size)
+            {
+                fprintf(stderr, "config: %s is too long\n", key);
+                return -1;
+            }
+            strcpy(field, value);
+            return 0;
+
+        case CONFIG_INT:
+            if (parse_number(value, 0, &n) < 0 || n > __INT_MAX__)
+            {
+                break;
+            }
+            if (n < opt->min)
+            {
+                fprintf(stderr, "config: %s must be at least %lld\n", key, opt->min);
+                return -1;
+            }
+            *(int *)field = (int)n;
+            return 0;
+
+        case CONFIG_SIZE:
+            if (parse_number(value, 1, &n) < 0)
+            {
+                break;
+            }
+            *(long long *)field = n;
+            return 0;
+    }
+
+    fprintf(stderr, "config: bad value for %s: %s\n", key, value);
+    return -1;
+}
+
+/**
+ * Set one setting from its text form
+ *
+ * Returns 0 on success, -1 for an unknown key or a bad value.
+ */
+int config_set(struct config *config, char *key, char *value)
+{
+    struct config_option *opt = find_option(options, OPTION_COUNT, key);
+
+    if (opt == NULL)
+    {
+        fprintf(stderr, "config: unknown setting %s\n", key);
+        return -1;
+    }
+
+    return set_option(opt, (char *)config, key, value);
+}
+
+/**
+ * Start a [vhost name alias...] section
+ *
+ * Returns the new host, or NULL on error.
+ */
+static struct config_vhost *vhost_section(struct config *config, char *names)
+{
+    if (config->vhost_count == CONFIG_VHOSTS_MAX)
+    {
+        fprintf(stderr, "config: more than %d vhosts\n", CONFIG_VHOSTS_MAX);
+        return NULL;
+    }
+    if (*names == '\0' || strlen(names) >= CONFIG_PATH_MAX)
+    {
+        fprintf(stderr, "config: a vhost needs a name\n");
+        return NULL;
+    }
+
+    struct config_vhost *vhost = &config->vhosts[config->vhost_count++];
+
+    memset(vhost, 0, sizeof *vhost);
+    strcpy(vhost->names, names);
+    vhost->cache_entries = -1;
+    vhost->cache_bytes = -1;
+    vhost->autoindex = -1;
+
+    return vhost;
+}
+
+/**
+ * Start an [upstream name] section
+ *
+ * Returns the new upstream, or NULL on error.
+ */
+static struct config_upstream *upstream_section(struct config *config, char *name)
+{
+    if (config->upstream_count == CONFIG_UPSTREAMS_MAX)
+    {
+        fprintf(stderr, "config: more than %d upstreams\n", CONFIG_UPSTREAMS_MAX);
+        return NULL;
+    }
+    if (*name == '\0' || strlen(name) >= CONFIG_PATH_MAX)
+    {
+        fprintf(stderr, "config: an upstream needs a name\n");
+        return NULL;
+    }
+
+    struct config_upstream *upstream = &config->upstreams[config->upstream_count++];
+
+    memset(upstream, 0, sizeof *upstream);
+    strcpy(upstream->name, name);
+    strcpy(upstream->balance, "round_robin");
+    upstream->health_interval = 5;
+    upstream->pool_size = 16;
+    upstream->timeout = 30;
+
+    return upstream;
+}
+
+/**
+ * Check an upstream section once it is complete
+ *
+ * Returns 0 if it is usable, -1 if not.
+ */
+static int check_upstream(char *path, struct config_upstream *upstream)
+{
+    char *problem = NULL;
+
+    if (upstream->prefix[0] != '/')
+    {
+        problem = "needs a prefix starting with /";
+    }
+    else if (strspn(upstream->servers, " \t") == strlen(upstream->servers))
+    {
+        problem = "needs servers";
+    }
+    else if (strcmp(upstream->balance, "round_robin") != 0 && strcmp(upstream->balance, "least_conn") != 0)
+    {
+        problem = "balance must be round_robin or least_conn";
+    }
+    else if (upstream->health_interval == 0 || upstream->timeout == 0)
+    {
+        problem = "health_interval and timeout must be at least 1";
+    }
+
+    if (problem != NULL)
+    {
+        fprintf(stderr, "%s: upstream %s %s\n", path, upstream->name, problem);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Strip leading and trailing whitespace in place
+ */
+static char *trim(char *s)
+{
+    while (isspace((unsigned char)*s))
+    {
+        s++;
+    }
+
+    char *end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1]))
+    {
+        *--end = '\0';
+    }
+
+    return s;
+}
+
+/**
+ * Apply a config file of "key = value" lines, # starts a comment
+ *
+ * A "[vhost name alias...]" line starts a virtual host's section, and
+ * "[upstream name]" a reverse proxied prefix's. The settings after it
+ * are the section's, up to the next one.
+ *
+ * Every line is applied even after a bad one, so all mistakes are
+ * reported at once. Returns 0 on success, -1 on error.
+ */
+int config_load(struct config *config, char *path)
+{
+    FILE *fp = fopen(path, "r");
+    char line[2 * CONFIG_PATH_MAX];
+    int lineno = 0;
+    int rv = 0;
+
+    // The section settings go to, NULL at the top level
+    char *section = NULL;
+    char *section_kind = NULL;
+    struct config_option *section_options = NULL;
+    int section_option_count = 0;
+
+    if (fp == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof line, fp) != NULL)
+    {
+        lineno++;
+
+        char *comment = strchr(line, '#');
+        if (comment != NULL)
+        {
+            *comment = '\0';
+        }
+
+        char *key = trim(line);
+        if (*key == '\0')
+        {
+            continue;
+        }
+
+        // [vhost name alias...] or [upstream name]
+        if (*key == '[')
+        {
+            char *end = strchr(key, ']');
+
+            if (end != NULL && end[1] == '\0' && strncmp(key, "[vhost", 6) == 0 && isspace((unsigned char)key[6]))
+            {
+                *end = '\0';
+                section = (char *)vhost_section(config, trim(key + 6));
+                section_kind = "vhost";
+                section_options = vhost_options;
+                section_option_count = VHOST_OPTION_COUNT;
+            }
+            else if (end != NULL && end[1] == '\0' && strncmp(key, "[upstream", 9) == 0 &&
+                     isspace((unsigned char)key[9]))
+            {
+                *end = '\0';
+                section = (char *)upstream_section(config, trim(key + 9));
+                section_kind = "upstream";
+                section_options = upstream_options;
+                section_option_count = UPSTREAM_OPTION_COUNT;
+            }
+            else
+            {
+                fprintf(stderr, "%s:%d: expected [vhost name ...] or [upstream name]\n", path, lineno);
+                fclose(fp);
+                return -1;
+            }
+
+            if (section == NULL)
+            {
+                fprintf(stderr, "%s:%d: section ignored\n", path, lineno);
+                fclose(fp);
+                return -1;
+            }
+            continue;
+        }
+
+        char *eq = strchr(key, '=');
+        if (eq == NULL)
+        {
+            fprintf(stderr, "%s:%d: expected key = value\n", path, lineno);
+            rv = -1;
+            continue;
+        }
+        *eq = '\0';
+        key = trim(key);
+
+        if (section != NULL)
+        {
+            struct config_option *opt = find_option(section_options, section_option_count, key);
+
+            if (opt == NULL)
+            {
+                fprintf(stderr, "%s:%d: %s can't be set per %s\n", path, lineno, key, section_kind);
+                rv = -1;
+            }
+            else if (set_option(opt, section, key, trim(eq + 1)) < 0)
+            {
+                fprintf(stderr, "%s:%d: setting ignored\n", path, lineno);
+                rv = -1;
+            }
+            continue;
+        }
+
+        if (config_set(config, key, trim(eq + 1)) < 0)
+        {
+            fprintf(stderr, "%s:%d: setting ignored\n", path, lineno);
+            rv = -1;
+        }
+    }
+
+    fclose(fp);
+
+    for (int i = 0; i < config->vhost_count; i++)
+    {
+        if (config->vhosts[i].root[0] == '\0')
+        {
+            fprintf(stderr, "%s: vhost %s has no root\n", path, config->vhosts[i].names);
+            rv = -1;
+        }
+    }
+
+    for (int i = 0; i < config->upstream_count; i++)
+    {
+        if (check_upstream(path, &config->upstreams[i]) < 0)
+        {
+            rv = -1;
+        }
+    }
+
+    return rv;
+}
+
+/**
+ * Build the configuration: the defaults, then the file given with
+ * -c/--config, then every --key=value or --key value on the command line
+ *
+ * Run again on SIGHUP, so a reload sees the file's new contents under
+ * the same command line. -h/--help prints the usage and exits.
+ * Returns 0 on success, -1 on error.
+ */
+int config_parse(struct config *config, int argc, char **argv)
+{
+    config_defaults(config);
+
+    // FIND the file first, the command line overrides it wherever it is
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0)
+        {
+            config_usage(argv[0]);
+            exit(0);
+        }
+        if ((strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--config") == 0) && i + 1 < argc)
+        {
+            if (config_load(config, argv[++i]) < 0)
+            {
+                return -1;
+            }
+        }
+    }
+
+    for (int i = 1; i < argc; i++)
+    {
+        char *arg = argv[i];
+
+        if (strcmp(arg, "-c") == 0 || strcmp(arg, "--config") == 0)
+        {
+            if (++i == argc)
+            {
+                fprintf(stderr, "config: %s needs a file\n", arg);
+                return -1;
+            }
+            continue;
+        }
+
+        if (strncmp(arg, "--", 2) != 0)
+        {
+            fprintf(stderr, "config: unexpected argument %s\n", arg);
+            return -1;
+        }
+
+        // --key=value, or --key value
+        char key[64];
+        char *value = strchr(arg, '=');
+
+        if (value != NULL)
+        {
+            snprintf(key, sizeof key, "%.*s", (int)(value - arg - 2), arg + 2);
+            value++;
+        }
+        else if (i + 1 < argc)
+        {
+            snprintf(key, sizeof key, "%s", arg + 2);
+            value = argv[++i];
+        }
+        else
+        {
+            fprintf(stderr, "config: %s needs a value\n", arg);
+            return -1;
+        }
+
+        if (config_set(config, key, value) < 0)
+        {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Take the reloadable settings of a freshly parsed configuration
+ *
+ * They are stored atomically, for readers using CONFIG_GET(). Settings
+ * that take a restart are left alone, with a warning if they changed.
+ */
+void config_reload(struct config *config, struct config *fresh)
+{
+    for (int i = 0; i < OPTION_COUNT; i++)
+    {
+        struct config_option *opt = &options[i];
+        char *field = (char *)config + opt->offset;
+        char *value = (char *)fresh + opt->offset;
+
+        if (memcmp(field, value, opt->size) == 0)
+        {
+            continue;
+        }
+
+        if (!opt->reloadable)
+        {
+            fprintf(stderr, "config: %s changed, that takes a restart\n", opt->key);
+        }
+        else if (opt->type == CONFIG_INT)
+        {
+            __atomic_store_n((int *)field, *(int *)value, __ATOMIC_RELAXED);
+        }
+        else if (opt->type == CONFIG_SIZE)
+        {
+            __atomic_store_n((long long *)field, *(long long *)value, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (config->vhost_count != fresh->vhost_count ||
+        memcmp(config->vhosts, fresh->vhosts, config->vhost_count * sizeof config->vhosts[0]) != 0)
+    {
+        fprintf(stderr, "config: vhosts changed, that takes a restart\n");
+    }
+
+    if (config->upstream_count != fresh->upstream_count ||
+        memcmp(config->upstreams, fresh->upstreams, config->upstream_count * sizeof config->upstreams[0]) != 0)
+    {
+        fprintf(stderr, "config: upstreams changed, that takes a restart\n");
+    }
+}
+
+/**
+ * Print how to run the server, with every setting and its default
+ */
+void config_usage(char *prog)
+{
+    static struct config defaults;
+
+    config_defaults(&defaults);
+
+    printf("usage: %s [-c FILE] [--SETTING=VALUE ...]\n\n", prog);
+    printf("Settings come from FILE, \"setting = value\" per line, then the command\n");
+    printf("line. Those marked * are re-read on SIGHUP, the rest take a restart.\n");
+    printf("In FILE, a \"[vhost name alias...]\" section serves those Host names from\n");
+    printf("its own root, assets, files, cache_entries, cache_bytes and autoindex, and\n");
+    printf("an \"[upstream name]\" section passes requests under its prefix to its\n");
+    printf("servers, see webserver.conf.example.\n\n");
+
+    for (int i = 0; i < OPTION_COUNT; i++)
+    {
+        struct config_option *opt = &options[i];
+        char *field = (char *)&defaults + opt->offset;
+        char def[CONFIG_PATH_MAX];
+
+        if (opt->type == CONFIG_STR)
+        {
+            snprintf(def, sizeof def, "%s", field);
+        }
+        else if (opt->type == CONFIG_INT)
+        {
+            snprintf(def, sizeof def, "%d", *(int *)field);
+        }
+        else
+        {
+            snprintf(def, sizeof def, "%lld", *(long long *)field);
+        }
+
+        printf("  --%-18s %c %s (%s)\n", opt->key, opt->reloadable ? '*' : ' ', opt->help, def);
+    }
+}
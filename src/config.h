@@ -0,0 +1,108 @@
+#ifndef _CONFIG_H_
+#define _CONFIG_H_
+
+#define CONFIG_PATH_MAX 1024
+#define CONFIG_VHOSTS_MAX 32
+#define CONFIG_UPSTREAMS_MAX 16
+
+// Read a tunable that SIGHUP may be changing under us
+#define CONFIG_GET(config, field) __atomic_load_n(&(config)->field, __ATOMIC_RELAXED)
+
+// A [vhost name alias...] section of the config file: a site of its
+// own, picked by the request's Host. Unset files, cache_entries,
+// cache_bytes and autoindex are taken from the top-level settings.
+struct config_vhost {
+    char names[CONFIG_PATH_MAX]; // Space-separated, the first is the site's name
+    char root[CONFIG_PATH_MAX];
+    char assets[CONFIG_PATH_MAX]; // "" for none
+    char files[CONFIG_PATH_MAX];
+    int cache_entries; // -1 when unset
+    long long cache_bytes; // -1 when unset
+    int autoindex; // -1 when unset
+};
+
+// An [upstream name] section: requests whose path starts with prefix are
+// passed on to one of the servers, on every host
+struct config_upstream {
+    char name[CONFIG_PATH_MAX];
+    char prefix[CONFIG_PATH_MAX];
+    char servers[CONFIG_PATH_MAX]; // Space-separated host:port
+    char balance[16]; // round_robin or least_conn
+    char health_check[CONFIG_PATH_MAX]; // Path to GET from each server, "" to only connect
+    int health_interval; // Seconds between checks
+    int pool_size; // Idle connections kept open to each server
+    int timeout; // Seconds to connect, and to wait on a server for data
+};
+
+// Everything that can be set from the config file or the command line.
+// Fields marked reloadable are picked up on SIGHUP, the rest take a restart
+// (or a SIGUSR2 upgrade).
+struct config {
+    // Listeners
+    char port[16];
+    char tls_port[16]; // Used when built with TLS=1
+    char tls_cert[CONFIG_PATH_MAX];
+    char tls_key[CONFIG_PATH_MAX];
+    int backlog; // Pending connections the kernel queues per listener
+
+    // Workers
+    char engine[16]; // How connections are served, only "threads" is built in
+    int workers; // Most worker threads at once, 0 for no cap; reloadable
+    int shards; // Shards, each pinned to a core with its own listeners and caches; 0 for none
+
+    // Files
+    char root[CONFIG_PATH_MAX];
+    char files[CONFIG_PATH_MAX]; // Error pages
+    char assets[CONFIG_PATH_MAX];
+    char post_log[CONFIG_PATH_MAX];
+    int autoindex; // List directories that have no index.html; reloadable
+
+    // Cache
+    int cache_entries; // reloadable
+    long long cache_bytes; // Content bytes held, 0 for no budget; reloadable
+    long long cache_max_file; // Bigger files are sendfile()d, not cached
+    int cache_ttl; // Seconds, only used when inotify can't watch the files; reloadable
+    char cache_snapshot[CONFIG_PATH_MAX]; // Hot entries saved at shutdown, reloaded at startup
+    char cache_manifest[CONFIG_PATH_MAX]; // Paths to pre-load, else the roots are walked
+    char cache_slab[CONFIG_PATH_MAX]; // Warm tier evicted entries go to
+    long long cache_slab_size; // 0 runs without a warm tier
+    long long cache_hugepages; // Region of huge pages for contents, 0 for malloc()
+
+    // Limits, all reloadable
+    long long max_body; // Largest request body accepted
+    int rate_limit; // Connections per second each client may open on average
+    int rate_burst; // Connections a client may open at once
+    int max_client_conns; // Connections each client may have open at a time
+
+    // Timeouts in seconds, all reloadable
+    int timeout_idle; // Accept to the first byte of a request
+    int timeout_header; // That byte to the end of the request head
+    int timeout_body; // A worker waiting on a silent client
+    int timeout_write; // A worker waiting on a client not taking data
+    int timeout_drain; // In-flight requests finishing when stopping
+    int timeout_upgrade; // A new binary coming up on SIGUSR2
+
+    // Socket buffers of accepted connections in bytes, 0 for the kernel's; reloadable
+    int sndbuf;
+    int rcvbuf;
+
+    int log_connections; // Print each client's address on accept; reloadable
+
+    // Virtual hosts, from the config file only. Requests for any other
+    // Host get the top-level root, assets and cache
+    struct config_vhost vhosts[CONFIG_VHOSTS_MAX];
+    int vhost_count;
+
+    // Reverse proxied path prefixes, from the config file only
+    struct config_upstream upstreams[CONFIG_UPSTREAMS_MAX];
+    int upstream_count;
+};
+
+extern void config_defaults(struct config *config);
+extern int config_set(struct config *config, char *key, char *value);
+extern int config_load(struct config *config, char *path);
+extern int config_parse(struct config *config, int argc, char **argv);
+extern void config_reload(struct config *config, struct config *fresh);
+extern void config_usage(char *prog);
+
+#endif
@@ -0,0 +1,504 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
+#include "request.h"
+#include "scan.h"
+#include "timerwheel.h"
+#include "affinity.h"
+#include "conn.h"
+
+#define CONN_FREE 0
+#define CONN_WAITING 1 // In the front stage, waiting for the request head
+#define CONN_WORKING 2 // Handed to a worker thread
+
+#define CONN_MAX_FDS (1 << 20)
+#define CONN_EVENTS 64 // epoll events taken per wakeup
+
+// A front stage: one thread waits on every connection of its own that
+// has no worker yet, and runs those connections' deadlines. There is one
+// per shard, see conn_start()
+struct conn_stage {
+    int epfd;
+    int cpu; // The core its thread is pinned to, -1 if it isn't
+    struct timerwheel wheel;
+    pthread_mutex_t lock; // Its connections' states and timers, and the wheel
+    unsigned long ticks; // wheel.now, for reading without the lock
+    struct conn_timeouts timeouts;
+    char peek_buf[REQUEST_HEADER_MAX]; // Only the stage's thread uses it
+};
+
+static struct conn *conns; // Indexed by descriptor
+static int max_fds;
+static struct conn_stage *stages;
+static int stage_count;
+static struct conn_handlers handlers;
+
+/**
+ * Ticks on the monotonic clock
+ */
+static unsigned long current_tick(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000UL + ts.tv_nsec / 1000000) / CONN_TICK_MS;
+}
+
+/**
+ * Milliseconds to ticks, rounding up
+ */
+static unsigned long to_ticks(int ms)
+{
+    return (ms + CONN_TICK_MS - 1) / CONN_TICK_MS;
+}
+
+/**
+ * Close a connection that never got a worker
+ *
+ * Called with the lock held.
+ */
+static void drop(int fd)
+{
+    struct conn *c = &conns[fd];
+
+    epoll_ctl(c->stage->epfd, EPOLL_CTL_DEL, fd, NULL);
+    timerwheel_del(&c->timer);
+    c->state = CONN_FREE;
+    close(fd);
+
+    handlers.dropped(fd, c->tls, &c->addr, c->arg);
+}
+
+/**
+ * Hand a connection whose request head is in to a worker
+ *
+ * From here the deadline only moves on while the connection makes
+ * progress, see conn_progress(). Called with the lock held.
+ */
+static void hand_off(int fd)
+{
+    struct conn *c = &conns[fd];
+    struct conn_stage *stage = c->stage;
+
+    epoll_ctl(stage->epfd, EPOLL_CTL_DEL, fd, NULL);
+    c->state = CONN_WORKING;
+    c->last_op = CONN_READ;
+    c->progress = stage->wheel.now;
+    c->outq = 0;
+    timerwheel_add(&stage->wheel, &c->timer, stage->wheel.now + to_ticks(stage->timeouts.body));
+
+    if (handlers.ready(fd, c->tls, &c->addr, c->arg) < 0)
+    {
+        drop(fd);
+    }
+}
+
+/**
+ * A connection's deadline passed
+ *
+ * Connections still in the front stage are closed, with a 408 if they
+ * speak plain HTTP. A worker's connection is shut down, which fails
+ * whatever read or write it is blocked in, unless it made progress in
+ * the meantime, in which case the deadline is just pushed back. The
+ * client draining the socket's send queue counts as progress, so a long
+ * write to a slow but live client isn't cut off.
+ * Called with the lock held.
+ */
+static void expired(struct timer *timer, void *arg)
+{
+    int fd = (int)(long)arg;
+    struct conn *c = &conns[fd];
+    struct conn_stage *stage = c->stage;
+
+    (void)timer;
+
+    if (c->state == CONN_WAITING)
+    {
+        static char timeout[] =
+            "HTTP/1.1 408 REQUEST TIMEOUT\r\n"
+            "Connection: close\r\n"
+            "Content-Length: 0\r\n"
+            "\r\n";
+
+        if (!c->tls)
+        {
+            send(fd, timeout, sizeof timeout - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+        }
+        drop(fd);
+    }
+    else if (c->state == CONN_WORKING)
+    {
+        int outq;
+        if (ioctl(fd, SIOCOUTQ, &outq) == 0 && outq != c->outq)
+        {
+            c->outq = outq;
+            __atomic_store_n(&c->progress, stage->wheel.now, __ATOMIC_RELAXED);
+        }
+
+        unsigned long progress = __atomic_load_n(&c->progress, __ATOMIC_RELAXED);
+        int op = __atomic_load_n(&c->last_op, __ATOMIC_RELAXED);
+        unsigned long limit = to_ticks(op == CONN_WRITE ? stage->timeouts.write : stage->timeouts.body);
+
+        if (stage->wheel.now - progress < limit)
+        {
+            timerwheel_add(&stage->wheel, &c->timer, progress + limit);
+        }
+        else
+        {
+            fprintf(stderr, "conn: socket %d timed out %s\n", fd, op == CONN_WRITE ? "writing" : "reading");
+            shutdown(fd, SHUT_RDWR);
+        }
+    }
+}
+
+/**
+ * See whether a waiting connection's request head is complete
+ *
+ * The bytes are only peeked at, they stay in the socket for the worker.
+ * Called with the lock held.
+ */
+static void readable(int fd, unsigned int events)
+{
+    struct conn *c = &conns[fd];
+    struct conn_stage *stage = c->stage;
+    char *peek_buf = stage->peek_buf;
+
+    if (c->state != CONN_WAITING)
+    {
+        return;
+    }
+
+    // TLS needs a worker for the handshake, the first byte will do
+    if (c->tls)
+    {
+        hand_off(fd);
+        return;
+    }
+
+    int n = recv(fd, peek_buf, sizeof stage->peek_buf, MSG_PEEK | MSG_DONTWAIT);
+
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        {
+            drop(fd);
+        }
+        return;
+    }
+
+    if (n <= 0)
+    {
+        drop(fd);
+        return;
+    }
+
+    // IF this is the first byte THEN the header deadline starts
+    if (c->scanned == 0)
+    {
+        timerwheel_add(&stage->wheel, &c->timer, stage->wheel.now + to_ticks(stage->timeouts.header));
+    }
+
+    // SEARCH only what arrived since last time, plus an overlap
+    int start = c->scanned > 3 ? c->scanned - 3 : 0;
+
+    if (scan_head_end(peek_buf + start, n - start) != NULL || n == (int)sizeof stage->peek_buf)
+    {
+        // A head too big for the buffer is left to the worker to refuse
+        hand_off(fd);
+    }
+    else if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+    {
+        drop(fd);
+    }
+    else
+    {
+        c->scanned = n;
+    }
+}
+
+/**
+ * Front stage thread: wait for request heads and run the deadlines
+ */
+static void *conn_thread(void *arg)
+{
+    struct conn_stage *stage = arg;
+    struct epoll_event events[CONN_EVENTS];
+
+    // A pinned stage's workers take their memory from its node
+    if (stage->cpu >= 0 && affinity_local_memory() < 0)
+    {
+        perror("set_mempolicy");
+    }
+
+    for (;;)
+    {
+        int n = epoll_wait(stage->epfd, events, CONN_EVENTS, CONN_TICK_MS);
+
+        if (n < 0 && errno != EINTR)
+        {
+            perror("epoll_wait");
+        }
+
+        pthread_mutex_lock(&stage->lock);
+
+        for (int i = 0; i < n; i++)
+        {
+            readable(events[i].data.fd, events[i].events);
+        }
+
+        timerwheel_advance(&stage->wheel, current_tick());
+        __atomic_store_n(&stage->ticks, stage->wheel.now, __ATOMIC_RELAXED);
+
+        pthread_mutex_unlock(&stage->lock);
+    }
+
+    return NULL;
+}
+
+/**
+ * Start count front stage threads
+ *
+ * Stage i's thread is pinned to cpus[i], unless cpus is NULL. The
+ * workers the ready handler starts inherit the pin, so a connection
+ * stays on its stage's core from accept to close.
+ *
+ * The handlers are called on a stage's thread, with its lock held, so
+ * they must not call conn_add() or conn_close().
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int conn_start(struct conn_timeouts *conn_timeouts, struct conn_handlers *conn_handlers, int *cpus, int count)
+{
+    struct rlimit rl;
+
+    max_fds = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < CONN_MAX_FDS ? (int)rl.rlim_cur : CONN_MAX_FDS;
+    conns = calloc(max_fds, sizeof *conns);
+    stages = calloc(count, sizeof *stages);
+
+    if (conns == NULL || stages == NULL)
+    {
+        perror("conn_start");
+        free(conns);
+        free(stages);
+        conns = NULL;
+        return -1;
+    }
+
+    handlers = *conn_handlers;
+
+    for (int i = 0; i < count; i++)
+    {
+        struct conn_stage *stage = &stages[i];
+        pthread_attr_t attr;
+        pthread_t thread;
+
+        stage->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (stage->epfd < 0)
+        {
+            perror("conn_start");
+            return -1;
+        }
+        pthread_mutex_init(&stage->lock, NULL);
+        stage->timeouts = *conn_timeouts;
+        stage->cpu = cpus != NULL ? cpus[i] : -1;
+        timerwheel_init(&stage->wheel, current_tick());
+        stage->ticks = stage->wheel.now;
+
+        pthread_attr_init(&attr);
+        if (stage->cpu >= 0)
+        {
+            affinity_attr(&attr, stage->cpu);
+        }
+
+        int rv = pthread_create(&thread, &attr, conn_thread, stage);
+        pthread_attr_destroy(&attr);
+        if (rv != 0)
+        {
+            perror("conn_start");
+            return -1;
+        }
+        pthread_detach(thread);
+
+        // Only now is the stage complete enough for conn_add()
+        stage_count = i + 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Change the deadlines while connections are open
+ *
+ * Deadlines already armed keep their expiry, the new ones apply from
+ * the next time each is armed.
+ */
+void conn_set_timeouts(struct conn_timeouts *conn_timeouts)
+{
+    for (int i = 0; i < stage_count; i++)
+    {
+        pthread_mutex_lock(&stages[i].lock);
+        stages[i].timeouts = *conn_timeouts;
+        pthread_mutex_unlock(&stages[i].lock);
+    }
+}
+
+/**
+ * Put a freshly accepted connection in front stage number stage
+ *
+ * It gets a worker through the ready handler once its request head is
+ * in, or is closed by the idle or header deadline. arg is handed to the
+ * handlers.
+ *
+ * Returns 0 on success, -1 if the connection can't be taken, in which
+ * case it is still the caller's.
+ */
+int conn_add(int fd, int tls, struct sockaddr_storage *addr, int stage, void *arg)
+{
+    if (conns == NULL || fd >= max_fds || stage >= stage_count)
+    {
+        return -1;
+    }
+
+    struct conn *c = &conns[fd];
+    struct conn_stage *s = &stages[stage];
+    struct epoll_event ev;
+
+    pthread_mutex_lock(&s->lock);
+
+    c->stage = s;
+    c->arg = arg;
+    c->state = CONN_WAITING;
+    c->tls = tls;
+    c->scanned = 0;
+    c->addr = *addr;
+    timer_init(&c->timer, expired, (void *)(long)fd);
+    timerwheel_add(&s->wheel, &c->timer, s->wheel.now + to_ticks(s->timeouts.idle));
+
+    // Edge-triggered: peeking leaves the bytes unread, so level-triggered
+    // would report them again and again
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    ev.data.fd = fd;
+
+    int rv = epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev);
+    if (rv < 0)
+    {
+        perror("epoll_ctl");
+        timerwheel_del(&c->timer);
+        c->state = CONN_FREE;
+    }
+
+    pthread_mutex_unlock(&s->lock);
+
+    return rv;
+}
+
+/**
+ * Note that a worker is about to wait on its client, from any thread
+ *
+ * The body or write deadline counts from the latest call. Takes no lock,
+ * so it is cheap enough to call before every read and write.
+ */
+void conn_progress(int fd, int op)
+{
+    if (conns != NULL && fd < max_fds && conns[fd].state == CONN_WORKING)
+    {
+        __atomic_store_n(&conns[fd].progress, __atomic_load_n(&conns[fd].stage->ticks, __ATOMIC_RELAXED),
+                         __ATOMIC_RELAXED);
+        __atomic_store_n(&conns[fd].last_op, op, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Close a worker's connection, cancelling its deadline first
+ *
+ * The deadline must be gone before the descriptor is, or it could fire
+ * on an unrelated connection that reuses the number.
+ */
+void conn_close(int fd)
+{
+    // A connection that never got into a stage has no timer, but may
+    // still point at the stage of an earlier one with its number
+    struct conn_stage *stage = conns != NULL && fd < max_fds ? conns[fd].stage : NULL;
+
+    if (stage != NULL)
+    {
+        pthread_mutex_lock(&stage->lock);
+        timerwheel_del(&conns[fd].timer);
+        conns[fd].state = CONN_FREE;
+        pthread_mutex_unlock(&stage->lock);
+    }
+
+    close(fd);
+}
+
+/**
+ * Close every connection still waiting for its request head, for when
+ * the server stops taking requests
+ *
+ * Returns the number of connections closed.
+ */
+int conn_drop_waiting(void)
+{
+    int count = 0;
+
+    if (conns == NULL)
+    {
+        return 0;
+    }
+
+    for (int i = 0; i < stage_count; i++)
+    {
+        pthread_mutex_lock(&stages[i].lock);
+        for (int fd = 0; fd < max_fds; fd++)
+        {
+            if (conns[fd].stage == &stages[i] && conns[fd].state == CONN_WAITING)
+            {
+                drop(fd);
+                count++;
+            }
+        }
+        pthread_mutex_unlock(&stages[i].lock);
+    }
+
+    return count;
+}
+
+/**
+ * Shut down every worker's connection, failing whatever read or write
+ * it is blocked in so the worker finishes
+ *
+ * Returns the number of connections shut down.
+ */
+int conn_shutdown_working(void)
+{
+    int count = 0;
+
+    if (conns == NULL)
+    {
+        return 0;
+    }
+
+    for (int i = 0; i < stage_count; i++)
+    {
+        pthread_mutex_lock(&stages[i].lock);
+        for (int fd = 0; fd < max_fds; fd++)
+        {
+            if (conns[fd].stage == &stages[i] && conns[fd].state == CONN_WORKING)
+            {
+                shutdown(fd, SHUT_RDWR);
+                count++;
+            }
+        }
+        pthread_mutex_unlock(&stages[i].lock);
+    }
+
+    return count;
+}
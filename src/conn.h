@@ -0,0 +1,55 @@
+#ifndef _CONN_H_
+#define _CONN_H_
+
+#include <pthread.h>
+#include <sys/socket.h>
+#include "timerwheel.h"
+
+#define CONN_TICK_MS 100 // Deadline resolution
+
+#define CONN_READ 0 // What a connection last made progress with
+#define CONN_WRITE 1
+
+// Deadlines, in milliseconds
+struct conn_timeouts {
+    int idle; // Accept to the first byte of the request
+    int header; // First byte to the end of the request head
+    int body; // Longest a worker may wait on the client for data
+    int write; // Longest a worker may wait on the client to take data
+};
+
+// What happens to connections once the front stage is done with them,
+// arg is what conn_add() was given
+struct conn_handlers {
+    // The request head is in (or, for TLS, the client spoke): start a
+    // worker, returning -1 if none can be had to drop the connection
+    int (*ready)(int fd, int tls, struct sockaddr_storage *addr, void *arg);
+    // The connection was dropped before it got a worker, fd is closed
+    void (*dropped)(int fd, int tls, struct sockaddr_storage *addr, void *arg);
+};
+
+struct conn_stage;
+
+// Per-descriptor connection state, a few hundred bytes however slow the client
+struct conn {
+    struct conn_stage *stage; // The front stage it was added to
+    void *arg; // For the handlers
+    int state; // CONN_FREE, CONN_WAITING or CONN_WORKING
+    int tls;
+    int scanned; // Bytes of the request already searched for its end
+    int last_op; // CONN_READ or CONN_WRITE
+    unsigned long progress; // Tick the worker last started waiting on the client
+    int outq; // Unsent bytes in the socket when last looked at
+    struct timer timer; // The deadline
+    struct sockaddr_storage addr;
+};
+
+extern int conn_start(struct conn_timeouts *timeouts, struct conn_handlers *handlers, int *cpus, int count);
+extern void conn_set_timeouts(struct conn_timeouts *timeouts);
+extern int conn_add(int fd, int tls, struct sockaddr_storage *addr, int stage, void *arg);
+extern void conn_progress(int fd, int op);
+extern void conn_close(int fd);
+extern int conn_drop_waiting(void);
+extern int conn_shutdown_working(void);
+
+#endif
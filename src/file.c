@@ -1,6 +1,14 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
 #include "file.h"
 
 /**
@@ -9,39 +17,54 @@
  * Buffer is not NUL-terminated.
  */
 struct file_data *file_load(char *filename)
+{
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct file_data *filedata = file_load_fd(fd);
+    close(fd);
+
+    return filedata;
+}
+
+/**
+ * Loads an open file into memory, reading from where fd is.
+ *
+ * The descriptor is left open. Buffer is not NUL-terminated.
+ */
+struct file_data *file_load_fd(int fd)
 {
     char *buffer, *p;
     struct stat buf;
     int bytes_read, bytes_remaining, total_bytes = 0;
 
     // Get the file size
-    if (stat(filename, &buf) == -1) {
+    if (fstat(fd, &buf) == -1) {
         return NULL;
     }
 
     // Make sure it's a regular file
-    if (!(buf.st_mode & S_IFREG)) {
-        return NULL;
-    }
-
-    // Open the file for reading
-    FILE *fp = fopen(filename, "rb");
-
-    if (fp == NULL) {
+    if (!S_ISREG(buf.st_mode)) {
         return NULL;
     }
 
     // Allocate that many bytes
     bytes_remaining = buf.st_size;
-    p = buffer = malloc(bytes_remaining);
+    p = buffer = malloc(bytes_remaining > 0 ? bytes_remaining : 1);
 
     if (buffer == NULL) {
         return NULL;
     }
 
     // Read in the entire file
-    while (bytes_read = fread(p, 1, bytes_remaining, fp), bytes_read != 0 && bytes_remaining > 0) {
+    while (bytes_remaining > 0 && (bytes_read = read(fd, p, bytes_remaining)) != 0) {
         if (bytes_read == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
             free(buffer);
             return NULL;
         }
@@ -65,6 +88,55 @@ struct file_data *file_load(char *filename)
     return filedata;
 }
 
+/**
+ * Opens path for reading, resolved beneath the directory dirfd.
+ *
+ * path is a request path, its leading slash is taken as dirfd.
+ * openat2() with RESOLVE_BENEATH makes the kernel refuse anything that
+ * would leave dirfd, including by symlink. Kernels before 5.6 don't have
+ * it; there plain openat() is used, after refusing any ".." segment
+ * here, but it does follow symlinks out of the tree.
+ *
+ * Returns the descriptor, or -1 with errno set.
+ */
+int file_open_beneath(int dirfd, char *path)
+{
+    static int no_openat2;
+
+    while (*path == '/') {
+        path++;
+    }
+    if (*path == '\0') {
+        path = ".";
+    }
+
+#ifdef SYS_openat2
+    if (!__atomic_load_n(&no_openat2, __ATOMIC_RELAXED)) {
+        struct open_how how = {
+            .flags = O_RDONLY | O_CLOEXEC | O_NOCTTY,
+            .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS,
+        };
+        int fd = syscall(SYS_openat2, dirfd, path, &how, sizeof how);
+
+        if (fd >= 0 || errno != ENOSYS) {
+            return fd;
+        }
+        __atomic_store_n(&no_openat2, 1, __ATOMIC_RELAXED);
+    }
+#endif
+    (void)no_openat2;
+
+    // REFUSE "..", openat() would follow it out of dirfd
+    for (char *p = path; (p = strstr(p, "..")) != NULL; p += 2) {
+        if ((p == path || p[-1] == '/') && (p[2] == '\0' || p[2] == '/')) {
+            errno = EACCES;
+            return -1;
+        }
+    }
+
+    return openat(dirfd, path, O_RDONLY | O_CLOEXEC | O_NOCTTY);
+}
+
 /**
  * Frees memory allocated by file_load().
  */
@@ -7,6 +7,8 @@ struct file_data {
 };
 
 extern struct file_data *file_load(char *filename);
+extern struct file_data *file_load_fd(int fd);
+extern int file_open_beneath(int dirfd, char *path);
 extern void file_free(struct file_data *filedata);
 
 #endif
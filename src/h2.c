@@ -0,0 +1,1390 @@
+#define _GNU_SOURCE // strcasestr()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "net.h"
+#include "response.h"
+#include "h2.h"
+
+#define H2_BLOCK_MAX 65536 // Largest header block we collect from CONTINUATION frames
+#define H2_IN_SIZE 16384 // Socket read size for the connection reader
+
+// Frame types
+enum {
+    FRAME_DATA,
+    FRAME_HEADERS,
+    FRAME_PRIORITY,
+    FRAME_RST_STREAM,
+    FRAME_SETTINGS,
+    FRAME_PUSH_PROMISE,
+    FRAME_PING,
+    FRAME_GOAWAY,
+    FRAME_WINDOW_UPDATE,
+    FRAME_CONTINUATION
+};
+
+// Frame flags
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+// Error codes
+#define ERR_NO_ERROR 0x0
+#define ERR_PROTOCOL 0x1
+#define ERR_INTERNAL 0x2
+#define ERR_FLOW_CONTROL 0x3
+#define ERR_STREAM_CLOSED 0x5
+#define ERR_FRAME_SIZE 0x6
+#define ERR_REFUSED_STREAM 0x7
+#define ERR_COMPRESSION 0x9
+#define ERR_ENHANCE_YOUR_CALM 0xb
+
+// Settings
+#define SETTINGS_HEADER_TABLE_SIZE 0x1
+#define SETTINGS_ENABLE_PUSH 0x2
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define SETTINGS_MAX_FRAME_SIZE 0x5
+
+static void put32(unsigned char *p, unsigned int v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static unsigned int get32(unsigned char *p)
+{
+    return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/**
+ * Fill in a 9-byte frame header
+ */
+static void frame_head(unsigned char *head, int len, int type, int flags, int stream_id)
+{
+    head[0] = len >> 16;
+    head[1] = len >> 8;
+    head[2] = len;
+    head[3] = type;
+    head[4] = flags;
+    put32(head + 5, stream_id & 0x7fffffff);
+}
+
+/**
+ * Send one frame, the caller holds write_lock
+ */
+static int send_frame_locked(struct h2_conn *c, int type, int flags, int stream_id, void *payload, int len)
+{
+    unsigned char head[9];
+
+    frame_head(head, len, type, flags, stream_id);
+
+    struct iovec iov[2] = {
+        { head, 9 },
+        { payload, len },
+    };
+
+    return net_send_iov(c->fd, iov, len > 0 ? 2 : 1) < 0 ? -1 : 0;
+}
+
+/**
+ * Send one frame
+ */
+static int send_frame(struct h2_conn *c, int type, int flags, int stream_id, void *payload, int len)
+{
+    pthread_mutex_lock(&c->write_lock);
+    int rv = send_frame_locked(c, type, flags, stream_id, payload, len);
+    pthread_mutex_unlock(&c->write_lock);
+
+    return rv;
+}
+
+static void send_rst(struct h2_conn *c, int stream_id, int error)
+{
+    unsigned char payload[4];
+
+    put32(payload, error);
+    send_frame(c, FRAME_RST_STREAM, 0, stream_id, payload, 4);
+}
+
+static void send_goaway(struct h2_conn *c, int error)
+{
+    unsigned char payload[8];
+
+    put32(payload, c->last_stream_id);
+    put32(payload + 4, error);
+    send_frame(c, FRAME_GOAWAY, 0, 0, payload, 8);
+}
+
+static void send_window_update(struct h2_conn *c, int stream_id, int increment)
+{
+    unsigned char payload[4];
+
+    put32(payload, increment);
+    send_frame(c, FRAME_WINDOW_UPDATE, 0, stream_id, payload, 4);
+}
+
+/**
+ * Find a running stream by id, the caller holds lock
+ */
+static struct h2_stream *find_stream(struct h2_conn *c, int id)
+{
+    for (struct h2_stream *s = c->streams; s != NULL; s = s->next)
+    {
+        if (s->id == id)
+        {
+            return s;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Read exactly len bytes of connection input
+ *
+ * Returns 0 on success, -1 if the connection closed.
+ */
+static int read_input(struct h2_conn *c, void *dest, int len)
+{
+    char *out = dest;
+
+    while (len > 0)
+    {
+        if (c->in_pos == c->in_len)
+        {
+            int n = net_recv(c->fd, c->in, c->in_cap);
+
+            if (n <= 0)
+            {
+                return -1;
+            }
+            c->in_pos = 0;
+            c->in_len = n;
+        }
+
+        int n = c->in_len - c->in_pos;
+        if (n > len) { n = len; }
+
+        memcpy(out, c->in + c->in_pos, n);
+        c->in_pos += n;
+        out += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * Apply the peer's SETTINGS
+ *
+ * Returns 0 or an HTTP/2 error code for the connection.
+ */
+static int apply_settings(struct h2_conn *c, unsigned char *p, int len)
+{
+    for (int i = 0; i + 6 <= len; i += 6)
+    {
+        int id = p[i] << 8 | p[i + 1];
+        unsigned int value = get32(p + i + 2);
+
+        switch (id)
+        {
+        case SETTINGS_ENABLE_PUSH:
+            if (value > 1)
+            {
+                return ERR_PROTOCOL;
+            }
+            break;
+
+        case SETTINGS_INITIAL_WINDOW_SIZE:
+            if (value > 0x7fffffff)
+            {
+                return ERR_FLOW_CONTROL;
+            }
+
+            // ADJUST every open stream by the change
+            pthread_mutex_lock(&c->lock);
+            for (struct h2_stream *s = c->streams; s != NULL; s = s->next)
+            {
+                s->send_window += (int)value - c->peer_initial_window;
+            }
+            c->peer_initial_window = value;
+            pthread_cond_broadcast(&c->changed);
+            pthread_mutex_unlock(&c->lock);
+            break;
+
+        case SETTINGS_MAX_FRAME_SIZE:
+            if (value < 16384 || value > 16777215)
+            {
+                return ERR_PROTOCOL;
+            }
+            pthread_mutex_lock(&c->lock);
+            c->peer_max_frame = value;
+            pthread_mutex_unlock(&c->lock);
+            break;
+        }
+        // Unknown settings must be ignored
+    }
+
+    return 0;
+}
+
+// Where decoded request headers go
+struct header_sink {
+    struct request *req;
+    char *out;
+    char *end;
+    int regular_seen; // Pseudo-headers must come first
+    int bad;
+    int too_large;
+};
+
+/**
+ * Append a "name: value" line to a request's header lines
+ */
+static void add_header_line(struct header_sink *hs, char *name, int name_len, char *value, int value_len)
+{
+    // +2 for ": ", +1 for the NUL, +1 for the empty line that ends the list
+    if (hs->end - hs->out < name_len + value_len + 4)
+    {
+        hs->too_large = 1;
+        return;
+    }
+
+    memcpy(hs->out, name, name_len);
+    hs->out += name_len;
+    *hs->out++ = ':';
+    *hs->out++ = ' ';
+    memcpy(hs->out, value, value_len);
+    hs->out += value_len;
+    *hs->out++ = '\0';
+    *hs->out = '\0';
+}
+
+/**
+ * hpack_decode() callback filling in a request
+ *
+ * Pseudo-headers become the method and path, :authority becomes Host and
+ * the rest become header lines just like an HTTP/1.1 request's.
+ */
+static int add_header(void *arg, char *name, int name_len, char *value, int value_len)
+{
+    struct header_sink *hs = arg;
+    struct request *req = hs->req;
+
+    if (name_len > 0 && name[0] == ':')
+    {
+        if (hs->regular_seen)
+        {
+            hs->bad = 1;
+        }
+        else if (name_len == 7 && memcmp(name, ":method", 7) == 0)
+        {
+            if (value_len == 0 || value_len >= (int)sizeof req->method)
+            {
+                hs->bad = 1;
+                return 0;
+            }
+            memcpy(req->method, value, value_len);
+            req->method[value_len] = '\0';
+        }
+        else if (name_len == 5 && memcmp(name, ":path", 5) == 0)
+        {
+            if (value_len >= (int)sizeof req->path)
+            {
+                hs->too_large = 1;
+                return 0;
+            }
+            memcpy(req->path, value, value_len);
+            req->path[value_len] = '\0';
+        }
+        else if (name_len == 10 && memcmp(name, ":authority", 10) == 0)
+        {
+            add_header_line(hs, "host", 4, value, value_len);
+        }
+        // :scheme is always http or https here
+
+        return 0;
+    }
+
+    hs->regular_seen = 1;
+
+    // Connection-specific headers are not allowed in HTTP/2
+    if ((name_len == 10 && memcmp(name, "connection", 10) == 0) ||
+        (name_len == 17 && memcmp(name, "transfer-encoding", 17) == 0))
+    {
+        hs->bad = 1;
+        return 0;
+    }
+
+    if (name_len == 14 && memcmp(name, "content-length", 14) == 0)
+    {
+        long long length = 0;
+
+        for (int i = 0; i < value_len; i++)
+        {
+            if (value[i] < '0' || value[i] > '9' || i > 15)
+            {
+                hs->bad = 1;
+                return 0;
+            }
+            length = length * 10 + value[i] - '0';
+        }
+        req->content_length = length;
+    }
+
+    add_header_line(hs, name, name_len, value, value_len);
+
+    return 0;
+}
+
+/**
+ * hpack_decode() callback for header blocks we don't need (trailers)
+ */
+static int discard_header(void *arg, char *name, int name_len, char *value, int value_len)
+{
+    (void)arg;
+    (void)name;
+    (void)name_len;
+    (void)value;
+    (void)value_len;
+
+    return 0;
+}
+
+/**
+ * Set up a stream's request before its headers are decoded
+ */
+static void init_request(struct h2_conn *c, struct h2_stream *s)
+{
+    struct request *req = &s->req;
+
+    req->fd = c->fd;
+    req->h2 = s;
+    req->method[0] = req->path[0] = '\0';
+    req->headers = req->buf;
+    req->buf[0] = '\0';
+    req->content_length = -1;
+    req->chunked = 0;
+    req->max_body_size = c->max_body_size;
+    req->body_total = 0;
+    req->body_remaining = 0;
+    req->body_state = 0;
+    req->in_pos = req->in_end = NULL;
+}
+
+static struct h2_stream *alloc_stream(struct h2_conn *c, int id)
+{
+    struct h2_stream *s = malloc(sizeof *s);
+
+    if (s == NULL)
+    {
+        return NULL;
+    }
+
+    s->id = id;
+    s->conn = c;
+    s->send_window = c->peer_initial_window;
+    s->recv_window = H2_WINDOW;
+    s->headers_sent = 0;
+    s->ended = 0;
+    s->reset = 0;
+    s->remote_closed = 0;
+    s->body = NULL;
+    s->body_start = 0;
+    s->body_len = 0;
+    s->next = NULL;
+    init_request(c, s);
+
+    return s;
+}
+
+/**
+ * Run one request, then finish and forget the stream
+ */
+static void *stream_thread(void *arg)
+{
+    struct h2_stream *s = arg;
+    struct h2_conn *c = s->conn;
+    int rst = 0;
+
+    c->handler(&s->req, c->handler_arg);
+
+    // IF the handler didn't complete the response THEN do it for them
+    if (!s->ended && !s->reset)
+    {
+        if (!s->headers_sent)
+        {
+            h2_send_headers(s, 500, "text/plain", 0, NULL, 1);
+        }
+        else
+        {
+            h2_send_data(s, NULL, 0, 1);
+        }
+    }
+
+    pthread_mutex_lock(&c->lock);
+
+    // A body nobody read is cancelled rather than drained
+    if (!s->remote_closed && !s->reset)
+    {
+        s->reset = 1;
+        rst = 1;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    // SEND the reset while the stream still counts as active: h2_serve()
+    // tears the connection down once none are
+    if (rst)
+    {
+        send_rst(c, s->id, ERR_NO_ERROR);
+    }
+
+    // UNLINK the stream
+    pthread_mutex_lock(&c->lock);
+    for (struct h2_stream **p = &c->streams; *p != NULL; p = &(*p)->next)
+    {
+        if (*p == s)
+        {
+            *p = s->next;
+            break;
+        }
+    }
+    c->active--;
+    pthread_cond_broadcast(&c->changed);
+    pthread_mutex_unlock(&c->lock);
+
+    free(s->body);
+    free(s);
+
+    return NULL;
+}
+
+/**
+ * Link a stream in and start its thread
+ *
+ * Returns 0 on success or an HTTP/2 error code for the stream.
+ */
+static int start_stream(struct h2_conn *c, struct h2_stream *s)
+{
+    pthread_mutex_lock(&c->lock);
+
+    if (c->active >= H2_MAX_STREAMS || c->closing)
+    {
+        pthread_mutex_unlock(&c->lock);
+        return ERR_REFUSED_STREAM;
+    }
+
+    s->next = c->streams;
+    c->streams = s;
+    c->active++;
+
+    if (pthread_create(&s->thread, NULL, stream_thread, s) != 0)
+    {
+        c->streams = s->next;
+        c->active--;
+        pthread_mutex_unlock(&c->lock);
+        return ERR_REFUSED_STREAM;
+    }
+
+    pthread_detach(s->thread);
+    pthread_mutex_unlock(&c->lock);
+
+    return 0;
+}
+
+/**
+ * Handle a complete header block
+ *
+ * Returns 0 or an HTTP/2 error code for the connection.
+ */
+static int finish_headers(struct h2_conn *c)
+{
+    int id = c->block_stream, error;
+    struct h2_stream *s;
+
+    c->block_stream = 0;
+
+    pthread_mutex_lock(&c->lock);
+    s = find_stream(c, id);
+
+    // TRAILERS on a running stream end its body
+    if (s != NULL)
+    {
+        if (!c->block_end_stream)
+        {
+            pthread_mutex_unlock(&c->lock);
+            return ERR_PROTOCOL;
+        }
+        s->remote_closed = 1;
+        pthread_cond_broadcast(&c->changed);
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    if (s != NULL || id <= c->last_stream_id)
+    {
+        // The block still has to be decoded to keep the table in step
+        if (hpack_decode(&c->decoder, c->block, c->block_len, discard_header, NULL) < 0)
+        {
+            return ERR_COMPRESSION;
+        }
+        return s != NULL ? 0 : ERR_STREAM_CLOSED;
+    }
+
+    c->last_stream_id = id;
+
+    if ((s = alloc_stream(c, id)) == NULL)
+    {
+        hpack_decode(&c->decoder, c->block, c->block_len, discard_header, NULL);
+        send_rst(c, id, ERR_REFUSED_STREAM);
+        return 0;
+    }
+
+    struct header_sink hs = {
+        .req = &s->req,
+        .out = s->req.buf,
+        .end = s->req.buf + sizeof s->req.buf,
+    };
+
+    if (hpack_decode(&c->decoder, c->block, c->block_len, add_header, &hs) < 0)
+    {
+        free(s);
+        return ERR_COMPRESSION;
+    }
+
+    s->remote_closed = c->block_end_stream;
+
+    if (hs.bad || s->req.method[0] == '\0' || s->req.path[0] == '\0')
+    {
+        error = ERR_PROTOCOL;
+    }
+    else if (hs.too_large)
+    {
+        error = ERR_ENHANCE_YOUR_CALM;
+    }
+    else
+    {
+        error = start_stream(c, s);
+    }
+
+    if (error != 0)
+    {
+        send_rst(c, id, error);
+        free(s);
+    }
+
+    return 0;
+}
+
+/**
+ * Collect a HEADERS or CONTINUATION fragment
+ *
+ * Returns 0 or an HTTP/2 error code for the connection.
+ */
+static int add_fragment(struct h2_conn *c, unsigned char *p, int len, int flags)
+{
+    if (c->block_len + len > H2_BLOCK_MAX)
+    {
+        return ERR_ENHANCE_YOUR_CALM;
+    }
+
+    memcpy(c->block + c->block_len, p, len);
+    c->block_len += len;
+
+    return (flags & FLAG_END_HEADERS) ? finish_headers(c) : 0;
+}
+
+/**
+ * Take in request body bytes for a stream
+ *
+ * Returns 0 or an HTTP/2 error code for the connection.
+ */
+static int handle_data(struct h2_conn *c, int id, int flags, unsigned char *p, int len)
+{
+    int pad = 0, rst = 0;
+
+    if (flags & FLAG_PADDED)
+    {
+        if (len < 1 || p[0] >= len)
+        {
+            return ERR_PROTOCOL;
+        }
+        pad = p[0] + 1;
+    }
+
+    // The connection window is returned at once, streams are limited
+    // by their own window and the body buffer
+    c->recv_credit += len;
+    if (c->recv_credit >= H2_WINDOW / 2)
+    {
+        send_window_update(c, 0, c->recv_credit);
+        c->recv_credit = 0;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    struct h2_stream *s = find_stream(c, id);
+
+    if (s == NULL || s->remote_closed)
+    {
+        pthread_mutex_unlock(&c->lock);
+        return id > c->last_stream_id ? ERR_PROTOCOL : 0;
+    }
+
+    if (s->reset)
+    {
+        pthread_mutex_unlock(&c->lock);
+        return 0;
+    }
+
+    s->recv_window -= len;
+
+    if (s->recv_window < 0)
+    {
+        s->reset = 1;
+        rst = ERR_FLOW_CONTROL;
+    }
+    else if (len - pad > 0)
+    {
+        if (s->body == NULL && (s->body = malloc(H2_WINDOW)) == NULL)
+        {
+            s->reset = 1;
+            rst = ERR_INTERNAL;
+        }
+        else
+        {
+            // APPEND to the ring, wrapping if needed
+            unsigned char *data = p + (pad > 0 ? 1 : 0);
+            int data_len = len - pad;
+            int tail = (s->body_start + s->body_len) % H2_WINDOW;
+            int first = H2_WINDOW - tail < data_len ? H2_WINDOW - tail : data_len;
+
+            memcpy(s->body + tail, data, first);
+            memcpy(s->body, data + first, data_len - first);
+            s->body_len += data_len;
+        }
+    }
+
+    // Padding never reaches the reader, so give its window back now
+    if (!rst && pad > 0)
+    {
+        s->recv_window += pad;
+    }
+
+    if (flags & FLAG_END_STREAM)
+    {
+        s->remote_closed = 1;
+    }
+
+    pthread_cond_broadcast(&c->changed);
+    pthread_mutex_unlock(&c->lock);
+
+    if (rst)
+    {
+        send_rst(c, id, rst);
+    }
+    else if (pad > 0 && !(flags & FLAG_END_STREAM))
+    {
+        send_window_update(c, id, pad);
+    }
+
+    return 0;
+}
+
+/**
+ * Handle one frame from the peer
+ *
+ * Returns 0 or an HTTP/2 error code for the connection.
+ */
+static int handle_frame(struct h2_conn *c, int type, int flags, int id, unsigned char *p, int len)
+{
+    struct h2_stream *s;
+    int error, pos = 0, pad = 0;
+
+    // A header block can't be interleaved with anything else
+    if (c->block_stream != 0 && (type != FRAME_CONTINUATION || id != c->block_stream))
+    {
+        return ERR_PROTOCOL;
+    }
+
+    switch (type)
+    {
+    case FRAME_DATA:
+        return id == 0 ? ERR_PROTOCOL : handle_data(c, id, flags, p, len);
+
+    case FRAME_HEADERS:
+        if (id == 0 || id % 2 == 0)
+        {
+            return ERR_PROTOCOL;
+        }
+
+        // STRIP padding and priority
+        if (flags & FLAG_PADDED)
+        {
+            if (len < 1)
+            {
+                return ERR_FRAME_SIZE;
+            }
+            pad = p[0];
+            pos = 1;
+        }
+        if (flags & FLAG_PRIORITY)
+        {
+            pos += 5;
+        }
+        if (pos + pad > len)
+        {
+            return ERR_PROTOCOL;
+        }
+
+        c->block_len = 0;
+        c->block_stream = id;
+        c->block_end_stream = flags & FLAG_END_STREAM;
+
+        return add_fragment(c, p + pos, len - pos - pad, flags);
+
+    case FRAME_CONTINUATION:
+        if (c->block_stream == 0)
+        {
+            return ERR_PROTOCOL;
+        }
+        return add_fragment(c, p, len, flags);
+
+    case FRAME_PRIORITY:
+        return len == 5 ? 0 : ERR_FRAME_SIZE;
+
+    case FRAME_RST_STREAM:
+        if (id == 0 || len != 4)
+        {
+            return id == 0 ? ERR_PROTOCOL : ERR_FRAME_SIZE;
+        }
+
+        pthread_mutex_lock(&c->lock);
+        if ((s = find_stream(c, id)) != NULL)
+        {
+            s->reset = 1;
+            pthread_cond_broadcast(&c->changed);
+        }
+        pthread_mutex_unlock(&c->lock);
+        return 0;
+
+    case FRAME_SETTINGS:
+        if (id != 0)
+        {
+            return ERR_PROTOCOL;
+        }
+        if (flags & FLAG_ACK)
+        {
+            return len == 0 ? 0 : ERR_FRAME_SIZE;
+        }
+        if (len % 6 != 0)
+        {
+            return ERR_FRAME_SIZE;
+        }
+        if ((error = apply_settings(c, p, len)) != 0)
+        {
+            return error;
+        }
+        send_frame(c, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+        return 0;
+
+    case FRAME_PUSH_PROMISE:
+        // Clients can't push
+        return ERR_PROTOCOL;
+
+    case FRAME_PING:
+        if (id != 0 || len != 8)
+        {
+            return id != 0 ? ERR_PROTOCOL : ERR_FRAME_SIZE;
+        }
+        if (!(flags & FLAG_ACK))
+        {
+            send_frame(c, FRAME_PING, FLAG_ACK, 0, p, 8);
+        }
+        return 0;
+
+    case FRAME_GOAWAY:
+        // Running streams finish, the peer just won't start new ones
+        return 0;
+
+    case FRAME_WINDOW_UPDATE:
+    {
+        if (len != 4)
+        {
+            return ERR_FRAME_SIZE;
+        }
+
+        int increment = get32(p) & 0x7fffffff;
+
+        pthread_mutex_lock(&c->lock);
+        if (id == 0)
+        {
+            if (increment == 0 || c->send_window > 0x7fffffff - increment)
+            {
+                pthread_mutex_unlock(&c->lock);
+                return increment == 0 ? ERR_PROTOCOL : ERR_FLOW_CONTROL;
+            }
+            c->send_window += increment;
+        }
+        else if ((s = find_stream(c, id)) != NULL)
+        {
+            if (increment == 0 || s->send_window > 0x7fffffff - increment)
+            {
+                s->reset = 1;
+                error = increment == 0 ? ERR_PROTOCOL : ERR_FLOW_CONTROL;
+                pthread_cond_broadcast(&c->changed);
+                pthread_mutex_unlock(&c->lock);
+                send_rst(c, id, error);
+                return 0;
+            }
+            s->send_window += increment;
+        }
+        pthread_cond_broadcast(&c->changed);
+        pthread_mutex_unlock(&c->lock);
+        return 0;
+    }
+    }
+
+    // Unknown frame types are ignored
+    return 0;
+}
+
+/**
+ * Decode base64url, as used by the HTTP2-Settings header
+ *
+ * Returns the decoded length, or -1 on bad input.
+ */
+static int base64url_decode(char *in, unsigned char *out, int cap)
+{
+    unsigned int bits = 0;
+    int nbits = 0, len = 0;
+
+    for (; *in != '\0' && *in != '='; in++)
+    {
+        int v;
+
+        if (*in >= 'A' && *in <= 'Z') { v = *in - 'A'; }
+        else if (*in >= 'a' && *in <= 'z') { v = *in - 'a' + 26; }
+        else if (*in >= '0' && *in <= '9') { v = *in - '0' + 52; }
+        else if (*in == '-' || *in == '+') { v = 62; }
+        else if (*in == '_' || *in == '/') { v = 63; }
+        else { return -1; }
+
+        bits = bits << 6 | v;
+        nbits += 6;
+
+        if (nbits >= 8)
+        {
+            if (len == cap)
+            {
+                return -1;
+            }
+            nbits -= 8;
+            out[len++] = bits >> nbits;
+        }
+    }
+
+    return len;
+}
+
+/**
+ * Return true if an HTTP/1.1 request asks to switch to h2c
+ *
+ * Only requests without a body are upgraded, so the first request never
+ * has to be read half in HTTP/1.1 and half in HTTP/2.
+ */
+int h2_upgrade_requested(struct request *req)
+{
+    char *upgrade = request_header(req, "Upgrade");
+
+    if (upgrade == NULL || request_header(req, "HTTP2-Settings") == NULL)
+    {
+        return 0;
+    }
+    if (req->chunked || req->content_length > 0)
+    {
+        return 0;
+    }
+
+    // TOKEN list, e.g. "h2c" or "websocket, h2c"
+    for (char *p = upgrade; (p = strcasestr(p, "h2c")) != NULL; p += 3)
+    {
+        if ((p == upgrade || p[-1] == ' ' || p[-1] == ',') && (p[3] == '\0' || p[3] == ' ' || p[3] == ','))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Take the settings from an h2c upgrade and turn its request into stream 1
+ *
+ * Returns 0 or an HTTP/2 error code for the connection.
+ */
+static int accept_upgrade(struct h2_conn *c, struct request *upgrade)
+{
+    unsigned char settings[256];
+    int len = base64url_decode(request_header(upgrade, "HTTP2-Settings"), settings, sizeof settings);
+
+    if (len < 0 || len % 6 != 0)
+    {
+        return ERR_PROTOCOL;
+    }
+
+    int error = apply_settings(c, settings, len);
+    if (error != 0)
+    {
+        return error;
+    }
+
+    struct h2_stream *s = alloc_stream(c, 1);
+    if (s == NULL)
+    {
+        return ERR_INTERNAL;
+    }
+
+    // COPY the request, moving the header pointer into the copy
+    memcpy(&s->req, upgrade, sizeof s->req);
+    s->req.headers = s->req.buf + (upgrade->headers - upgrade->buf);
+    s->req.in_pos = s->req.in_end = NULL;
+    s->req.h2 = s;
+    s->remote_closed = 1;
+    c->last_stream_id = 1;
+
+    if ((error = start_stream(c, s)) != 0)
+    {
+        free(s);
+        send_rst(c, 1, error);
+    }
+
+    return 0;
+}
+
+/**
+ * Serve an HTTP/2 connection until the peer goes away
+ *
+ * The connection's thread reads and dispatches frames, each request runs
+ * on a thread of its own so a slow response doesn't hold up the others.
+ *
+ * upgrade:      an HTTP/1.1 request that asked for h2c, or NULL.
+ * initial:      bytes already read from the socket, not yet parsed.
+ * preface_seen: how much of the client preface was already consumed.
+ *
+ * Returns 0 when the connection ended cleanly, -1 on error.
+ */
+int h2_serve(int fd, h2_handler handler, void *handler_arg, long long max_body_size,
+             struct request *upgrade, char *initial, int initial_len, int preface_seen)
+{
+    struct h2_conn conn, *c = &conn;
+    unsigned char head[9];
+    unsigned char *payload = malloc(H2_FRAME_MAX);
+    int error = 0;
+
+    memset(c, 0, sizeof *c);
+    c->fd = fd;
+    c->handler = handler;
+    c->handler_arg = handler_arg;
+    c->max_body_size = max_body_size;
+    c->send_window = H2_WINDOW;
+    c->peer_initial_window = H2_WINDOW;
+    c->peer_max_frame = H2_FRAME_MAX;
+    c->block = malloc(H2_BLOCK_MAX);
+    c->in_cap = initial_len > H2_IN_SIZE ? initial_len : H2_IN_SIZE;
+    c->in = malloc(c->in_cap);
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_mutex_init(&c->write_lock, NULL);
+    pthread_cond_init(&c->changed, NULL);
+    hpack_decoder_init(&c->decoder);
+
+    if (payload == NULL || c->block == NULL || c->in == NULL)
+    {
+        error = ERR_INTERNAL;
+        goto done;
+    }
+
+    // FRAMES are written as they are ready, Nagle would hold a response's
+    // DATA back until the client ACKs its HEADERS
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+    if (initial_len > 0)
+    {
+        memcpy(c->in, initial, initial_len);
+        c->in_len = initial_len;
+    }
+
+    // SWITCH protocols first, our SETTINGS are the first HTTP/2 bytes
+    if (upgrade != NULL)
+    {
+        char *switching = "HTTP/1.1 101 Switching Protocols\r\n"
+                          "Connection: Upgrade\r\n"
+                          "Upgrade: h2c\r\n"
+                          "\r\n";
+        struct iovec iov = { switching, strlen(switching) };
+
+        if (net_send_iov(fd, &iov, 1) < 0)
+        {
+            goto done;
+        }
+    }
+
+    // OUR settings go first, before any response can
+    unsigned char settings[12];
+    settings[0] = 0;
+    settings[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    put32(settings + 2, H2_MAX_STREAMS);
+    settings[6] = 0;
+    settings[7] = SETTINGS_ENABLE_PUSH;
+    put32(settings + 8, 0);
+    send_frame(c, FRAME_SETTINGS, 0, 0, settings, sizeof settings);
+
+    if (upgrade != NULL && (error = accept_upgrade(c, upgrade)) != 0)
+    {
+        goto done;
+    }
+
+    // CHECK the rest of the client preface
+    char preface[H2_PREFACE_LEN];
+    if (read_input(c, preface, H2_PREFACE_LEN - preface_seen) < 0 ||
+        memcmp(preface, H2_PREFACE + preface_seen, H2_PREFACE_LEN - preface_seen) != 0)
+    {
+        error = ERR_PROTOCOL;
+        goto done;
+    }
+
+    // READ frames until the peer closes or breaks the protocol
+    while (read_input(c, head, 9) == 0)
+    {
+        int len = head[0] << 16 | head[1] << 8 | head[2];
+        int id = get32(head + 5) & 0x7fffffff;
+
+        if (len > H2_FRAME_MAX)
+        {
+            error = ERR_FRAME_SIZE;
+            break;
+        }
+        if (read_input(c, payload, len) < 0)
+        {
+            break;
+        }
+        if ((error = handle_frame(c, head[3], head[4], id, payload, len)) != 0)
+        {
+            break;
+        }
+    }
+
+done:
+    if (error != 0)
+    {
+        send_goaway(c, error);
+    }
+
+    // WAKE every stream so nothing waits on a window or body forever
+    pthread_mutex_lock(&c->lock);
+    c->closing = 1;
+    pthread_cond_broadcast(&c->changed);
+    while (c->active > 0)
+    {
+        pthread_cond_wait(&c->changed, &c->lock);
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    hpack_decoder_free(&c->decoder);
+    pthread_cond_destroy(&c->changed);
+    pthread_mutex_destroy(&c->write_lock);
+    pthread_mutex_destroy(&c->lock);
+    free(c->in);
+    free(c->block);
+    free(payload);
+
+    return error == 0 ? 0 : -1;
+}
+
+/**
+ * Read up to len bytes of a stream's request body
+ *
+ * Window updates go out as the handler reads, so the peer can never send
+ * more than the stream's buffer holds.
+ *
+ * Returns the number of bytes read, 0 at the end of the body, or a
+ * REQUEST_ERR_* value.
+ */
+int h2_body_read(struct h2_stream *s, void *dest, int len)
+{
+    struct h2_conn *c = s->conn;
+    char *out = dest;
+
+    pthread_mutex_lock(&c->lock);
+
+    while (s->body_len == 0 && !s->remote_closed && !s->reset && !c->closing)
+    {
+        pthread_cond_wait(&c->changed, &c->lock);
+    }
+
+    if (s->body_len == 0)
+    {
+        pthread_mutex_unlock(&c->lock);
+        return s->remote_closed && !s->reset ? 0 : REQUEST_ERR_CLOSED;
+    }
+
+    int n = s->body_len < len ? s->body_len : len;
+
+    if (s->req.body_total + n > s->req.max_body_size)
+    {
+        pthread_mutex_unlock(&c->lock);
+        return REQUEST_ERR_TOO_LARGE;
+    }
+
+    int first = H2_WINDOW - s->body_start < n ? H2_WINDOW - s->body_start : n;
+
+    memcpy(out, s->body + s->body_start, first);
+    memcpy(out + first, s->body, n - first);
+    s->body_start = (s->body_start + n) % H2_WINDOW;
+    s->body_len -= n;
+    s->recv_window += n;
+
+    int more = !s->remote_closed;
+
+    pthread_mutex_unlock(&c->lock);
+
+    s->req.body_total += n;
+
+    if (more)
+    {
+        send_window_update(c, s->id, n);
+    }
+
+    return n;
+}
+
+/**
+ * Send a stream's response headers
+ *
+ * The block is encoded without the dynamic table, so the same bytes are
+ * valid on any connection. If cached is given, it points at a slot where
+ * the encoded block of this exact response is kept for next time. A date
+ * header is added fresh each time.
+ *
+ * content_length is left out when negative.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int h2_send_headers(struct h2_stream *s, int status, char *content_type,
+                    long long content_length, void **cached, int end_stream)
+{
+    struct h2_conn *c = s->conn;
+    unsigned char block[1024];
+    unsigned char *blob = cached ? __atomic_load_n((unsigned char **)cached, __ATOMIC_ACQUIRE) : NULL;
+    char value[50];
+    int len, n;
+
+    if (blob != NULL)
+    {
+        memcpy(&len, blob, sizeof len);
+        memcpy(block, blob + sizeof len, len);
+    }
+    else
+    {
+        // ENCODE :status, content-type and content-length
+        len = hpack_encode_status(block, sizeof block, status);
+
+        if (len >= 0 && content_type != NULL)
+        {
+            n = hpack_encode_header(block + len, sizeof block - len, "content-type", content_type);
+            len = n < 0 ? -1 : len + n;
+        }
+        if (len >= 0 && content_length >= 0)
+        {
+            snprintf(value, sizeof value, "%lld", content_length);
+            n = hpack_encode_header(block + len, sizeof block - len, "content-length", value);
+            len = n < 0 ? -1 : len + n;
+        }
+        if (len < 0)
+        {
+            fprintf(stderr, "h2_send_headers: header too long\n");
+            return -1;
+        }
+
+        // SHARE the block, whoever loses the race frees theirs
+        if (cached != NULL && (blob = malloc(sizeof len + len)) != NULL)
+        {
+            void *expected = NULL;
+
+            memcpy(blob, &len, sizeof len);
+            memcpy(blob + sizeof len, block, len);
+            if (!__atomic_compare_exchange_n(cached, &expected, blob, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            {
+                free(blob);
+            }
+        }
+    }
+
+    populate_date_string(value, sizeof value);
+    if ((n = hpack_encode_header(block + len, sizeof block - len, "date", value)) < 0)
+    {
+        return -1;
+    }
+    len += n;
+
+    // The block is always smaller than the minimum frame size, so it
+    // never needs CONTINUATION frames
+    pthread_mutex_lock(&c->write_lock);
+    int rv = s->reset ? -1 : send_frame_locked(c, FRAME_HEADERS, FLAG_END_HEADERS | (end_stream ? FLAG_END_STREAM : 0),
+                                               s->id, block, len);
+    pthread_mutex_unlock(&c->write_lock);
+
+    if (rv == 0)
+    {
+        s->headers_sent = 1;
+        s->ended = end_stream;
+    }
+
+    return rv;
+}
+
+/**
+ * Wait until the peer lets us send some DATA on a stream
+ *
+ * Returns how many bytes (at most want) may be sent, or -1 if the stream
+ * or connection is gone.
+ */
+static int reserve_window(struct h2_stream *s, int want)
+{
+    struct h2_conn *c = s->conn;
+
+    pthread_mutex_lock(&c->lock);
+
+    while (!s->reset && !c->closing && (s->send_window <= 0 || c->send_window <= 0))
+    {
+        pthread_cond_wait(&c->changed, &c->lock);
+    }
+
+    if (s->reset || c->closing)
+    {
+        pthread_mutex_unlock(&c->lock);
+        return -1;
+    }
+
+    int n = want;
+    if (n > s->send_window) { n = s->send_window; }
+    if (n > c->send_window) { n = c->send_window; }
+    if (n > c->peer_max_frame) { n = c->peer_max_frame; }
+
+    s->send_window -= n;
+    c->send_window -= n;
+
+    pthread_mutex_unlock(&c->lock);
+
+    return n;
+}
+
+/**
+ * Send response body on a stream, as many DATA frames as flow control
+ * requires
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int h2_send_data(struct h2_stream *s, void *data, int len, int end_stream)
+{
+    char *p = data;
+
+    if (s->ended)
+    {
+        return -1;
+    }
+
+    do
+    {
+        int n = len > 0 ? reserve_window(s, len) : 0;
+
+        if (n < 0)
+        {
+            return -1;
+        }
+
+        int last = end_stream && n == len;
+
+        if (send_frame(s->conn, FRAME_DATA, last ? FLAG_END_STREAM : 0, s->id, p, n) < 0)
+        {
+            return -1;
+        }
+
+        p += n;
+        len -= n;
+        s->ended = last;
+    } while (len > 0);
+
+    return 0;
+}
+
+/**
+ * Send a whole file as a stream's response body, ending the stream
+ *
+ * Each DATA frame's payload goes out with sendfile(). If one can't be
+ * completed after its head went out, say because the file shrank, the
+ * peer would take whatever comes next as the rest of it, so the whole
+ * connection is shut down, not just the stream.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int h2_send_file(struct h2_stream *s, int file_fd, off_t len)
+{
+    struct h2_conn *c = s->conn;
+    unsigned char head[9];
+    off_t offset = 0;
+
+    if (len == 0)
+    {
+        return h2_send_data(s, NULL, 0, 1);
+    }
+
+    while (offset < len)
+    {
+        int n = reserve_window(s, len - offset < INT_MAX ? (int)(len - offset) : INT_MAX);
+
+        if (n < 0)
+        {
+            return -1;
+        }
+
+        int last = offset + n == len;
+        struct iovec iov = { head, 9 };
+
+        frame_head(head, n, FRAME_DATA, last ? FLAG_END_STREAM : 0, s->id);
+
+        // HEADER and payload must not be split by another stream's frame
+        pthread_mutex_lock(&c->write_lock);
+        int rv = net_send_iov_more(c->fd, &iov, 1) < 0 || net_sendfile(c->fd, file_fd, offset, n) != n ? -1 : 0;
+
+        // IF the frame was cut short THEN nothing more can go out framed:
+        // end the connection, h2_serve() then sees it close and cleans up
+        if (rv < 0)
+        {
+            shutdown(c->fd, SHUT_RDWR);
+        }
+        pthread_mutex_unlock(&c->write_lock);
+
+        if (rv < 0)
+        {
+            return -1;
+        }
+
+        offset += n;
+        s->ended = last;
+    }
+
+    return 0;
+}
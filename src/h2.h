@@ -0,0 +1,83 @@
+#ifndef _H2_H_
+#define _H2_H_
+
+#include <pthread.h>
+#include <sys/types.h>
+#include "hpack.h"
+#include "request.h"
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_PRI_LINE_LEN 18 // "PRI * HTTP/2.0\r\n\r\n", what request_read() consumes
+
+#define H2_MAX_STREAMS 32 // SETTINGS_MAX_CONCURRENT_STREAMS we advertise
+#define H2_WINDOW 65535 // Initial stream window, also the body buffer size
+#define H2_FRAME_MAX 16384 // Largest frame payload either side may send
+
+struct h2_conn;
+
+typedef void (*h2_handler)(struct request *req, void *arg);
+
+// One request/response exchange, run on its own thread
+struct h2_stream {
+    int id;
+    struct h2_conn *conn;
+    pthread_t thread;
+
+    int send_window; // How much DATA the peer lets us send
+    int recv_window; // How much DATA we let the peer send
+    int headers_sent;
+    int ended; // We sent END_STREAM
+    int reset; // RST_STREAM sent or received
+    int remote_closed; // Peer sent END_STREAM
+
+    char *body; // Ring buffer of received request body
+    int body_start;
+    int body_len;
+
+    struct h2_stream *next;
+    struct request req;
+};
+
+// An HTTP/2 connection, the reader runs on the connection's thread
+struct h2_conn {
+    int fd;
+    h2_handler handler; // Runs each request, on the stream's thread
+    void *handler_arg;
+    long long max_body_size;
+
+    pthread_mutex_t lock; // Streams, windows and settings
+    pthread_mutex_t write_lock; // Keeps each frame (or header block) whole
+    pthread_cond_t changed; // Windows opened, body arrived, stream finished
+
+    struct h2_stream *streams;
+    int active; // Streams still running
+    int last_stream_id;
+    int send_window; // Connection-level window for our DATA
+    int recv_credit; // Received DATA not yet returned with WINDOW_UPDATE
+    int peer_initial_window;
+    int peer_max_frame;
+    int closing;
+
+    struct hpack_decoder decoder;
+    unsigned char *block; // Header block collected over CONTINUATION frames
+    int block_len;
+    int block_stream;
+    int block_end_stream;
+
+    char *in; // Raw input not yet parsed
+    int in_cap;
+    int in_pos;
+    int in_len;
+};
+
+extern int h2_upgrade_requested(struct request *req);
+extern int h2_serve(int fd, h2_handler handler, void *handler_arg, long long max_body_size,
+                    struct request *upgrade, char *initial, int initial_len, int preface_seen);
+extern int h2_body_read(struct h2_stream *stream, void *dest, int len);
+extern int h2_send_headers(struct h2_stream *stream, int status, char *content_type,
+                           long long content_length, void **cached, int end_stream);
+extern int h2_send_data(struct h2_stream *stream, void *data, int len, int end_stream);
+extern int h2_send_file(struct h2_stream *stream, int file_fd, off_t len);
+
+#endif
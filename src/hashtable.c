@@ -120,6 +120,7 @@ void htent_free(void *htent, void *arg)
 {
 	(void)arg;
 
+	free(((struct htent *)htent)->key);
 	free(htent);
 }
 
@@ -250,6 +251,7 @@ void *hashtable_delete_bin(struct hashtable *ht, void *key, int key_size)
 
 	void *data = ent->data;
 
+	free(ent->key);
 	free(ent);
 
     add_entry_count(ht, -1);
@@ -0,0 +1,605 @@
+#include <stdlib.h>
+#include <string.h>
+#include "hpack.h"
+
+#define STATIC_COUNT 61
+#define ENTRY_OVERHEAD 32 // Per-entry size overhead from RFC 7541 4.1
+
+// RFC 7541 Appendix A
+static const struct {
+    char *name;
+    char *value;
+} static_table[STATIC_COUNT] = {
+    { ":authority", "" }, // 1
+    { ":method", "GET" }, // 2
+    { ":method", "POST" }, // 3
+    { ":path", "/" }, // 4
+    { ":path", "/index.html" }, // 5
+    { ":scheme", "http" }, // 6
+    { ":scheme", "https" }, // 7
+    { ":status", "200" }, // 8
+    { ":status", "204" }, // 9
+    { ":status", "206" }, // 10
+    { ":status", "304" }, // 11
+    { ":status", "400" }, // 12
+    { ":status", "404" }, // 13
+    { ":status", "500" }, // 14
+    { "accept-charset", "" }, // 15
+    { "accept-encoding", "gzip, deflate" }, // 16
+    { "accept-language", "" }, // 17
+    { "accept-ranges", "" }, // 18
+    { "accept", "" }, // 19
+    { "access-control-allow-origin", "" }, // 20
+    { "age", "" }, // 21
+    { "allow", "" }, // 22
+    { "authorization", "" }, // 23
+    { "cache-control", "" }, // 24
+    { "content-disposition", "" }, // 25
+    { "content-encoding", "" }, // 26
+    { "content-language", "" }, // 27
+    { "content-length", "" }, // 28
+    { "content-location", "" }, // 29
+    { "content-range", "" }, // 30
+    { "content-type", "" }, // 31
+    { "cookie", "" }, // 32
+    { "date", "" }, // 33
+    { "etag", "" }, // 34
+    { "expect", "" }, // 35
+    { "expires", "" }, // 36
+    { "from", "" }, // 37
+    { "host", "" }, // 38
+    { "if-match", "" }, // 39
+    { "if-modified-since", "" }, // 40
+    { "if-none-match", "" }, // 41
+    { "if-range", "" }, // 42
+    { "if-unmodified-since", "" }, // 43
+    { "last-modified", "" }, // 44
+    { "link", "" }, // 45
+    { "location", "" }, // 46
+    { "max-forwards", "" }, // 47
+    { "proxy-authenticate", "" }, // 48
+    { "proxy-authorization", "" }, // 49
+    { "range", "" }, // 50
+    { "referer", "" }, // 51
+    { "refresh", "" }, // 52
+    { "retry-after", "" }, // 53
+    { "server", "" }, // 54
+    { "set-cookie", "" }, // 55
+    { "strict-transport-security", "" }, // 56
+    { "transfer-encoding", "" }, // 57
+    { "user-agent", "" }, // 58
+    { "vary", "" }, // 59
+    { "via", "" }, // 60
+    { "www-authenticate", "" }, // 61
+};
+
+// The Huffman code from RFC 7541 Appendix B is canonical, so it is fully
+// described by the number of codes of each length and the symbols
+// ordered by (length, symbol).
+static const unsigned char huffman_counts[31] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+    0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4,
+};
+
+static const unsigned short huffman_symbols[257] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51,
+    52, 53, 54, 55, 56, 57, 61, 65, 95, 98, 100, 102, 103, 104, 108, 109,
+    110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118,
+    119, 120, 121, 122, 38, 42, 44, 59, 88, 90, 33, 34, 40, 41, 63, 39,
+    43, 124, 35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177,
+    179, 209, 216, 217, 227, 229, 230, 129, 132, 133, 134, 136, 146, 154, 156, 160,
+    163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+    158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142,
+    144, 145, 148, 159, 171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243, 255, 203, 204, 211,
+    212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253, 254,
+    2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220, 249, 10, 13, 22,
+    256,
+};
+
+/**
+ * Decode a Huffman-coded string
+ *
+ * Returns the decoded length or -1 on a malformed string.
+ */
+static int huffman_decode(unsigned char *in, int len, char *out)
+{
+    int code = 0, bits = 0, first = 0, index = 0, out_len = 0;
+
+    for (int i = 0; i < len; i++)
+    {
+        for (int shift = 7; shift >= 0; shift--)
+        {
+            code = (code << 1) | ((in[i] >> shift) & 1);
+            bits++;
+
+            // IF code falls into the range of this length THEN we have a symbol
+            if (code - first < huffman_counts[bits])
+            {
+                int symbol = huffman_symbols[index + code - first];
+
+                if (symbol == 256)
+                {
+                    return -1; // EOS must not appear in the data
+                }
+
+                out[out_len++] = symbol;
+                code = bits = first = index = 0;
+                continue;
+            }
+
+            // ELSE move on to the codes one bit longer
+            first = (first + huffman_counts[bits]) << 1;
+            index += huffman_counts[bits];
+
+            if (bits == 30)
+            {
+                return -1;
+            }
+        }
+    }
+
+    // Padding is at most 7 bits, all ones (a prefix of EOS)
+    if (bits > 7 || code != (1 << bits) - 1)
+    {
+        return -1;
+    }
+
+    return out_len;
+}
+
+/**
+ * Decode an integer with an N-bit prefix
+ *
+ * Returns the value or -1 on truncated or oversized input.
+ */
+static int decode_int(unsigned char *block, int len, int *pos, int prefix_bits)
+{
+    int max_prefix = (1 << prefix_bits) - 1;
+    int value = block[*pos] & max_prefix;
+
+    (*pos)++;
+
+    if (value < max_prefix)
+    {
+        return value;
+    }
+
+    for (int shift = 0; *pos < len; shift += 7)
+    {
+        unsigned char b = block[(*pos)++];
+
+        if (shift > 21)
+        {
+            return -1;
+        }
+
+        value += (b & 0x7f) << shift;
+
+        if ((b & 0x80) == 0)
+        {
+            return value;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Decode a string literal into the scratch buffer at *scratch_pos
+ *
+ * Returns a pointer to the string and sets its length, or NULL on error.
+ */
+static char *decode_string(struct hpack_decoder *d, unsigned char *block, int len, int *pos,
+                           int *scratch_pos, int *out_len)
+{
+    if (*pos >= len)
+    {
+        return NULL;
+    }
+
+    int huffman = block[*pos] & 0x80;
+    int str_len = decode_int(block, len, pos, 7);
+
+    if (str_len < 0 || str_len > len - *pos)
+    {
+        return NULL;
+    }
+
+    char *out = d->scratch + *scratch_pos;
+
+    if (huffman)
+    {
+        *out_len = huffman_decode(block + *pos, str_len, out);
+        if (*out_len < 0)
+        {
+            return NULL;
+        }
+    }
+    else
+    {
+        memcpy(out, block + *pos, str_len);
+        *out_len = str_len;
+    }
+
+    *pos += str_len;
+    out[*out_len] = '\0';
+    *scratch_pos += *out_len + 1;
+
+    return out;
+}
+
+/**
+ * Drop the oldest dynamic entries until the table fits in max_size
+ */
+static void evict(struct hpack_decoder *d, int max_size)
+{
+    int drop = 0;
+
+    while (d->size > max_size && drop < d->count)
+    {
+        struct hpack_field *f = &d->fields[drop++];
+
+        d->size -= f->name_len + f->value_len + ENTRY_OVERHEAD;
+        free(f->name);
+        free(f->value);
+    }
+
+    if (drop > 0)
+    {
+        d->count -= drop;
+        memmove(d->fields, d->fields + drop, d->count * sizeof(*d->fields));
+    }
+}
+
+/**
+ * Add a field to the dynamic table, evicting as needed
+ *
+ * name and value are malloc()ed copies, made before anything is evicted:
+ * the field's name may be that of an entry this evicts. The table takes
+ * them over if the entry fits.
+ *
+ * Returns 1 if it did, 0 if the entry is bigger than the whole table,
+ * which just empties it and leaves the copies with the caller, or -1 if
+ * out of memory.
+ */
+static int insert(struct hpack_decoder *d, char *name, int name_len, char *value, int value_len)
+{
+    int entry_size = name_len + value_len + ENTRY_OVERHEAD;
+
+    if (d->count == d->cap)
+    {
+        int cap = d->cap ? d->cap * 2 : 16;
+        struct hpack_field *fields = realloc(d->fields, cap * sizeof(*fields));
+
+        if (fields == NULL)
+        {
+            return -1;
+        }
+        d->fields = fields;
+        d->cap = cap;
+    }
+
+    evict(d, d->max_size - entry_size);
+
+    if (entry_size > d->max_size)
+    {
+        return 0;
+    }
+
+    struct hpack_field *f = &d->fields[d->count++];
+
+    f->name = name;
+    f->value = value;
+    f->name_len = name_len;
+    f->value_len = value_len;
+    d->size += entry_size;
+
+    return 1;
+}
+
+/**
+ * Look up a static or dynamic table index
+ *
+ * Returns 0 on success, -1 for an index out of range.
+ */
+static int lookup(struct hpack_decoder *d, int index, char **name, int *name_len, char **value, int *value_len)
+{
+    if (index >= 1 && index <= STATIC_COUNT)
+    {
+        *name = static_table[index - 1].name;
+        *value = static_table[index - 1].value;
+        *name_len = strlen(*name);
+        *value_len = strlen(*value);
+        return 0;
+    }
+
+    // Dynamic entries are numbered newest first
+    index -= STATIC_COUNT + 1;
+    if (index < 0 || index >= d->count)
+    {
+        return -1;
+    }
+
+    struct hpack_field *f = &d->fields[d->count - 1 - index];
+
+    *name = f->name;
+    *value = f->value;
+    *name_len = f->name_len;
+    *value_len = f->value_len;
+
+    return 0;
+}
+
+/**
+ * Set up an empty decoder
+ */
+void hpack_decoder_init(struct hpack_decoder *d)
+{
+    memset(d, 0, sizeof(*d));
+    d->max_size = HPACK_TABLE_SIZE;
+}
+
+/**
+ * Free a decoder's dynamic table
+ */
+void hpack_decoder_free(struct hpack_decoder *d)
+{
+    evict(d, -1);
+    free(d->fields);
+    free(d->scratch);
+}
+
+/**
+ * Decode a complete header block, calling emit for each field
+ *
+ * Decoding stops if emit returns non-zero.
+ *
+ * Returns 0 on success, -1 on a compression error (which is fatal for
+ * the connection) or emit's non-zero return value.
+ */
+int hpack_decode(struct hpack_decoder *d, unsigned char *block, int len, hpack_emit emit, void *arg)
+{
+    // Huffman strings grow at most 8/5 when decoded
+    int need = len * 8 / 5 + 16;
+
+    if (need > d->scratch_cap)
+    {
+        char *scratch = realloc(d->scratch, need);
+
+        if (scratch == NULL)
+        {
+            return -1;
+        }
+        d->scratch = scratch;
+        d->scratch_cap = need;
+    }
+
+    int pos = 0, first_field = 1;
+
+    while (pos < len)
+    {
+        unsigned char b = block[pos];
+        char *name, *value;
+        char *unlinked[2] = { NULL, NULL }; // Copies no table entry took over
+        int name_len, value_len, index, scratch_pos = 0, rv;
+
+        if (b & 0x80)
+        {
+            // INDEXED header field
+            index = decode_int(block, len, &pos, 7);
+            if (index <= 0 || lookup(d, index, &name, &name_len, &value, &value_len) < 0)
+            {
+                return -1;
+            }
+        }
+        else if ((b & 0xe0) == 0x20)
+        {
+            // TABLE size update, only allowed before the first field
+            int size = decode_int(block, len, &pos, 5);
+            if (size < 0 || size > HPACK_TABLE_SIZE || !first_field)
+            {
+                return -1;
+            }
+            d->max_size = size;
+            evict(d, size);
+            continue;
+        }
+        else
+        {
+            // LITERAL field, with incremental indexing (01) or without (0000/0001)
+            int indexing = (b & 0x40) != 0;
+
+            index = decode_int(block, len, &pos, indexing ? 6 : 4);
+            if (index < 0)
+            {
+                return -1;
+            }
+
+            if (index > 0)
+            {
+                if (lookup(d, index, &name, &name_len, &value, &value_len) < 0)
+                {
+                    return -1;
+                }
+            }
+            else if ((name = decode_string(d, block, len, &pos, &scratch_pos, &name_len)) == NULL)
+            {
+                return -1;
+            }
+
+            if ((value = decode_string(d, block, len, &pos, &scratch_pos, &value_len)) == NULL)
+            {
+                return -1;
+            }
+
+            // INDEX copies, name may belong to an entry the insert evicts
+            if (indexing)
+            {
+                char *name_copy = strndup(name, name_len);
+                char *value_copy = strndup(value, value_len);
+                int linked = name_copy != NULL && value_copy != NULL ?
+                             insert(d, name_copy, name_len, value_copy, value_len) : -1;
+
+                if (linked < 0)
+                {
+                    free(name_copy);
+                    free(value_copy);
+                    return -1;
+                }
+                if (!linked)
+                {
+                    unlinked[0] = name_copy;
+                    unlinked[1] = value_copy;
+                }
+                name = name_copy;
+                value = value_copy;
+            }
+        }
+
+        first_field = 0;
+
+        rv = emit(arg, name, name_len, value, value_len);
+        free(unlinked[0]);
+        free(unlinked[1]);
+
+        if (rv != 0)
+        {
+            return rv;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Encode an integer with an N-bit prefix, keeping the high bits of out[0]
+ */
+static int encode_int(unsigned char *out, int cap, int value, int prefix_bits, unsigned char high)
+{
+    int max_prefix = (1 << prefix_bits) - 1;
+    int pos = 0;
+
+    if (cap < 1)
+    {
+        return -1;
+    }
+
+    if (value < max_prefix)
+    {
+        out[pos++] = high | value;
+        return pos;
+    }
+
+    out[pos++] = high | max_prefix;
+    value -= max_prefix;
+
+    while (value >= 0x80)
+    {
+        if (pos >= cap) { return -1; }
+        out[pos++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+
+    if (pos >= cap) { return -1; }
+    out[pos++] = value;
+
+    return pos;
+}
+
+/**
+ * Encode a raw (non-Huffman) string literal
+ */
+static int encode_string(unsigned char *out, int cap, char *s)
+{
+    int len = strlen(s);
+    int n = encode_int(out, cap, len, 7, 0x00);
+
+    if (n < 0 || n + len > cap)
+    {
+        return -1;
+    }
+
+    memcpy(out + n, s, len);
+
+    return n + len;
+}
+
+/**
+ * Encode a :status pseudo-header
+ *
+ * Uses the static table entry when there is one for the code.
+ *
+ * Returns the number of bytes written, or -1 if out is too small.
+ */
+int hpack_encode_status(unsigned char *out, int cap, int status)
+{
+    char value[4];
+
+    value[0] = '0' + (status / 100) % 10;
+    value[1] = '0' + (status / 10) % 10;
+    value[2] = '0' + status % 10;
+    value[3] = '\0';
+
+    return hpack_encode_header(out, cap, ":status", value);
+}
+
+/**
+ * Encode a header field without touching the peer's dynamic table
+ *
+ * The output doesn't depend on what was sent before, so blocks built
+ * from it can be cached and concatenated freely. name must be lowercase.
+ *
+ * Returns the number of bytes written, or -1 if out is too small.
+ */
+int hpack_encode_header(unsigned char *out, int cap, char *name, char *value)
+{
+    int name_index = 0;
+
+    for (int i = 0; i < STATIC_COUNT; i++)
+    {
+        if (strcmp(static_table[i].name, name) != 0)
+        {
+            continue;
+        }
+
+        // EXACT match is a single indexed byte
+        if (strcmp(static_table[i].value, value) == 0)
+        {
+            return encode_int(out, cap, i + 1, 7, 0x80);
+        }
+
+        if (name_index == 0)
+        {
+            name_index = i + 1;
+        }
+    }
+
+    // LITERAL without indexing, name from the static table if possible
+    int pos = encode_int(out, cap, name_index, 4, 0x00), n;
+
+    if (pos < 0)
+    {
+        return -1;
+    }
+
+    if (name_index == 0)
+    {
+        if ((n = encode_string(out + pos, cap - pos, name)) < 0)
+        {
+            return -1;
+        }
+        pos += n;
+    }
+
+    if ((n = encode_string(out + pos, cap - pos, value)) < 0)
+    {
+        return -1;
+    }
+
+    return pos + n;
+}
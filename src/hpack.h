@@ -0,0 +1,33 @@
+#ifndef _HPACK_H_
+#define _HPACK_H_
+
+#define HPACK_TABLE_SIZE 4096 // SETTINGS_HEADER_TABLE_SIZE default
+
+// One dynamic table entry
+struct hpack_field {
+    char *name;
+    char *value;
+    int name_len;
+    int value_len;
+};
+
+// Decoding context for one direction of one HTTP/2 connection
+struct hpack_decoder {
+    struct hpack_field *fields; // Oldest first
+    int count;
+    int cap;
+    int size; // Sum of name + value + 32 per entry
+    int max_size; // Current limit, set by table size updates
+    char *scratch; // Huffman-decoded strings
+    int scratch_cap;
+};
+
+typedef int (*hpack_emit)(void *arg, char *name, int name_len, char *value, int value_len);
+
+extern void hpack_decoder_init(struct hpack_decoder *d);
+extern void hpack_decoder_free(struct hpack_decoder *d);
+extern int hpack_decode(struct hpack_decoder *d, unsigned char *block, int len, hpack_emit emit, void *arg);
+extern int hpack_encode_status(unsigned char *out, int cap, int status);
+extern int hpack_encode_header(unsigned char *out, int cap, char *name, char *value);
+
+#endif
@@ -0,0 +1,219 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include "hugemem.h"
+
+// The cache's content buffers come from one region of huge pages, so the
+// hot ones share a few TLB entries instead of taking one per 4 KB page.
+//
+// Requests are rounded up to a size class, four to each power of two from
+// 64 bytes to a whole huge page, so at most a fifth of a buffer is slack.
+// Each huge page is handed to a class the first time the class needs room
+// and cut into buffers of its size; freed buffers go on their class's free
+// list. Pages stay with their class. Whatever doesn't fit, because it's
+// bigger than a page or the region is full, is malloc()ed.
+
+#define CLASS_MIN_SHIFT 6 // Smallest class, 64 bytes
+#define CLASS_STEPS 4 // Classes to each power of two
+#define CLASS_COUNT ((21 - CLASS_MIN_SHIFT) * CLASS_STEPS + 1) // Up to HUGEMEM_PAGE
+
+struct size_class
+{
+    size_t size;
+    void *free; // Free buffers, each starting with the next one's address
+    pthread_mutex_t lock;
+};
+
+struct hugemem
+{
+    char *base; // NULL until hugemem_init()
+    size_t size;
+    size_t pages;
+    size_t next_page; // Pages from here on belong to no class yet
+    unsigned char *page_class; // Class of each page, for hugemem_free()
+    pthread_mutex_t page_lock;
+    struct size_class classes[CLASS_COUNT];
+};
+
+static struct hugemem heap;
+
+/**
+ * Return the class a buffer of size bytes comes from
+ */
+static int class_of(size_t size)
+{
+    if (size <= (1 << CLASS_MIN_SHIFT))
+    {
+        return 0;
+    }
+
+    // size is in (2^k, 2^(k+1)], split into CLASS_STEPS steps
+    int k = 63 - __builtin_clzll(size - 1);
+    size_t step = ((size_t)1 << k) / CLASS_STEPS;
+    size_t j = (size - ((size_t)1 << k) + step - 1) / step;
+
+    return (k - CLASS_MIN_SHIFT) * CLASS_STEPS + (int)j;
+}
+
+/**
+ * Map the region the cache's content buffers come from, size bytes
+ * rounded up to whole huge pages
+ *
+ * Reserved huge pages are used if there are enough, else the region is
+ * madvise()d for transparent huge pages. Must be called before any other
+ * thread allocates. Returns HUGEMEM_HUGETLB or HUGEMEM_THP, or -1 on
+ * error, leaving hugemem_alloc() to malloc().
+ */
+int hugemem_init(size_t size)
+{
+    int kind = HUGEMEM_HUGETLB;
+    size_t pages = (size + HUGEMEM_PAGE - 1) / HUGEMEM_PAGE;
+
+    if (heap.base != NULL || pages == 0)
+    {
+        return -1;
+    }
+    size = pages * HUGEMEM_PAGE;
+
+    char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+    // IF there aren't enough reserved huge pages THEN map a page more than
+    // needed, to line the region up on a huge page boundary, and ask for
+    // transparent ones
+    if (base == MAP_FAILED)
+    {
+        kind = HUGEMEM_THP;
+        base = mmap(NULL, size + HUGEMEM_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                    -1, 0);
+        if (base == MAP_FAILED)
+        {
+            perror("hugemem mmap");
+            return -1;
+        }
+
+        char *aligned = (char *)(((uintptr_t)base + HUGEMEM_PAGE - 1) & ~(uintptr_t)(HUGEMEM_PAGE - 1));
+
+        if (aligned > base)
+        {
+            munmap(base, aligned - base);
+        }
+        munmap(aligned + size, base + HUGEMEM_PAGE - aligned);
+        base = aligned;
+
+        if (madvise(base, size, MADV_HUGEPAGE) < 0)
+        {
+            perror("hugemem madvise");
+        }
+    }
+
+    heap.page_class = malloc(pages);
+    if (heap.page_class == NULL)
+    {
+        munmap(base, size);
+        return -1;
+    }
+
+    heap.size = size;
+    heap.pages = pages;
+    heap.next_page = 0;
+    pthread_mutex_init(&heap.page_lock, NULL);
+
+    for (int i = 0; i < CLASS_COUNT; i++)
+    {
+        int k = i == 0 ? CLASS_MIN_SHIFT : CLASS_MIN_SHIFT + (i - 1) / CLASS_STEPS;
+        int j = i == 0 ? 0 : (i - 1) % CLASS_STEPS + 1;
+
+        heap.classes[i].size = ((size_t)1 << k) + j * (((size_t)1 << k) / CLASS_STEPS);
+        heap.classes[i].free = NULL;
+        pthread_mutex_init(&heap.classes[i].lock, NULL);
+    }
+
+    heap.base = base;
+
+    return kind;
+}
+
+/**
+ * Give a class a page more of buffers
+ *
+ * Called with the class's lock held. Returns -1 if the region is full.
+ */
+static int grow_class(int class)
+{
+    struct size_class *c = &heap.classes[class];
+
+    pthread_mutex_lock(&heap.page_lock);
+    size_t page = heap.next_page < heap.pages ? heap.next_page++ : heap.pages;
+    pthread_mutex_unlock(&heap.page_lock);
+
+    if (page == heap.pages)
+    {
+        return -1;
+    }
+
+    heap.page_class[page] = class;
+
+    // CUT the page into buffers, chained from the last one back
+    char *start = heap.base + page * HUGEMEM_PAGE;
+
+    for (size_t offset = 0; offset + c->size <= HUGEMEM_PAGE; offset += c->size)
+    {
+        *(void **)(start + offset) = c->free;
+        c->free = start + offset;
+    }
+
+    return 0;
+}
+
+/**
+ * Allocate size bytes for cache content
+ *
+ * From the huge-page region when there is one with room, else malloc().
+ * Returns NULL if out of memory.
+ */
+void *hugemem_alloc(size_t size)
+{
+    if (heap.base == NULL || size > HUGEMEM_PAGE)
+    {
+        return malloc(size);
+    }
+
+    struct size_class *c = &heap.classes[class_of(size)];
+    void *p;
+
+    pthread_mutex_lock(&c->lock);
+    if (c->free == NULL)
+    {
+        grow_class(c - heap.classes);
+    }
+    if ((p = c->free) != NULL)
+    {
+        c->free = *(void **)p;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    return p != NULL ? p : malloc(size);
+}
+
+/**
+ * Free what hugemem_alloc() returned
+ */
+void hugemem_free(void *p)
+{
+    char *cp = p;
+
+    if (heap.base == NULL || cp < heap.base || cp >= heap.base + heap.size)
+    {
+        free(p);
+        return;
+    }
+
+    struct size_class *c = &heap.classes[heap.page_class[(cp - heap.base) / HUGEMEM_PAGE]];
+
+    pthread_mutex_lock(&c->lock);
+    *(void **)p = c->free;
+    c->free = p;
+    pthread_mutex_unlock(&c->lock);
+}
@@ -0,0 +1,16 @@
+#ifndef _HUGEMEM_H_
+#define _HUGEMEM_H_
+
+#include <stddef.h>
+
+#define HUGEMEM_PAGE (2 * 1024 * 1024) // Huge page size on x86-64 and arm64
+
+// What hugemem_init() got its region from
+#define HUGEMEM_HUGETLB 1 // Reserved huge pages, MAP_HUGETLB
+#define HUGEMEM_THP 2 // Ordinary memory the kernel backs with transparent huge pages
+
+extern int hugemem_init(size_t size);
+extern void *hugemem_alloc(size_t size);
+extern void hugemem_free(void *p);
+
+#endif
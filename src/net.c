@@ -1,14 +1,23 @@
+#define _GNU_SOURCE // splice(), pipe2()
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <linux/filter.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include "net.h"
-
-#define BACKLOG 10	 // how many pending connections queue will hold
+#include "conn.h"
+#include "request.h"
+#ifdef USE_TLS
+#include "tls.h"
+#endif
 
 /**
  * This gets an Internet address, either IPv4 or IPv6
@@ -27,9 +36,13 @@ void *get_in_addr(struct sockaddr *sa)
 /**
  * Return the main listening socket
  *
+ * backlog: how many pending connections the queue will hold
+ * reuseport: join the port's SO_REUSEPORT group, so every shard can have
+ *            a listener of its own on it
+ *
  * Returns -1 or error
  */
-int get_listener_socket(char *port)
+int get_listener_socket(char *port, int backlog, int reuseport)
 {
     int sockfd;
     struct addrinfo hints, *servinfo, *p;
@@ -73,6 +86,15 @@ int get_listener_socket(char *port)
             return -2;
         }
 
+        // SO_REUSEPORT lets several sockets listen on the port, the
+        // kernel spreads the connections over them
+        if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+            perror("setsockopt");
+            close(sockfd);
+            freeaddrinfo(servinfo);
+            return -2;
+        }
+
         // See if we can bind this socket to this local IP address. This
         // associates the file descriptor (the socket descriptor) that
         // we will read and write on with a specific IP address.
@@ -97,7 +119,7 @@ int get_listener_socket(char *port)
 
     // Start listening. This is what allows remote computers to connect
     // to this socket/IP.
-    if (listen(sockfd, BACKLOG) == -1) {
+    if (listen(sockfd, backlog) == -1) {
         //perror("listen");
         close(sockfd);
         return -4;
@@ -105,3 +127,261 @@ int get_listener_socket(char *port)
 
     return sockfd;
 }
+
+/**
+ * Make a SO_REUSEPORT group hand each connection to the listener of the
+ * CPU that took its SYN: listener i gets CPU i's connections
+ *
+ * fd is any listener of the group, which must have count of them,
+ * joined in CPU order. With the NIC's queues spread over the CPUs, a
+ * connection is then served where its packets arrive.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int net_steer_by_cpu(int fd, int count)
+{
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU }, // A = the current CPU
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, count }, // A %= count
+        { BPF_RET | BPF_A, 0, 0, 0 }, // Listener A takes it
+    };
+    struct sock_fprog prog = { sizeof code / sizeof code[0], code };
+
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof prog);
+}
+
+/**
+ * Take net_steer_by_cpu()'s program off a SO_REUSEPORT group, so the
+ * kernel spreads connections over its listeners by hash again
+ *
+ * Returns 0 on success, -1 if there was none or on error.
+ */
+int net_unsteer(int fd)
+{
+    return setsockopt(fd, SOL_SOCKET, SO_DETACH_REUSEPORT_BPF, NULL, 0);
+}
+
+/**
+ * Receive from a connection, decrypting if it carries TLS
+ *
+ * Returns the number of bytes read, 0 on close or -1 on error.
+ */
+int net_recv(int fd, void *buf, int len)
+{
+    conn_progress(fd, CONN_READ);
+
+#ifdef USE_TLS
+    if (tls_active(fd)) {
+        return tls_recv(fd, buf, len);
+    }
+#endif
+
+    int n;
+
+    do {
+        n = recv(fd, buf, len, 0);
+    } while (n < 0 && errno == EINTR);
+
+    return n;
+}
+
+/**
+ * Send a whole iovec array, resuming after short sends
+ *
+ * flags: added to sendmsg()'s, MSG_MORE or 0
+ *
+ * Returns the number of bytes sent, or -1 on error.
+ */
+static int send_iov(int fd, struct iovec *iov, int iovcnt, int flags)
+{
+    conn_progress(fd, CONN_WRITE);
+
+#ifdef USE_TLS
+    if (tls_active(fd)) {
+        return tls_send_iov(fd, iov, iovcnt);
+    }
+#endif
+
+    struct msghdr msg;
+    int total = 0;
+
+    memset(&msg, 0, sizeof msg);
+
+    while (iovcnt > 0) {
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+
+        // MSG_NOSIGNAL: a client hanging up shouldn't SIGPIPE the server
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL | flags);
+
+        if (sent < 0) {
+            if (errno == EINTR) { continue; }
+            perror("send");
+            return -1;
+        }
+        total += sent;
+
+        // Skip the buffers that went out completely
+        while (iovcnt > 0 && (size_t)sent >= iov->iov_len) {
+            sent -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        // Advance into the buffer that went out partially
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+
+    return total;
+}
+
+/**
+ * Send a whole iovec array
+ *
+ * Returns the number of bytes sent, or -1 on error.
+ */
+int net_send_iov(int fd, struct iovec *iov, int iovcnt)
+{
+    return send_iov(fd, iov, iovcnt, 0);
+}
+
+/**
+ * Send a head that more data follows right away, from sendfile() or
+ * splice() say
+ *
+ * MSG_MORE holds back a partial segment for what comes next, so a small
+ * head doesn't go out in a packet of its own. The next send without it
+ * pushes everything out, so one must follow.
+ *
+ * Returns the number of bytes sent, or -1 on error.
+ */
+int net_send_iov_more(int fd, struct iovec *iov, int iovcnt)
+{
+    return send_iov(fd, iov, iovcnt, MSG_MORE);
+}
+
+/**
+ * Send count bytes of a file starting at offset, without copying
+ * through user space where possible
+ *
+ * Returns the number of bytes sent, or -1 on error.
+ */
+off_t net_sendfile(int fd, int file_fd, off_t offset, off_t count)
+{
+    conn_progress(fd, CONN_WRITE);
+
+#ifdef USE_TLS
+    if (tls_active(fd)) {
+        return tls_sendfile(fd, file_fd, offset, count);
+    }
+#endif
+
+    off_t total = 0;
+
+    while (total < count) {
+        ssize_t sent = sendfile(fd, file_fd, &offset, count - total);
+
+        if (sent < 0 && errno == EINTR) { continue; }
+        if (sent <= 0) {
+            perror("sendfile");
+            return -1;
+        }
+        total += sent;
+    }
+
+    return total;
+}
+
+/**
+ * net_splice() for when one side is TLS: through user space after all
+ */
+static long long copy_stream(int from_fd, int to_fd, long long count)
+{
+    char buf[REQUEST_BODY_CHUNK];
+    long long total = 0;
+
+    while (total < count) {
+        int want = count - total < (long long)sizeof buf ? (int)(count - total) : (int)sizeof buf;
+        int n = net_recv(from_fd, buf, want);
+
+        if (n < 0) { return -1; }
+        if (n == 0) { break; }
+
+        struct iovec iov = { buf, n };
+        if (net_send_iov(to_fd, &iov, 1) < 0) {
+            return -1;
+        }
+        total += n;
+    }
+
+    return total;
+}
+
+/**
+ * Move count bytes from one connection to another
+ *
+ * Between plain sockets they go through a pipe with splice(), so they
+ * are never copied into user space. A TLS side has to be decrypted or
+ * encrypted here, so then it's a read and write loop.
+ *
+ * Returns the number of bytes moved, fewer if from_fd closed first, or
+ * -1 on error.
+ */
+long long net_splice(int from_fd, int to_fd, long long count)
+{
+#ifdef USE_TLS
+    if (tls_active(from_fd) || tls_active(to_fd)) {
+        return copy_stream(from_fd, to_fd, count);
+    }
+#endif
+
+    int pipefd[2];
+    long long total = 0;
+
+    if (pipe2(pipefd, O_CLOEXEC) < 0) {
+        perror("pipe2");
+        return copy_stream(from_fd, to_fd, count);
+    }
+
+    while (total < count) {
+        size_t want = count - total < NET_SPLICE_CHUNK ? (size_t)(count - total) : NET_SPLICE_CHUNK;
+
+        conn_progress(from_fd, CONN_READ);
+        ssize_t n = splice(from_fd, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n < 0) {
+            perror("splice");
+            total = -1;
+            break;
+        }
+        if (n == 0) { break; }
+
+        // DRAIN the pipe into the other socket; the last of it goes
+        // without SPLICE_F_MORE, so it isn't held back for more
+        while (n > 0) {
+            int more = total + n < count ? SPLICE_F_MORE : 0;
+
+            conn_progress(to_fd, CONN_WRITE);
+            ssize_t sent = splice(pipefd[0], NULL, to_fd, NULL, n, SPLICE_F_MOVE | more);
+
+            if (sent < 0 && errno == EINTR) { continue; }
+            if (sent <= 0) {
+                perror("splice");
+                close(pipefd[0]);
+                close(pipefd[1]);
+                return -1;
+            }
+            n -= sent;
+            total += sent;
+        }
+    }
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+
+    return total;
+}
@@ -1,7 +1,21 @@
 #ifndef _NET_H_
 #define _NET_H_
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define NET_SPLICE_CHUNK 65536 // Bytes spliced at a time, a default pipe's capacity
+
+struct sockaddr;
+
 void *get_in_addr(struct sockaddr *sa);
-int get_listener_socket(char *port);
+int get_listener_socket(char *port, int backlog, int reuseport);
+int net_steer_by_cpu(int fd, int count);
+int net_unsteer(int fd);
+int net_recv(int fd, void *buf, int len);
+int net_send_iov(int fd, struct iovec *iov, int iovcnt);
+int net_send_iov_more(int fd, struct iovec *iov, int iovcnt);
+off_t net_sendfile(int fd, int file_fd, off_t offset, off_t count);
+long long net_splice(int from_fd, int to_fd, long long count);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,356 @@
+#define _GNU_SOURCE // O_TMPFILE, copy_file_range()
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/uio.h>
+#include <sys/file.h>
+#include "postlog.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/**
+ * Write a whole iovec array, resuming after short writes
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0)
+    {
+        ssize_t written = writev(fd, iov, iovcnt);
+
+        if (written < 0)
+        {
+            if (errno == EINTR) { continue; }
+            return -1;
+        }
+
+        // SKIP the buffers that went out completely
+        while (iovcnt > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        // ADVANCE into the buffer that went out partially
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Copy a spooled record into the log at the current file position
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int copy_spool(int fd, int spool_fd, int length)
+{
+    loff_t offset = 0;
+
+    // COPY in the kernel when the filesystem allows it
+    while (offset < length)
+    {
+        ssize_t copied = copy_file_range(spool_fd, &offset, fd, NULL, length - offset, 0);
+
+        if (copied > 0) { continue; }
+        if (copied < 0 && errno == EINTR) { continue; }
+        if (copied < 0 && errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)
+        {
+            return -1;
+        }
+        break;
+    }
+
+    // ELSE fall back to reading it through a buffer
+    char buffer[16384];
+
+    while (offset < length)
+    {
+        ssize_t n = pread(spool_fd, buffer, sizeof buffer, offset);
+
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) { return -1; }
+
+        struct iovec iov = { buffer, n };
+        if (writev_all(fd, &iov, 1) < 0)
+        {
+            return -1;
+        }
+        offset += n;
+    }
+
+    return 0;
+}
+
+/**
+ * Write one batch of records and make it durable
+ *
+ * Returns 1 on success, -1 on error.
+ */
+static int commit_batch(int fd, struct postlog_record *batch)
+{
+    struct iovec iov[IOV_MAX];
+    int iovcnt = 0;
+
+    // Only the writer thread moves the file position, but start at the
+    // real end in case anything else appended in the meantime
+    if (lseek(fd, 0, SEEK_END) < 0)
+    {
+        perror("postlog lseek");
+        return -1;
+    }
+
+    for (struct postlog_record *rec = batch; rec != NULL; rec = rec->next)
+    {
+        if (rec->spool_fd < 0)
+        {
+            iov[iovcnt].iov_base = rec->data;
+            iov[iovcnt].iov_len = rec->length;
+            iovcnt++;
+        }
+
+        // FLUSH when the vector is full, a spooled record comes or the batch is done
+        if (iovcnt > 0 && (iovcnt == IOV_MAX || rec->spool_fd >= 0 || rec->next == NULL))
+        {
+            if (writev_all(fd, iov, iovcnt) < 0)
+            {
+                perror("postlog writev");
+                return -1;
+            }
+            iovcnt = 0;
+        }
+
+        if (rec->spool_fd >= 0 && copy_spool(fd, rec->spool_fd, rec->length) < 0)
+        {
+            perror("postlog copy");
+            return -1;
+        }
+    }
+
+    if (fdatasync(fd) < 0)
+    {
+        perror("postlog fdatasync");
+        return -1;
+    }
+
+    return 1;
+}
+
+/**
+ * Writer thread: takes everything queued so far and commits it as one batch
+ */
+static void *postlog_writer(void *arg)
+{
+    struct postlog *log = arg;
+
+    pthread_mutex_lock(&log->lock);
+
+    while (log->running || log->head != NULL)
+    {
+        if (log->head == NULL)
+        {
+            pthread_cond_wait(&log->pending, &log->lock);
+            continue;
+        }
+
+        // DETACH the whole queue; appenders keep queueing behind it
+        struct postlog_record *batch = log->head;
+        log->head = log->tail = NULL;
+        pthread_mutex_unlock(&log->lock);
+
+        // LOCK the file against another server process appending to it,
+        // as the old one does while it drains during an upgrade
+        flock(log->fd, LOCK_EX);
+        int status = commit_batch(log->fd, batch);
+        flock(log->fd, LOCK_UN);
+
+        pthread_mutex_lock(&log->lock);
+        for (struct postlog_record *rec = batch, *next; rec != NULL; rec = next)
+        {
+            // Record lives on the waiter's stack, read next before waking it
+            next = rec->next;
+            rec->status = status;
+        }
+        pthread_cond_broadcast(&log->committed);
+    }
+
+    pthread_mutex_unlock(&log->lock);
+
+    return NULL;
+}
+
+/**
+ * Open (or create) the log file and start its writer thread
+ *
+ * Returns NULL on error.
+ */
+struct postlog *postlog_open(char *path)
+{
+    struct postlog *log = malloc(sizeof(*log));
+    if (!log)
+    {
+        return NULL;
+    }
+
+    // Not O_APPEND: the kernel refuses to copy_file_range() into those
+    log->fd = open(path, O_CREAT | O_WRONLY | O_CLOEXEC, 0644);
+    if (log->fd < 0)
+    {
+        perror("postlog open");
+        free(log);
+        return NULL;
+    }
+
+    char *path_copy = strdup(path);
+    log->dir = strdup(dirname(path_copy));
+    free(path_copy);
+
+    log->running = 1;
+    log->head = log->tail = NULL;
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_cond_init(&log->pending, NULL);
+    pthread_cond_init(&log->committed, NULL);
+
+    if (pthread_create(&log->writer, NULL, postlog_writer, log) != 0)
+    {
+        perror("postlog pthread_create");
+        close(log->fd);
+        free(log->dir);
+        free(log);
+        return NULL;
+    }
+
+    return log;
+}
+
+/**
+ * Stop the writer after draining the queue, then close the file
+ */
+void postlog_close(struct postlog *log)
+{
+    pthread_mutex_lock(&log->lock);
+    log->running = 0;
+    pthread_cond_signal(&log->pending);
+    pthread_mutex_unlock(&log->lock);
+
+    pthread_join(log->writer, NULL);
+
+    close(log->fd);
+    free(log->dir);
+    pthread_cond_destroy(&log->committed);
+    pthread_cond_destroy(&log->pending);
+    pthread_mutex_destroy(&log->lock);
+    free(log);
+}
+
+/**
+ * Queue a record for the writer thread and wait until it is on disk
+ */
+static int append_record(struct postlog *log, void *data, int spool_fd, int length)
+{
+    struct postlog_record rec;
+
+    rec.data = data;
+    rec.length = length;
+    rec.spool_fd = spool_fd;
+    rec.status = 0;
+    rec.next = NULL;
+
+    pthread_mutex_lock(&log->lock);
+
+    if (!log->running)
+    {
+        pthread_mutex_unlock(&log->lock);
+        return -1;
+    }
+
+    // QUEUE the record at the tail
+    if (log->tail == NULL)
+    {
+        log->head = log->tail = &rec;
+    }
+    else
+    {
+        log->tail->next = &rec;
+        log->tail = &rec;
+    }
+    pthread_cond_signal(&log->pending);
+
+    // WAIT until the writer has committed our batch
+    while (rec.status == 0)
+    {
+        pthread_cond_wait(&log->committed, &log->lock);
+    }
+
+    pthread_mutex_unlock(&log->lock);
+
+    return rec.status > 0 ? 0 : -1;
+}
+
+/**
+ * Append data to the log and wait until it is on disk
+ *
+ * Concurrent appends are written together by the writer thread with a
+ * single writev() + fdatasync(), each record kept contiguous.
+ *
+ * Returns 0 once the data is durable, -1 on error.
+ */
+int postlog_append(struct postlog *log, void *data, int length)
+{
+    return append_record(log, data, -1, length);
+}
+
+/**
+ * Open an anonymous spool file for a record too big to hold in memory
+ *
+ * The file lives next to the log so the final copy stays on one
+ * filesystem. Returns -1 on error.
+ */
+int postlog_spool_open(struct postlog *log)
+{
+    int fd = open(log->dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+
+    if (fd < 0 && (errno == EOPNOTSUPP || errno == EISDIR || errno == EINVAL))
+    {
+        // No O_TMPFILE support, create a named file and unlink it right away
+        char template[4096];
+
+        snprintf(template, sizeof template, "%s/.postlog-XXXXXX", log->dir);
+        fd = mkostemp(template, O_CLOEXEC);
+        if (fd >= 0)
+        {
+            unlink(template);
+        }
+    }
+
+    if (fd < 0)
+    {
+        perror("postlog spool");
+    }
+
+    return fd;
+}
+
+/**
+ * Append the first length bytes of a spool file as one record
+ *
+ * Waits like postlog_append(). The caller still owns spool_fd.
+ */
+int postlog_append_spool(struct postlog *log, int spool_fd, int length)
+{
+    return append_record(log, NULL, spool_fd, length);
+}
@@ -0,0 +1,33 @@
+#ifndef _POSTLOG_H_
+#define _POSTLOG_H_
+
+#include <pthread.h>
+
+// A single pending append, owned by the thread waiting on it
+struct postlog_record {
+    void *data;
+    int length;
+    int spool_fd; // Copy length bytes from this file instead of data, or -1
+    int status; // 0 while pending, 1 once durable, -1 on write error
+    struct postlog_record *next;
+};
+
+// Append-only log with a dedicated group-commit writer thread
+struct postlog {
+    int fd;
+    char *dir; // Directory of the log, spool files are created there
+    int running;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t pending; // Signalled when records are queued
+    pthread_cond_t committed; // Broadcast after every batch
+    struct postlog_record *head, *tail; // Queue of records not yet written
+};
+
+extern struct postlog *postlog_open(char *path);
+extern void postlog_close(struct postlog *log);
+extern int postlog_append(struct postlog *log, void *data, int length);
+extern int postlog_spool_open(struct postlog *log);
+extern int postlog_append_spool(struct postlog *log, int spool_fd, int length);
+
+#endif
@@ -0,0 +1,1011 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include "net.h"
+#include "conn.h"
+#include "request.h"
+#include "response.h"
+#include "h2.h"
+#include "config.h"
+#include "urlpath.h"
+#include "scan.h"
+#include "cache.h"
+#include "respcache.h"
+#include "proxy.h"
+#ifdef USE_TLS
+#include "tls.h"
+#endif
+
+#define PROXY_HEAD_MAX (REQUEST_HEADER_MAX + 1024) // Room for the client's headers and ours
+
+// Headers about one connection rather than the message, never passed on
+static char *hop_headers[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer",
+    "Transfer-Encoding", "Upgrade", "HTTP2-Settings", NULL
+};
+
+/**
+ * Return true if a "Name: value" line is the named header
+ */
+static int header_is(char *line, char *name)
+{
+    size_t len = strlen(name);
+
+    return strnlen(line, len + 1) > len && line[len] == ':' && scan_caseeq(line, name, len);
+}
+
+/**
+ * Return true if a header line is hop-by-hop
+ */
+static int is_hop_header(char *line)
+{
+    for (int i = 0; hop_headers[i] != NULL; i++)
+    {
+        if (header_is(line, hop_headers[i]))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * printf() onto the end of a head being built
+ *
+ * Once it overflows *len stays past size, for the caller to check at the
+ * end.
+ */
+static void add(char *head, int size, int *len, char *fmt, ...)
+{
+    va_list ap;
+
+    if (*len >= size)
+    {
+        return;
+    }
+
+    va_start(ap, fmt);
+    *len += vsnprintf(head + *len, size - *len, fmt, ap);
+    va_end(ap);
+}
+
+/**
+ * Set up an upstream from its config section, resolving its servers
+ *
+ * Returns NULL on error.
+ */
+struct upstream *upstream_create(struct config_upstream *config)
+{
+    struct upstream *u = calloc(1, sizeof *u);
+    char servers[CONFIG_PATH_MAX], *save = NULL;
+
+    if (u == NULL)
+    {
+        return NULL;
+    }
+
+    u->name = config->name;
+    u->prefix = config->prefix;
+    u->balance = strcmp(config->balance, "least_conn") == 0 ? PROXY_LEAST_CONN : PROXY_ROUND_ROBIN;
+    u->health_check = config->health_check;
+    u->health_interval = config->health_interval;
+    u->pool_size = config->pool_size < PROXY_POOL_MAX ? config->pool_size : PROXY_POOL_MAX;
+    u->timeout = config->timeout;
+
+    strcpy(servers, config->servers);
+
+    for (char *address = strtok_r(servers, " \t", &save); address != NULL; address = strtok_r(NULL, " \t", &save))
+    {
+        struct addrinfo hints, *ai;
+        char host[256];
+        char *colon = strrchr(address, ':');
+
+        if (u->server_count == PROXY_SERVERS_MAX)
+        {
+            fprintf(stderr, "proxy: %s has more than %d servers\n", u->name, PROXY_SERVERS_MAX);
+            free(u);
+            return NULL;
+        }
+
+        // HOST:PORT, with brackets around an IPv6 host
+        if (colon == NULL || colon == address || colon - address >= (int)sizeof host)
+        {
+            fprintf(stderr, "proxy: %s: expected host:port, not %s\n", u->name, address);
+            free(u);
+            return NULL;
+        }
+        int host_len = colon - address;
+        char *host_start = address;
+        if (host_start[0] == '[' && colon[-1] == ']')
+        {
+            host_start++;
+            host_len -= 2;
+        }
+        memcpy(host, host_start, host_len);
+        host[host_len] = '\0';
+
+        memset(&hints, 0, sizeof hints);
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+
+        int rv = getaddrinfo(host, colon + 1, &hints, &ai);
+        if (rv != 0)
+        {
+            fprintf(stderr, "proxy: %s: %s: %s\n", u->name, address, gai_strerror(rv));
+            free(u);
+            return NULL;
+        }
+
+        struct upstream_server *srv = &u->servers[u->server_count++];
+
+        srv->address = strdup(address);
+        memcpy(&srv->addr, ai->ai_addr, ai->ai_addrlen);
+        srv->addr_len = ai->ai_addrlen;
+        srv->healthy = 1;
+        pthread_mutex_init(&srv->lock, NULL);
+        freeaddrinfo(ai);
+    }
+
+    return u;
+}
+
+/**
+ * Close every idle connection to a server
+ */
+static void flush_idle(struct upstream_server *srv)
+{
+    pthread_mutex_lock(&srv->lock);
+    while (srv->idle_count > 0)
+    {
+        close(srv->idle[--srv->idle_count]);
+    }
+    pthread_mutex_unlock(&srv->lock);
+}
+
+/**
+ * Mark a server up or down, saying so when that changes
+ */
+static void set_health(struct upstream *u, struct upstream_server *srv, int healthy, char *why)
+{
+    if (__atomic_exchange_n(&srv->healthy, healthy, __ATOMIC_RELAXED) != healthy)
+    {
+        fprintf(stderr, "proxy: %s server %s is %s%s%s\n", u->name, srv->address, healthy ? "up" : "down",
+                why != NULL ? ": " : "", why != NULL ? why : "");
+
+        if (!healthy)
+        {
+            flush_idle(srv);
+        }
+    }
+}
+
+/**
+ * Connect to a server, giving up after the upstream's timeout
+ *
+ * Reads and writes on the connection time out the same. Returns the
+ * socket, or -1 with errno set.
+ */
+static int connect_server(struct upstream *u, struct upstream_server *srv)
+{
+    int fd = socket(srv->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    int err = 0, one = 1;
+    socklen_t err_len = sizeof err;
+    struct timeval tv = { u->timeout, 0 };
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&srv->addr, srv->addr_len) < 0)
+    {
+        struct pollfd pfd = { fd, POLLOUT, 0 };
+        int rv;
+
+        if (errno != EINPROGRESS)
+        {
+            err = errno;
+        }
+        else
+        {
+            do
+            {
+                rv = poll(&pfd, 1, u->timeout * 1000);
+            } while (rv < 0 && errno == EINTR);
+
+            if (rv == 0)
+            {
+                err = ETIMEDOUT;
+            }
+            else if (rv < 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0)
+            {
+                err = errno;
+            }
+        }
+
+        if (err != 0)
+        {
+            close(fd);
+            errno = err;
+            return -1;
+        }
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+
+    return fd;
+}
+
+/**
+ * Take an idle connection to a server from its pool
+ *
+ * Ones the server has closed meanwhile are thrown away. Returns -1 if
+ * none is left.
+ */
+static int take_idle(struct upstream_server *srv)
+{
+    for (;;)
+    {
+        pthread_mutex_lock(&srv->lock);
+        int fd = srv->idle_count > 0 ? srv->idle[--srv->idle_count] : -1;
+        pthread_mutex_unlock(&srv->lock);
+
+        if (fd < 0)
+        {
+            return -1;
+        }
+
+        // An idle connection has nothing to read: EOF or stray bytes
+        // mean it's no use
+        char c;
+        if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return fd;
+        }
+        close(fd);
+    }
+}
+
+/**
+ * Give a connection back to its server's pool, or close it if full
+ */
+static void put_idle(struct upstream *u, struct upstream_server *srv, int fd)
+{
+    pthread_mutex_lock(&srv->lock);
+    if (srv->idle_count < u->pool_size && __atomic_load_n(&srv->healthy, __ATOMIC_RELAXED))
+    {
+        srv->idle[srv->idle_count++] = fd;
+        fd = -1;
+    }
+    pthread_mutex_unlock(&srv->lock);
+
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+/**
+ * Pick the server for a request, skipping those in tried
+ *
+ * Round robin takes the next healthy server in turn, least connections
+ * the healthy one serving the fewest requests, ties going round. If none
+ * is healthy any untried one is tried anyway, so a request during an
+ * outage finds out at once when a server comes back.
+ * Returns NULL when every server has been tried.
+ */
+static struct upstream_server *pick_server(struct upstream *u, unsigned long tried)
+{
+    struct upstream_server *best = NULL;
+    unsigned int start = __atomic_fetch_add(&u->turn, 1, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < u->server_count; i++)
+    {
+        int index = (start + i) % u->server_count;
+        struct upstream_server *srv = &u->servers[index];
+
+        if ((tried & (1UL << index)) || !__atomic_load_n(&srv->healthy, __ATOMIC_RELAXED))
+        {
+            continue;
+        }
+
+        if (u->balance == PROXY_ROUND_ROBIN)
+        {
+            return srv;
+        }
+        if (best == NULL || __atomic_load_n(&srv->active, __ATOMIC_RELAXED) < __atomic_load_n(&best->active, __ATOMIC_RELAXED))
+        {
+            best = srv;
+        }
+    }
+
+    for (int i = 0; best == NULL && i < u->server_count; i++)
+    {
+        int index = (start + i) % u->server_count;
+
+        if (!(tried & (1UL << index)))
+        {
+            best = &u->servers[index];
+        }
+    }
+
+    return best;
+}
+
+/**
+ * Build the head of the request passed on to a server
+ *
+ * The client's headers go along, but for hop-by-hop ones and the body
+ * framing, which is set here: Content-Length if length isn't negative,
+ * else chunked if set, else none. X-Forwarded-For and -Proto say who
+ * asked, and how. Returns the length, or -1 if it doesn't fit.
+ */
+static int request_head(struct upstream_server *srv, struct request *req, char *head, int size,
+                        long long length, int chunked)
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len = sizeof addr;
+    char client[INET6_ADDRSTRLEN] = "unknown";
+    char *proto = "http";
+    char *forwarded_for = NULL;
+    char path[3 * sizeof req->path];
+    int has_host = 0, len = 0;
+
+    if (getpeername(req->fd, (struct sockaddr *)&addr, &addr_len) == 0 &&
+        (addr.ss_family == AF_INET || addr.ss_family == AF_INET6))
+    {
+        inet_ntop(addr.ss_family, get_in_addr((struct sockaddr *)&addr), client, sizeof client);
+    }
+#ifdef USE_TLS
+    if (tls_active(req->fd))
+    {
+        proto = "https";
+    }
+#endif
+
+    // The path was decoded, see urlpath_normalize()
+    if (urlpath_encode(path, sizeof path, req->path) < 0)
+    {
+        return -1;
+    }
+    add(head, size, &len, "%s %s HTTP/1.1\r\n", req->method, path);
+
+    for (char *line = req->headers; line != NULL && *line != '\0'; line += strlen(line) + 1)
+    {
+        if (is_hop_header(line) || header_is(line, "Content-Length") || header_is(line, "Expect") ||
+            header_is(line, "X-Forwarded-Proto"))
+        {
+            continue;
+        }
+        if (header_is(line, "X-Forwarded-For"))
+        {
+            forwarded_for = line + strlen("X-Forwarded-For:") + strspn(line + strlen("X-Forwarded-For:"), " \t");
+            continue;
+        }
+        has_host |= header_is(line, "Host");
+
+        add(head, size, &len, "%s\r\n", line);
+    }
+
+    if (!has_host)
+    {
+        add(head, size, &len, "Host: %s\r\n", srv->address);
+    }
+    if (forwarded_for != NULL)
+    {
+        add(head, size, &len, "X-Forwarded-For: %s, %s\r\n", forwarded_for, client);
+    }
+    else
+    {
+        add(head, size, &len, "X-Forwarded-For: %s\r\n", client);
+    }
+    add(head, size, &len, "X-Forwarded-Proto: %s\r\n", proto);
+
+    if (length >= 0)
+    {
+        add(head, size, &len, "Content-Length: %lld\r\n", length);
+    }
+    else if (chunked)
+    {
+        add(head, size, &len, "Transfer-Encoding: chunked\r\n");
+    }
+    add(head, size, &len, "\r\n");
+
+    return len < size ? len : -1;
+}
+
+/**
+ * Build the head of a server's response for an HTTP/1.1 client
+ *
+ * Its headers go along but for hop-by-hop ones. Our connection to the
+ * client closes after the response, and chunked bodies stay chunked.
+ * Returns the length, or -1 if it doesn't fit.
+ */
+static int response_head(struct request *resp, char *head, int size)
+{
+    int len = 0;
+
+    add(head, size, &len, "HTTP/1.1%s\r\n", resp->path + 8);
+
+    for (char *line = resp->headers; *line != '\0'; line += strlen(line) + 1)
+    {
+        if (is_hop_header(line) || (resp->chunked && header_is(line, "Content-Length")))
+        {
+            continue;
+        }
+        add(head, size, &len, "%s\r\n", line);
+    }
+
+    add(head, size, &len, "Connection: close\r\n");
+    if (resp->chunked)
+    {
+        add(head, size, &len, "Transfer-Encoding: chunked\r\n");
+    }
+    add(head, size, &len, "\r\n");
+
+    return len < size ? len : -1;
+}
+
+/**
+ * Send data, as one chunk if chunked is set, then the last chunk if
+ * last is set
+ */
+static int send_body(int fd, void *data, int len, int chunked, int last)
+{
+    struct iovec iov[4];
+    char size_line[20];
+    int iovcnt = 0;
+
+    if (chunked && len > 0)
+    {
+        iov[iovcnt].iov_base = size_line;
+        iov[iovcnt++].iov_len = snprintf(size_line, sizeof size_line, "%x\r\n", len);
+    }
+    if (len > 0)
+    {
+        iov[iovcnt].iov_base = data;
+        iov[iovcnt++].iov_len = len;
+    }
+    if (chunked && len > 0)
+    {
+        iov[iovcnt].iov_base = "\r\n";
+        iov[iovcnt++].iov_len = 2;
+    }
+    if (chunked && last)
+    {
+        iov[iovcnt].iov_base = "0\r\n\r\n";
+        iov[iovcnt++].iov_len = 5;
+    }
+
+    return iovcnt == 0 || net_send_iov(fd, iov, iovcnt) >= 0 ? 0 : -1;
+}
+
+/**
+ * Return true if a comma-separated header value has the token
+ */
+static int has_token(char *value, char *token)
+{
+    size_t len = strlen(token);
+
+    for (char *p = value; p != NULL && *p != '\0'; p = strchr(p, ','), p = p ? p + 1 : NULL)
+    {
+        p += strspn(p, " \t");
+        if (strncasecmp(p, token, len) == 0 && (p[len] == '\0' || p[len] == ',' || p[len] == ' '))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// A copy of a response body kept for the cache while it is relayed
+struct stored {
+    struct cache *cache; // NULL to keep nothing
+    long long max; // Largest body kept
+    char *data; // NULL while nothing is being kept
+    int len;
+    int size;
+};
+
+/**
+ * Start keeping a copy of a response, if the cache may answer later
+ * requests with it
+ *
+ * Only 200 responses to GETs that say how long they keep are stored,
+ * and none that are a client's own: to a request with Authorization, or
+ * setting a cookie. Returns the seconds it keeps, or -1.
+ */
+static int store_begin(struct stored *stored, struct request *req, struct request *resp, int status)
+{
+    stored->data = NULL;
+    stored->len = 0;
+
+    if (stored->cache == NULL || status != 200 || strcmp(req->method, "GET") != 0 ||
+        request_header(req, "Authorization") != NULL || request_header(resp, "Set-Cookie") != NULL ||
+        resp->content_length > stored->max)
+    {
+        return -1;
+    }
+
+    int lifetime = respcache_lifetime(request_header(resp, "Cache-Control"));
+    if (lifetime < 0)
+    {
+        return -1;
+    }
+
+    stored->size = resp->content_length > 0 ? resp->content_length : REQUEST_BODY_CHUNK;
+    stored->data = malloc(stored->size);
+
+    return stored->data != NULL ? lifetime : -1;
+}
+
+/**
+ * Add relayed body bytes to the copy, giving it up if it grows too big
+ */
+static void store_append(struct stored *stored, void *data, int len)
+{
+    if (stored->data == NULL)
+    {
+        return;
+    }
+
+    if (stored->len + len > stored->max)
+    {
+        free(stored->data);
+        stored->data = NULL;
+        return;
+    }
+
+    if (stored->len + len > stored->size)
+    {
+        int size = stored->size * 2;
+        while (size < stored->len + len)
+        {
+            size *= 2;
+        }
+
+        char *data = realloc(stored->data, size);
+        if (data == NULL)
+        {
+            free(stored->data);
+            stored->data = NULL;
+            return;
+        }
+        stored->data = data;
+        stored->size = size;
+    }
+
+    memcpy(stored->data + stored->len, data, len);
+    stored->len += len;
+}
+
+/**
+ * Put the kept copy of a response in the cache, with the server's
+ * headers but for ones about the connection or this one sending
+ *
+ * head is free by now, the headers are built there.
+ */
+static void store_finish(struct stored *stored, struct request *req, struct request *resp, int lifetime,
+                         char *head)
+{
+    int len = 0;
+
+    head[0] = '\0';
+    for (char *line = resp->headers; *line != '\0'; line += strlen(line) + 1)
+    {
+        if (is_hop_header(line) || header_is(line, "Content-Length") || header_is(line, "Content-Type") ||
+            header_is(line, "Date") || header_is(line, "Age"))
+        {
+            continue;
+        }
+        add(head, PROXY_HEAD_MAX, &len, "%s\r\n", line);
+    }
+
+    if (len < PROXY_HEAD_MAX)
+    {
+        respcache_put(stored->cache, req, request_header(resp, "Content-Type"), head, request_header(resp, "Vary"),
+                      stored->data, stored->len, lifetime);
+    }
+}
+
+/**
+ * Pass the server's response back to the client
+ *
+ * Returns 0 if all of it got through, -1 if either side failed.
+ */
+static int relay_response(struct request *req, struct request *resp, int status, int head_request, char *head,
+                          char *body, struct stored *stored)
+{
+    int bodyless = head_request || request_body_done(resp) || resp->content_length == 0;
+    int n;
+
+    if (req->h2 != NULL)
+    {
+        // HTTP/2 carries the status, type and length; other headers stay behind
+        char *cl = request_header(resp, "Content-Length");
+        long long length = head_request ? (cl != NULL ? atoll(cl) : -1) : resp->content_length;
+
+        if (h2_send_headers(req->h2, status, request_header(resp, "Content-Type"), length, NULL, bodyless) < 0)
+        {
+            return -1;
+        }
+        if (bodyless)
+        {
+            return 0;
+        }
+        while ((n = request_body_read(resp, body, REQUEST_BODY_CHUNK)) > 0)
+        {
+            store_append(stored, body, n);
+            if (h2_send_data(req->h2, body, n, 0) < 0)
+            {
+                return -1;
+            }
+        }
+        return n < 0 ? -1 : h2_send_data(req->h2, NULL, 0, 1);
+    }
+
+    // SPLICE a Content-Length body straight through, unless it is being
+    // kept, else copy it here. A head the splice follows waits for it
+    int splice = !bodyless && resp->content_length >= 0 && !resp->chunked && stored->data == NULL;
+    int head_len = response_head(resp, head, PROXY_HEAD_MAX);
+    struct iovec iov = { head, head_len };
+
+    if (head_len < 0 ||
+        (splice && resp->content_length > 0 ? net_send_iov_more(req->fd, &iov, 1) : net_send_iov(req->fd, &iov, 1)) < 0)
+    {
+        return -1;
+    }
+    if (bodyless)
+    {
+        return 0;
+    }
+    if (splice)
+    {
+        return request_body_splice(resp, req->fd) < 0 ? -1 : 0;
+    }
+    while ((n = request_body_read(resp, body, REQUEST_BODY_CHUNK)) > 0)
+    {
+        store_append(stored, body, n);
+        if (send_body(req->fd, body, n, resp->chunked, 0) < 0)
+        {
+            return -1;
+        }
+    }
+
+    return n < 0 ? -1 : send_body(req->fd, NULL, 0, resp->chunked, 1);
+}
+
+// What exchange() made of it
+#define EXCHANGE_DONE 0 // The client got the server's response
+#define EXCHANGE_FAILED -1 // The server failed before responding, errno says how
+#define EXCHANGE_BROKEN -2 // It failed part way through the response, the client has part of it
+#define EXCHANGE_CLIENT -3 // The client's request body couldn't be read
+
+/**
+ * Send a request to a server over fd and relay its response
+ *
+ * body holds first bytes of the request body already read, which the
+ * rest follows; with splice set, it is passed on unread instead. A
+ * response the cache may serve again is stored, in stored->cache. *keep
+ * is set if the connection may carry another request.
+ */
+static int exchange(struct upstream_server *srv, int fd, struct request *req, struct request *resp,
+                    char *head, char *body, int first, int splice, struct stored *stored, int *keep)
+{
+    int head_request = strcmp(req->method, "HEAD") == 0;
+    long long length = splice ? req->content_length : first > 0 ? req->content_length : -1;
+    int chunked = first > 0 && length < 0;
+    int n = first;
+
+    *keep = 0;
+
+    // SEND the head, with the body's first bytes
+    int head_len = request_head(srv, req, head, PROXY_HEAD_MAX, length, chunked);
+    struct iovec iov = { head, head_len };
+
+    if (head_len < 0)
+    {
+        errno = E2BIG;
+        return EXCHANGE_FAILED;
+    }
+    // The body follows at once, so the head waits to share its packets
+    if (((splice && length > 0) || first > 0 ? net_send_iov_more(fd, &iov, 1) : net_send_iov(fd, &iov, 1)) < 0)
+    {
+        return EXCHANGE_FAILED;
+    }
+
+    // THEN the body
+    if (splice)
+    {
+        // Which side failed can't be told apart here
+        if (request_body_splice(req, fd) < 0)
+        {
+            return EXCHANGE_FAILED;
+        }
+    }
+    else if (first > 0)
+    {
+        do
+        {
+            if (send_body(fd, body, n, chunked, 0) < 0)
+            {
+                return EXCHANGE_FAILED;
+            }
+        } while ((n = request_body_read(req, body, REQUEST_BODY_CHUNK)) > 0);
+
+        if (n < 0)
+        {
+            return EXCHANGE_CLIENT;
+        }
+        if (send_body(fd, NULL, 0, chunked, 1) < 0)
+        {
+            return EXCHANGE_FAILED;
+        }
+    }
+
+    // READ the response head; the client's deadline mustn't run out
+    // while the server is the one being slow
+    conn_progress(req->fd, CONN_READ);
+
+    int status = request_read_response(resp, fd, head_request);
+    if (status < 0)
+    {
+        if (status == REQUEST_ERR_MALFORMED || status == REQUEST_ERR_TOO_LARGE)
+        {
+            errno = EPROTO;
+        }
+        else if (errno != EAGAIN && errno != EWOULDBLOCK)
+        {
+            errno = ECONNRESET;
+        }
+        return EXCHANGE_FAILED;
+    }
+
+    int framed = resp->content_length >= 0 || resp->chunked || request_body_done(resp);
+    int lifetime = store_begin(stored, req, resp, status);
+
+    if (relay_response(req, resp, status, head_request, head, body, stored) < 0)
+    {
+        free(stored->data);
+        return EXCHANGE_BROKEN;
+    }
+
+    // STORE it, if all of it was kept
+    if (lifetime >= 0 && stored->data != NULL)
+    {
+        store_finish(stored, req, resp, lifetime, head);
+    }
+    free(stored->data);
+
+    *keep = framed && request_body_done(resp) && strncmp(resp->path, "HTTP/1.1", 8) == 0 &&
+            !has_token(request_header(resp, "Connection"), "close");
+
+    return EXCHANGE_DONE;
+}
+
+/**
+ * Pass a request on to one of an upstream's servers, and its response
+ * back
+ *
+ * A pooled connection is used if there is one. If the server can't be
+ * reached the next one is tried, and it is marked down until a health
+ * check passes. A reused connection that turns out to have been closed
+ * is retried on a fresh one, as long as no request body was sent.
+ * Clients get a 502 if no server responds, or a 504 on a timeout.
+ *
+ * cache is the host's, where responses that allow it are stored and
+ * answered from; NULL to store none.
+ */
+void proxy_request(struct upstream *u, struct request *req, struct cache *cache)
+{
+    struct stored stored = { cache, u->store_max, NULL, 0, 0 };
+
+    // IF a stored response will do THEN no server is bothered
+    if (cache != NULL && respcache_serve(cache, req))
+    {
+        return;
+    }
+
+    struct request *resp = malloc(sizeof *resp);
+    char *head = malloc(PROXY_HEAD_MAX);
+    char body[REQUEST_BODY_CHUNK];
+    unsigned long tried = 0;
+    int first = 0, retried = 0, rv = EXCHANGE_FAILED;
+
+    if (resp == NULL || head == NULL)
+    {
+        send_response(req, "HTTP/1.1 500 INTERNAL SERVER ERROR", "text/plain", "", 0);
+        free(resp);
+        free(head);
+        return;
+    }
+
+    // A plain HTTP/1.1 Content-Length body is spliced across unread,
+    // otherwise the first of it is read now, which says if there is any
+    int splice = req->h2 == NULL && !req->chunked && req->content_length > 0;
+
+    if (!splice && (first = request_body_read(req, body, sizeof body)) < 0)
+    {
+        if (first == REQUEST_ERR_TOO_LARGE)
+        {
+            send_response(req, "HTTP/1.1 413 PAYLOAD TOO LARGE", "text/plain", "", 0);
+        }
+        free(resp);
+        free(head);
+        return;
+    }
+
+    for (;;)
+    {
+        struct upstream_server *srv = pick_server(u, tried);
+
+        if (srv == NULL)
+        {
+            break;
+        }
+
+        int fd = take_idle(srv);
+        int reused = fd >= 0;
+
+        if (fd < 0 && (fd = connect_server(u, srv)) < 0)
+        {
+            set_health(u, srv, 0, strerror(errno));
+            tried |= 1UL << (srv - u->servers);
+            continue;
+        }
+
+        int keep;
+        __atomic_add_fetch(&srv->active, 1, __ATOMIC_RELAXED);
+        rv = exchange(srv, fd, req, resp, head, body, first, splice, &stored, &keep);
+        __atomic_sub_fetch(&srv->active, 1, __ATOMIC_RELAXED);
+
+        int err = errno;
+        if (keep)
+        {
+            put_idle(u, srv, fd);
+        }
+        else
+        {
+            close(fd);
+        }
+
+        // RETRY a stale pooled connection, if nothing was used up yet
+        if (rv == EXCHANGE_FAILED && reused && !retried && !splice && first == 0 &&
+            (err == ECONNRESET || err == EPIPE))
+        {
+            retried = 1;
+            continue;
+        }
+
+        if (rv == EXCHANGE_FAILED)
+        {
+            fprintf(stderr, "proxy: %s server %s failed: %s\n", u->name, srv->address, strerror(err));
+            errno = err;
+        }
+        break;
+    }
+
+    if (rv == EXCHANGE_FAILED)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ETIMEDOUT)
+        {
+            send_response(req, "HTTP/1.1 504 GATEWAY TIMEOUT", "text/plain", "", 0);
+        }
+        else
+        {
+            send_response(req, "HTTP/1.1 502 BAD GATEWAY", "text/plain", "", 0);
+        }
+    }
+
+    free(resp);
+    free(head);
+}
+
+/**
+ * See whether a server is up: it takes a connection and, if the upstream
+ * has a health_check path, answers a GET for it with a 2xx or 3xx
+ *
+ * Returns NULL if it is, else what is wrong.
+ */
+static char *check_server(struct upstream *u, struct upstream_server *srv)
+{
+    char buf[256];
+    int fd = connect_server(u, srv), len = 0, n;
+
+    if (fd < 0)
+    {
+        return strerror(errno);
+    }
+    if (u->health_check[0] == '\0')
+    {
+        close(fd);
+        return NULL;
+    }
+
+    len = snprintf(buf, sizeof buf, "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
+                   u->health_check, srv->address);
+    if (len >= (int)sizeof buf || send(fd, buf, len, MSG_NOSIGNAL) != len)
+    {
+        close(fd);
+        return "health check not sent";
+    }
+
+    // The status line is all that matters
+    len = 0;
+    while (len < 12 && (n = recv(fd, buf + len, sizeof buf - 1 - len, 0)) > 0)
+    {
+        len += n;
+    }
+    close(fd);
+    buf[len] = '\0';
+
+    if (len < 12 || strncmp(buf, "HTTP/1.", 7) != 0)
+    {
+        return "no answer to the health check";
+    }
+    if (buf[9] != '2' && buf[9] != '3')
+    {
+        return "health check failed";
+    }
+
+    return NULL;
+}
+
+/**
+ * Thread checking an upstream's servers every health_interval seconds
+ */
+static void *check_thread(void *arg)
+{
+    struct upstream *u = arg;
+
+    for (;;)
+    {
+        sleep(u->health_interval);
+
+        for (int i = 0; i < u->server_count; i++)
+        {
+            char *problem = check_server(u, &u->servers[i]);
+            set_health(u, &u->servers[i], problem == NULL, problem);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Start checking an upstream's servers' health in the background
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int upstream_start_checks(struct upstream *u)
+{
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, check_thread, u) != 0)
+    {
+        perror("upstream_start_checks");
+        return -1;
+    }
+    pthread_detach(thread);
+
+    return 0;
+}
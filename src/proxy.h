@@ -0,0 +1,50 @@
+#ifndef _PROXY_H_
+#define _PROXY_H_
+
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define PROXY_SERVERS_MAX 32 // Servers per upstream
+#define PROXY_POOL_MAX 64 // Idle connections kept per server, at most
+
+// How an upstream picks a server
+#define PROXY_ROUND_ROBIN 0
+#define PROXY_LEAST_CONN 1
+
+struct request;
+struct cache;
+struct config_upstream;
+
+// One server of an upstream, with its idle keep-alive connections
+struct upstream_server {
+    char *address; // host:port as configured
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int healthy; // Cleared when a connect or a check fails, set when a check passes
+    int active; // Requests it is serving now
+    pthread_mutex_t lock; // idle
+    int idle[PROXY_POOL_MAX]; // Most recently used last
+    int idle_count;
+};
+
+// A path prefix whose requests are passed on to a group of servers
+struct upstream {
+    char *name;
+    char *prefix;
+    int balance; // PROXY_ROUND_ROBIN or PROXY_LEAST_CONN
+    char *health_check; // Path to GET, "" to only connect
+    int health_interval; // Seconds
+    int pool_size;
+    int timeout; // Seconds
+    long long store_max; // Largest response body kept in a host's cache
+    unsigned int turn; // Round robin position
+    struct upstream_server servers[PROXY_SERVERS_MAX];
+    int server_count;
+    struct upstream *next; // All upstreams, in the order configured
+};
+
+extern struct upstream *upstream_create(struct config_upstream *config);
+extern int upstream_start_checks(struct upstream *upstream);
+extern void proxy_request(struct upstream *upstream, struct request *req, struct cache *cache);
+
+#endif
@@ -0,0 +1,257 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+#include "hashtable.h"
+#include "ratelimit.h"
+
+#define RATELIMIT_BUCKETS 4096
+#define RATELIMIT_SWEEP_MIN 1024 // Clients tracked before idle ones are swept
+
+/**
+ * Seconds on the monotonic clock
+ */
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Turn a client address into its hashtable key
+ *
+ * IPv6 clients are keyed by their /64, which is what one host usually
+ * gets to pick addresses from. IPv4-mapped addresses count as IPv4.
+ * Returns the key size, or 0 for loopback if it is exempt.
+ */
+static int client_key(struct ratelimit *rl, struct sockaddr *addr, unsigned char *key)
+{
+    if (addr->sa_family == AF_INET6)
+    {
+        struct in6_addr *a = &((struct sockaddr_in6 *)addr)->sin6_addr;
+
+        if (IN6_IS_ADDR_V4MAPPED(a))
+        {
+            memcpy(key, a->s6_addr + 12, 4);
+        }
+        else
+        {
+            if (rl->exempt_loopback && IN6_IS_ADDR_LOOPBACK(a))
+            {
+                return 0;
+            }
+            memcpy(key, a->s6_addr, 8);
+            return 8;
+        }
+    }
+    else
+    {
+        memcpy(key, &((struct sockaddr_in *)addr)->sin_addr, 4);
+    }
+
+    // 127.0.0.0/8
+    return rl->exempt_loopback && key[0] == 127 ? 0 : 4;
+}
+
+/**
+ * Create a rate limiter
+ *
+ * rate:      connections per second each client may open on average, 0 for
+ *            no limit
+ * burst:     connections a client may open at once after being idle
+ * max_conns: connections each client may have open, 0 for no cap
+ */
+struct ratelimit *ratelimit_create(double rate, double burst, int max_conns, int exempt_loopback)
+{
+    struct ratelimit *rl = calloc(1, sizeof *rl);
+
+    if (rl == NULL)
+    {
+        return NULL;
+    }
+
+    rl->rate = rate;
+    rl->burst = burst;
+    rl->max_conns = max_conns;
+    rl->exempt_loopback = exempt_loopback;
+    rl->clients = hashtable_create(RATELIMIT_BUCKETS, NULL);
+    rl->sweep_at = RATELIMIT_SWEEP_MIN;
+    pthread_mutex_init(&rl->lock, NULL);
+
+    return rl;
+}
+
+/**
+ * Free a rate limiter
+ */
+void ratelimit_free(struct ratelimit *rl)
+{
+    struct ratelimit_client *c = rl->head;
+
+    while (c != NULL)
+    {
+        struct ratelimit_client *next = c->next;
+        free(c);
+        c = next;
+    }
+
+    hashtable_destroy(rl->clients);
+    pthread_mutex_destroy(&rl->lock);
+    free(rl);
+}
+
+/**
+ * Change a rate limiter's limits while it is in use
+ *
+ * Clients keep the tokens they have, up to the new burst.
+ */
+void ratelimit_configure(struct ratelimit *rl, double rate, double burst, int max_conns)
+{
+    pthread_mutex_lock(&rl->lock);
+    rl->rate = rate;
+    rl->burst = burst;
+    rl->max_conns = max_conns;
+    pthread_mutex_unlock(&rl->lock);
+}
+
+/**
+ * Refill a client's bucket for the time since it was last updated
+ */
+static void refill(struct ratelimit *rl, struct ratelimit_client *c, double t)
+{
+    c->tokens += (t - c->updated) * rl->rate;
+    if (c->tokens > rl->burst)
+    {
+        c->tokens = rl->burst;
+    }
+    c->updated = t;
+}
+
+/**
+ * Forget clients with nothing open and a full bucket, they are no
+ * different from clients never seen
+ *
+ * Called with the lock held. The threshold doubles with the number of
+ * clients kept, so sweeping costs O(1) per new client.
+ */
+static void sweep(struct ratelimit *rl, double t)
+{
+    struct ratelimit_client **p = &rl->head;
+
+    while (*p != NULL)
+    {
+        struct ratelimit_client *c = *p;
+
+        refill(rl, c, t);
+
+        if (c->conns == 0 && c->tokens >= rl->burst)
+        {
+            *p = c->next;
+            hashtable_delete_bin(rl->clients, c->key, c->key_size);
+            free(c);
+            rl->count--;
+        }
+        else
+        {
+            p = &c->next;
+        }
+    }
+
+    rl->sweep_at = rl->count * 2 > RATELIMIT_SWEEP_MIN ? rl->count * 2 : RATELIMIT_SWEEP_MIN;
+}
+
+/**
+ * Take a token and a connection slot for a new connection from addr
+ *
+ * Returns RATELIMIT_OK, in which case ratelimit_release() must be called
+ * when the connection closes, or why the connection should be refused.
+ */
+int ratelimit_acquire(struct ratelimit *rl, struct sockaddr *addr)
+{
+    unsigned char key[16];
+    int key_size = client_key(rl, addr, key);
+    int rv = RATELIMIT_OK;
+    double t = now();
+
+    if (key_size == 0)
+    {
+        return RATELIMIT_OK;
+    }
+
+    pthread_mutex_lock(&rl->lock);
+
+    struct ratelimit_client *c = hashtable_get_bin(rl->clients, key, key_size);
+
+    if (c == NULL)
+    {
+        if (rl->count >= rl->sweep_at)
+        {
+            sweep(rl, t);
+        }
+
+        c = calloc(1, sizeof *c);
+        if (c == NULL)
+        {
+            pthread_mutex_unlock(&rl->lock);
+            return RATELIMIT_OK;
+        }
+
+        memcpy(c->key, key, key_size);
+        c->key_size = key_size;
+        c->tokens = rl->burst;
+        c->updated = t;
+        c->next = rl->head;
+        rl->head = c;
+        rl->count++;
+        hashtable_put_bin(rl->clients, c->key, key_size, c);
+    }
+
+    refill(rl, c, t);
+
+    if (rl->max_conns > 0 && c->conns >= rl->max_conns)
+    {
+        rv = RATELIMIT_CONNS;
+    }
+    else if (rl->rate > 0 && c->tokens < 1)
+    {
+        rv = RATELIMIT_RATE;
+    }
+    else
+    {
+        if (rl->rate > 0)
+        {
+            c->tokens -= 1;
+        }
+        c->conns++;
+    }
+
+    pthread_mutex_unlock(&rl->lock);
+
+    return rv;
+}
+
+/**
+ * Give back the connection slot taken by ratelimit_acquire()
+ */
+void ratelimit_release(struct ratelimit *rl, struct sockaddr *addr)
+{
+    unsigned char key[16];
+    int key_size = client_key(rl, addr, key);
+
+    if (key_size == 0)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&rl->lock);
+
+    struct ratelimit_client *c = hashtable_get_bin(rl->clients, key, key_size);
+
+    if (c != NULL && c->conns > 0)
+    {
+        c->conns--;
+    }
+
+    pthread_mutex_unlock(&rl->lock);
+}
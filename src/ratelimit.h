@@ -0,0 +1,41 @@
+#ifndef _RATELIMIT_H_
+#define _RATELIMIT_H_
+
+#include <pthread.h>
+#include <sys/socket.h>
+
+#define RATELIMIT_OK 0
+#define RATELIMIT_RATE 1 // Client is out of tokens
+#define RATELIMIT_CONNS 2 // Client has too many connections open
+
+// What we know about one client address
+struct ratelimit_client {
+    unsigned char key[16]; // IPv4 address, or the /64 of an IPv6 one
+    int key_size;
+    double tokens; // Connections the client may still open right away
+    double updated; // When tokens was last brought up to date, in seconds
+    int conns; // Connections open now
+    struct ratelimit_client *next; // All clients, for sweeping out idle ones
+};
+
+// Token bucket and connection cap per client address
+struct ratelimit {
+    double rate; // Tokens added per second, 0 for no limit
+    double burst; // Bucket size
+    int max_conns; // Concurrent connections per client, 0 for no cap
+    int exempt_loopback; // Don't limit connections from this host
+
+    pthread_mutex_t lock;
+    struct hashtable *clients; // Key to struct ratelimit_client
+    struct ratelimit_client *head;
+    int count;
+    int sweep_at; // Sweep idle clients out once count reaches this
+};
+
+extern struct ratelimit *ratelimit_create(double rate, double burst, int max_conns, int exempt_loopback);
+extern void ratelimit_free(struct ratelimit *rl);
+extern void ratelimit_configure(struct ratelimit *rl, double rate, double burst, int max_conns);
+extern int ratelimit_acquire(struct ratelimit *rl, struct sockaddr *addr);
+extern void ratelimit_release(struct ratelimit *rl, struct sockaddr *addr);
+
+#endif
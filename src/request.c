@@ -0,0 +1,672 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include "net.h"
+#include "scan.h"
+#include "request.h"
+#include "h2.h"
+
+#define CHUNK_LINE_MAX 4096 // Longest chunk-size or trailer line we accept
+
+// Body reader states
+enum {
+    BODY_DONE,
+    BODY_LENGTH,      // Content-Length body
+    BODY_CHUNK_SIZE,  // Waiting for a chunk-size line
+    BODY_CHUNK_DATA,  // Inside chunk data
+    BODY_CHUNK_CRLF,  // CRLF after chunk data
+    BODY_TRAILERS,    // Trailer section after the last chunk
+    BODY_CLOSE,       // A response body that ends when the server closes
+    BODY_ERROR
+};
+
+/**
+ * Make sure there are unread raw bytes, reading more from the socket
+ *
+ * Returns 0 on success, REQUEST_ERR_CLOSED if the peer went away.
+ */
+static int fill(struct request *req)
+{
+    if (req->in_pos < req->in_end)
+    {
+        return 0;
+    }
+
+    int n = net_recv(req->fd, req->body_buf, sizeof req->body_buf);
+
+    if (n <= 0)
+    {
+        return REQUEST_ERR_CLOSED;
+    }
+
+    req->in_pos = req->body_buf;
+    req->in_end = req->body_buf + n;
+
+    return 0;
+}
+
+/**
+ * Return the next raw body byte, or a REQUEST_ERR_* value
+ */
+static int next_byte(struct request *req)
+{
+    int rv = fill(req);
+
+    if (rv < 0)
+    {
+        return rv;
+    }
+
+    return (unsigned char)*req->in_pos++;
+}
+
+/**
+ * Parse a chunk-size line, ignoring chunk extensions
+ *
+ * Returns the chunk size or a REQUEST_ERR_* value.
+ */
+static long long read_chunk_size(struct request *req)
+{
+    long long size = 0;
+    int digits = 0, c, i;
+
+    for (i = 0; i < CHUNK_LINE_MAX; i++)
+    {
+        if ((c = next_byte(req)) < 0)
+        {
+            return c;
+        }
+
+        if (c == '\n')
+        {
+            return digits > 0 ? size : REQUEST_ERR_MALFORMED;
+        }
+
+        // HEX digits only count before any extension or whitespace
+        if (digits == i && (c >= '0' && c <= '9'))
+        {
+            size = size * 16 + (c - '0');
+        }
+        else if (digits == i && ((c | 0x20) >= 'a' && (c | 0x20) <= 'f'))
+        {
+            size = size * 16 + ((c | 0x20) - 'a' + 10);
+        }
+        else
+        {
+            continue;
+        }
+
+        if (++digits > 15)
+        {
+            return REQUEST_ERR_TOO_LARGE;
+        }
+    }
+
+    return REQUEST_ERR_MALFORMED;
+}
+
+/**
+ * Skip the trailer section, up to and including the final empty line
+ */
+static int skip_trailers(struct request *req)
+{
+    int line_len = 0, total = 0, c;
+
+    while ((c = next_byte(req)) >= 0)
+    {
+        if (++total > CHUNK_LINE_MAX)
+        {
+            return REQUEST_ERR_TOO_LARGE;
+        }
+
+        if (c == '\n')
+        {
+            if (line_len == 0)
+            {
+                return 0;
+            }
+            line_len = 0;
+        }
+        else if (c != '\r')
+        {
+            line_len++;
+        }
+    }
+
+    return c;
+}
+
+/**
+ * Split the header lines, from line on, in place
+ *
+ * They are left as NUL-terminated strings one after another, followed
+ * by an empty string.
+ */
+static int parse_headers(struct request *req, char *line, char *head_end)
+{
+    char *out, *eol, *colon;
+    int len;
+
+    // COMPACT header lines into NUL-terminated strings
+    req->headers = out = line;
+
+    for (; line < head_end; line = eol + 1)
+    {
+        eol = scan_eol(line, head_end, &colon);
+        if (eol == NULL)
+        {
+            eol = head_end;
+        }
+
+        len = eol - line;
+        if (len > 0 && line[len - 1] == '\r')
+        {
+            len--;
+        }
+        if (len == 0)
+        {
+            break;
+        }
+        if (colon == NULL)
+        {
+            return REQUEST_ERR_MALFORMED;
+        }
+
+        memmove(out, line, len);
+        out[len] = '\0';
+        out += len + 1;
+    }
+
+    *out = '\0';
+
+    return 0;
+}
+
+/**
+ * Split the request line and the header lines in place
+ */
+static int parse_head(struct request *req, char *head, char *head_end)
+{
+    char *line = head, *eol;
+    int len;
+
+    // REQUEST line: METHOD SP PATH SP VERSION
+    eol = memchr(line, '\n', head_end - line);
+    char *sp1 = memchr(line, ' ', eol - line);
+    char *sp2 = sp1 ? memchr(sp1 + 1, ' ', eol - sp1 - 1) : NULL;
+
+    if (sp1 == NULL || sp2 == NULL)
+    {
+        return REQUEST_ERR_MALFORMED;
+    }
+
+    len = sp1 - line;
+    if (len == 0 || len >= (int)sizeof req->method)
+    {
+        return REQUEST_ERR_MALFORMED;
+    }
+    memcpy(req->method, line, len);
+    req->method[len] = '\0';
+
+    len = sp2 - sp1 - 1;
+    if (len == 0)
+    {
+        return REQUEST_ERR_MALFORMED;
+    }
+    if (len >= (int)sizeof req->path)
+    {
+        return REQUEST_ERR_TOO_LARGE;
+    }
+    memcpy(req->path, sp1 + 1, len);
+    req->path[len] = '\0';
+
+    return parse_headers(req, eol + 1, head_end);
+}
+
+/**
+ * Work out how the body is framed from Content-Length / Transfer-Encoding
+ */
+static int setup_body(struct request *req)
+{
+    char *te = request_header(req, "Transfer-Encoding");
+    char *cl = request_header(req, "Content-Length");
+
+    req->content_length = -1;
+    req->chunked = 0;
+    req->body_total = 0;
+    req->body_remaining = 0;
+    req->body_state = BODY_DONE;
+
+    if (te != NULL)
+    {
+        // Only "chunked" as the final coding is something we can decode
+        size_t te_len = strlen(te);
+
+        if (te_len < 7 || strcasecmp(te + te_len - 7, "chunked") != 0)
+        {
+            return REQUEST_ERR_MALFORMED;
+        }
+
+        req->chunked = 1;
+        req->body_state = BODY_CHUNK_SIZE;
+
+        // Transfer-Encoding overrides Content-Length
+        return 0;
+    }
+
+    if (cl != NULL)
+    {
+        char *end;
+
+        if (*cl < '0' || *cl > '9')
+        {
+            return REQUEST_ERR_MALFORMED;
+        }
+
+        errno = 0;
+        req->content_length = strtoll(cl, &end, 10);
+        if (errno != 0 || *end != '\0')
+        {
+            return REQUEST_ERR_MALFORMED;
+        }
+        if (req->content_length > req->max_body_size)
+        {
+            return REQUEST_ERR_TOO_LARGE;
+        }
+
+        req->body_remaining = req->content_length;
+        req->body_state = BODY_LENGTH;
+    }
+
+    return 0;
+}
+
+/**
+ * Read up to the blank line that ends the headers
+ *
+ * The first carry bytes of buf were read already. Sets up the reader
+ * for whatever came in past the headers. Returns a pointer to the blank
+ * line, or NULL with *rv set to a REQUEST_ERR_* value.
+ */
+static char *read_head(struct request *req, int fd, long long max_body_size, int carry, int *rv)
+{
+    int len = carry;
+    char *end = scan_head_end(req->buf, len);
+
+    req->fd = fd;
+    req->h2 = NULL;
+    req->max_body_size = max_body_size;
+    req->method[0] = req->path[0] = '\0';
+    req->headers = NULL;
+    req->body_state = BODY_DONE;
+    req->in_pos = req->in_end = NULL;
+
+    // READ until the blank line that ends the headers
+    while (end == NULL)
+    {
+        if (len == REQUEST_HEADER_MAX)
+        {
+            *rv = REQUEST_ERR_TOO_LARGE;
+            return NULL;
+        }
+
+        int n = net_recv(fd, req->buf + len, REQUEST_HEADER_MAX - len);
+
+        if (n <= 0)
+        {
+            if (n < 0) { perror("recv"); }
+            *rv = REQUEST_ERR_CLOSED;
+            return NULL;
+        }
+
+        // The terminator may straddle two reads
+        int from = len > 3 ? len - 3 : 0;
+        len += n;
+        end = scan_head_end(req->buf + from, len - from);
+    }
+
+    // BODY bytes that came in with the headers are read first
+    req->in_pos = end + 4;
+    req->in_end = req->buf + len;
+
+    return end;
+}
+
+/**
+ * Read the request line and headers from a socket
+ *
+ * Anything received past the headers is kept for request_body_read().
+ *
+ * Returns 0 on success or a REQUEST_ERR_* value.
+ */
+int request_read(struct request *req, int fd, long long max_body_size)
+{
+    int rv;
+    char *end = read_head(req, fd, max_body_size, 0, &rv);
+
+    if (end == NULL)
+    {
+        return rv;
+    }
+
+    if ((rv = parse_head(req, req->buf, end + 2)) < 0)
+    {
+        return rv;
+    }
+
+    return setup_body(req);
+}
+
+/**
+ * Read the reply to a request we sent to another server, for proxying
+ *
+ * The status line goes in path, "HTTP/1.1 200 OK" say, and the body is
+ * read with request_body_read() like a request's. A reply without
+ * Content-Length or chunked framing runs until the server closes, and
+ * one to a HEAD request, or with a 204 or 304 status, has none.
+ * Interim 1xx replies are skipped.
+ *
+ * Returns the status code, or a REQUEST_ERR_* value.
+ */
+int request_read_response(struct request *resp, int fd, int head_request)
+{
+    int rv, carry = 0, status;
+    char *end, *eol;
+
+    for (;;)
+    {
+        if ((end = read_head(resp, fd, __LONG_LONG_MAX__, carry, &rv)) == NULL)
+        {
+            return rv;
+        }
+
+        // STATUS line: HTTP/1.x SP 3DIGIT [SP reason]
+        eol = memchr(resp->buf, '\n', end + 2 - resp->buf);
+        int len = eol - resp->buf;
+
+        if (len > 0 && resp->buf[len - 1] == '\r')
+        {
+            len--;
+        }
+        if (len < 12 || len >= (int)sizeof resp->path || strncmp(resp->buf, "HTTP/1.", 7) != 0 ||
+            resp->buf[8] != ' ' || resp->buf[9] < '1' || resp->buf[9] > '5' || resp->buf[10] < '0' ||
+            resp->buf[10] > '9' || resp->buf[11] < '0' || resp->buf[11] > '9' || (len > 12 && resp->buf[12] != ' '))
+        {
+            return REQUEST_ERR_MALFORMED;
+        }
+        memcpy(resp->path, resp->buf, len);
+        resp->path[len] = '\0';
+
+        status = atoi(resp->path + 9);
+
+        // SKIP interim responses, like 103 Early Hints; we never ask to
+        // switch protocols, so a 101 is an error
+        if (status == 101)
+        {
+            return REQUEST_ERR_MALFORMED;
+        }
+        if (status >= 200)
+        {
+            break;
+        }
+        carry = resp->in_end - resp->in_pos;
+        memmove(resp->buf, resp->in_pos, carry);
+    }
+
+    if ((rv = parse_headers(resp, eol + 1, end + 2)) < 0)
+    {
+        return rv;
+    }
+
+    if (head_request || status == 204 || status == 304)
+    {
+        resp->content_length = -1;
+        resp->chunked = 0;
+        resp->body_state = BODY_DONE;
+        return status;
+    }
+
+    if ((rv = setup_body(resp)) < 0)
+    {
+        return rv;
+    }
+    if (resp->body_state == BODY_DONE && resp->content_length < 0)
+    {
+        resp->body_state = BODY_CLOSE;
+    }
+
+    return status;
+}
+
+/**
+ * Find a header value by case-insensitive name
+ *
+ * Returns NULL if the header wasn't sent.
+ */
+char *request_header(struct request *req, char *name)
+{
+    size_t name_len = strlen(name), line_len;
+
+    if (req->headers == NULL)
+    {
+        return NULL;
+    }
+
+    for (char *line = req->headers; *line != '\0'; line += line_len + 1)
+    {
+        line_len = strlen(line);
+
+        // The colon rules out most lines before the names are compared
+        if (line_len > name_len && line[name_len] == ':' && scan_caseeq(line, name, name_len))
+        {
+            char *value = line + name_len + 1;
+
+            while (*value == ' ' || *value == '\t')
+            {
+                value++;
+            }
+
+            // TRIM trailing whitespace in place
+            char *value_end = value + strlen(value);
+            while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t'))
+            {
+                *--value_end = '\0';
+            }
+
+            return value;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Read up to len bytes of decoded request body
+ *
+ * Handles both Content-Length and chunked bodies, using only the
+ * request's fixed-size buffers however large the body is. HTTP/2
+ * requests read from their stream instead.
+ *
+ * Returns the number of bytes read, 0 at the end of the body, or a
+ * REQUEST_ERR_* value.
+ */
+int request_body_read(struct request *req, void *dest, int len)
+{
+    long long size;
+    int rv, c;
+
+    if (req->h2 != NULL)
+    {
+        return h2_body_read(req->h2, dest, len);
+    }
+
+    for (;;)
+    {
+        switch (req->body_state)
+        {
+        case BODY_DONE:
+            return 0;
+
+        case BODY_ERROR:
+            return REQUEST_ERR_MALFORMED;
+
+        case BODY_LENGTH:
+        case BODY_CHUNK_DATA:
+            if (req->body_remaining == 0)
+            {
+                req->body_state = req->body_state == BODY_LENGTH ? BODY_DONE : BODY_CHUNK_CRLF;
+                continue;
+            }
+
+            if ((rv = fill(req)) < 0)
+            {
+                req->body_state = BODY_ERROR;
+                return rv;
+            }
+
+            int n = req->in_end - req->in_pos;
+            if (n > len) { n = len; }
+            if (n > req->body_remaining) { n = req->body_remaining; }
+
+            memcpy(dest, req->in_pos, n);
+            req->in_pos += n;
+            req->body_remaining -= n;
+            req->body_total += n;
+
+            return n;
+
+        case BODY_CLOSE:
+        {
+            if (fill(req) < 0)
+            {
+                req->body_state = BODY_DONE;
+                return 0;
+            }
+
+            int n = req->in_end - req->in_pos;
+            if (n > len) { n = len; }
+
+            memcpy(dest, req->in_pos, n);
+            req->in_pos += n;
+            req->body_total += n;
+
+            return n;
+        }
+
+        case BODY_CHUNK_SIZE:
+            if ((size = read_chunk_size(req)) < 0)
+            {
+                req->body_state = BODY_ERROR;
+                return size;
+            }
+            if (req->body_total + size > req->max_body_size)
+            {
+                req->body_state = BODY_ERROR;
+                return REQUEST_ERR_TOO_LARGE;
+            }
+
+            req->body_remaining = size;
+            req->body_state = size == 0 ? BODY_TRAILERS : BODY_CHUNK_DATA;
+            continue;
+
+        case BODY_CHUNK_CRLF:
+            c = next_byte(req);
+            if (c == '\r')
+            {
+                c = next_byte(req);
+            }
+            if (c != '\n')
+            {
+                req->body_state = BODY_ERROR;
+                return c < 0 ? c : REQUEST_ERR_MALFORMED;
+            }
+
+            req->body_state = BODY_CHUNK_SIZE;
+            continue;
+
+        case BODY_TRAILERS:
+            if ((rv = skip_trailers(req)) < 0)
+            {
+                req->body_state = BODY_ERROR;
+                return rv;
+            }
+
+            req->body_state = BODY_DONE;
+            continue;
+        }
+    }
+}
+
+/**
+ * Return true once the whole body has been read
+ */
+int request_body_done(struct request *req)
+{
+    return req->h2 != NULL || req->body_state == BODY_DONE;
+}
+
+/**
+ * Pass the rest of a Content-Length body on to another connection
+ * without reading it here
+ *
+ * What came in with the headers is sent, the rest goes across with
+ * net_splice(), which keeps it in the kernel between plain sockets.
+ *
+ * Returns the number of bytes passed on, or a REQUEST_ERR_* value,
+ * REQUEST_ERR_MALFORMED if the body isn't framed by Content-Length.
+ */
+long long request_body_splice(struct request *req, int to_fd)
+{
+    long long total = 0;
+
+    if (req->body_state == BODY_DONE)
+    {
+        return 0;
+    }
+    if (req->h2 != NULL || req->body_state != BODY_LENGTH)
+    {
+        return REQUEST_ERR_MALFORMED;
+    }
+
+    // SEND what is buffered already
+    long long buffered = req->in_end - req->in_pos;
+    if (buffered > req->body_remaining)
+    {
+        buffered = req->body_remaining;
+    }
+    if (buffered > 0)
+    {
+        struct iovec iov = { req->in_pos, buffered };
+        int more = buffered < req->body_remaining;
+
+        if ((more ? net_send_iov_more(to_fd, &iov, 1) : net_send_iov(to_fd, &iov, 1)) < 0)
+        {
+            req->body_state = BODY_ERROR;
+            return REQUEST_ERR_CLOSED;
+        }
+        req->in_pos += buffered;
+        req->body_remaining -= buffered;
+        total += buffered;
+    }
+
+    // SPLICE the rest straight across
+    if (req->body_remaining > 0)
+    {
+        long long moved = net_splice(req->fd, to_fd, req->body_remaining);
+
+        if (moved < req->body_remaining)
+        {
+            req->body_state = BODY_ERROR;
+            return REQUEST_ERR_CLOSED;
+        }
+        total += moved;
+        req->body_remaining = 0;
+    }
+
+    req->body_total += total;
+    req->body_state = BODY_DONE;
+
+    return total;
+}
@@ -0,0 +1,43 @@
+#ifndef _REQUEST_H_
+#define _REQUEST_H_
+
+#define REQUEST_HEADER_MAX 65536 // 64K for the request line and headers
+#define REQUEST_BODY_CHUNK 16384 // 16K read size for streamed bodies
+
+// request_read() and request_body_read() errors
+#define REQUEST_ERR_CLOSED -1 // Connection closed or recv failed
+#define REQUEST_ERR_MALFORMED -2 // Bad request line, header or chunk framing
+#define REQUEST_ERR_TOO_LARGE -3 // Headers or body over the limit
+
+struct h2_stream;
+
+// A parsed HTTP/1.1 request with a streaming body reader
+struct request {
+    int fd;
+    struct h2_stream *h2; // Set when the request came in on an HTTP/2 stream
+    char method[16];
+    char path[2048];
+
+    char *headers; // NUL-separated "Name: value" lines, ends with an empty one
+    long long content_length; // -1 when not given
+    int chunked; // Transfer-Encoding: chunked
+
+    // Body reader state
+    long long max_body_size;
+    long long body_total; // Decoded body bytes handed out so far
+    long long body_remaining; // Bytes left in the body or the current chunk
+    int body_state;
+    char *in_pos, *in_end; // Unread raw bytes in buf or body_buf
+
+    char buf[REQUEST_HEADER_MAX];
+    char body_buf[REQUEST_BODY_CHUNK];
+};
+
+extern int request_read(struct request *req, int fd, long long max_body_size);
+extern char *request_header(struct request *req, char *name);
+extern int request_body_read(struct request *req, void *dest, int len);
+extern int request_read_response(struct request *resp, int fd, int head_request);
+extern int request_body_done(struct request *req);
+extern long long request_body_splice(struct request *req, int to_fd);
+
+#endif
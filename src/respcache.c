@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/uio.h>
+#include "net.h"
+#include "request.h"
+#include "response.h"
+#include "h2.h"
+#include "cache.h"
+#include "respcache.h"
+
+// Responses are kept in a host's cache next to its files, under keys like
+//
+//    GET example.com/api/users?page=2
+//
+// which can't collide with file keys, those start with a slash. A HEAD is
+// answered from what a GET stored. A response with a Vary header is kept
+// under a variant key instead, the base key followed by the value of each
+// request header it names, one per line. The base key then holds a
+// record of type RESPCACHE_VARY whose content is the Vary value, so a
+// lookup knows which headers to add.
+
+/**
+ * Find a directive in a Cache-Control or Pragma value
+ *
+ * Returns what follows the directive's name, "=60" or "" for instance,
+ * or NULL if it isn't there.
+ */
+static char *directive(char *value, char *name)
+{
+    size_t len = strlen(name);
+
+    for (char *p = value; p != NULL && *p != '\0'; p = strchr(p, ','), p = p ? p + 1 : NULL)
+    {
+        p += strspn(p, " \t");
+        if (strncasecmp(p, name, len) == 0 &&
+            (p[len] == '\0' || p[len] == '=' || p[len] == ',' || p[len] == ' ' || p[len] == '\t'))
+        {
+            return p + len;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Return the seconds a directive like max-age=60 gives, or -1 if it
+ * isn't there
+ */
+static long directive_seconds(char *value, char *name)
+{
+    char *p = directive(value, name);
+
+    if (p == NULL || *p++ != '=')
+    {
+        return -1;
+    }
+    if (*p == '"')
+    {
+        p++;
+    }
+
+    return *p >= '0' && *p <= '9' ? strtol(p, NULL, 10) : -1;
+}
+
+/**
+ * Return how many seconds a response may be served from a shared cache,
+ * going by its Cache-Control, or -1 if it mustn't be stored
+ *
+ * s-maxage wins over max-age. Responses that are no-store, no-cache or
+ * private aren't stored, nor are ones that don't say how long they keep.
+ */
+int respcache_lifetime(char *cache_control)
+{
+    if (cache_control == NULL || directive(cache_control, "no-store") != NULL ||
+        directive(cache_control, "no-cache") != NULL || directive(cache_control, "private") != NULL)
+    {
+        return -1;
+    }
+
+    long seconds = directive_seconds(cache_control, "s-maxage");
+    if (seconds < 0)
+    {
+        seconds = directive_seconds(cache_control, "max-age");
+    }
+
+    return seconds <= 0 ? -1 : seconds < INT_MAX ? (int)seconds : INT_MAX;
+}
+
+/**
+ * Build the base key of a request
+ *
+ * Returns its length, or -1 if it doesn't fit.
+ */
+static int base_key(char *key, size_t size, struct request *req)
+{
+    char *host = request_header(req, "Host");
+    int len = snprintf(key, size, "GET %s%s", host != NULL ? host : "", req->path);
+
+    return len < (int)size ? len : -1;
+}
+
+/**
+ * Extend a base key of length len to the variant key of a request, for
+ * a response that varies on the comma-separated headers in vary
+ *
+ * Returns the new length, or -1 if it doesn't fit.
+ */
+static int variant_key(char *key, size_t size, int len, struct request *req, char *vary)
+{
+    char name[256];
+
+    for (char *p = vary + strspn(vary, " \t,"); *p != '\0'; p += strspn(p, " \t,"))
+    {
+        size_t name_len = strcspn(p, " \t,");
+
+        if (name_len >= sizeof name)
+        {
+            return -1;
+        }
+        memcpy(name, p, name_len);
+        name[name_len] = '\0';
+        p += name_len;
+
+        char *value = request_header(req, name);
+
+        len += snprintf(key + len, size - len, "\n%s", value != NULL ? value : "");
+        if (len >= (int)size)
+        {
+            return -1;
+        }
+    }
+
+    return len;
+}
+
+/**
+ * Look up a stored response, dropping it if it has expired
+ */
+static struct cache_entry *fresh_get(struct cache *cache, char *key)
+{
+    struct cache_entry *entry = cache_get(cache, key);
+
+    if (entry != NULL && time(NULL) >= entry->expires_at)
+    {
+        remove_entry(cache, entry);
+        cache_release(cache, entry);
+        return NULL;
+    }
+
+    return entry;
+}
+
+/**
+ * Send a stored response, with its age
+ *
+ * HTTP/2 carries the status, type and length, as it does for responses
+ * passed on by the proxy.
+ */
+static int send_entry(struct request *req, struct cache_entry *entry, int head_request)
+{
+    int body_length = head_request ? 0 : entry->content_length;
+    char *headers = entry->headers != NULL ? entry->headers : "";
+
+    if (req->h2 != NULL)
+    {
+        if (h2_send_headers(req->h2, 200, entry->content_type, entry->content_length, &entry->h2_head,
+                            body_length == 0) < 0 ||
+            (body_length > 0 && h2_send_data(req->h2, entry->content, body_length, 1) < 0))
+        {
+            return -1;
+        }
+        return 0;
+    }
+
+    char head[512];
+    char date[50];
+    populate_date_string(date, sizeof date);
+
+    int head_length = snprintf(head, sizeof head,
+                               "HTTP/1.1 200 OK\r\n"
+                               "Date: %s\r\n"
+                               "Connection: close\r\n"
+                               "Content-Length: %i\r\n"
+                               "Content-Type: %s\r\n"
+                               "Age: %ld\r\n",
+                               date, entry->content_length, entry->content_type,
+                               (long)(time(NULL) - entry->created_at));
+
+    if (head_length >= (int)sizeof head)
+    {
+        return -1;
+    }
+
+    struct iovec iov[4] = {
+        { head, head_length },
+        { headers, strlen(headers) },
+        { "\r\n", 2 },
+        { entry->content, body_length },
+    };
+
+    return net_send_iov(req->fd, iov, body_length > 0 ? 4 : 3) < 0 ? -1 : 0;
+}
+
+/**
+ * Answer a GET or HEAD from a stored response, if there is a fresh one
+ *
+ * A client asking for no-cache or max-age=0 always goes past the cache.
+ * Returns 1 if the request was answered, 0 if it is up to the caller.
+ */
+int respcache_serve(struct cache *cache, struct request *req)
+{
+    char key[RESPCACHE_KEY_MAX];
+    int head_request = strcmp(req->method, "HEAD") == 0;
+    char *cache_control = request_header(req, "Cache-Control");
+    char *pragma = request_header(req, "Pragma");
+
+    if ((!head_request && strcmp(req->method, "GET") != 0) ||
+        (cache_control != NULL && (directive(cache_control, "no-cache") != NULL ||
+                                   directive(cache_control, "no-store") != NULL ||
+                                   directive_seconds(cache_control, "max-age") == 0)) ||
+        (pragma != NULL && directive(pragma, "no-cache") != NULL))
+    {
+        return 0;
+    }
+
+    int len = base_key(key, sizeof key, req);
+    struct cache_entry *entry = len < 0 ? NULL : fresh_get(cache, key);
+
+    // IF the response varies THEN find it by the headers it names
+    if (entry != NULL && strcmp(entry->content_type, RESPCACHE_VARY) == 0)
+    {
+        len = variant_key(key, sizeof key, len, req, entry->content);
+        cache_release(cache, entry);
+        entry = len < 0 ? NULL : fresh_get(cache, key);
+    }
+
+    if (entry == NULL)
+    {
+        return 0;
+    }
+
+    send_entry(req, entry, head_request);
+    cache_release(cache, entry);
+
+    return 1;
+}
+
+/**
+ * Put a stored response in the cache, expiring lifetime seconds from now
+ */
+static void store(struct cache *cache, char *key, char *content_type, char *headers, void *content,
+                  int content_length, int lifetime)
+{
+    time_t now = time(NULL);
+    struct cache_entry *entry = alloc_entry(key, content_type, content, content_length, now);
+
+    if (entry == NULL)
+    {
+        return;
+    }
+
+    entry->expires_at = now + lifetime;
+    if (headers != NULL && (entry->headers = strdup(headers)) == NULL)
+    {
+        free_entry(entry);
+        return;
+    }
+
+    cache_insert(cache, entry);
+}
+
+/**
+ * Store the 200 response to a GET, for lifetime seconds
+ *
+ * headers are "Name: value\r\n" lines to send along with it, or NULL.
+ * vary is the response's Vary header, or NULL. A response that varies on
+ * "*" can't be matched to a request, so it isn't stored.
+ */
+void respcache_put(struct cache *cache, struct request *req, char *content_type, char *headers, char *vary,
+                   void *body, int content_length, int lifetime)
+{
+    char key[RESPCACHE_KEY_MAX];
+    int len = base_key(key, sizeof key, req);
+
+    if (len < 0 || lifetime <= 0 || (vary != NULL && strchr(vary, '*') != NULL))
+    {
+        return;
+    }
+
+    if (content_type == NULL)
+    {
+        content_type = "application/octet-stream";
+    }
+
+    // A response that varies goes under its variant key, behind a record
+    // naming the headers
+    if (vary != NULL && vary[strspn(vary, " \t,")] != '\0')
+    {
+        store(cache, key, RESPCACHE_VARY, NULL, vary, strlen(vary) + 1, lifetime);
+        if ((len = variant_key(key, sizeof key, len, req, vary)) < 0)
+        {
+            return;
+        }
+    }
+
+    store(cache, key, content_type, headers, body, content_length, lifetime);
+}
@@ -0,0 +1,15 @@
+#ifndef _RESPCACHE_H_
+#define _RESPCACHE_H_
+
+#define RESPCACHE_KEY_MAX 4096
+#define RESPCACHE_VARY "vary" // Content type of the entry naming the headers a response varies on
+
+struct cache;
+struct request;
+
+extern int respcache_lifetime(char *cache_control);
+extern int respcache_serve(struct cache *cache, struct request *req);
+extern void respcache_put(struct cache *cache, struct request *req, char *content_type, char *headers, char *vary,
+                          void *body, int content_length, int lifetime);
+
+#endif
@@ -0,0 +1,315 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "net.h"
+#include "request.h"
+#include "response.h"
+#include "h2.h"
+
+/**
+ * Getting date for HTTP response
+ * */
+void populate_date_string(char *buf, size_t max_len)
+{
+    time_t rawtime = time(NULL);
+    struct tm info;
+    localtime_r(&rawtime, &info);
+    strftime(buf, max_len, "%a %b %d %H:%M:%S %Z %Y", &info);
+}
+
+/**
+ * Return the status code from a status line like "HTTP/1.1 200 OK"
+ */
+static int status_code(char *header)
+{
+    return atoi(header + 9);
+}
+
+/**
+ * Send an HTTP response
+ *
+ * header:       "HTTP/1.1 404 NOT FOUND" or "HTTP/1.1 200 OK", etc.
+ * content_type: "text/plain", etc.
+ * body:         the data to send.
+ *
+ * Headers and body go out with one writev-style call, the body is not
+ * copied. Return the number of bytes sent or -1 on error.
+ */
+int send_response(struct request *req, char *header, char *content_type, void *body, int content_length)
+{
+    return send_cached_response(req, header, content_type, body, content_length, NULL);
+}
+
+/**
+ * Send an HTTP response whose headers never change, like a cache entry's
+ *
+ * h2_head is where the HTTP/2 encoding of the headers is kept, so it is
+ * built only once. It may be NULL.
+ */
+int send_cached_response(struct request *req, char *header, char *content_type, void *body,
+                         int content_length, void **h2_head)
+{
+    char response_header[512];
+
+    if (req->h2 != NULL)
+    {
+        if (h2_send_headers(req->h2, status_code(header), content_type, content_length, h2_head,
+                            content_length == 0) < 0 ||
+            (content_length > 0 && h2_send_data(req->h2, body, content_length, 1) < 0))
+        {
+            return -1;
+        }
+        return content_length;
+    }
+
+    // GET time for the request
+    char response_format[50];
+    populate_date_string(response_format, sizeof(response_format));
+
+    // INIT length of header response
+    int header_length = snprintf(response_header, sizeof response_header,
+                                 "%s\r\n"
+                                 "Date: %s\r\n"
+                                 "Connection: close\r\n"
+                                 "Content-Length: %i\r\n"
+                                 "Content-Type: %s\r\n"
+                                 "\r\n",
+                                 header, response_format, content_length, content_type);
+
+    if (header_length >= (int)sizeof response_header)
+    {
+        fprintf(stderr, "send_response: header too long\n");
+        return -1;
+    }
+
+    struct iovec iov[2] = {
+        { response_header, header_length },
+        { body, content_length },
+    };
+
+    // Send it all!
+    return net_send_iov(req->fd, iov, content_length > 0 ? 2 : 1);
+}
+
+/**
+ * Send an HTTP response whose body is a file on disk
+ *
+ * The body goes out with sendfile(), so it is never copied into user
+ * space (with kernel TLS, not even for HTTPS connections).
+ *
+ * Return the number of bytes sent or -1 on error.
+ */
+off_t send_file_response(struct request *req, char *header, char *content_type, int file_fd, off_t content_length)
+{
+    char response_header[512];
+
+    if (req->h2 != NULL)
+    {
+        if (h2_send_headers(req->h2, status_code(header), content_type, content_length, NULL,
+                            content_length == 0) < 0 ||
+            (content_length > 0 && h2_send_file(req->h2, file_fd, content_length) < 0))
+        {
+            return -1;
+        }
+        return content_length;
+    }
+
+    // GET time for the request
+    char response_format[50];
+    populate_date_string(response_format, sizeof(response_format));
+
+    int header_length = snprintf(response_header, sizeof response_header,
+                                 "%s\r\n"
+                                 "Date: %s\r\n"
+                                 "Connection: close\r\n"
+                                 "Content-Length: %lld\r\n"
+                                 "Content-Type: %s\r\n"
+                                 "\r\n",
+                                 header, response_format, (long long)content_length, content_type);
+
+    // SEND the head held back for the file's first bytes, so the two
+    // share packets
+    struct iovec iov = { response_header, header_length };
+
+    if ((content_length > 0 ? net_send_iov_more(req->fd, &iov, 1) : net_send_iov(req->fd, &iov, 1)) < 0)
+    {
+        return -1;
+    }
+
+    off_t rv = net_sendfile(req->fd, file_fd, 0, content_length);
+
+    return rv < 0 ? -1 : header_length + rv;
+}
+
+/**
+ * HTTP/2 version of flush_chunk(), the body goes out as DATA frames
+ */
+static int flush_frames(struct response *resp, void *data, int length, int last)
+{
+    struct h2_stream *s = resp->req->h2;
+    int body_length = resp->buf_length + length;
+    int rv = 0;
+
+    if (resp->head_length > 0)
+    {
+        rv = h2_send_headers(s, resp->status, resp->content_type, -1, NULL, last && body_length == 0);
+    }
+    else if (last && body_length == 0)
+    {
+        rv = h2_send_data(s, NULL, 0, 1);
+    }
+
+    if (rv == 0 && resp->buf_length > 0)
+    {
+        rv = h2_send_data(s, resp->buf, resp->buf_length, last && length == 0);
+    }
+    if (rv == 0 && length > 0)
+    {
+        rv = h2_send_data(s, data, length, last);
+    }
+
+    resp->head_length = 0;
+    resp->buf_length = 0;
+
+    if (rv < 0)
+    {
+        resp->error = 1;
+    }
+
+    return rv;
+}
+
+/**
+ * Send pending headers and buffered body as one chunk, plus extra data
+ *
+ * data may be NULL. If last is set the terminating chunk goes out too.
+ */
+static int flush_chunk(struct response *resp, void *data, int length, int last)
+{
+    struct iovec iov[6];
+    int iovcnt = 0;
+    char size_line[20];
+    int chunk_length = resp->buf_length + length;
+
+    if (resp->error)
+    {
+        return -1;
+    }
+
+    if (resp->req->h2 != NULL)
+    {
+        return flush_frames(resp, data, length, last);
+    }
+
+    if (resp->head_length > 0)
+    {
+        iov[iovcnt].iov_base = resp->head;
+        iov[iovcnt++].iov_len = resp->head_length;
+    }
+
+    if (chunk_length > 0)
+    {
+        iov[iovcnt].iov_base = size_line;
+        iov[iovcnt++].iov_len = snprintf(size_line, sizeof size_line, "%x\r\n", chunk_length);
+
+        if (resp->buf_length > 0)
+        {
+            iov[iovcnt].iov_base = resp->buf;
+            iov[iovcnt++].iov_len = resp->buf_length;
+        }
+        if (length > 0)
+        {
+            iov[iovcnt].iov_base = data;
+            iov[iovcnt++].iov_len = length;
+        }
+
+        iov[iovcnt].iov_base = "\r\n";
+        iov[iovcnt++].iov_len = 2;
+    }
+
+    if (last)
+    {
+        iov[iovcnt].iov_base = "0\r\n\r\n";
+        iov[iovcnt++].iov_len = 5;
+    }
+
+    if (iovcnt > 0 && net_send_iov(resp->req->fd, iov, iovcnt) < 0)
+    {
+        resp->error = 1;
+        return -1;
+    }
+
+    resp->head_length = 0;
+    resp->buf_length = 0;
+
+    return 0;
+}
+
+/**
+ * Start a streamed response
+ *
+ * The status line and headers are held back and sent along with the
+ * first chunk of body, so short responses still go out in one call.
+ */
+int response_begin(struct response *resp, struct request *req, char *header, char *content_type)
+{
+    char response_format[50];
+    populate_date_string(response_format, sizeof(response_format));
+
+    resp->req = req;
+    resp->status = status_code(header);
+    resp->content_type = content_type;
+    resp->error = 0;
+    resp->buf_length = 0;
+    resp->head_length = snprintf(resp->head, sizeof resp->head,
+                                 "%s\r\n"
+                                 "Date: %s\r\n"
+                                 "Connection: close\r\n"
+                                 "Transfer-Encoding: chunked\r\n"
+                                 "Content-Type: %s\r\n"
+                                 "\r\n",
+                                 header, response_format, content_type);
+
+    if (resp->head_length >= (int)sizeof resp->head)
+    {
+        fprintf(stderr, "response_begin: header too long\n");
+        resp->error = 1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Append body data to a streamed response
+ *
+ * Small writes are buffered; once the buffer would overflow, it and the
+ * new data are sent as a single chunk without copying the data.
+ */
+int response_write(struct response *resp, void *data, int length)
+{
+    if (resp->error)
+    {
+        return -1;
+    }
+
+    if (resp->buf_length + length <= RESPONSE_BUFFER_SIZE)
+    {
+        memcpy(resp->buf + resp->buf_length, data, length);
+        resp->buf_length += length;
+        return 0;
+    }
+
+    return flush_chunk(resp, data, length, 0);
+}
+
+/**
+ * Send whatever is buffered and the terminating zero-length chunk
+ */
+int response_finish(struct response *resp)
+{
+    return flush_chunk(resp, NULL, 0, 1);
+}
@@ -0,0 +1,33 @@
+#ifndef _RESPONSE_H_
+#define _RESPONSE_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define RESPONSE_BUFFER_SIZE 4096 // Small writes are coalesced up to this size
+
+struct request;
+
+// A response whose body is streamed with chunked transfer encoding, or as
+// DATA frames on HTTP/2
+struct response {
+    struct request *req;
+    int status;
+    char *content_type;
+    int error; // Set once a send fails, later calls do nothing
+    int head_length; // Status line and headers not sent yet
+    int buf_length; // Body bytes waiting to go out as the next chunk
+    char head[512];
+    char buf[RESPONSE_BUFFER_SIZE];
+};
+
+extern void populate_date_string(char *buf, size_t max_len);
+extern int send_response(struct request *req, char *header, char *content_type, void *body, int content_length);
+extern int send_cached_response(struct request *req, char *header, char *content_type, void *body,
+                                int content_length, void **h2_head);
+extern off_t send_file_response(struct request *req, char *header, char *content_type, int file_fd, off_t content_length);
+extern int response_begin(struct response *resp, struct request *req, char *header, char *content_type);
+extern int response_write(struct response *resp, void *data, int length);
+extern int response_finish(struct response *resp);
+
+#endif
@@ -0,0 +1,417 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "router.h"
+
+/**
+ * Allocate a trie node with a copy of the given edge label
+ */
+static struct route_node *alloc_node(char *label, int label_len)
+{
+    struct route_node *node = calloc(1, sizeof(*node));
+    if (!node)
+    {
+        return NULL;
+    }
+
+    node->label = malloc(label_len + 1);
+    memcpy(node->label, label, label_len);
+    node->label[label_len] = '\0';
+    node->label_len = label_len;
+    node->indices = calloc(1, 1);
+
+    return node;
+}
+
+/**
+ * Deallocate a node and everything below it
+ */
+static void free_node(struct route_node *node)
+{
+    if (!node) { return; }
+
+    for (int i = 0; i < node->child_count; i++)
+    {
+        free_node(node->children[i]);
+    }
+    free_node(node->param_child);
+    free_node(node->wildcard);
+
+    struct route_method *m = node->methods, *next;
+    while (m != NULL)
+    {
+        next = m->next;
+        free(m->method);
+        free(m);
+        m = next;
+    }
+
+    free(node->children);
+    free(node->indices);
+    free(node->param_name);
+    free(node->label);
+    free(node);
+}
+
+/**
+ * Add a static child, indexed by the first byte of its label
+ */
+static void add_child(struct route_node *node, struct route_node *child)
+{
+    node->children = realloc(node->children, (node->child_count + 1) * sizeof(*node->children));
+    node->indices = realloc(node->indices, node->child_count + 2);
+
+    node->children[node->child_count] = child;
+    node->indices[node->child_count] = child->label[0];
+    node->child_count++;
+    node->indices[node->child_count] = '\0';
+}
+
+/**
+ * Find the static child whose label starts with c
+ */
+static struct route_node *find_child(struct route_node *node, char c)
+{
+    char *p = memchr(node->indices, c, node->child_count);
+
+    return p ? node->children[p - node->indices] : NULL;
+}
+
+/**
+ * Split a node's label at len, moving everything below into a new child
+ */
+static void split_node(struct route_node *node, int len)
+{
+    struct route_node *rest = alloc_node(node->label + len, node->label_len - len);
+
+    // MOVE children, params and handlers down to the new node
+    free(rest->indices);
+    rest->indices = node->indices;
+    rest->children = node->children;
+    rest->child_count = node->child_count;
+    rest->param_child = node->param_child;
+    rest->wildcard = node->wildcard;
+    rest->methods = node->methods;
+
+    node->indices = calloc(1, 1);
+    node->children = NULL;
+    node->child_count = 0;
+    node->param_child = NULL;
+    node->wildcard = NULL;
+    node->methods = NULL;
+    node->label[len] = '\0';
+    node->label_len = len;
+
+    add_child(node, rest);
+}
+
+/**
+ * Insert a run of static path bytes below a node
+ *
+ * Returns the node at the end of the run.
+ */
+static struct route_node *insert_static(struct route_node *node, char *s, int len)
+{
+    while (len > 0)
+    {
+        struct route_node *child = find_child(node, *s);
+
+        // IF no edge starts with this byte THEN hang the whole run here
+        if (child == NULL)
+        {
+            child = alloc_node(s, len);
+            add_child(node, child);
+            return child;
+        }
+
+        int common = 0;
+        while (common < len && common < child->label_len && s[common] == child->label[common])
+        {
+            common++;
+        }
+
+        // IF the edge only partly matches THEN split it where they differ
+        if (common < child->label_len)
+        {
+            split_node(child, common);
+        }
+
+        node = child;
+        s += common;
+        len -= common;
+    }
+
+    return node;
+}
+
+/**
+ * Walk a pattern into the trie, creating nodes as needed
+ *
+ * Returns the node for the pattern or NULL if it is invalid or clashes
+ * with an existing parameter name.
+ */
+static struct route_node *insert_pattern(struct route_node *node, char *pattern)
+{
+    while (*pattern != '\0')
+    {
+        if (*pattern == ':')
+        {
+            int name_len = strcspn(pattern + 1, "/");
+
+            if (name_len == 0)
+            {
+                return NULL;
+            }
+
+            if (node->param_child == NULL)
+            {
+                node->param_child = alloc_node("", 0);
+                node->param_child->param_name = strndup(pattern + 1, name_len);
+            }
+            else if (strncmp(node->param_child->param_name, pattern + 1, name_len) != 0 ||
+                     node->param_child->param_name[name_len] != '\0')
+            {
+                return NULL;
+            }
+
+            node = node->param_child;
+            pattern += name_len + 1;
+        }
+        else if (*pattern == '*')
+        {
+            // Wildcard only makes sense as the last thing in a pattern
+            if (pattern[1] != '\0')
+            {
+                return NULL;
+            }
+
+            if (node->wildcard == NULL)
+            {
+                node->wildcard = alloc_node("", 0);
+            }
+
+            return node->wildcard;
+        }
+        else
+        {
+            int run = strcspn(pattern, ":*");
+
+            node = insert_static(node, pattern, run);
+            pattern += run;
+        }
+    }
+
+    return node;
+}
+
+/**
+ * Find the handler for a method on a node
+ */
+static struct route_method *find_method(struct route_node *node, char *method)
+{
+    for (struct route_method *m = node->methods; m != NULL; m = m->next)
+    {
+        if (strcmp(m->method, method) == 0 || strcmp(m->method, "*") == 0)
+        {
+            return m;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Match the rest of a path below a node
+ *
+ * Static edges win over ":name" segments, which win over "*". Sets
+ * path_matched if some node matched the path but not the method.
+ */
+static struct route_method *match(struct route_node *node, char *path, char *method,
+                                  struct route_params *params, int *path_matched)
+{
+    struct route_method *m;
+
+    if (*path == '\0' && node->methods != NULL)
+    {
+        if ((m = find_method(node, method)) != NULL)
+        {
+            return m;
+        }
+        *path_matched = 1;
+    }
+
+    // TRY the static edge first
+    struct route_node *child = *path ? find_child(node, *path) : NULL;
+    if (child != NULL && strncmp(path, child->label, child->label_len) == 0)
+    {
+        if ((m = match(child, path + child->label_len, method, params, path_matched)) != NULL)
+        {
+            return m;
+        }
+    }
+
+    // THEN a parameter segment
+    if (node->param_child != NULL && *path != '\0' && *path != '/' && params->count < ROUTE_PARAMS_MAX)
+    {
+        int seg_len = strcspn(path, "/");
+        int i = params->count++;
+
+        params->names[i] = node->param_child->param_name;
+        params->values[i] = path;
+        params->lengths[i] = seg_len;
+
+        if ((m = match(node->param_child, path + seg_len, method, params, path_matched)) != NULL)
+        {
+            return m;
+        }
+        params->count--;
+    }
+
+    // THEN the catch-all
+    if (node->wildcard != NULL && node->wildcard->methods != NULL && params->count < ROUTE_PARAMS_MAX)
+    {
+        if ((m = find_method(node->wildcard, method)) != NULL)
+        {
+            int i = params->count++;
+
+            params->names[i] = "*";
+            params->values[i] = path;
+            params->lengths[i] = strlen(path);
+
+            return m;
+        }
+        *path_matched = 1;
+    }
+
+    return NULL;
+}
+
+/**
+ * Create an empty router
+ */
+struct router *router_create(void)
+{
+    struct router *router = malloc(sizeof(*router));
+    if (!router)
+    {
+        return NULL;
+    }
+
+    router->root = alloc_node("", 0);
+
+    return router;
+}
+
+/**
+ * Deallocate a router and its routes
+ */
+void router_free(struct router *router)
+{
+    free_node(router->root);
+    free(router);
+}
+
+/**
+ * Register a handler for a method and path pattern
+ *
+ * Patterns are exact ("/d20"), parameterized ("/dice/:sides") or
+ * prefixes whose last character is "*", which matches the rest of the
+ * path. method "*" matches any method.
+ *
+ * Returns 0 on success, -1 on an invalid or duplicate route.
+ */
+int router_add(struct router *router, char *method, char *pattern, route_handler handler, void *arg)
+{
+    if (pattern[0] != '/')
+    {
+        return -1;
+    }
+
+    struct route_node *node = insert_pattern(router->root, pattern);
+    if (node == NULL)
+    {
+        fprintf(stderr, "router: bad pattern %s\n", pattern);
+        return -1;
+    }
+
+    for (struct route_method *m = node->methods; m != NULL; m = m->next)
+    {
+        if (strcmp(m->method, method) == 0)
+        {
+            fprintf(stderr, "router: duplicate route %s %s\n", method, pattern);
+            return -1;
+        }
+    }
+
+    struct route_method *m = malloc(sizeof(*m));
+    m->method = strdup(method);
+    m->handler = handler;
+    m->arg = arg;
+    m->next = NULL;
+
+    // APPEND so that an exact method registered first is found first
+    struct route_method **tail = &node->methods;
+    while (*tail != NULL)
+    {
+        tail = &(*tail)->next;
+    }
+    *tail = m;
+
+    return 0;
+}
+
+/**
+ * Run the handler registered for a request
+ *
+ * The query string is not part of the match.
+ *
+ * Returns ROUTER_OK, ROUTER_NOT_FOUND or ROUTER_METHOD_NOT_ALLOWED.
+ */
+int router_dispatch(struct router *router, struct request *req)
+{
+    struct route_params params;
+    char path[sizeof req->path];
+    int path_matched = 0;
+
+    int path_len = strcspn(req->path, "?");
+    memcpy(path, req->path, path_len);
+    path[path_len] = '\0';
+
+    params.count = 0;
+
+    struct route_method *m = match(router->root, path, req->method, &params, &path_matched);
+    if (m == NULL)
+    {
+        return path_matched ? ROUTER_METHOD_NOT_ALLOWED : ROUTER_NOT_FOUND;
+    }
+
+    // COPY the captured values out as strings
+    char *out = params.storage;
+    for (int i = 0; i < params.count; i++)
+    {
+        memcpy(out, params.values[i], params.lengths[i]);
+        out[params.lengths[i]] = '\0';
+        params.values[i] = out;
+        out += params.lengths[i] + 1;
+    }
+
+    m->handler(req, &params, m->arg);
+
+    return ROUTER_OK;
+}
+
+/**
+ * Get a captured parameter by name, "*" for the wildcard
+ */
+char *route_param(struct route_params *params, char *name)
+{
+    for (int i = 0; i < params->count; i++)
+    {
+        if (strcmp(params->names[i], name) == 0)
+        {
+            return params->values[i];
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,55 @@
+#ifndef _ROUTER_H_
+#define _ROUTER_H_
+
+#include "request.h"
+
+#define ROUTE_PARAMS_MAX 8
+
+// router_dispatch() results
+#define ROUTER_OK 0
+#define ROUTER_NOT_FOUND -1 // No pattern matches the path
+#define ROUTER_METHOD_NOT_ALLOWED -2 // A pattern matches, but not for this method
+
+// Values captured from ":name" segments and a trailing "*"
+struct route_params {
+    int count;
+    char *names[ROUTE_PARAMS_MAX];
+    char *values[ROUTE_PARAMS_MAX];
+    int lengths[ROUTE_PARAMS_MAX];
+    char storage[2048 + ROUTE_PARAMS_MAX]; // NUL-terminated copies of the values
+};
+
+typedef void (*route_handler)(struct request *req, struct route_params *params, void *arg);
+
+// Handler for one method on a trie node
+struct route_method {
+    char *method; // "GET", "POST", ... or "*" for any
+    route_handler handler;
+    void *arg;
+    struct route_method *next;
+};
+
+// Radix trie node
+struct route_node {
+    char *label; // Static path bytes on the edge into this node
+    int label_len;
+    char *indices; // First byte of each static child's label
+    struct route_node **children;
+    int child_count;
+    char *param_name; // Set on a ":name" node
+    struct route_node *param_child; // ":name" segment below this node
+    struct route_node *wildcard; // "*" matching the rest of the path
+    struct route_method *methods;
+};
+
+struct router {
+    struct route_node *root;
+};
+
+extern struct router *router_create(void);
+extern void router_free(struct router *router);
+extern int router_add(struct router *router, char *method, char *pattern, route_handler handler, void *arg);
+extern int router_dispatch(struct router *router, struct request *req);
+extern char *route_param(struct route_params *params, char *name);
+
+#endif
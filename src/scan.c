@@ -0,0 +1,395 @@
+#define _GNU_SOURCE // memmem()
+#include <stdint.h>
+#include <string.h>
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+// Kernels for taking request heads apart: finding the blank line that ends
+// one, splitting it into header lines, and matching header names without
+// regard to case. Each comes in a plain C version and, on x86, SSE2 and
+// AVX2 ones, which compare 16 or 32 bytes at once against the characters
+// sought. The best the CPU has is picked at startup; they all give the
+// same answers.
+
+struct kernels
+{
+    char *(*head_end)(char *p, size_t len);
+    char *(*eol)(char *p, char *end, char **colon);
+    int (*caseeq)(const char *a, const char *b, size_t n);
+};
+
+#define ONES 0x0101010101010101ULL
+#define HIGH_BITS 0x8080808080808080ULL
+
+/**
+ * Fold the ASCII capitals in 8 bytes to lower case, leaving every other
+ * byte alone
+ */
+static uint64_t fold8(uint64_t w)
+{
+    uint64_t low7 = w & ~HIGH_BITS;
+    uint64_t above_z = low7 + ONES * (0x7f - 'Z'); // High bit set past 'Z'
+    uint64_t from_a = low7 + ONES * (0x80 - 'A'); // High bit set from 'A' on
+    uint64_t upper = (from_a ^ above_z) & ~w & HIGH_BITS;
+
+    return w | (upper >> 2);
+}
+
+static char *head_end_scalar(char *p, size_t len)
+{
+    return memmem(p, len, "\r\n\r\n", 4);
+}
+
+static char *eol_scalar(char *p, char *end, char **colon)
+{
+    char *eol = memchr(p, '\n', end - p);
+
+    if (*colon == NULL)
+    {
+        *colon = memchr(p, ':', (eol != NULL ? eol : end) - p);
+    }
+
+    return eol;
+}
+
+/**
+ * Compare 8 bytes at a time, the last 8 overlapping the ones before
+ * where n isn't a multiple
+ */
+static int caseeq_scalar(const char *a, const char *b, size_t n)
+{
+    uint64_t x, y;
+
+    if (n < 8)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            unsigned char c = a[i], d = b[i];
+
+            if ((c >= 'A' && c <= 'Z' ? c | 0x20 : c) != (d >= 'A' && d <= 'Z' ? d | 0x20 : d))
+            {
+                return 0;
+            }
+        }
+        return 1;
+    }
+
+    for (size_t i = 0;; i += 8)
+    {
+        if (i + 8 > n)
+        {
+            i = n - 8;
+        }
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        if (fold8(x) != fold8(y))
+        {
+            return 0;
+        }
+        if (i + 8 == n)
+        {
+            return 1;
+        }
+    }
+}
+
+#ifdef SCAN_X86
+
+/**
+ * Find "\r\n\r\n" 16 positions at a time, comparing the four bytes from
+ * each and ANDing the results
+ */
+__attribute__((target("sse2"))) static char *head_end_sse2(char *p, size_t len)
+{
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i lf = _mm_set1_epi8('\n');
+    size_t i = 0;
+
+    while (i + 19 <= len)
+    {
+        __m128i m = _mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i)), cr),
+                          _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + 1)), lf)),
+            _mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + 2)), cr),
+                          _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(p + i + 3)), lf)));
+        unsigned mask = _mm_movemask_epi8(m);
+
+        if (mask != 0)
+        {
+            return p + i + __builtin_ctz(mask);
+        }
+        i += 16;
+    }
+
+    return head_end_scalar(p + i, len - i);
+}
+
+/**
+ * Find the line end and the first colon before it 16 bytes at a time
+ */
+__attribute__((target("sse2"))) static char *eol_sse2(char *p, char *end, char **colon)
+{
+    const __m128i lf = _mm_set1_epi8('\n');
+    const __m128i col = _mm_set1_epi8(':');
+
+    while (end - p >= 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        unsigned nl = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+
+        if (*colon == NULL)
+        {
+            unsigned c = _mm_movemask_epi8(_mm_cmpeq_epi8(v, col));
+
+            // ONLY colons before the line end count
+            if (nl != 0)
+            {
+                c &= (nl & -nl) - 1;
+            }
+            if (c != 0)
+            {
+                *colon = p + __builtin_ctz(c);
+            }
+        }
+        if (nl != 0)
+        {
+            return p + __builtin_ctz(nl);
+        }
+        p += 16;
+    }
+
+    return eol_scalar(p, end, colon);
+}
+
+/**
+ * Fold the ASCII capitals in 16 bytes to lower case: biased so 'A' is
+ * the smallest signed byte, the capitals are the 26 smallest
+ */
+__attribute__((target("sse2"))) static __m128i fold16(__m128i x)
+{
+    __m128i biased = _mm_add_epi8(x, _mm_set1_epi8((char)(-128 - 'A')));
+    __m128i upper = _mm_cmpgt_epi8(_mm_set1_epi8(-128 + 26), biased);
+
+    return _mm_or_si128(x, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+__attribute__((target("sse2"))) static int caseeq_sse2(const char *a, const char *b, size_t n)
+{
+    if (n < 16)
+    {
+        return caseeq_scalar(a, b, n);
+    }
+
+    for (size_t i = 0;; i += 16)
+    {
+        if (i + 16 > n)
+        {
+            i = n - 16;
+        }
+
+        __m128i x = fold16(_mm_loadu_si128((const __m128i *)(a + i)));
+        __m128i y = fold16(_mm_loadu_si128((const __m128i *)(b + i)));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) != 0xffff)
+        {
+            return 0;
+        }
+        if (i + 16 == n)
+        {
+            return 1;
+        }
+    }
+}
+
+/**
+ * Find "\r\n\r\n" 32 positions at a time, comparing the four bytes from
+ * each and ANDing the results
+ */
+__attribute__((target("avx2"))) static char *head_end_avx2(char *p, size_t len)
+{
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t i = 0;
+
+    while (i + 35 <= len)
+    {
+        __m256i m = _mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i)), cr),
+                             _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + 1)), lf)),
+            _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + 2)), cr),
+                             _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(p + i + 3)), lf)));
+        unsigned mask = _mm256_movemask_epi8(m);
+
+        if (mask != 0)
+        {
+            return p + i + __builtin_ctz(mask);
+        }
+        i += 32;
+    }
+
+    return head_end_sse2(p + i, len - i);
+}
+
+/**
+ * Find the line end and the first colon before it 32 bytes at a time
+ */
+__attribute__((target("avx2"))) static char *eol_avx2(char *p, char *end, char **colon)
+{
+    const __m256i lf = _mm256_set1_epi8('\n');
+    const __m256i col = _mm256_set1_epi8(':');
+
+    while (end - p >= 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        unsigned nl = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+
+        if (*colon == NULL)
+        {
+            unsigned c = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, col));
+
+            // ONLY colons before the line end count
+            if (nl != 0)
+            {
+                c &= (nl & -nl) - 1;
+            }
+            if (c != 0)
+            {
+                *colon = p + __builtin_ctz(c);
+            }
+        }
+        if (nl != 0)
+        {
+            return p + __builtin_ctz(nl);
+        }
+        p += 32;
+    }
+
+    return eol_sse2(p, end, colon);
+}
+
+__attribute__((target("avx2"))) static int caseeq_avx2(const char *a, const char *b, size_t n)
+{
+    if (n < 32)
+    {
+        return caseeq_sse2(a, b, n);
+    }
+
+    const __m256i bias = _mm256_set1_epi8((char)(-128 - 'A'));
+    const __m256i last_upper = _mm256_set1_epi8(-128 + 26);
+    const __m256i to_lower = _mm256_set1_epi8(0x20);
+
+    for (size_t i = 0;; i += 32)
+    {
+        if (i + 32 > n)
+        {
+            i = n - 32;
+        }
+
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+
+        x = _mm256_or_si256(x, _mm256_and_si256(_mm256_cmpgt_epi8(last_upper, _mm256_add_epi8(x, bias)), to_lower));
+        y = _mm256_or_si256(y, _mm256_and_si256(_mm256_cmpgt_epi8(last_upper, _mm256_add_epi8(y, bias)), to_lower));
+
+        if ((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) != 0xffffffffu)
+        {
+            return 0;
+        }
+        if (i + 32 == n)
+        {
+            return 1;
+        }
+    }
+}
+
+#endif
+
+static const struct kernels kernels[] = {
+    [SCAN_SCALAR] = { head_end_scalar, eol_scalar, caseeq_scalar },
+#ifdef SCAN_X86
+    [SCAN_SSE2] = { head_end_sse2, eol_sse2, caseeq_sse2 },
+    [SCAN_AVX2] = { head_end_avx2, eol_avx2, caseeq_avx2 },
+#endif
+};
+
+static int level = SCAN_SCALAR;
+static int best = SCAN_SCALAR; // What the CPU has
+
+/**
+ * Pick the best kernels the CPU has, before main()
+ */
+__attribute__((constructor)) static void scan_init(void)
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    best = __builtin_cpu_supports("avx2") ? SCAN_AVX2 : __builtin_cpu_supports("sse2") ? SCAN_SSE2 : SCAN_SCALAR;
+#endif
+    level = best;
+}
+
+/**
+ * Return the level of the kernels in use
+ */
+int scan_level(void)
+{
+    return level;
+}
+
+/**
+ * Use the kernels of a lower level than the best, for benchmarks and
+ * tests; must be called before other threads scan
+ *
+ * Returns the level set, no higher than the CPU has.
+ */
+int scan_set_level(int want)
+{
+    level = want < SCAN_SCALAR ? SCAN_SCALAR : want > best ? best : want;
+
+    return level;
+}
+
+/**
+ * Return a level's name, for messages
+ */
+char *scan_level_name(int which)
+{
+    return which == SCAN_AVX2 ? "AVX2" : which == SCAN_SSE2 ? "SSE2" : "scalar";
+}
+
+/**
+ * Find the "\r\n\r\n" that ends a head in len bytes from p
+ *
+ * Returns where it starts, or NULL if it isn't there.
+ */
+char *scan_head_end(char *p, size_t len)
+{
+    return kernels[level].head_end(p, len);
+}
+
+/**
+ * Find the '\n' that ends the line at p, before end, and the line's
+ * first ':', which *colon is set to; NULL for either that isn't there
+ *
+ * Returns where the '\n' is.
+ */
+char *scan_eol(char *p, char *end, char **colon)
+{
+    *colon = NULL;
+
+    return kernels[level].eol(p, end, colon);
+}
+
+/**
+ * Return true if n bytes at a and b are the same but for the case of
+ * ASCII letters
+ *
+ * Reads all n bytes of both, NULs included.
+ */
+int scan_caseeq(const char *a, const char *b, size_t n)
+{
+    return kernels[level].caseeq(a, b, n);
+}
@@ -0,0 +1,18 @@
+#ifndef _SCAN_H_
+#define _SCAN_H_
+
+#include <stddef.h>
+
+// Instruction set levels, each using the ones below where it helps
+#define SCAN_SCALAR 0
+#define SCAN_SSE2 1
+#define SCAN_AVX2 2
+
+extern int scan_level(void);
+extern int scan_set_level(int level);
+extern char *scan_level_name(int which);
+extern char *scan_head_end(char *p, size_t len);
+extern char *scan_eol(char *p, char *end, char **colon);
+extern int scan_caseeq(const char *a, const char *b, size_t n);
+
+#endif
@@ -7,6 +7,16 @@
  *    curl -D - http://localhost:3490/d20
  *    curl -D - http://localhost:3490/date
  *
+ * HTTPS (build with `make TLS=1`, then `make certs` for a self-signed pair):
+ *
+ *    curl -k -D - https://localhost:3491/
+ *
+ * HTTP/2, with prior knowledge, by upgrade, or negotiated over TLS:
+ *
+ *    curl --http2-prior-knowledge -D - http://localhost:3490/
+ *    curl --http2 -D - http://localhost:3490/
+ *    curl -k --http2 -D - https://localhost:3491/
+ *
  * You can also test the above URLs in your browser! They should work!
  *
  * Posting Data:
@@ -14,10 +24,22 @@
  *    curl -D - -X POST -H 'Content-Type: text/plain' -d 'Hello, sample data!' http://localhost:3490/save
  *
  * (Posting data is harder to test from a browser.)
+ *
+ * Stopping and upgrading, without dropping requests in flight:
+ *
+ *    kill -TERM <pid>     stop accepting, let requests finish, flush the POST log
+ *    kill -USR2 <pid>     start the binary now installed at the same path on
+ *                         our listening sockets, then drain like SIGTERM
+ *
+ * Settings come from a config file and the command line, see --help:
+ *
+ *    ./server -c webserver.conf --port 8080
+ *    kill -HUP <pid>      re-read them, tunables apply at once
  * 
  *  With the guidance of ChatGPT and mostly guidance (his code was horrible or doesn't make sense)
  */
 
+#define _GNU_SOURCE // ppoll(), pipe2(), close_range(), accept4()
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -33,78 +55,85 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/wait.h>
+#include <sys/eventfd.h>
 #include "net.h"
 #include "file.h"
 #include "mime.h"
 #include "cache.h"
+#include "postlog.h"
+#include "request.h"
+#include "response.h"
+#include "router.h"
+#include "h2.h"
+#include "warmup.h"
+#include "watch.h"
+#include "slab.h"
+#include "ratelimit.h"
+#include "conn.h"
+#include "config.h"
+#include "vhost.h"
+#include "urlpath.h"
+#include "autoindex.h"
+#include "proxy.h"
+#include "affinity.h"
+#include "hugemem.h"
+#include "scan.h"
+#ifdef USE_TLS
+#include "tls.h"
+#endif
 
-#define PORT "3490" // the port users will be connecting to
-
-#define SERVER_FILES "./serverfiles"
-#define SERVER_ROOT "./serverroot"
-#define SERVER_ASSETS "./assets"
-
-/**
- * Getting date for HTTP response
- * */
-static inline void populate_date_string(char *buf, size_t max_len)
-{
-    time_t rawtime = time(NULL);
-    struct tm *info = localtime(&rawtime);
-    strftime(buf, max_len, "%a %b %d %H:%M:%S %Z %Y", info);
-}
-
-/**
- * Send an HTTP response
- *
- * header:       "HTTP/1.1 404 NOT FOUND" or "HTTP/1.1 200 OK", etc.
- * content_type: "text/plain", etc.
- * body:         the data to send.
- *
- * Return the value from the send() function.
- */
-int send_response(int fd, char *header, char *content_type, void *body, int content_length)
-{
-    const int max_response_size = 262144;
-    char response[max_response_size];
-
-    // Build HTTP response and store it in response
+#define ENV_LISTENERS "WEBSERVER_LISTENERS" // "http,https;..." listening sockets handed down, per shard
+#define ENV_READY "WEBSERVER_READY" // pipe the new binary reports it is up on
+#define ACCEPT_BATCH 64 // Most connections taken per wakeup of a listener
 
-    // GET time for the request
-    char response_format[50];
-    populate_date_string(response_format, sizeof(response_format));
+// Settings from the config file and command line, see config.h. Those
+// SIGHUP reloads are read with CONFIG_GET()
+static struct config config;
 
-    // INIT length of header response
-    int header_length = snprintf(response, max_response_size,
-                                 "%s\n"
-                                 "Date: %s\n"
-                                 "Connection: close\n"
-                                 "Content-Length: %i\n"
-                                 "Content-Type: %s\n"
-                                 "\n",
-                                 header, response_format, content_length, content_type);
+// Reverse proxied prefixes, routed on every host
+static struct upstream *upstreams;
 
-    // APPEND body into response buffer after header
-    memcpy(response + header_length, body, content_length);
+// Worker threads still running, so stopping can wait for them
+static int workers = 0;
+static pthread_mutex_t workers_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workers_done = PTHREAD_COND_INITIALIZER;
 
-    // INIT response_length of body and header
-    int response_length = header_length + content_length;
-
-    // Send it all!
-    int rv = send(fd, response, response_length, 0);
+typedef struct
+{
+    int sockfd;
+    int tls; // Connection came in on the TLS listener
+    struct vhosts *vhosts;
+    struct ratelimit *ratelimit; // Released when the connection closes
+    struct sockaddr_storage addr;
+} thread_config_t;
 
-    if (rv < 0)
-    {
-        perror("send");
-    }
+// A shared-nothing slice of the server. With shards configured there is
+// one per core, with its own listeners, front stage, sites and caches,
+// every thread of it pinned to the core, so its connections never move.
+// Without, the one shard is the whole server and the main thread runs it
+struct shard {
+    int index; // Also the number of its front stage
+    int cpu; // -1 when not pinned
+    struct vhosts *vhosts;
+    thread_config_t worker; // What its connections' workers are started with
+    struct pollfd listeners[3]; // HTTP, HTTPS (-1 for none), and an eventfd that stops its thread
+    struct postlog *postlog; // Shared by every shard
+    struct slab *warm; // Its default site's warm tier, NULL for none
+    pthread_t thread;
+};
 
-    return rv;
-}
+static struct shard *shards;
+static int shard_count = 1;
+static pthread_barrier_t shards_up; // Every shard thread has its sites
 
 /**
  * Send a /d20 endpoint response
  */
-void get_d20(int fd)
+void get_d20(struct request *req)
 {
     // Generate a random number between 1 and 20 inclusive
 
@@ -119,330 +148,1759 @@ void get_d20(int fd)
     char buff_number[4];
 
     // GET random number into the buffer
-    sprintf(buff_number, "%d", random_number);
+    int byte_length = snprintf(buff_number, sizeof buff_number, "%d", random_number);
 
-    // INIT byte_counter from buffer
-    int byte_length = 0;
-
-    // FOR every number inside the buffer
-    for (int i = 0; buff_number[i] != '\0'; i++)
+    // Stream it back as text/plain data, no Content-Length needed up front
+    struct response resp;
+    if (response_begin(&resp, req, "HTTP/1.1 200 OK", "text/plain") == 0)
     {
-        // COUNTER UP byte_length
-        byte_length++;
+        response_write(&resp, buff_number, byte_length);
+        response_finish(&resp);
     }
-    // ENDFOR
-
-    // Use send_response() to send it back as text/plain data
-    send_response(fd, "HTTP/1.1 200 OK", "text/plain", buff_number, byte_length);
 }
 
 /**
- * Send a 404 response
+ * Send a 404 response, with the 404.html in files
  */
-void resp_404(int fd)
+void resp_404(struct request *req, char *files)
 {
     char filepath[4096];
     struct file_data *filedata;
     char *mime_type;
 
     // Fetch the 404.html file
-    snprintf(filepath, sizeof filepath, "%s/404.html", SERVER_FILES);
+    snprintf(filepath, sizeof filepath, "%s/404.html", files);
     filedata = file_load(filepath);
 
     if (filedata == NULL)
     {
         fprintf(stderr, "cannot find system 404 file\n");
-        send_response(fd, "HTTP/1.1 404 NOT FOUND", "text/plain", "", 0);
+        send_response(req, "HTTP/1.1 404 NOT FOUND", "text/plain", "", 0);
     }
     else
     {
         mime_type = mime_type_get(filepath);
-        send_response(fd, "HTTP/1.1 404 NOT FOUND", mime_type, filedata->data, filedata->size);
+        send_response(req, "HTTP/1.1 404 NOT FOUND", mime_type, filedata->data, filedata->size);
         file_free(filedata);
     }
 }
 
 /**
- * Read and return a file from disk or cache
+ * Open a request path beneath the host's root, else beneath its assets
+ *
+ * Returns the descriptor with st filled in, or -1.
+ */
+static int open_static(struct vhost *host, char *request_path, struct stat *st)
+{
+    for (int i = 0; host->roots[i] != NULL; i++)
+    {
+        if (host->root_fds[i] < 0)
+        {
+            continue;
+        }
+
+        int fd = file_open_beneath(host->root_fds[i], request_path);
+        if (fd >= 0)
+        {
+            if (fstat(fd, st) == 0)
+            {
+                return fd;
+            }
+            close(fd);
+        }
+    }
+
+    return -1;
+}
+
+int serve_static(struct request *req, struct vhost *host, char *request_path, int index);
+int serve_directory(struct request *req, struct vhost *host, char *dir_path);
+
+/**
+ * Read and return a file from disk, putting it in the host's cache
+ *
+ * If claimed is set the caller holds the cache's load claim on
+ * request_path, which is handed back as soon as the outcome is known.
+ * A directory is answered with its index.html, or its listing, if index
+ * is set.
+ *
+ * Returns 0 once answered, -1 if there is no such file and nothing was
+ * sent.
  */
-void get_file(int fd, struct cache *cache, char *request_path, char *filepath)
+int get_file(struct request *req, struct vhost *host, char *request_path, int claimed, int index)
 {
+    struct cache *cache = host->cache;
     // INIT file attributes
-    struct file_data *filedata;
-    char *mime_type;
+    struct file_data *filedata = NULL;
+    char *mime_type = mime_type_get(request_path);
     time_t cache_date_created;
+    struct stat st;
 
-    filedata = file_load(filepath);
+    int file_fd = open_static(host, request_path, &st);
+
+    // IF path is a directory THEN serve its index.html instead
+    if (file_fd >= 0 && S_ISDIR(st.st_mode))
+    {
+        close(file_fd);
+        if (claimed)
+        {
+            cache_unclaim(cache, request_path);
+        }
+        return index ? serve_directory(req, host, request_path) : -1;
+    }
+
+    // IF file is too big to cache THEN stream it straight from disk
+    if (file_fd >= 0 && S_ISREG(st.st_mode) && st.st_size > config.cache_max_file)
+    {
+        if (claimed)
+        {
+            cache_unclaim(cache, request_path);
+        }
+        send_file_response(req, "HTTP/1.1 200 OK", mime_type, file_fd, st.st_size);
+        close(file_fd);
+        return 0;
+    }
+
+    if (file_fd >= 0)
+    {
+        filedata = file_load_fd(file_fd);
+        close(file_fd);
+    }
+
+    if (claimed && filedata == NULL)
+    {
+        cache_unclaim(cache, request_path);
+    }
 
     // IF file exist in root
-    if (filedata != NULL)
+    if (filedata == NULL)
     {
-        mime_type = mime_type_get(filepath);
-        time(&cache_date_created);
-        // PUT file into cache
-        cache_put(cache, request_path, mime_type, filedata->data, filedata->size, cache_date_created);
-        // THEN send that file to client
-        send_response(fd, "HTTP/1.1 200 OK", mime_type, filedata->data, filedata->size);
+        return -1;
     }
-    else
+
+    time(&cache_date_created);
+    // PUT file into cache
+    cache_put(cache, request_path, mime_type, filedata->data, filedata->size, cache_date_created);
+    if (claimed)
     {
-        resp_404(fd);
+        cache_unclaim(cache, request_path);
     }
+    // THEN send that file to client
+    send_response(req, "HTTP/1.1 200 OK", mime_type, filedata->data, filedata->size);
+    file_free(filedata);
+
+    return 0;
 }
 
 /**
- * Search for the end of the HTTP header
- *
- * "Newlines" in HTTP can be \r\n (carriage return followed by newline) or \n
- * (newline) or \r (carriage return).
+ * Return true if the request asks for a listing as JSON rather than HTML
  */
-char *find_start_of_body(char *request)
+static int wants_json(struct request *req)
 {
-    char *body = strstr(request, "\r\n\r\n");
-
-    strlcpy(body, body + 4, strlen(body));
-    strlcat(body, "\n", strlen(body) + 2);
+    char *query = strchr(req->path, '?');
+    char *accept = request_header(req, "Accept");
 
-    return body;
+    return (query != NULL && strstr(query, AUTOINDEX_JSON + 1) != NULL) ||
+           (accept != NULL && strstr(accept, "application/json") != NULL);
 }
 
 /**
- * 
- * Handle save file for body from post request
+ * Serve a directory's listing from the host's cache, rendering it on a
+ * miss
  *
- **/
-void save_post(int postfd, char *body)
+ * The watcher drops a listing when names in its directory change.
+ * Returns 0 once answered, -1 if there is no such directory and nothing
+ * was sent.
+ */
+static int serve_autoindex(struct request *req, struct vhost *host, char *dir_path)
 {
-    // INIT file attributes
-    char jsonpath[2048];
-    struct file_data *filedata;
-    char *mime_type = NULL;
+    struct cache *cache = host->cache;
+    int json = wants_json(req);
+    char *content_type = json ? "application/json" : "text/html";
+    char listing_path[sizeof req->path + 1];
+    char key[sizeof req->path + sizeof AUTOINDEX_JSON];
+    struct stat st;
 
-    snprintf(jsonpath, sizeof jsonpath, "%s/post.json", SERVER_ROOT);
+    if (autoindex_key(listing_path, sizeof listing_path, dir_path, 0) < 0 ||
+        autoindex_key(key, sizeof key, dir_path, json) < 0)
+    {
+        return -1;
+    }
 
-    filedata = file_load(jsonpath);
+    // IF cached, and fresh or already being rendered again THEN serve it
+    int claimed;
+    struct cache_entry *listing_entry = cache_get_or_claim(cache, key, &claimed);
+    if (listing_entry != NULL)
+    {
+        if (host->watched || difftime(time(NULL), listing_entry->created_at) <= CONFIG_GET(&config, cache_ttl) ||
+            !cache_claim(cache, key))
+        {
+            send_cached_response(req, "HTTP/1.1 200 OK", listing_entry->content_type, listing_entry->content,
+                                 listing_entry->content_length, &listing_entry->h2_head);
+            cache_release(cache, listing_entry);
+            return 0;
+        }
+        cache_release(cache, listing_entry);
+        claimed = 1;
+    }
 
-    
-    if (filedata != NULL)
+    // RENDER it in one pass over the directory
+    struct file_data *listing = NULL;
+    int dir_fd = open_static(host, dir_path, &st);
+
+    if (dir_fd >= 0)
     {
-        if (mime_type == NULL) mime_type = mime_type_get(jsonpath);
-        send_response(postfd, "HTTP/1.1 200 OK", mime_type, filedata->data, filedata->size);
-        file_free(filedata);
+        if (S_ISDIR(st.st_mode))
+        {
+            listing = autoindex_render(dir_fd, listing_path, json);
+        }
+        close(dir_fd);
     }
 
-    // INIT file descriptor for saving file
-    postfd = open("post_data.txt", O_CREAT | O_WRONLY | O_APPEND, 0644);
-    if (postfd < 0)
+    if (listing != NULL)
     {
-        perror("r1");
-        exit(1);
+        cache_put(cache, key, content_type, listing->data, listing->size, time(NULL));
+    }
+    if (claimed)
+    {
+        cache_unclaim(cache, key);
+    }
+    if (listing == NULL)
+    {
+        return -1;
     }
 
-    // WRITE into the file
-    write(postfd, body, strlen(body));
-    
-    close(postfd);
+    send_response(req, "HTTP/1.1 200 OK", content_type, listing->data, listing->size);
+    file_free(listing);
+
+    return 0;
 }
 
 /**
- * Handle HTTP request and send response
+ * Answer for a directory: its index.html, else its listing if the host
+ * has autoindex on
+ *
+ * Returns 0 once answered, -1 if there is neither and nothing was sent.
  */
-void handle_http_request(int fd, struct cache *cache)
+int serve_directory(struct request *req, struct vhost *host, char *dir_path)
 {
-    const int request_buffer_size = 65536; // 64K
-    char request[request_buffer_size];
-    // RESET request for remaining values
-    memset(request, 0, request_buffer_size);
-    // INIT filepath
-    char filepath[4096];
-    // INIT buffer for filepath stats
-    struct stat buffer;
-    // INIT current time of requst
-    time_t request_created_time;
+    char index_path[sizeof req->path + sizeof "/index.html"];
+    size_t len = strlen(dir_path);
 
-    // Read request
-    int bytes_recvd = recv(fd, request, request_buffer_size - 1, 0);
+    snprintf(index_path, sizeof index_path, "%s%sindex.html", dir_path,
+             len > 0 && dir_path[len - 1] == '/' ? "" : "/");
 
-    if (bytes_recvd < 0)
+    if (serve_static(req, host, index_path, 0) == 0)
     {
-        perror("recv");
-        return;
+        return 0;
     }
 
-    // Read the first two components of the first line of the request
+    int autoindex = host->autoindex >= 0 ? host->autoindex : CONFIG_GET(&config, autoindex);
+
+    return autoindex ? serve_autoindex(req, host, dir_path) : -1;
+}
 
-    // INIT variable for http method
-    char http_method[10];
+/**
+ * Send an error response for a request that couldn't be read
+ */
+void resp_request_error(struct request *req, int error)
+{
+    if (error == REQUEST_ERR_TOO_LARGE)
+    {
+        send_response(req, "HTTP/1.1 413 PAYLOAD TOO LARGE", "text/plain", "", 0);
+    }
+    else if (error == REQUEST_ERR_MALFORMED)
+    {
+        send_response(req, "HTTP/1.1 400 BAD REQUEST", "text/plain", "", 0);
+    }
+    // Nobody to answer if the connection is gone
+}
 
-    // INIT variable for file path
-    char request_route[2000];
+/**
+ * Turn away a connection without serving it, the caller closes it
+ *
+ * Plain HTTP clients get a canned 429 (over their limits) or 503 (we are
+ * busy) if the socket takes it at once; TLS clients, which haven't done
+ * a handshake, get nothing.
+ */
+void refuse_connection(int fd, int tls, int status, char *why)
+{
+    char response[128];
+    int len = snprintf(response, sizeof response,
+                       "HTTP/1.1 %d %s\r\n"
+                       "Connection: close\r\n"
+                       "Content-Length: 0\r\n"
+                       "Retry-After: 1\r\n"
+                       "\r\n",
+                       status, status == 429 ? "TOO MANY REQUESTS" : "SERVICE UNAVAILABLE");
 
-    // ASSIGN http method into variable
-    sscanf(request, "%s %s", http_method, request_route);
+    if (!tls)
+    {
+        send(fd, response, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        shutdown(fd, SHUT_WR);
+    }
 
-    // ASSIGN full path from disk
-    snprintf(filepath, sizeof filepath, "%s%s", SERVER_ROOT, request_route);
+    printf("server: refused connection, %s\n", why);
+}
 
-    // GET OS info stats to buffer
-    if (stat(filepath, &buffer) != 0)
+/**
+ * Write a whole buffer to a file
+ */
+static int write_all(int fd, char *buf, int len)
+{
+    while (len > 0)
     {
-        snprintf(filepath, sizeof filepath, "%s%s", SERVER_ASSETS, request_route);
+        int n = write(fd, buf, len);
+
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n < 0) { return -1; }
+
+        buf += n;
+        len -= n;
     }
-    else
+
+    return 0;
+}
+
+/**
+ * 
+ * Handle save file for body from post request
+ *
+ **/
+void save_post(struct vhost *host, struct request *req)
+{
+    struct postlog *postlog = host->postlog;
+    // INIT file attributes
+    char jsonpath[2048];
+    struct file_data *filedata;
+    char *mime_type = NULL;
+    // INIT body chunk, +1 for the newline that ends each record
+    char chunk[REQUEST_BODY_CHUNK + 1];
+    int chunk_length = 0, body_length = 0, n, rv;
+    int spool_fd = -1;
+
+    // READ the body chunk by chunk
+    while ((n = request_body_read(req, chunk + chunk_length, REQUEST_BODY_CHUNK - chunk_length)) > 0)
     {
-        // IF path is a directory
-        if (S_ISDIR(buffer.st_mode))
+        chunk_length += n;
+        body_length += n;
+
+        // IF chunk is full THEN move it to a spool file so memory use stays fixed
+        if (chunk_length == REQUEST_BODY_CHUNK)
         {
-            // THEN normalize requested path to automatic index.html
-            if (request_route[strlen(request_route) - 1] == '/')
+            if (spool_fd < 0)
             {
-                strlcat(request_route, "index.html", sizeof(request_route));
+                spool_fd = postlog_spool_open(postlog);
             }
-            else
+            if (spool_fd < 0 || write_all(spool_fd, chunk, chunk_length) < 0)
             {
-                strlcat(request_route, "/index.html", sizeof(request_route));
+                perror("spool write");
+                send_response(req, "HTTP/1.1 500 INTERNAL SERVER ERROR", "text/plain", "", 0);
+                if (spool_fd >= 0) { close(spool_fd); }
+                return;
             }
-            // ASSIGN normalize path with index.html
-            snprintf(filepath, sizeof filepath, "%s%s", SERVER_ROOT, request_route);
+            chunk_length = 0;
         }
     }
-    time(&request_created_time);
 
-    // If GET, handle the get endpoints
+    // IF body couldn't be read THEN tell the client why
+    if (n < 0)
+    {
+        resp_request_error(req, n);
+        if (spool_fd >= 0) { close(spool_fd); }
+        return;
+    }
+
+    chunk[chunk_length++] = '\n';
+
+    // APPEND body to the log, this returns only after it is on disk
+    if (spool_fd < 0)
+    {
+        rv = postlog_append(postlog, chunk, chunk_length);
+    }
+    else
+    {
+        rv = write_all(spool_fd, chunk, chunk_length);
+        if (rv == 0)
+        {
+            rv = postlog_append_spool(postlog, spool_fd, body_length + 1);
+        }
+        close(spool_fd);
+    }
+
+    if (rv < 0)
+    {
+        send_response(req, "HTTP/1.1 500 INTERNAL SERVER ERROR", "text/plain", "", 0);
+        return;
+    }
+
+    snprintf(jsonpath, sizeof jsonpath, "%s/post.json", host->roots[0]);
+
+    filedata = file_load(jsonpath);
+
+    // THEN acknowledge the client
+    if (filedata != NULL)
+    {
+        if (mime_type == NULL) mime_type = mime_type_get(jsonpath);
+        send_response(req, "HTTP/1.1 200 OK", mime_type, filedata->data, filedata->size);
+        file_free(filedata);
+    }
+    else
+    {
+        send_response(req, "HTTP/1.1 200 OK", "text/plain", "", 0);
+    }
+}
+
+/**
+ * Serve a request path from the host's cache, or from disk on a miss
+ *
+ * A hit costs no system calls at all. See get_file() for index and the
+ * return value.
+ */
+int serve_static(struct request *req, struct vhost *host, char *request_path, int index)
+{
+    struct cache *cache = host->cache;
+    // INIT current time of requst
+    time_t request_created_time;
+
+    time(&request_created_time);
 
-    // IF method is GET
-    if (strcmp(http_method, "GET") == 0)
+    // INIT cached file from requested file_route, or the job of loading it.
+    // Requests that miss while another one loads the file wait for it
+    int claimed;
+    struct cache_entry *founded_file = cache_get_or_claim(cache, request_path, &claimed);
+    // IF file is found from cache_entry
+    if (founded_file != NULL)
     {
-        //    Check if it's /d20 and handle that special case
-        // IF url path is /d20
-        if (strcmp(request_route, "/d20") == 0)
+        // INIT difference in time between entry and request
+        int time_difference = difftime(request_created_time, founded_file->created_at);
+        // IF nothing watches the files and the entry is past its TTL, and
+        // no other request is reloading it already
+        if (!host->watched && time_difference > CONFIG_GET(&config, cache_ttl) && cache_claim(cache, request_path))
         {
-            get_d20(fd);
+            // THEN put a new one, the stale one is served meanwhile
+            cache_release(cache, founded_file);
+            return get_file(req, host, request_path, 1, index);
         }
-        //    Otherwise serve the requested file by calling get_file()
         else
         {
-            // INIT cached file from requested file_route
-            struct cache_entry *founded_file = cache_get(cache, request_route);
-            // IF file is found from cache_entry
-            if (founded_file != NULL)
-            {
-                // INIT difference in time between entry and request
-                int time_difference = difftime(request_created_time, founded_file->created_at);
-                // IF cache entry was stale for 1 minute
-                if (time_difference > 60)
-                {
-                    // THEN remove that entry and put a new one
-                    remove_entry(cache, founded_file);
-                    get_file(fd, cache, request_route, filepath);
-                }
-                else
-                {
-                    // THEN SERVE that file from cache
-                    send_response(fd, "HTTP/1.1 200 OK", founded_file->content_type, founded_file->content, founded_file->content_length);
-                }
-            }
-            // ELSE
-            else
-            {
-                // SERVE that file from disk
-                get_file(fd, cache, request_route, filepath);
-            }
+            // THEN SERVE that file from cache
+            send_cached_response(req, "HTTP/1.1 200 OK", founded_file->content_type, founded_file->content,
+                                 founded_file->content_length, &founded_file->h2_head);
+            cache_release(cache, founded_file);
+            return 0;
         }
     }
-    // (Stretch) If POST, handle the post request
-    else if (strcmp(http_method, "POST") == 0)
-    {
-        // SEND requests into find_start_of_body
-        char *request_body = find_start_of_body(request);
 
-        // SAVE data from body
-        save_post(fd, request_body);
+    // SERVE that file from disk
+    return get_file(req, host, request_path, claimed, index);
+}
+
+/**
+ * Serve a file from the cache or from disk
+ *
+ * Catch-all route handler for GET, arg is the host. The path was
+ * normalized by dispatch_request(), so it can't climb out of the roots.
+ */
+void get_static(struct request *req, struct route_params *params, void *arg)
+{
+    (void)params;
+    struct vhost *host = arg;
+    // INIT the route: the path without its query
+    char request_route[sizeof req->path];
+    size_t len = strcspn(req->path, "?");
+
+    memcpy(request_route, req->path, len);
+    request_route[len] = '\0';
+
+    // A trailing slash asks for a directory
+    int rv = request_route[len - 1] == '/' ? serve_directory(req, host, request_route)
+                                           : serve_static(req, host, request_route, 1);
+    if (rv < 0)
+    {
+        resp_404(req, host->files);
     }
 }
 
 /**
- * 
- * Thread handler for each request
- * 
- */ 
-void *server_thread(void *arg) {
-    thread_config_t *config = (thread_config_t*)arg;
-    int sockfd = config->sockfd;
-    struct cache *cache = config->cache;
-    free(config);
+ * Route handler for GET /d20
+ */
+void handle_d20(struct request *req, struct route_params *params, void *arg)
+{
+    (void)params;
+    (void)arg;
+    get_d20(req);
+}
 
-    unsigned long id = (unsigned long)pthread_self();
-    printf("Thread %lu created to handle connection with socket %d\n", id, sockfd);
-    handle_http_request(sockfd, cache);
-    printf("Thread %lu is done\n", id);
-    close(sockfd);
-    return 0;
+/**
+ * Route handler for POST, arg is the host
+ */
+void handle_post(struct request *req, struct route_params *params, void *arg)
+{
+    (void)params;
+    // SAVE data from body
+    save_post(arg, req);
 }
 
+// What an upstream's route in a host's table is handed
+struct proxy_route {
+    struct upstream *upstream;
+    struct vhost *host; // Its cache keeps the responses that allow it
+};
 
 /**
- * Main
+ * Route handler for an upstream's prefix, any method, arg is the
+ * proxy_route
  */
-int main(void)
+void handle_proxy(struct request *req, struct route_params *params, void *arg)
 {
-    int newfd;                          // listen on sock_fd, new connection on newfd
-    struct sockaddr_storage their_addr; // connector's address information
-    char s[INET6_ADDRSTRLEN];
+    struct proxy_route *route = arg;
 
-    struct cache *cache = cache_create(10, 0);
+    (void)params;
+    // PASS it on to a backend server, unless the host's cache has its response
+    proxy_request(route->upstream, req, route->host->cache);
+}
 
-    // Get a listening socket
-    int listenfd = get_listener_socket(PORT);
+/**
+ * Register a host's endpoints
+ */
+struct router *create_routes(struct vhost *host)
+{
+    struct router *router = router_create();
 
-    if (listenfd < 0)
+    if (router == NULL ||
+        router_add(router, "GET", "/d20", handle_d20, NULL) < 0 ||
+        router_add(router, "GET", "/*", get_static, host) < 0 ||
+        router_add(router, "POST", "/*", handle_post, host) < 0)
     {
-        fprintf(stderr, "webserver: fatal error getting listening socket\n");
-        exit(1);
+        if (router != NULL)
+        {
+            router_free(router);
+        }
+        return NULL;
     }
 
-    printf("webserver: waiting for connections on port %s...\n", PORT);
-
-    // This is the main loop that accepts incoming connections and
-    // responds to the request. The main parent process
-    // then goes back to waiting for new connections.
-
-    while (1)
+    // Upstream prefixes are longer than "/", so they win over the above
+    for (struct upstream *u = upstreams; u != NULL; u = u->next)
     {
-        socklen_t sin_size = sizeof their_addr;
-        // Parent process will block on the accept() call until someone
-        // makes a new connection:
-        newfd = accept(listenfd, (struct sockaddr *)&their_addr, &sin_size);
-        if (newfd == -1)
+        char pattern[CONFIG_PATH_MAX + 1];
+        struct proxy_route *route = malloc(sizeof *route);
+
+        if (route == NULL)
         {
-            perror("accept");
-            continue;
+            router_free(router);
+            return NULL;
         }
-        
-        // Print out a message that we got the connection
-        inet_ntop(their_addr.ss_family,
-                  get_in_addr((struct sockaddr *)&their_addr),
-                  s, sizeof s);
-        printf("server: got connection from %s\n", s);
-        pthread_t thread;
+        route->upstream = u;
+        route->host = host;
 
-        thread_config_t *config = (thread_config_t*)malloc(sizeof(*config));
-        if(!config)
+        snprintf(pattern, sizeof pattern, "%s*", u->prefix);
+        if (router_add(router, "*", pattern, handle_proxy, route) < 0)
         {
-            perror("OOM");
-            continue;
+            free(route);
+            router_free(router);
+            return NULL;
         }
-        config->sockfd = newfd;
-        config->cache = cache;
-        pthread_create(&thread, NULL, server_thread, config);
+    }
+
+    return router;
+}
+
+/**
+ * Run a parsed request through its host's route table, arg is the host
+ * table
+ *
+ * Used for HTTP/1.1 requests and HTTP/2 streams alike.
+ */
+void dispatch_request(struct request *req, void *arg)
+{
+    // FIND the site by Host (HTTP/2's :authority), then the handler for
+    // method and path in its route table
+    struct vhost *host = vhosts_lookup(arg, request_header(req, "Host"));
+
+    // DECODE and normalize the path first, so routes and files only ever
+    // see one spelling of it, and never one that climbs out of the root
+    if (urlpath_normalize(req->path) < 0)
+    {
+        send_response(req, "HTTP/1.1 400 BAD REQUEST", "text/plain", "", 0);
+        return;
+    }
 
-        // newfd is a new socket descriptor for the new connection.
-        // listenfd is still listening for new connections.
+    int rv = router_dispatch(host->router, req);
 
-        pthread_detach(thread);
+    if (rv == ROUTER_NOT_FOUND)
+    {
+        resp_404(req, host->files);
+    }
+    else if (rv == ROUTER_METHOD_NOT_ALLOWED)
+    {
+        send_response(req, "HTTP/1.1 405 METHOD NOT ALLOWED", "text/plain", "", 0);
+    }
+}
+
+/**
+ * Handle HTTP request and send response
+ */
+void handle_http_request(int fd, struct vhosts *vhosts)
+{
+    // INIT parsed request with its header and body buffers
+    struct request req;
+
+    // Read request line and headers, the body is read by the handler
+    int rv = request_read(&req, fd, CONFIG_GET(&config, max_body));
+
+    if (rv < 0)
+    {
+        resp_request_error(&req, rv);
+        return;
+    }
+
+    // IF the client knows we speak HTTP/2 THEN this was the start of its preface
+    if (strcmp(req.method, "PRI") == 0 && strcmp(req.path, "*") == 0)
+    {
+        h2_serve(fd, dispatch_request, vhosts, CONFIG_GET(&config, max_body), NULL,
+                 req.in_pos, req.in_end - req.in_pos, H2_PRI_LINE_LEN);
+        return;
+    }
+
+    // IF the client asked to upgrade to h2c THEN answer this request as stream 1
+    if (h2_upgrade_requested(&req))
+    {
+        h2_serve(fd, dispatch_request, vhosts, CONFIG_GET(&config, max_body), &req,
+                 req.in_pos, req.in_end - req.in_pos, 0);
+        return;
+    }
+
+    dispatch_request(&req, vhosts);
+}
+
+/**
+ * 
+ * Thread handler for each request
+ * 
+ */ 
+void *server_thread(void *arg) {
+    thread_config_t *worker = (thread_config_t*)arg;
+    int sockfd = worker->sockfd;
+    struct vhosts *vhosts = worker->vhosts;
+    int tls = worker->tls;
+
+    unsigned long id = (unsigned long)pthread_self();
+    printf("Thread %lu created to handle connection with socket %d\n", id, sockfd);
+
+#ifdef USE_TLS
+    // The handshake runs here so a slow client can't stall the accept loop
+    if (tls && tls_accept(sockfd) < 0)
+    {
+        fprintf(stderr, "Thread %lu: TLS handshake failed\n", id);
+    }
+    // ALPN picked the protocol during the handshake
+    else if (tls && tls_alpn_h2(sockfd))
+    {
+        h2_serve(sockfd, dispatch_request, vhosts, CONFIG_GET(&config, max_body), NULL, NULL, 0, 0);
+    }
+    else
+#endif
+    handle_http_request(sockfd, vhosts);
+    printf("Thread %lu is done\n", id);
+
+#ifdef USE_TLS
+    if (tls)
+    {
+        tls_close(sockfd);
+    }
+#endif
+    (void)tls;
+
+    conn_close(sockfd);
+    ratelimit_release(worker->ratelimit, (struct sockaddr *)&worker->addr);
+    free(worker);
+
+    pthread_mutex_lock(&workers_lock);
+    if (--workers == 0)
+    {
+        pthread_cond_broadcast(&workers_done);
+    }
+    pthread_mutex_unlock(&workers_lock);
+
+    return 0;
+}
+
+/**
+ * Start a thread to serve a connection
+ *
+ * arg is a thread_config_t with the router and rate limiter filled in.
+ * Returns 0 on success, -1 on error, in which case the connection is
+ * still the caller's to close.
+ */
+int start_worker(int fd, int tls, struct sockaddr_storage *addr, void *arg)
+{
+    thread_config_t *worker = (thread_config_t*)malloc(sizeof(*worker));
+    pthread_t thread;
+    int max_workers = CONFIG_GET(&config, workers);
+
+    if (!worker)
+    {
+        perror("OOM");
+        return -1;
+    }
+    *worker = *(thread_config_t *)arg;
+    worker->sockfd = fd;
+    worker->tls = tls;
+    worker->addr = *addr;
+
+    // IF every worker is busy THEN the client had better come back later
+    pthread_mutex_lock(&workers_lock);
+    if (max_workers > 0 && workers >= max_workers)
+    {
+        pthread_mutex_unlock(&workers_lock);
+        refuse_connection(fd, tls, 503, "all workers busy");
+        free(worker);
+        return -1;
+    }
+    workers++;
+    pthread_mutex_unlock(&workers_lock);
+
+    if (pthread_create(&thread, NULL, server_thread, worker) != 0)
+    {
+        perror("pthread_create");
+        free(worker);
+        pthread_mutex_lock(&workers_lock);
+        workers--;
+        pthread_mutex_unlock(&workers_lock);
+        return -1;
+    }
+    pthread_detach(thread);
+
+    return 0;
+}
+
+/**
+ * Wait up to timeout seconds for every worker thread to finish
+ *
+ * Returns the number of workers still running.
+ */
+int wait_workers(int timeout)
+{
+    struct timespec deadline;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout;
+
+    pthread_mutex_lock(&workers_lock);
+    while (workers > 0 && pthread_cond_timedwait(&workers_done, &workers_lock, &deadline) == 0)
+    {
+    }
+    int left = workers;
+    pthread_mutex_unlock(&workers_lock);
+
+    return left;
+}
+
+/**
+ * Split a cache budget between the shards, 0 staying "no budget"
+ */
+static long long shard_budget(long long budget)
+{
+    return budget > 0 && budget < shard_count ? 1 : budget / shard_count;
+}
+
+/**
+ * Give the default sites' caches, the rate limiter and the deadlines the
+ * tunables in config, after every reload
+ */
+static void apply_config(struct ratelimit *ratelimit)
+{
+    struct conn_timeouts timeouts = {
+        CONFIG_GET(&config, timeout_idle) * 1000,
+        CONFIG_GET(&config, timeout_header) * 1000,
+        CONFIG_GET(&config, timeout_body) * 1000,
+        CONFIG_GET(&config, timeout_write) * 1000,
+    };
+
+    for (int i = 0; i < shard_count; i++)
+    {
+        cache_set_limits(shards[i].vhosts->fallback->cache, shard_budget(CONFIG_GET(&config, cache_entries)),
+                         shard_budget(CONFIG_GET(&config, cache_bytes)));
+    }
+    ratelimit_configure(ratelimit, CONFIG_GET(&config, rate_limit), CONFIG_GET(&config, rate_burst),
+                        CONFIG_GET(&config, max_client_conns));
+    conn_set_timeouts(&timeouts);
+}
+
+/**
+ * Set up a site: its cache, kept fresh by inotify, and its route table
+ *
+ * assets may be "". The cache is warmed from snapshot, then the roots,
+ * once warmup_start() is called on the host's warmup. Returns NULL on
+ * error.
+ */
+static struct vhost *open_vhost(char *name, char *root, char *assets, char *files,
+                                int cache_entries, long long cache_bytes,
+                                char *snapshot, struct postlog *postlog)
+{
+    struct vhost *host = calloc(1, sizeof *host);
+
+    if (host == NULL)
+    {
+        return NULL;
+    }
+
+    host->name = name;
+    host->roots[0] = root;
+    host->roots[1] = assets[0] != '\0' ? assets : NULL;
+    host->files = files;
+    host->postlog = postlog;
+    host->autoindex = -1;
+
+    // OPEN the roots once, every file is resolved beneath them
+    for (int i = 0; i < 2; i++)
+    {
+        host->root_fds[i] = host->roots[i] != NULL ? open(host->roots[i], O_PATH | O_DIRECTORY | O_CLOEXEC) : -1;
+        if (host->roots[i] != NULL && host->root_fds[i] < 0)
+        {
+            fprintf(stderr, "webserver: cannot open %s: %s\n", host->roots[i], strerror(errno));
+        }
+    }
+
+    host->cache = cache_create(cache_entries, 0);
+    host->router = host->cache != NULL ? create_routes(host) : NULL;
+
+    // IF either failed THEN undo the host, before the watcher can see it
+    if (host->router == NULL)
+    {
+        fprintf(stderr, "webserver: error setting up the cache and routes for %s\n", root);
+        if (host->cache != NULL)
+        {
+            cache_free(host->cache);
+        }
+        for (int i = 0; i < 2; i++)
+        {
+            if (host->root_fds[i] >= 0)
+            {
+                close(host->root_fds[i]);
+            }
+        }
+        free(host);
+        return NULL;
+    }
+    cache_set_limits(host->cache, cache_entries, cache_bytes);
+    // Cache hits only set a bit, so they don't serialize the request threads
+    cache_set_eviction(host->cache, CACHE_CLOCK);
+
+    // WATCH the document roots so edits reach the cache at once
+    if (watch_start(host->cache, host->roots, host->root_fds, config.cache_max_file) == 0)
+    {
+        host->watched = 1;
+    }
+    else
+    {
+        fprintf(stderr, "webserver: inotify unavailable for %s, cache entries expire after %d seconds\n",
+                root, config.cache_ttl);
+    }
+
+    host->warmup.cache = host->cache;
+    host->warmup.snapshot = snapshot;
+    host->warmup.roots = host->roots;
+    host->warmup.root_fds = host->root_fds;
+    host->warmup.max_file_size = config.cache_max_file;
+
+    return host;
+}
+
+/**
+ * Set up a shard's sites: the default one from the top-level settings,
+ * and one per [vhost] section, each with its own cache and route table,
+ * then start warming the caches
+ *
+ * Each shard gets its share of the cache budgets. They are read-only
+ * from here on. Exits on error, like the rest of startup.
+ */
+static void open_sites(struct shard *shard)
+{
+    int quiet = shard->index > 0; // The first shard speaks for them all
+    struct vhosts *vhosts = vhosts_create();
+    struct vhost *fallback = open_vhost("", config.root, config.assets, config.files,
+                                        shard_budget(config.cache_entries), shard_budget(config.cache_bytes),
+                                        config.cache_snapshot, shard->postlog);
+
+    if (vhosts == NULL || fallback == NULL)
+    {
+        fprintf(stderr, "webserver: fatal error setting up the default site\n");
+        exit(1);
+    }
+    fallback->warmup.manifest = config.cache_manifest;
+    vhosts_set_fallback(vhosts, fallback);
+
+    for (int i = 0; i < config.vhost_count; i++)
+    {
+        struct config_vhost *cv = &config.vhosts[i];
+        char name[VHOST_NAME_MAX], snapshot[CONFIG_PATH_MAX + VHOST_NAME_MAX];
+
+        // The first name stands for the site, its snapshot is named after it
+        sscanf(cv->names, "%255s", name);
+        snprintf(snapshot, sizeof snapshot, "%s.%s", config.cache_snapshot, name);
+
+        struct vhost *host = open_vhost(strdup(name), cv->root, cv->assets,
+                                        cv->files[0] != '\0' ? cv->files : config.files,
+                                        shard_budget(cv->cache_entries >= 0 ? cv->cache_entries : config.cache_entries),
+                                        shard_budget(cv->cache_bytes >= 0 ? cv->cache_bytes : config.cache_bytes),
+                                        strdup(snapshot), shard->postlog);
+
+        if (host != NULL)
+        {
+            host->autoindex = cv->autoindex;
+        }
+        if (host == NULL || vhosts_add(vhosts, host, cv->names) < 0)
+        {
+            fprintf(stderr, "webserver: fatal error setting up vhost %s\n", name);
+            exit(1);
+        }
+        if (!quiet)
+        {
+            printf("webserver: serving %s from %s\n", cv->names, cv->root);
+        }
+    }
+
+    // BACK the default site's cache with the warm tier IF it has one, its
+    // entries are checked against the files before being promoted
+    if (shard->warm != NULL)
+    {
+        cache_set_warm_tier(fallback->cache, shard->warm, warmup_fresh, &fallback->warmup);
+    }
+
+    // WARM the caches in the background from their last snapshots, then
+    // the manifest or the document roots
+    for (struct vhost *host = vhosts->head; host != NULL; host = host->next)
+    {
+        if (warmup_start(&host->warmup) < 0)
+        {
+            fprintf(stderr, "webserver: cache warm-up of %s not started\n", host->roots[0]);
+        }
+    }
+
+    shard->vhosts = vhosts;
+    shard->worker.vhosts = vhosts;
+}
+
+/**
+ * Save every site's hot cache entries, so the next start doesn't begin cold
+ */
+static void save_snapshots(struct vhosts *vhosts)
+{
+    for (struct vhost *host = vhosts->head; host != NULL; host = host->next)
+    {
+        int saved = cache_snapshot_save(host->cache, host->warmup.snapshot);
+
+        if (saved >= 0)
+        {
+            printf("webserver: saved %d cache entries to %s\n", saved, host->warmup.snapshot);
+        }
+    }
+}
+
+/**
+ * A connection closed before it got a thread, give back its slot
+ */
+void connection_dropped(int fd, int tls, struct sockaddr_storage *addr, void *arg)
+{
+    (void)fd;
+    (void)tls;
+    ratelimit_release(((thread_config_t *)arg)->ratelimit, (struct sockaddr *)addr);
+}
+
+// Set by SIGINT/SIGTERM, the accept loop then shuts down
+static volatile sig_atomic_t stop_requested = 0;
+
+// Set by SIGUSR2, the accept loop then hands its listeners to a new binary
+static volatile sig_atomic_t upgrade_requested = 0;
+
+// Set by SIGHUP, the accept loop then re-reads the configuration
+static volatile sig_atomic_t reload_requested = 0;
+
+static void handle_stop(int sig)
+{
+    if (sig == SIGUSR2)
+    {
+        upgrade_requested = 1;
+    }
+    else if (sig == SIGHUP)
+    {
+        reload_requested = 1;
+    }
+    else
+    {
+        stop_requested = 1;
+    }
+}
+
+/**
+ * Return a shard's HTTP (tls 0) or HTTPS (tls 1) listening socket in
+ * ENV_LISTENERS, handed down by the process we replace, or -1 if there
+ * isn't one
+ */
+static int inherited_listener(int shard, int tls)
+{
+    char *env = getenv(ENV_LISTENERS);
+    int fds[2];
+
+    // SKIP to the shard's pair
+    for (int i = 0; env != NULL && i < shard; i++)
+    {
+        env = strchr(env, ';');
+        env = env != NULL ? env + 1 : NULL;
+    }
+
+    if (env == NULL || sscanf(env, "%d,%d", &fds[0], &fds[1]) != 2 || fds[tls] < 0)
+    {
+        return -1;
+    }
+
+    // MAKE SURE it really is one, the variable could be stale
+    int listening = 0;
+    socklen_t len = sizeof listening;
+
+    if (getsockopt(fds[tls], SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) < 0 || !listening)
+    {
+        return -1;
+    }
+
+    return fds[tls];
+}
+
+/**
+ * Close the listeners handed down for shards from the first one we don't
+ * have on, when we run fewer than the process we replace
+ *
+ * Connections queued on them are lost, but left open their SO_REUSEPORT
+ * group would keep handing them new ones nobody accepts.
+ */
+static void close_inherited_listeners(int from)
+{
+    int closed = 0;
+
+    for (int shard = from;; shard++)
+    {
+        int fds[2] = { inherited_listener(shard, 0), inherited_listener(shard, 1) };
+
+        if (fds[0] < 0 && fds[1] < 0)
+        {
+            break;
+        }
+        for (int tls = 0; tls < 2; tls++)
+        {
+            if (fds[tls] >= 0)
+            {
+                close(fds[tls]);
+                closed++;
+            }
+        }
+    }
+
+    if (closed > 0)
+    {
+        fprintf(stderr, "webserver: closed %d listeners of shards we don't run\n", closed);
+    }
+}
+
+/**
+ * Tell the process we replace that we are taking connections
+ */
+static void report_ready(void)
+{
+    char *env = getenv(ENV_READY);
+
+    if (env != NULL)
+    {
+        int fd = atoi(env);
+
+        if (write(fd, "1", 1) < 0)
+        {
+            perror("report ready");
+        }
+        close(fd);
+    }
+
+    unsetenv(ENV_READY);
+    unsetenv(ENV_LISTENERS);
+}
+
+/**
+ * Start exe as a new server that takes over the listening sockets
+ *
+ * The new process gets every shard's listeners and a pipe, and nothing
+ * else of ours. Its shards accept from the same sockets as ours, so
+ * nothing queued is lost and a SO_REUSEPORT group keeps the sockets its
+ * steering was built for. signals is the signal mask it should start
+ * with.
+ *
+ * Returns 0 once it reports it is up, -1 if it didn't come up, in which
+ * case it has been killed.
+ */
+static int upgrade(char *exe, char **argv, sigset_t *signals)
+{
+    extern char **environ;
+    char ready_env[32];
+    int ready[2];
+
+    if (pipe2(ready, O_CLOEXEC) < 0)
+    {
+        perror("upgrade pipe");
+        return -1;
+    }
+
+    // BUILD the new process's environment before forking, after that
+    // only async-signal-safe calls are allowed
+    int n = 0;
+    while (environ[n] != NULL)
+    {
+        n++;
+    }
+
+    int keep_count = 2 * shard_count + 1;
+    size_t env_size = sizeof ENV_LISTENERS + 24 * shard_count;
+    char **envp = malloc((n + 3) * sizeof *envp);
+    char *listeners_env = malloc(env_size);
+    int *keep = malloc(keep_count * sizeof *keep);
+
+    if (envp == NULL || listeners_env == NULL || keep == NULL)
+    {
+        perror("OOM");
+        free(envp);
+        free(listeners_env);
+        free(keep);
+        close(ready[0]);
+        close(ready[1]);
+        return -1;
+    }
+
+    int j = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (strncmp(environ[i], ENV_LISTENERS "=", sizeof ENV_LISTENERS) != 0 &&
+            strncmp(environ[i], ENV_READY "=", sizeof ENV_READY) != 0)
+        {
+            envp[j++] = environ[i];
+        }
+    }
+
+    // LIST every shard's pair, in shard order
+    int len = snprintf(listeners_env, env_size, ENV_LISTENERS "=");
+
+    for (int i = 0; i < shard_count; i++)
+    {
+        len += snprintf(listeners_env + len, env_size - len, "%s%d,%d", i > 0 ? ";" : "",
+                        shards[i].listeners[0].fd, shards[i].listeners[1].fd);
+        keep[2 * i] = shards[i].listeners[0].fd;
+        keep[2 * i + 1] = shards[i].listeners[1].fd;
+    }
+    keep[keep_count - 1] = ready[1];
+
+    snprintf(ready_env, sizeof ready_env, ENV_READY "=%d", ready[1]);
+    envp[j++] = listeners_env;
+    envp[j++] = ready_env;
+    envp[j] = NULL;
+
+    // SORT the descriptors to keep, everything else above stdio is closed
+    for (int i = 1; i < keep_count; i++)
+    {
+        for (int k = i; k > 0 && keep[k - 1] > keep[k]; k--)
+        {
+            int t = keep[k];
+            keep[k] = keep[k - 1];
+            keep[k - 1] = t;
+        }
+    }
+
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        unsigned int from = 3;
+
+        for (int i = 0; i < keep_count; i++)
+        {
+            if (keep[i] >= (int)from)
+            {
+                if (keep[i] > (int)from)
+                {
+                    close_range(from, keep[i] - 1, 0);
+                }
+                from = keep[i] + 1;
+            }
+        }
+        close_range(from, ~0U, 0);
+
+        fcntl(ready[1], F_SETFD, 0);
+        sigprocmask(SIG_SETMASK, signals, NULL);
+        execve(exe, argv, envp);
+        _exit(127);
+    }
+
+    free(envp);
+    free(listeners_env);
+    free(keep);
+    close(ready[1]);
+
+    if (pid < 0)
+    {
+        perror("fork");
+        close(ready[0]);
+        return -1;
+    }
+
+    // WAIT for it to report, it closing the pipe without means it died
+    struct pollfd p = { .fd = ready[0], .events = POLLIN };
+    char c;
+    int up = poll(&p, 1, CONFIG_GET(&config, timeout_upgrade) * 1000) == 1 && read(ready[0], &c, 1) == 1;
+
+    close(ready[0]);
+
+    if (!up)
+    {
+        fprintf(stderr, "webserver: new binary %s didn't come up, still serving\n", exe);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+
+    printf("webserver: handed over to process %d\n", (int)pid);
+
+    return 0;
+}
+
+/**
+ * Open a shard's listeners, and the eventfd that stops its thread
+ *
+ * Each shard takes over those of the same shard of the process we
+ * replace, if any. With reuseport every shard gets sockets of its own on
+ * the ports. Returns 0 on success, -1 if there is no HTTP listener.
+ */
+static int open_listeners(struct shard *shard, int reuseport, int tls_ready)
+{
+    int fd = inherited_listener(shard->index, 0);
+
+    shard->listeners[0] = (struct pollfd){ .fd = fd >= 0 ? fd : get_listener_socket(config.port, config.backlog, reuseport),
+                                           .events = POLLIN };
+    shard->listeners[1] = (struct pollfd){ .fd = -1, .events = POLLIN };
+    shard->listeners[2] = (struct pollfd){ .fd = reuseport ? eventfd(0, EFD_CLOEXEC) : -1, .events = POLLIN };
+
+    // An HTTPS listener handed down is no use without the certificate
+    fd = inherited_listener(shard->index, 1);
+    if (!tls_ready && fd >= 0)
+    {
+        close(fd);
+    }
+    else if (tls_ready)
+    {
+        shard->listeners[1].fd = fd >= 0 ? fd : get_listener_socket(config.tls_port, config.backlog, reuseport);
+    }
+
+    // Don't block, accept_connections() takes them until there are none
+    for (int tls = 0; tls < 2; tls++)
+    {
+        if (shard->listeners[tls].fd >= 0)
+        {
+            fcntl(shard->listeners[tls].fd, F_SETFL, fcntl(shard->listeners[tls].fd, F_GETFL) | O_NONBLOCK);
+        }
+    }
+
+    return shard->listeners[0].fd >= 0 ? 0 : -1;
+}
+
+/**
+ * Take a connection from one of a shard's listeners into its front
+ * stage, unless the client is over its limits
+ */
+static void take_connection(struct shard *shard, int tls, int newfd, struct sockaddr_storage *their_addr)
+{
+    struct ratelimit *ratelimit = shard->worker.ratelimit;
+
+    // IF the client is over its limits THEN turn it away before it
+    // gets a thread
+    int limited = ratelimit_acquire(ratelimit, (struct sockaddr *)their_addr);
+    if (limited != RATELIMIT_OK)
+    {
+        refuse_connection(newfd, tls, 429, limited == RATELIMIT_CONNS ? "too many open" : "rate limit reached");
+        close(newfd);
+        return;
+    }
+
+    // SIZE the socket buffers IF this host is tuned to
+    int sndbuf = CONFIG_GET(&config, sndbuf);
+    int rcvbuf = CONFIG_GET(&config, rcvbuf);
+
+    if (sndbuf > 0)
+    {
+        setsockopt(newfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof sndbuf);
+    }
+    if (rcvbuf > 0)
+    {
+        setsockopt(newfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+    }
+
+    // Print out a message that we got the connection, IF anyone wants
+    // to read it; the address is only formatted for this
+    if (CONFIG_GET(&config, log_connections))
+    {
+        char s[INET6_ADDRSTRLEN];
+
+        inet_ntop(their_addr->ss_family,
+                  get_in_addr((struct sockaddr *)their_addr),
+                  s, sizeof s);
+        printf("server: got connection from %s\n", s);
+    }
+
+    // newfd is a new socket descriptor for the new connection.
+    // The listener is still listening for new connections.
+
+    // IF the front stage can't take it THEN it gets a thread at once
+    if (conn_add(newfd, tls, their_addr, shard->index, &shard->worker) < 0 &&
+        start_worker(newfd, tls, their_addr, &shard->worker) < 0)
+    {
+        close(newfd);
+        ratelimit_release(ratelimit, (struct sockaddr *)their_addr);
+    }
+}
+
+/**
+ * Take every connection waiting on one of a shard's listeners
+ *
+ * The listeners don't block, so one wakeup drains the queue until accept
+ * says there is nothing left, up to ACCEPT_BATCH so the other listener
+ * isn't kept waiting behind a flood. Accepted sockets stay blocking, the
+ * workers read and write them that way.
+ */
+static void accept_connections(struct shard *shard, int tls)
+{
+    for (int i = 0; i < ACCEPT_BATCH; i++)
+    {
+        struct sockaddr_storage their_addr; // connector's address information
+        socklen_t sin_size = sizeof their_addr;
+
+        int newfd = accept4(shard->listeners[tls].fd, (struct sockaddr *)&their_addr, &sin_size, SOCK_CLOEXEC);
+        if (newfd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED) { continue; }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) { perror("accept"); }
+            return;
+        }
+
+        take_connection(shard, tls, newfd, &their_addr);
+    }
+}
+
+/**
+ * A shard's thread: set up its sites from its own core, so their memory
+ * comes from the core's NUMA node, then accept on its listeners until
+ * its eventfd says to stop
+ */
+static void *shard_thread(void *arg)
+{
+    struct shard *shard = arg;
+
+    if (affinity_local_memory() < 0)
+    {
+        perror("set_mempolicy");
+    }
+
+    open_sites(shard);
+    pthread_barrier_wait(&shards_up);
+
+    for (;;)
+    {
+        if (poll(shard->listeners, 3, -1) < 0)
+        {
+            if (errno != EINTR) { perror("poll"); }
+            continue;
+        }
+
+        if (shard->listeners[2].revents & POLLIN)
+        {
+            return NULL;
+        }
+
+        for (int tls = 0; tls < 2; tls++)
+        {
+            if (shard->listeners[tls].fd >= 0 && (shard->listeners[tls].revents & POLLIN))
+            {
+                accept_connections(shard, tls);
+            }
+        }
+    }
+}
+
+/**
+ * Start a shard's thread, pinned to its core
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int start_shard(struct shard *shard)
+{
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    affinity_attr(&attr, shard->cpu);
+
+    int rv = pthread_create(&shard->thread, &attr, shard_thread, shard);
+    pthread_attr_destroy(&attr);
+
+    if (rv != 0)
+    {
+        return -1;
+    }
+
+    int node = affinity_node(shard->cpu);
+    printf("webserver: shard %d on core %d, NUMA node %d\n", shard->index, shard->cpu, node);
+
+    return 0;
+}
+
+/**
+ * Main
+ */
+int main(int argc, char **argv)
+{
+    int upgraded = 0;
+
+    // READ the config file and command line
+    if (config_parse(&config, argc, argv) < 0)
+    {
+        fprintf(stderr, "webserver: fatal error in the configuration, see %s --help\n", argv[0]);
+        exit(1);
+    }
+
+    if (strcmp(config.engine, "threads") != 0)
+    {
+        fprintf(stderr, "webserver: the %s engine isn't built in, using threads\n", config.engine);
+    }
+
+    // REMEMBER where the binary is, a new one installed there is what
+    // SIGUSR2 starts
+    static char exe[PATH_MAX];
+    ssize_t exe_len = readlink("/proc/self/exe", exe, sizeof exe - 1);
+
+    if (exe_len > 0)
+    {
+        exe[exe_len] = '\0';
+    }
+    else
+    {
+        snprintf(exe, sizeof exe, "%s", argv[0]);
+    }
+
+    // BLOCK the stop, upgrade and reload signals in every thread, the
+    // accept loop alone takes them in ppoll()
+    sigset_t stop_signals, accept_mask;
+    struct sigaction sa;
+
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    sigaddset(&stop_signals, SIGUSR2);
+    sigaddset(&stop_signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, &accept_mask);
+
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = handle_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+
+    // KEEP cache contents in huge pages IF asked to, before any thread
+    // can allocate them
+    if (config.cache_hugepages > 0)
+    {
+        int kind = hugemem_init(config.cache_hugepages);
+
+        if (kind < 0)
+        {
+            fprintf(stderr, "webserver: cache contents go in ordinary pages\n");
+        }
+        else
+        {
+            printf("webserver: cache contents in %lld MB of %s huge pages\n",
+                   (config.cache_hugepages + HUGEMEM_PAGE - 1) / HUGEMEM_PAGE * HUGEMEM_PAGE / (1024 * 1024),
+                   kind == HUGEMEM_HUGETLB ? "reserved" : "transparent");
+        }
+    }
+
+    // Open the POST log, its writer thread group-commits all appends
+    struct postlog *postlog = postlog_open(config.post_log);
+
+    if (postlog == NULL)
+    {
+        fprintf(stderr, "webserver: fatal error opening %s\n", config.post_log);
+        exit(1);
+    }
+
+    // SET UP the upstreams first, every site routes to them
+    struct upstream **upstream_tail = &upstreams;
+
+    for (int i = 0; i < config.upstream_count; i++)
+    {
+        struct upstream *u = upstream_create(&config.upstreams[i]);
+
+        if (u == NULL || upstream_start_checks(u) < 0)
+        {
+            fprintf(stderr, "webserver: fatal error setting up upstream %s\n", config.upstreams[i].name);
+            exit(1);
+        }
+        u->store_max = config.cache_max_file;
+        *upstream_tail = u;
+        upstream_tail = &u->next;
+        printf("webserver: passing %s to %s\n", u->prefix, config.upstreams[i].servers);
+    }
+
+    // Limit each client's connection rate and open connections. Loopback is
+    // exempt: it is either us, or a proxy speaking for many clients
+    struct ratelimit *ratelimit = ratelimit_create(config.rate_limit, config.rate_burst, config.max_client_conns, 1);
+
+    if (ratelimit == NULL)
+    {
+        fprintf(stderr, "webserver: fatal error creating the rate limiter\n");
+        exit(1);
+    }
+
+    // SPLIT the server into shards IF asked to, one per core we may run on
+    static int cpus[AFFINITY_CPUS_MAX];
+    int cpu_count = config.shards > 0 ? affinity_cpus(cpus, AFFINITY_CPUS_MAX) : 0;
+    int sharded = cpu_count > 0;
+
+    if (config.shards > 0 && !sharded)
+    {
+        fprintf(stderr, "webserver: can't tell which cores to run on, running without shards\n");
+    }
+    else if (sharded && config.shards > cpu_count)
+    {
+        fprintf(stderr, "webserver: %d shards on %d cores, some share one\n", config.shards, cpu_count);
+    }
+
+    shard_count = sharded ? config.shards : 1;
+    shards = calloc(shard_count, sizeof *shards);
+    int *shard_cpus = calloc(shard_count, sizeof *shard_cpus);
+
+    if (shards == NULL || shard_cpus == NULL)
+    {
+        fprintf(stderr, "webserver: fatal error setting up shards\n");
+        exit(1);
+    }
+
+    // BACK the first shard's default site with a warm tier on disk
+    struct slab *slab = config.cache_slab_size > 0 ? slab_open(config.cache_slab, config.cache_slab_size) : NULL;
+
+    if (slab == NULL && config.cache_slab_size > 0)
+    {
+        fprintf(stderr, "webserver: running without a warm cache tier\n");
+    }
+
+    for (int i = 0; i < shard_count; i++)
+    {
+        shards[i].index = i;
+        shards[i].cpu = sharded ? cpus[i % cpu_count] : -1;
+        shards[i].worker.ratelimit = ratelimit;
+        shards[i].postlog = postlog;
+        shards[i].warm = i == 0 ? slab : NULL;
+        shard_cpus[i] = shards[i].cpu;
+    }
+
+    // WAIT for request heads on one thread per shard, so a connection only
+    // gets a thread of its own once there is a request to serve, and
+    // enforce every connection's deadlines
+    struct conn_timeouts timeouts = {
+        config.timeout_idle * 1000, config.timeout_header * 1000,
+        config.timeout_body * 1000, config.timeout_write * 1000
+    };
+    static struct conn_handlers handlers = { start_worker, connection_dropped };
+
+    if (conn_start(&timeouts, &handlers, sharded ? shard_cpus : NULL, shard_count) < 0)
+    {
+        fprintf(stderr, "webserver: running without connection deadlines\n");
+    }
+
+    // Get the listening sockets, each shard's are those of the same
+    // shard of the process we replace if any
+    int tls_ready = 0;
+#ifdef USE_TLS
+    tls_ready = tls_init(config.tls_cert, config.tls_key) == 0;
+#endif
+
+    for (int i = 0; i < shard_count; i++)
+    {
+        if (open_listeners(&shards[i], sharded, tls_ready) < 0)
+        {
+            fprintf(stderr, "webserver: fatal error getting listening socket\n");
+            exit(1);
+        }
+    }
+    close_inherited_listeners(shard_count);
+
+    printf("webserver: waiting for connections on port %s...\n", config.port);
+    printf("webserver: scanning request heads with %s\n", scan_level_name(scan_level()));
+#ifdef USE_TLS
+    if (shards[0].listeners[1].fd < 0)
+    {
+        fprintf(stderr, "webserver: TLS disabled, need %s and %s (make certs)\n", config.tls_cert, config.tls_key);
+    }
+    else
+    {
+        printf("webserver: waiting for TLS connections on port %s...\n", config.tls_port);
+    }
+#endif
+
+    // STEER each connection to the shard of the core its packets arrive
+    // on, IF the shards are the cores 0 to n-1 one to one; else drop any
+    // steering the process we replace left on the sockets, it was built
+    // for its shards
+    int one_to_one = sharded && shard_count == cpu_count && cpus[shard_count - 1] == shard_count - 1;
+
+    for (int tls = 0; tls < 2; tls++)
+    {
+        int fd = shards[0].listeners[tls].fd;
+
+        if (fd >= 0 && one_to_one && net_steer_by_cpu(fd, shard_count) < 0)
+        {
+            perror("webserver: connections not steered by core");
+        }
+        else if (fd >= 0 && !one_to_one)
+        {
+            net_unsteer(fd);
+        }
+    }
+
+    // SET UP the sites, on the main thread or on every shard's own
+    if (!sharded)
+    {
+        open_sites(&shards[0]);
+    }
+    else
+    {
+        pthread_barrier_init(&shards_up, NULL, shard_count + 1);
+
+        for (int i = 0; i < shard_count; i++)
+        {
+            if (start_shard(&shards[i]) < 0)
+            {
+                fprintf(stderr, "webserver: fatal error starting shard %d\n", i);
+                exit(1);
+            }
+        }
+        pthread_barrier_wait(&shards_up);
+    }
+
+    // This is the main loop that accepts incoming connections and
+    // responds to the request. The main parent process
+    // then goes back to waiting for new connections. With shards, their
+    // threads accept and this loop only takes the signals.
+    struct pollfd *listeners = shards[0].listeners;
+
+    report_ready();
+
+    while (!stop_requested)
+    {
+        // IF asked to upgrade THEN start the new binary on our listeners,
+        // and drain once it is up
+        if (upgrade_requested)
+        {
+            upgrade_requested = 0;
+
+            // SAVE the hot entries for it to warm from, and leave it a
+            // fresh warm tier: it truncates the file ours is mapped from
+            save_snapshots(shards[0].vhosts);
+            if (slab != NULL)
+            {
+                unlink(config.cache_slab);
+            }
+
+            if (upgrade(exe, argv, &accept_mask) == 0)
+            {
+                upgraded = 1;
+                break;
+            }
+            continue;
+        }
+
+        // IF asked to reload THEN take the new tunables, a bad config
+        // file changes nothing
+        if (reload_requested)
+        {
+            static struct config fresh;
+
+            reload_requested = 0;
+
+            if (config_parse(&fresh, argc, argv) == 0)
+            {
+                config_reload(&config, &fresh);
+                apply_config(ratelimit);
+                printf("webserver: configuration reloaded\n");
+            }
+            else
+            {
+                fprintf(stderr, "webserver: configuration not reloaded\n");
+            }
+            continue;
+        }
+
+        // Parent process will block until someone makes a new connection
+        // on either listener, or is told to stop
+        if (ppoll(listeners, sharded ? 0 : 2, NULL, &accept_mask) < 0)
+        {
+            if (errno != EINTR) { perror("poll"); }
+            continue;
+        }
+        for (int tls = 0; tls < 2; tls++)
+        {
+            if (listeners[tls].fd >= 0 && (listeners[tls].revents & POLLIN))
+            {
+                accept_connections(&shards[0], tls);
+            }
+        }
+    }
+
+    // STOP accepting; after an upgrade the new process has every shard's
+    // listeners, closing ours leaves them open
+    for (int i = 0; sharded && i < shard_count; i++)
+    {
+        eventfd_write(shards[i].listeners[2].fd, 1);
+        pthread_join(shards[i].thread, NULL);
+    }
+    for (int i = 0; i < shard_count; i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            if (shards[i].listeners[j].fd >= 0)
+            {
+                close(shards[i].listeners[j].fd);
+            }
+        }
+    }
+
+    // DRAIN: connections with no request yet are closed, requests in
+    // flight get timeout_drain to finish before their sockets are shut down
+    int dropped = conn_drop_waiting();
+    printf("webserver: draining, closed %d idle connections\n", dropped);
+
+    if (wait_workers(config.timeout_drain) > 0)
+    {
+        fprintf(stderr, "webserver: cutting off %d connections still open\n", conn_shutdown_working());
+    }
+
+    // FLUSH the POST log once nothing can append to it any more
+    if (wait_workers(config.timeout_drain) == 0)
+    {
+        postlog_close(postlog);
+    }
+
+    // SAVE the hot entries so the next start doesn't begin cold, unless
+    // the new process is already warming from them. The first shard's
+    // stand for the rest
+    if (!upgraded)
+    {
+        save_snapshots(shards[0].vhosts);
     }
 
-    // Unreachable code
+    printf("webserver: stopped\n");
 
     return 0;
 }
@@ -0,0 +1,380 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
+#include "hashtable.h"
+#include "slab.h"
+
+#define SLAB_MAGIC 0x424c5357 // "WSLB"
+#define SLAB_DEFLATE 1 // Content is zlib-compressed
+
+// Record layout: this header, the path and content type (NUL-terminated),
+// then the stored content, padded so the next record is 8-byte aligned
+struct slab_record
+{
+    uint32_t magic;
+    uint32_t length; // Whole record
+    uint32_t path_length; // Including the NUL
+    uint32_t content_type_length; // Including the NUL
+    uint32_t content_length; // Uncompressed
+    uint32_t stored_length;
+    uint32_t flags;
+    uint32_t reserved;
+    int64_t created_at;
+};
+
+// The index stores offset + 1, so offset 0 isn't mistaken for "not found"
+#define OFFSET_REF(offset) ((void *)(uintptr_t)((offset) + 1))
+#define REF_OFFSET(ref) ((size_t)(uintptr_t)(ref) - 1)
+
+/**
+ * Create the slab file, preallocated to size bytes, and map it
+ *
+ * Whatever the file held before is discarded. Returns NULL on error.
+ */
+struct slab *slab_open(char *filename, size_t size)
+{
+    size &= ~(size_t)7;
+
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        perror("slab open");
+        return NULL;
+    }
+
+    // RESERVE the blocks now, so a full disk shows up here and not as a
+    // SIGBUS when a page is first written
+    int rv = posix_fallocate(fd, 0, size);
+    if (rv != 0)
+    {
+        fprintf(stderr, "slab_open: %s: %s\n", filename, strerror(rv));
+        close(fd);
+        return NULL;
+    }
+
+    char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        perror("slab mmap");
+        close(fd);
+        return NULL;
+    }
+
+    struct slab *slab = calloc(1, sizeof *slab);
+    if (slab == NULL)
+    {
+        munmap(map, size);
+        close(fd);
+        return NULL;
+    }
+
+    slab->fd = fd;
+    slab->map = map;
+    slab->size = size;
+    slab->index = hashtable_create(0, NULL);
+    pthread_mutex_init(&slab->lock, NULL);
+
+    return slab;
+}
+
+/**
+ * Unmap and close the slab
+ */
+void slab_close(struct slab *slab)
+{
+    hashtable_destroy(slab->index);
+    pthread_mutex_destroy(&slab->lock);
+    munmap(slab->map, slab->size);
+    close(slab->fd);
+    free(slab);
+}
+
+/**
+ * Drop the oldest record in the log
+ *
+ * Called with the slab lock held.
+ */
+static void drop_tail(struct slab *slab)
+{
+    struct slab_record *rec = (struct slab_record *)(slab->map + slab->tail);
+    char *path = (char *)(rec + 1);
+
+    // IF the record is still the live one for its path THEN forget the path
+    if (hashtable_get(slab->index, path) == OFFSET_REF(slab->tail))
+    {
+        hashtable_delete(slab->index, path);
+    }
+
+    slab->tail += rec->length;
+    slab->count--;
+
+    if (slab->wrapped && slab->tail >= slab->wrap_at)
+    {
+        slab->tail = 0;
+        slab->wrapped = 0;
+    }
+}
+
+/**
+ * Find length contiguous bytes at head, dropping old records as needed
+ *
+ * Called with the slab lock held. length must not exceed the slab size.
+ */
+static size_t make_room(struct slab *slab, size_t length)
+{
+    for (;;)
+    {
+        if (slab->count == 0)
+        {
+            slab->head = slab->tail = 0;
+            slab->wrapped = 0;
+        }
+
+        if (!slab->wrapped)
+        {
+            if (slab->size - slab->head >= length)
+            {
+                return slab->head;
+            }
+
+            // WRAP to the start, records from tail on stay where they are
+            slab->wrap_at = slab->head;
+            slab->head = 0;
+            slab->wrapped = 1;
+        }
+        else if (slab->tail - slab->head >= length)
+        {
+            return slab->head;
+        }
+        else
+        {
+            drop_tail(slab);
+        }
+    }
+}
+
+/**
+ * Append an entry to the slab, superseding any earlier one for the path
+ *
+ * The content is compressed first if that makes it smaller. Entries bigger
+ * than half the slab are refused rather than flushing everything else.
+ *
+ * Returns 0 on success, -1 if the entry wasn't stored.
+ */
+int slab_put(struct slab *slab, char *path, char *content_type, void *content, int content_length,
+             time_t created_at)
+{
+    void *stored = content;
+    void *compressed = NULL;
+    uint32_t stored_length = content_length;
+    uint32_t flags = 0;
+
+#ifdef USE_ZLIB
+    uLongf compressed_length = compressBound(content_length);
+    compressed = malloc(compressed_length);
+
+    if (compressed != NULL &&
+        compress2(compressed, &compressed_length, content, content_length, Z_BEST_SPEED) == Z_OK &&
+        compressed_length < (uLongf)content_length)
+    {
+        stored = compressed;
+        stored_length = compressed_length;
+        flags = SLAB_DEFLATE;
+    }
+#endif
+
+    struct slab_record rec;
+    rec.magic = SLAB_MAGIC;
+    rec.path_length = strlen(path) + 1;
+    rec.content_type_length = strlen(content_type) + 1;
+    rec.content_length = content_length;
+    rec.stored_length = stored_length;
+    rec.flags = flags;
+    rec.reserved = 0;
+    rec.created_at = created_at;
+
+    size_t length = sizeof rec + rec.path_length + rec.content_type_length + stored_length;
+    length = (length + 7) & ~(size_t)7;
+
+    if (length > slab->size / 2)
+    {
+        free(compressed);
+        return -1;
+    }
+    rec.length = length;
+
+    pthread_mutex_lock(&slab->lock);
+
+    size_t offset = make_room(slab, length);
+    char *p = slab->map + offset;
+
+    memcpy(p, &rec, sizeof rec);
+    p += sizeof rec;
+    memcpy(p, path, rec.path_length);
+    p += rec.path_length;
+    memcpy(p, content_type, rec.content_type_length);
+    p += rec.content_type_length;
+    memcpy(p, stored, stored_length);
+
+    slab->head = offset + length;
+    slab->count++;
+
+    hashtable_delete(slab->index, path);
+    hashtable_put(slab->index, path, OFFSET_REF(offset));
+
+    pthread_mutex_unlock(&slab->lock);
+
+    free(compressed);
+
+    return 0;
+}
+
+/**
+ * Read an entry back from the slab
+ *
+ * Returns a copy, decompressed, to be freed with slab_item_free(), or
+ * NULL if the path isn't in the slab.
+ */
+struct slab_item *slab_get(struct slab *slab, char *path)
+{
+    struct slab_item *item = calloc(1, sizeof *item);
+    void *stored = NULL;
+    struct slab_record rec;
+
+    if (item == NULL)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&slab->lock);
+
+    void *ref = hashtable_get(slab->index, path);
+
+    if (ref != NULL)
+    {
+        char *p = slab->map + REF_OFFSET(ref);
+
+        memcpy(&rec, p, sizeof rec);
+        p += sizeof rec + rec.path_length;
+
+        // COPY out under the lock, decompress after it
+        item->content_type = strdup(p);
+        stored = malloc(rec.stored_length > 0 ? rec.stored_length : 1);
+        if (stored != NULL)
+        {
+            memcpy(stored, p + rec.content_type_length, rec.stored_length);
+        }
+    }
+
+    pthread_mutex_unlock(&slab->lock);
+
+    if (ref == NULL || item->content_type == NULL || stored == NULL)
+    {
+        free(stored);
+        slab_item_free(item);
+        return NULL;
+    }
+
+    item->content_length = rec.content_length;
+    item->created_at = rec.created_at;
+
+    if (!(rec.flags & SLAB_DEFLATE))
+    {
+        item->content = stored;
+        return item;
+    }
+
+#ifdef USE_ZLIB
+    uLongf content_length = rec.content_length;
+    item->content = malloc(content_length > 0 ? content_length : 1);
+
+    if (item->content != NULL &&
+        (uncompress(item->content, &content_length, stored, rec.stored_length) != Z_OK ||
+         content_length != rec.content_length))
+    {
+        free(item->content);
+        item->content = NULL;
+    }
+#endif
+
+    free(stored);
+
+    if (item->content == NULL)
+    {
+        slab_item_free(item);
+        return NULL;
+    }
+
+    return item;
+}
+
+/**
+ * Free an entry returned by slab_get()
+ */
+void slab_item_free(struct slab_item *item)
+{
+    if (item == NULL) { return; }
+    free(item->content_type);
+    free(item->content);
+    free(item);
+}
+
+/**
+ * Forget the entry for a path, its space is reused when the tail passes
+ *
+ * Returns 0 if it was in the slab, -1 if not.
+ */
+int slab_delete(struct slab *slab, char *path)
+{
+    pthread_mutex_lock(&slab->lock);
+    void *ref = hashtable_delete(slab->index, path);
+    pthread_mutex_unlock(&slab->lock);
+
+    return ref != NULL ? 0 : -1;
+}
+
+/**
+ * Forget every entry whose path starts with prefix ("" forgets all)
+ *
+ * Returns the number of entries forgotten.
+ */
+int slab_delete_prefix(struct slab *slab, char *prefix)
+{
+    size_t prefix_len = strlen(prefix);
+    size_t offset;
+    int count = 0, i;
+
+    pthread_mutex_lock(&slab->lock);
+
+    // WALK the log from oldest to newest
+    for (i = 0, offset = slab->tail; i < slab->count; i++)
+    {
+        if (slab->wrapped && offset >= slab->wrap_at)
+        {
+            offset = 0;
+        }
+
+        struct slab_record *rec = (struct slab_record *)(slab->map + offset);
+        char *path = (char *)(rec + 1);
+
+        if (strncmp(path, prefix, prefix_len) == 0 &&
+            hashtable_get(slab->index, path) == OFFSET_REF(offset))
+        {
+            hashtable_delete(slab->index, path);
+            count++;
+        }
+
+        offset += rec->length;
+    }
+
+    pthread_mutex_unlock(&slab->lock);
+
+    return count;
+}
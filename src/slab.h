@@ -0,0 +1,41 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+// The cache's warm tier: one preallocated, mmap'd file written as a ring
+// log. Records are appended at head and the oldest are dropped at tail to
+// make room, so the file is only ever written sequentially.
+struct slab {
+    int fd;
+    char *map;
+    size_t size;
+    size_t head; // Where the next record goes
+    size_t tail; // Oldest record
+    size_t wrap_at; // End of the records before head wrapped to the start
+    int wrapped; // Records run from tail to wrap_at, then from 0 to head
+    int count; // Records in the log, including superseded ones
+    struct hashtable *index; // Path to the offset of its live record
+    pthread_mutex_t lock;
+};
+
+// An entry read back from the slab
+struct slab_item {
+    char *content_type;
+    void *content;
+    int content_length;
+    time_t created_at;
+};
+
+extern struct slab *slab_open(char *filename, size_t size);
+extern void slab_close(struct slab *slab);
+extern int slab_put(struct slab *slab, char *path, char *content_type, void *content, int content_length,
+                    time_t created_at);
+extern struct slab_item *slab_get(struct slab *slab, char *path);
+extern void slab_item_free(struct slab_item *item);
+extern int slab_delete(struct slab *slab, char *path);
+extern int slab_delete_prefix(struct slab *slab, char *prefix);
+
+#endif
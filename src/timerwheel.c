@@ -0,0 +1,151 @@
+#include <stddef.h>
+#include "timerwheel.h"
+
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_SPAN (1UL << (WHEEL_BITS * WHEEL_LEVELS)) // Ticks the wheel reaches
+
+/**
+ * Initialize an empty wheel starting at tick now
+ */
+void timerwheel_init(struct timerwheel *wheel, unsigned long now)
+{
+    wheel->now = now;
+
+    for (int level = 0; level < WHEEL_LEVELS; level++)
+    {
+        for (int i = 0; i < WHEEL_SIZE; i++)
+        {
+            struct timer *head = &wheel->slots[level][i];
+            head->next = head->prev = head;
+        }
+    }
+}
+
+/**
+ * Initialize a timer that isn't armed
+ */
+void timer_init(struct timer *timer, void (*fn)(struct timer *timer, void *arg), void *arg)
+{
+    timer->next = timer->prev = NULL;
+    timer->fn = fn;
+    timer->arg = arg;
+}
+
+/**
+ * Return true if the timer is armed
+ */
+int timer_pending(struct timer *timer)
+{
+    return timer->next != NULL;
+}
+
+/**
+ * Put a timer in the slot its expiry falls in, seen from the current tick
+ *
+ * expires must not be before the current tick.
+ */
+static void insert(struct timerwheel *wheel, struct timer *timer)
+{
+    unsigned long delta = timer->expires - wheel->now;
+    int level = 0;
+
+    while (level < WHEEL_LEVELS - 1 && delta >= 1UL << (WHEEL_BITS * (level + 1)))
+    {
+        level++;
+    }
+
+    struct timer *head = &wheel->slots[level][(timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+/**
+ * Arm a timer to fire at tick expires, re-arming it if it already is
+ *
+ * Expiries in the past fire on the next tick, ones beyond the wheel's
+ * reach are brought in to its last tick.
+ */
+void timerwheel_add(struct timerwheel *wheel, struct timer *timer, unsigned long expires)
+{
+    timerwheel_del(timer);
+
+    if ((long)(expires - wheel->now) <= 0)
+    {
+        expires = wheel->now + 1;
+    }
+    else if (expires - wheel->now >= WHEEL_SPAN)
+    {
+        expires = wheel->now + WHEEL_SPAN - 1;
+    }
+
+    timer->expires = expires;
+    insert(wheel, timer);
+}
+
+/**
+ * Disarm a timer, doing nothing if it isn't armed
+ */
+void timerwheel_del(struct timer *timer)
+{
+    if (timer->next != NULL)
+    {
+        timer->prev->next = timer->next;
+        timer->next->prev = timer->prev;
+        timer->next = timer->prev = NULL;
+    }
+}
+
+/**
+ * Move every timer in a slot to where it belongs now
+ */
+static void cascade(struct timerwheel *wheel, int level)
+{
+    struct timer *head = &wheel->slots[level][(wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    struct timer *timer = head->next;
+
+    head->next = head->prev = head;
+
+    while (timer != head)
+    {
+        struct timer *next = timer->next;
+        insert(wheel, timer);
+        timer = next;
+    }
+}
+
+/**
+ * Advance the wheel to tick now, firing every timer that expires on the way
+ *
+ * A timer's function may re-arm it, or arm and cancel others.
+ */
+void timerwheel_advance(struct timerwheel *wheel, unsigned long now)
+{
+    while ((long)(now - wheel->now) > 0)
+    {
+        wheel->now++;
+
+        // CASCADE each level whose lower level just came full circle
+        for (int level = 1; level < WHEEL_LEVELS; level++)
+        {
+            if ((wheel->now >> (WHEEL_BITS * (level - 1))) & WHEEL_MASK)
+            {
+                break;
+            }
+            cascade(wheel, level);
+        }
+
+        // FIRE this tick's slot, one timer at a time since firing one may
+        // change the others
+        struct timer *head = &wheel->slots[0][wheel->now & WHEEL_MASK];
+
+        while (head->next != head)
+        {
+            struct timer *timer = head->next;
+            timerwheel_del(timer);
+            timer->fn(timer, timer->arg);
+        }
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef _TIMERWHEEL_H_
+#define _TIMERWHEEL_H_
+
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS) // Slots per level
+#define WHEEL_LEVELS 4 // Reaches WHEEL_SIZE^4 ticks ahead
+
+// A timer, embedded in whatever it times out
+struct timer {
+    struct timer *next, *prev; // In a slot's list, NULL when not armed
+    unsigned long expires; // Tick to fire at
+    void (*fn)(struct timer *timer, void *arg);
+    void *arg;
+};
+
+// Hierarchical timing wheel: level 0 has one slot per tick, each higher
+// level's slots span a whole turn of the level below. Timers cascade down
+// a level as their slot comes round, so arming, cancelling and firing are
+// all O(1). Not locked, callers serialize.
+struct timerwheel {
+    unsigned long now; // Current tick
+    struct timer slots[WHEEL_LEVELS][WHEEL_SIZE]; // List heads
+};
+
+extern void timerwheel_init(struct timerwheel *wheel, unsigned long now);
+extern void timer_init(struct timer *timer, void (*fn)(struct timer *timer, void *arg), void *arg);
+extern int timer_pending(struct timer *timer);
+extern void timerwheel_add(struct timerwheel *wheel, struct timer *timer, unsigned long expires);
+extern void timerwheel_del(struct timer *timer);
+extern void timerwheel_advance(struct timerwheel *wheel, unsigned long now);
+
+#endif
@@ -0,0 +1,399 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include "tls.h"
+
+#define TLS_RECORD_SIZE 16384 // Largest TLS record payload
+
+static SSL_CTX *ctx = NULL;
+
+// TLS state of each connection, indexed by socket fd
+static SSL **conns = NULL;
+static int conns_size = 0;
+
+// One lock per connection, an SSL object can't be read and written from
+// two threads at once (HTTP/2 streams send while the reader waits). The
+// holder is also the only thread using the socket, tls_recv() relies on
+// it to switch the socket to non-blocking for a read
+static pthread_mutex_t *locks = NULL;
+
+/**
+ * Return the TLS session on a socket, or NULL for plain connections
+ */
+static SSL *get_conn(int fd)
+{
+    if (fd < 0 || fd >= conns_size)
+    {
+        return NULL;
+    }
+
+    return conns[fd];
+}
+
+/**
+ * Pick h2 when the client offers it, else http/1.1
+ */
+static int select_alpn(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                       const unsigned char *in, unsigned int inlen, void *arg)
+{
+    static unsigned char protos[] = "\x02h2\x08http/1.1";
+    (void)ssl;
+    (void)arg;
+
+    if (SSL_select_next_proto((unsigned char **)out, outlen, protos, sizeof protos - 1, in, inlen) != OPENSSL_NPN_NEGOTIATED)
+    {
+        return SSL_TLSEXT_ERR_NOACK;
+    }
+
+    return SSL_TLSEXT_ERR_OK;
+}
+
+/**
+ * Create the server context from a PEM certificate chain and key
+ *
+ * Sessions can be resumed both from the server-side cache and from
+ * tickets, and kernel TLS is requested so that once the handshake is done
+ * record encryption happens in the kernel and sendfile() keeps working.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int tls_init(char *cert_file, char *key_file)
+{
+    struct rlimit rl;
+
+    ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL)
+    {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION);
+
+    // RESUMPTION from our session cache (TLS 1.2) and from tickets
+    SSL_CTX_set_session_id_context(ctx, (unsigned char *)"webserver", 9);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, 20480);
+    SSL_CTX_set_num_tickets(ctx, 2);
+
+    SSL_CTX_set_alpn_select_cb(ctx, select_alpn, NULL);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) <= 0 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) <= 0 ||
+        SSL_CTX_check_private_key(ctx) <= 0)
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        ctx = NULL;
+        return -1;
+    }
+
+    // ONE slot per possible descriptor so lookups never need a lock
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur == RLIM_INFINITY)
+    {
+        rl.rlim_cur = 65536;
+    }
+    conns_size = rl.rlim_cur;
+    conns = calloc(conns_size, sizeof(*conns));
+    locks = calloc(conns_size, sizeof(*locks));
+
+    if (conns == NULL || locks == NULL)
+    {
+        return -1;
+    }
+
+    for (int i = 0; i < conns_size; i++)
+    {
+        pthread_mutex_init(&locks[i], NULL);
+    }
+
+    return 0;
+}
+
+/**
+ * Run the server side of the handshake on a freshly accepted socket
+ *
+ * Returns 0 on success, -1 on error.
+ */
+int tls_accept(int fd)
+{
+    if (ctx == NULL || fd >= conns_size)
+    {
+        return -1;
+    }
+
+    SSL *ssl = SSL_new(ctx);
+    if (ssl == NULL)
+    {
+        return -1;
+    }
+
+    SSL_set_fd(ssl, fd);
+
+    if (SSL_accept(ssl) <= 0)
+    {
+        ERR_clear_error();
+        SSL_free(ssl);
+        return -1;
+    }
+
+    conns[fd] = ssl;
+
+    return 0;
+}
+
+/**
+ * Send close_notify and forget the TLS session of a socket
+ *
+ * Does nothing for plain connections. The socket itself stays open.
+ */
+void tls_close(int fd)
+{
+    SSL *ssl = get_conn(fd);
+
+    if (ssl == NULL)
+    {
+        return;
+    }
+
+    SSL_shutdown(ssl);
+    SSL_free(ssl);
+    ERR_clear_error();
+    conns[fd] = NULL;
+}
+
+/**
+ * Return true if a socket carries TLS
+ */
+int tls_active(int fd)
+{
+    return get_conn(fd) != NULL;
+}
+
+/**
+ * Return true if ALPN settled on HTTP/2
+ */
+int tls_alpn_h2(int fd)
+{
+    SSL *ssl = get_conn(fd);
+    const unsigned char *proto;
+    unsigned int len;
+
+    if (ssl == NULL)
+    {
+        return 0;
+    }
+
+    SSL_get0_alpn_selected(ssl, &proto, &len);
+
+    return len == 2 && memcmp(proto, "h2", 2) == 0;
+}
+
+/**
+ * Read decrypted bytes
+ *
+ * Every wait for input happens without the connection's lock held, so
+ * other threads can keep sending meanwhile. The socket stays blocking
+ * for them; it is only made non-blocking for the SSL_read() itself,
+ * under the lock, so a record that has only partly arrived sends us
+ * back to waiting instead of blocking with the lock held.
+ *
+ * Returns the number of bytes read, 0 on close or -1 on error.
+ */
+int tls_recv(int fd, void *buf, int len)
+{
+    SSL *ssl = get_conn(fd);
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+    pthread_mutex_lock(&locks[fd]);
+    int wait = !SSL_has_pending(ssl);
+    pthread_mutex_unlock(&locks[fd]);
+
+    for (;;)
+    {
+        if (wait)
+        {
+            while (poll(&pfd, 1, -1) < 0 && errno == EINTR)
+            {
+            }
+        }
+
+        pthread_mutex_lock(&locks[fd]);
+
+        int flags = fcntl(fd, F_GETFL);
+
+        fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        int n = SSL_read(ssl, buf, len);
+        int err = n > 0 ? SSL_ERROR_NONE : SSL_get_error(ssl, n);
+        fcntl(fd, F_SETFL, flags);
+
+        ERR_clear_error();
+        pthread_mutex_unlock(&locks[fd]);
+
+        if (n > 0)
+        {
+            return n;
+        }
+
+        // WAIT for whatever the record layer is short of, then retry
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+        {
+            pfd.events = err == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT;
+            wait = 1;
+            continue;
+        }
+
+        return err == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+    }
+}
+
+/**
+ * tls_send_iov() with the connection's lock held
+ */
+static int send_iov(SSL *ssl, struct iovec *iov, int iovcnt)
+{
+    char record[TLS_RECORD_SIZE];
+    int record_length = 0, total = 0;
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        char *p = iov[i].iov_base;
+        int left = iov[i].iov_len;
+
+        while (left > 0)
+        {
+            // BIG buffers with nothing gathered go out directly
+            if (record_length == 0 && left >= TLS_RECORD_SIZE)
+            {
+                if (SSL_write(ssl, p, TLS_RECORD_SIZE) <= 0)
+                {
+                    ERR_clear_error();
+                    return -1;
+                }
+                p += TLS_RECORD_SIZE;
+                left -= TLS_RECORD_SIZE;
+                total += TLS_RECORD_SIZE;
+                continue;
+            }
+
+            int n = TLS_RECORD_SIZE - record_length;
+            if (n > left) { n = left; }
+
+            memcpy(record + record_length, p, n);
+            record_length += n;
+            p += n;
+            left -= n;
+
+            if (record_length == TLS_RECORD_SIZE)
+            {
+                if (SSL_write(ssl, record, record_length) <= 0)
+                {
+                    ERR_clear_error();
+                    return -1;
+                }
+                total += record_length;
+                record_length = 0;
+            }
+        }
+    }
+
+    if (record_length > 0)
+    {
+        if (SSL_write(ssl, record, record_length) <= 0)
+        {
+            ERR_clear_error();
+            return -1;
+        }
+        total += record_length;
+    }
+
+    return total;
+}
+
+/**
+ * Encrypt and send an iovec array
+ *
+ * Small buffers are gathered into full records rather than sending one
+ * record per buffer.
+ *
+ * Returns the number of bytes sent, or -1 on error.
+ */
+int tls_send_iov(int fd, struct iovec *iov, int iovcnt)
+{
+    pthread_mutex_lock(&locks[fd]);
+    int rv = send_iov(get_conn(fd), iov, iovcnt);
+    pthread_mutex_unlock(&locks[fd]);
+
+    return rv;
+}
+
+/**
+ * tls_sendfile() with the connection's lock held
+ */
+static off_t send_file(SSL *ssl, int file_fd, off_t offset, off_t count)
+{
+    off_t total = 0;
+
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl)))
+    {
+        while (total < count)
+        {
+            ossl_ssize_t n = SSL_sendfile(ssl, file_fd, offset + total, count - total, 0);
+
+            if (n <= 0)
+            {
+                ERR_clear_error();
+                return -1;
+            }
+            total += n;
+        }
+
+        return total;
+    }
+
+    char buf[TLS_RECORD_SIZE];
+
+    while (total < count)
+    {
+        int want = count - total < TLS_RECORD_SIZE ? (int)(count - total) : TLS_RECORD_SIZE;
+        ssize_t n = pread(file_fd, buf, want, offset + total);
+
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n <= 0) { return -1; }
+
+        if (SSL_write(ssl, buf, n) <= 0)
+        {
+            ERR_clear_error();
+            return -1;
+        }
+        total += n;
+    }
+
+    return total;
+}
+
+/**
+ * Send part of a file over TLS
+ *
+ * With kernel TLS active this is a real sendfile(), otherwise the file
+ * is read and encrypted in user space.
+ *
+ * Returns the number of bytes sent, or -1 on error.
+ */
+off_t tls_sendfile(int fd, int file_fd, off_t offset, off_t count)
+{
+    pthread_mutex_lock(&locks[fd]);
+    off_t rv = send_file(get_conn(fd), file_fd, offset, count);
+    pthread_mutex_unlock(&locks[fd]);
+
+    return rv;
+}
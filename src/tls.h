@@ -0,0 +1,16 @@
+#ifndef _TLS_H_
+#define _TLS_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+extern int tls_init(char *cert_file, char *key_file);
+extern int tls_accept(int fd);
+extern void tls_close(int fd);
+extern int tls_active(int fd);
+extern int tls_alpn_h2(int fd);
+extern int tls_recv(int fd, void *buf, int len);
+extern int tls_send_iov(int fd, struct iovec *iov, int iovcnt);
+extern off_t tls_sendfile(int fd, int file_fd, off_t offset, off_t count);
+
+#endif
@@ -0,0 +1,183 @@
+#include <string.h>
+#include "urlpath.h"
+
+/**
+ * Value of a hex digit, -1 if c isn't one
+ */
+static int hex_value(int c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/**
+ * Decode and normalize a request target's path in place, in one pass
+ *
+ * Percent escapes are decoded, empty and "." segments dropped, and ".."
+ * takes the segment before it along. A trailing slash is kept, so the
+ * result still says whether a directory was asked for. The query, if
+ * any, is kept after the path untouched; a fragment is dropped.
+ *
+ * Escapes are decoded before segments are looked at, so "%2e%2e" can't
+ * be used to sneak past. Escapes of the characters that end a segment or
+ * the path ("%2f", "%3f", "%23") are refused rather than decoded: they
+ * would turn into a separator that everything after us takes at its word.
+ * Output is never longer than input, so nothing is allocated.
+ *
+ * Returns the new length, or -1 if the path isn't absolute, has a bad,
+ * NUL or delimiter escape, or climbs above the root.
+ */
+int urlpath_normalize(char *path)
+{
+    char *r = path, *w = path, *seg;
+
+    if (*r != '/')
+    {
+        return -1;
+    }
+    r++;
+    w++;
+    seg = w; // Start of the segment being written
+
+    for (;;)
+    {
+        int c = *r;
+        int end = c == '\0' || c == '?' || c == '#';
+
+        if (!end)
+        {
+            r++;
+
+            if (c == '%')
+            {
+                int hi = hex_value(r[0]);
+                int lo = hi >= 0 ? hex_value(r[1]) : -1;
+
+                if (lo < 0)
+                {
+                    return -1;
+                }
+                c = hi << 4 | lo;
+                r += 2;
+
+                if (c == '\0' || c == '/' || c == '?' || c == '#')
+                {
+                    return -1;
+                }
+            }
+
+            if (c != '/')
+            {
+                *w++ = c;
+                continue;
+            }
+        }
+
+        // A segment ended: empty and "." ones are dropped, ".." takes the
+        // one before it too
+        int seg_len = w - seg;
+
+        if (seg_len == 1 && seg[0] == '.')
+        {
+            w = seg;
+        }
+        else if (seg_len == 2 && seg[0] == '.' && seg[1] == '.')
+        {
+            if (seg == path + 1)
+            {
+                return -1;
+            }
+
+            // BACK over the slash before "..", then the segment before it
+            w = seg - 1;
+            while (w[-1] != '/')
+            {
+                w--;
+            }
+        }
+        else if (seg_len > 0 && !end)
+        {
+            *w++ = '/';
+        }
+        seg = w;
+
+        if (end)
+        {
+            break;
+        }
+    }
+
+    // KEEP the query, it may be needed further on
+    if (*r == '?')
+    {
+        size_t query_len = strcspn(r, "#");
+
+        memmove(w, r, query_len);
+        w += query_len;
+    }
+    *w = '\0';
+
+    return w - path;
+}
+
+/**
+ * Percent-encode a normalized path so it can go in a request line again,
+ * for passing a request on
+ *
+ * Bytes a path may hold as they are stay, the rest are escaped. A query
+ * was never decoded, so it is copied as it is.
+ *
+ * Returns the length, or -1 if it doesn't fit in size.
+ */
+int urlpath_encode(char *dest, size_t size, char *path)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    static const char safe[] = "-._~!$&'()*+,;=:@/";
+    size_t len = 0;
+    char *p = path;
+
+    for (; *p != '\0' && *p != '?'; p++)
+    {
+        unsigned char c = *p;
+        int plain = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+                    strchr(safe, c) != NULL;
+
+        if (len + (plain ? 1 : 3) >= size)
+        {
+            return -1;
+        }
+
+        if (plain)
+        {
+            dest[len++] = c;
+        }
+        else
+        {
+            dest[len++] = '%';
+            dest[len++] = hex[c >> 4];
+            dest[len++] = hex[c & 15];
+        }
+    }
+
+    // COPY the query
+    size_t query_len = strlen(p);
+
+    if (len + query_len >= size)
+    {
+        return -1;
+    }
+    memcpy(dest + len, p, query_len + 1);
+
+    return len + query_len;
+}
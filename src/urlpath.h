@@ -0,0 +1,9 @@
+#ifndef _URLPATH_H_
+#define _URLPATH_H_
+
+#include <stddef.h>
+
+extern int urlpath_normalize(char *path);
+extern int urlpath_encode(char *dest, size_t size, char *path);
+
+#endif
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include "hashtable.h"
+#include "vhost.h"
+
+#define VHOST_BUCKETS 64
+
+/**
+ * Create an empty host table
+ */
+struct vhosts *vhosts_create(void)
+{
+    struct vhosts *vhosts = calloc(1, sizeof *vhosts);
+
+    if (vhosts == NULL)
+    {
+        return NULL;
+    }
+
+    vhosts->names = hashtable_create(VHOST_BUCKETS, NULL);
+    if (vhosts->names == NULL)
+    {
+        free(vhosts);
+        return NULL;
+    }
+
+    return vhosts;
+}
+
+/**
+ * Reduce a Host header to the name it is filed under: lowercased, with
+ * any port and trailing dot dropped
+ *
+ * Returns the name's length, or -1 if it is too long to be one.
+ */
+static int host_key(char *host, char *key)
+{
+    int len = 0;
+
+    // [v6 literal]:port keeps its brackets, anything else loses its :port
+    char *end = host[0] == '[' ? strchr(host, ']') : strchr(host, ':');
+
+    if (end == NULL)
+    {
+        end = host + strlen(host);
+    }
+    else if (host[0] == '[')
+    {
+        end++;
+    }
+
+    if (end > host && end[-1] == '.')
+    {
+        end--;
+    }
+
+    for (char *p = host; p < end; p++)
+    {
+        if (len == VHOST_NAME_MAX - 1)
+        {
+            return -1;
+        }
+        key[len++] = tolower((unsigned char)*p);
+    }
+    key[len] = '\0';
+
+    return len;
+}
+
+/**
+ * Add a site under each of the space-separated names
+ *
+ * Returns 0 on success, -1 if a name is taken or too long.
+ */
+int vhosts_add(struct vhosts *vhosts, struct vhost *vhost, char *names)
+{
+    char list[1024], key[VHOST_NAME_MAX];
+    char *saveptr;
+
+    snprintf(list, sizeof list, "%s", names);
+
+    for (char *name = strtok_r(list, " \t", &saveptr); name != NULL; name = strtok_r(NULL, " \t", &saveptr))
+    {
+        if (host_key(name, key) <= 0)
+        {
+            fprintf(stderr, "vhost: bad host name %s\n", name);
+            return -1;
+        }
+        if (hashtable_get(vhosts->names, key) != NULL)
+        {
+            fprintf(stderr, "vhost: %s is served twice\n", name);
+            return -1;
+        }
+        hashtable_put(vhosts->names, key, vhost);
+    }
+
+    vhost->next = NULL;
+    if (vhosts->tail == NULL)
+    {
+        vhosts->head = vhost;
+    }
+    else
+    {
+        vhosts->tail->next = vhost;
+    }
+    vhosts->tail = vhost;
+
+    return 0;
+}
+
+/**
+ * Serve requests for unknown hosts, or without a Host, from vhost
+ *
+ * vhost is also added to the list of all hosts, if it isn't in it yet.
+ */
+void vhosts_set_fallback(struct vhosts *vhosts, struct vhost *vhost)
+{
+    for (struct vhost *v = vhosts->head; v != NULL; v = v->next)
+    {
+        if (v == vhost)
+        {
+            vhosts->fallback = vhost;
+            return;
+        }
+    }
+
+    vhost->next = vhosts->head;
+    vhosts->head = vhost;
+    if (vhosts->tail == NULL)
+    {
+        vhosts->tail = vhost;
+    }
+    vhosts->fallback = vhost;
+}
+
+/**
+ * Find the site for a request's Host, which may be NULL
+ *
+ * One hash lookup. Returns the fallback site if the host isn't known.
+ */
+struct vhost *vhosts_lookup(struct vhosts *vhosts, char *host)
+{
+    char key[VHOST_NAME_MAX];
+
+    if (host != NULL && host_key(host, key) > 0)
+    {
+        struct vhost *vhost = hashtable_get(vhosts->names, key);
+
+        if (vhost != NULL)
+        {
+            return vhost;
+        }
+    }
+
+    return vhosts->fallback;
+}
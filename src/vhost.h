@@ -0,0 +1,39 @@
+#ifndef _VHOST_H_
+#define _VHOST_H_
+
+#include "warmup.h"
+
+#define VHOST_NAME_MAX 256 // Longest Host looked up, DNS names are shorter
+
+struct cache;
+struct router;
+struct postlog;
+
+// One site: its files, its cache and its route table
+struct vhost {
+    char *name; // For logs, "" for the default host
+    char *roots[3]; // Root, then assets if any, NULL-terminated
+    int root_fds[2]; // roots[] opened, files are resolved beneath these; -1 if missing
+    char *files; // Error pages
+    struct cache *cache;
+    int watched; // inotify keeps the cache up to date, entries never expire
+    int autoindex; // List directories without an index.html, -1 to follow the config
+    struct router *router;
+    struct postlog *postlog;
+    struct warmup_config warmup;
+    struct vhost *next; // All hosts, in the order added
+};
+
+// Host names to sites
+struct vhosts {
+    struct hashtable *names; // Lowercased name to struct vhost
+    struct vhost *fallback; // For a missing or unknown Host
+    struct vhost *head, *tail;
+};
+
+extern struct vhosts *vhosts_create(void);
+extern int vhosts_add(struct vhosts *vhosts, struct vhost *vhost, char *names);
+extern void vhosts_set_fallback(struct vhosts *vhosts, struct vhost *vhost);
+extern struct vhost *vhosts_lookup(struct vhosts *vhosts, char *host);
+
+#endif
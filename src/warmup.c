@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "file.h"
+#include "mime.h"
+#include "hashtable.h"
+#include "cache.h"
+#include "warmup.h"
+
+/**
+ * Open the file that serves a request path, trying each root in order
+ *
+ * The path is resolved beneath root_fds, the roots opened, the way
+ * requests are answered, so a symlink can't bring a file from outside
+ * them into the cache (see file_open_beneath()).
+ *
+ * Returns the descriptor with st filled in, or -1 if no root has a
+ * regular file there.
+ */
+int warmup_open(char **roots, int *root_fds, char *request_path, struct stat *st)
+{
+    for (int i = 0; roots[i] != NULL; i++)
+    {
+        int fd = root_fds[i] >= 0 ? file_open_beneath(root_fds[i], request_path) : -1;
+
+        if (fd < 0)
+        {
+            continue;
+        }
+        if (fstat(fd, st) == 0 && S_ISREG(st->st_mode))
+        {
+            return fd;
+        }
+        close(fd);
+    }
+
+    return -1;
+}
+
+/**
+ * Return true once the cache has no free slots
+ */
+static int cache_full(struct cache *cache)
+{
+    pthread_rwlock_rdlock(&cache->lock);
+    int full = cache->cur_size >= cache->max_size;
+    pthread_rwlock_unlock(&cache->lock);
+
+    return full;
+}
+
+/**
+ * Load one request path into the cache unless it is already there
+ *
+ * Returns 1 if it was loaded, 0 if not.
+ */
+static int warm_path(struct warmup_config *config, char *request_path)
+{
+    struct stat st;
+
+    pthread_rwlock_rdlock(&config->cache->lock);
+    int exists = hashtable_get(config->cache->index, request_path) != NULL;
+    pthread_rwlock_unlock(&config->cache->lock);
+
+    int fd = exists ? -1 : warmup_open(config->roots, config->root_fds, request_path, &st);
+
+    if (fd < 0)
+    {
+        return 0;
+    }
+
+    struct file_data *filedata = st.st_size <= config->max_file_size ? file_load_fd(fd) : NULL;
+    close(fd);
+
+    if (filedata == NULL)
+    {
+        return 0;
+    }
+
+    cache_put(config->cache, request_path, mime_type_get(request_path), filedata->data, filedata->size,
+              time(NULL));
+    file_free(filedata);
+
+    return 1;
+}
+
+/**
+ * Load the request paths listed in the manifest, in order
+ *
+ * Returns the number of entries loaded, or -1 if there is no manifest.
+ */
+static int warm_manifest(struct warmup_config *config)
+{
+    char line[2048];
+    int loaded = 0;
+
+    FILE *fp = config->manifest ? fopen(config->manifest, "r") : NULL;
+
+    if (fp == NULL)
+    {
+        return -1;
+    }
+
+    while (!cache_full(config->cache) && fgets(line, sizeof line, fp) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+
+        // SKIP blank lines and comments
+        if (line[0] != '/')
+        {
+            continue;
+        }
+
+        loaded += warm_path(config, line);
+    }
+
+    fclose(fp);
+
+    return loaded;
+}
+
+/**
+ * Walk a directory tree below a root, loading every file it serves
+ *
+ * request_path is the tree's path relative to the root, "" at the top.
+ */
+static int warm_tree(struct warmup_config *config, int root_fd, char *request_path)
+{
+    char child[2048];
+    struct dirent *de;
+    int loaded = 0;
+
+    // OPEN the directory beneath the root, as its files will be
+    int fd = file_open_beneath(root_fd, request_path);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+
+    if (dir == NULL)
+    {
+        if (fd >= 0) { close(fd); }
+        return 0;
+    }
+
+    while (!cache_full(config->cache) && (de = readdir(dir)) != NULL)
+    {
+        if (de->d_name[0] == '.')
+        {
+            continue;
+        }
+
+        if (snprintf(child, sizeof child, "%s/%s", request_path, de->d_name) >= (int)sizeof child)
+        {
+            continue;
+        }
+
+        if (de->d_type == DT_DIR)
+        {
+            loaded += warm_tree(config, root_fd, child);
+        }
+        else if (de->d_type == DT_REG || de->d_type == DT_UNKNOWN)
+        {
+            loaded += warm_path(config, child);
+        }
+    }
+
+    closedir(dir);
+
+    return loaded;
+}
+
+/**
+ * Snapshot and warm tier callback: an entry is fresh if its file hasn't
+ * been modified since the entry was created
+ *
+ * arg is the struct warmup_config. The comparison is strict since mtimes
+ * have whole-second resolution here, so a file written in the same second
+ * is reloaded to be safe.
+ */
+int warmup_fresh(char *request_path, time_t created_at, void *arg)
+{
+    struct warmup_config *config = arg;
+    struct stat st;
+    int fd = warmup_open(config->roots, config->root_fds, request_path, &st);
+
+    if (fd < 0)
+    {
+        return 0;
+    }
+    close(fd);
+
+    return st.st_mtime < created_at;
+}
+
+/**
+ * Fill the cache: the snapshot first, then the manifest, or a walk of
+ * the document roots when there is no manifest
+ *
+ * Stops as soon as the cache is full. Returns the number of entries
+ * loaded.
+ */
+int warmup_run(struct warmup_config *config)
+{
+    int loaded = 0, n;
+
+    if (config->snapshot != NULL &&
+        (n = cache_snapshot_load(config->cache, config->snapshot, warmup_fresh, config)) >= 0)
+    {
+        printf("warmup: %d fresh entries in %s\n", n, config->snapshot);
+        loaded += n;
+    }
+
+    if ((n = warm_manifest(config)) >= 0)
+    {
+        return loaded + n;
+    }
+
+    for (int i = 0; config->roots[i] != NULL && !cache_full(config->cache); i++)
+    {
+        if (config->root_fds[i] >= 0)
+        {
+            loaded += warm_tree(config, config->root_fds[i], "");
+        }
+    }
+
+    return loaded;
+}
+
+/**
+ * Thread running the warm-up
+ */
+static void *warmup_thread(void *arg)
+{
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int loaded = warmup_run(arg);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    printf("warmup: loaded %d cache entries in %ld ms\n", loaded,
+           (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000);
+
+    return NULL;
+}
+
+/**
+ * Warm the cache in the background, so the server accepts connections
+ * right away
+ *
+ * config must stay valid until the warm-up is done.
+ *
+ * Returns 0 on success, -1 if the thread couldn't be started.
+ */
+int warmup_start(struct warmup_config *config)
+{
+    pthread_t thread;
+
+    if (pthread_create(&thread, NULL, warmup_thread, config) != 0)
+    {
+        return -1;
+    }
+    pthread_detach(thread);
+
+    return 0;
+}
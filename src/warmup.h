@@ -0,0 +1,25 @@
+#ifndef _WARMUP_H_
+#define _WARMUP_H_
+
+#include <stddef.h>
+#include <time.h>
+
+struct cache;
+struct stat;
+
+// What to fill the cache from at startup
+struct warmup_config {
+    struct cache *cache;
+    char *snapshot; // Loaded first if it exists, may be NULL
+    char *manifest; // Request paths to load, one per line; if missing the roots are walked
+    char **roots; // Document roots in lookup order, NULL-terminated
+    int *root_fds; // roots[] opened, files are resolved beneath these; -1 if missing
+    long max_file_size; // Bigger files are never cached
+};
+
+extern int warmup_open(char **roots, int *root_fds, char *request_path, struct stat *st);
+extern int warmup_fresh(char *request_path, time_t created_at, void *arg);
+extern int warmup_run(struct warmup_config *config);
+extern int warmup_start(struct warmup_config *config);
+
+#endif
@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "file.h"
+#include "mime.h"
+#include "hashtable.h"
+#include "cache.h"
+#include "warmup.h"
+#include "autoindex.h"
+#include "watch.h"
+
+// What changes a file's content or which file serves a path
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+// A watched directory
+struct watch_dir {
+    int root; // Index into roots
+    char *path; // Relative to the root, "" for the root itself
+};
+
+struct watcher {
+    int fd;
+    struct cache *cache;
+    char **roots;
+    int *root_fds; // roots[] opened, see vhost.h
+    long max_file_size;
+    struct watch_dir *dirs; // Indexed by watch descriptor
+    int dirs_size;
+};
+
+/**
+ * Watch a directory and everything below it
+ */
+static void add_tree(struct watcher *w, int root, char *path)
+{
+    char fdpath[64], child[2048];
+    struct dirent *de;
+
+    // OPEN the directory beneath the root, so a symlink can't lead the
+    // watch out of it, and watch what was opened
+    int fd = w->root_fds[root] >= 0 ? file_open_beneath(w->root_fds[root], path) : -1;
+
+    if (fd < 0)
+    {
+        return;
+    }
+    snprintf(fdpath, sizeof fdpath, "/proc/self/fd/%d", fd);
+
+    int wd = inotify_add_watch(w->fd, fdpath, WATCH_MASK);
+
+    if (wd < 0)
+    {
+        if (errno != ENOENT && errno != ENOTDIR) { perror("inotify_add_watch"); }
+        close(fd);
+        return;
+    }
+
+    // GROW the table, descriptors are small and handed out in order
+    if (wd >= w->dirs_size)
+    {
+        int size = w->dirs_size * 2 > wd + 1 ? w->dirs_size * 2 : wd + 16;
+        struct watch_dir *dirs = realloc(w->dirs, size * sizeof *dirs);
+
+        if (dirs == NULL)
+        {
+            inotify_rm_watch(w->fd, wd);
+            close(fd);
+            return;
+        }
+        memset(dirs + w->dirs_size, 0, (size - w->dirs_size) * sizeof *dirs);
+        w->dirs = dirs;
+        w->dirs_size = size;
+    }
+
+    // The same directory may come back under a new name
+    free(w->dirs[wd].path);
+    w->dirs[wd].root = root;
+    w->dirs[wd].path = strdup(path);
+
+    DIR *dir = fdopendir(fd);
+
+    if (dir == NULL)
+    {
+        close(fd);
+        return;
+    }
+
+    while ((de = readdir(dir)) != NULL)
+    {
+        if (de->d_type != DT_DIR || strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+        {
+            continue;
+        }
+
+        if (snprintf(child, sizeof child, "%s/%s", path, de->d_name) < (int)sizeof child)
+        {
+            add_tree(w, root, child);
+        }
+    }
+
+    closedir(dir);
+}
+
+/**
+ * Stop watching a directory and everything below it
+ */
+static void remove_tree(struct watcher *w, int root, char *path)
+{
+    size_t path_len = strlen(path);
+
+    for (int wd = 0; wd < w->dirs_size; wd++)
+    {
+        char *p = w->dirs[wd].path;
+
+        if (p != NULL && w->dirs[wd].root == root && strncmp(p, path, path_len) == 0 &&
+            (p[path_len] == '\0' || p[path_len] == '/'))
+        {
+            inotify_rm_watch(w->fd, wd);
+            free(p);
+            w->dirs[wd].path = NULL;
+        }
+    }
+}
+
+/**
+ * Bring a changed path's cache entry up to date
+ *
+ * Only paths in the hot tier are reloaded, so a burst of writes to files
+ * nobody asks for costs nothing. A warm tier copy is just dropped.
+ */
+static void refresh(struct watcher *w, char *request_path)
+{
+    struct stat st;
+
+    pthread_rwlock_rdlock(&w->cache->lock);
+    int cached = hashtable_get(w->cache->index, request_path) != NULL;
+    pthread_rwlock_unlock(&w->cache->lock);
+
+    if (!cached)
+    {
+        cache_delete(w->cache, request_path);
+        return;
+    }
+
+    // RELOAD from whichever root serves the path now, the old entry is
+    // served until cache_put() swaps the new one in
+    struct file_data *filedata = NULL;
+    int fd = warmup_open(w->roots, w->root_fds, request_path, &st);
+
+    if (fd >= 0)
+    {
+        if (st.st_size <= w->max_file_size)
+        {
+            filedata = file_load_fd(fd);
+        }
+        close(fd);
+    }
+
+    if (filedata != NULL)
+    {
+        cache_put(w->cache, request_path, mime_type_get(request_path), filedata->data, filedata->size, time(NULL));
+        file_free(filedata);
+    }
+    else
+    {
+        cache_delete(w->cache, request_path);
+    }
+}
+
+/**
+ * Drop the cached listings of a directory, see autoindex_key()
+ */
+static void forget_listings(struct watcher *w, char *path)
+{
+    char key[2048];
+
+    for (int json = 0; json <= 1; json++)
+    {
+        if (autoindex_key(key, sizeof key, path, json) == 0)
+        {
+            cache_delete(w->cache, key);
+        }
+    }
+}
+
+/**
+ * Act on one inotify event
+ */
+static void handle_event(struct watcher *w, struct inotify_event *ev)
+{
+    char request_path[2048];
+
+    // LOST events, nothing in the cache can be trusted
+    if (ev->mask & IN_Q_OVERFLOW)
+    {
+        fprintf(stderr, "watch: event queue overflowed, flushing the cache\n");
+        cache_delete_prefix(w->cache, "");
+        return;
+    }
+
+    if (ev->wd < 0 || ev->wd >= w->dirs_size || w->dirs[ev->wd].path == NULL)
+    {
+        return;
+    }
+
+    struct watch_dir *dir = &w->dirs[ev->wd];
+
+    if (ev->mask & IN_IGNORED)
+    {
+        free(dir->path);
+        dir->path = NULL;
+        return;
+    }
+
+    if (ev->len == 0 ||
+        snprintf(request_path, sizeof request_path, "%s/%s", dir->path, ev->name) >= (int)sizeof request_path)
+    {
+        return;
+    }
+
+    // NAMES came or went, the directory's listings are out of date
+    if (ev->mask & (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO))
+    {
+        forget_listings(w, dir->path);
+    }
+
+    if (ev->mask & IN_ISDIR)
+    {
+        int root = dir->root;
+
+        if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+        {
+            remove_tree(w, root, request_path);
+        }
+        if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+        {
+            add_tree(w, root, request_path);
+        }
+
+        // ANY path below may now be served by a different file
+        strcat(request_path, "/");
+        cache_delete_prefix(w->cache, request_path);
+        return;
+    }
+
+    // New files are picked up when their writer closes them
+    if (ev->mask & IN_CREATE)
+    {
+        return;
+    }
+
+    refresh(w, request_path);
+}
+
+/**
+ * Thread reading inotify events
+ */
+static void *watch_thread(void *arg)
+{
+    struct watcher *w = arg;
+    char buf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;)
+    {
+        ssize_t n = read(w->fd, buf, sizeof buf);
+
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            perror("watch read");
+            break;
+        }
+
+        for (char *p = buf; p < buf + n;)
+        {
+            struct inotify_event *ev = (struct inotify_event *)p;
+
+            handle_event(w, ev);
+            p += sizeof *ev + ev->len;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Keep the cache in step with the files under the document roots
+ *
+ * A thread watches every directory with inotify. When a file is
+ * written, replaced, removed or shadowed, its cache entry (if any) is
+ * reloaded or dropped, so entries never need a TTL.
+ *
+ * Returns 0 on success, -1 if inotify isn't available.
+ */
+int watch_start(struct cache *cache, char **roots, int *root_fds, long max_file_size)
+{
+    pthread_t thread;
+    struct watcher *w = calloc(1, sizeof *w);
+
+    if (w == NULL)
+    {
+        return -1;
+    }
+
+    w->fd = inotify_init1(IN_CLOEXEC);
+    w->cache = cache;
+    w->roots = roots;
+    w->root_fds = root_fds;
+    w->max_file_size = max_file_size;
+
+    if (w->fd < 0)
+    {
+        perror("inotify_init1");
+        free(w);
+        return -1;
+    }
+
+    for (int i = 0; roots[i] != NULL; i++)
+    {
+        add_tree(w, i, "");
+    }
+
+    if (pthread_create(&thread, NULL, watch_thread, w) != 0)
+    {
+        close(w->fd);
+        free(w->dirs);
+        free(w);
+        return -1;
+    }
+    pthread_detach(thread);
+
+    return 0;
+}
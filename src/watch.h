@@ -0,0 +1,8 @@
+#ifndef _WATCH_H_
+#define _WATCH_H_
+
+struct cache;
+
+extern int watch_start(struct cache *cache, char **roots, int *root_fds, long max_file_size);
+
+#endif